@@ -0,0 +1,504 @@
+/* ***************************************************
+flv: FLV tag and AMF0 serialization helpers
+Greg Kennedy 2021
+*************************************************** */
+#include "flv.h"
+
+#include <stdio.h>
+#include <time.h>
+
+// containers nested deeper than this are treated as malformed,
+//  so hostile input cannot recurse us off the end of the stack
+#define AMF_MAX_DEPTH 32
+
+/* ************************************************************************ */
+// "pascal" string (uint16 strlen, string content)
+//  this is also how object / array keys are written
+void pstring(struct flv_tag * const t, const char * const str)
+{
+	const size_t string_length = strlen(str);
+
+	if (string_length > 0xFFFF) {
+		t->overflow = 1;
+		return;
+	}
+
+	uint8_t * const p = flv_Reserve(t, 2 + string_length);
+	if (p == NULL) return;
+
+	u16be(p, string_length);
+	memcpy(p + 2, str, string_length);
+}
+
+// AMF (Action Message Format) serializers
+//  Number (double floating-point)
+void amf_number(struct flv_tag * const t, const double value)
+{
+	uint8_t * const p = flv_Reserve(t, 9);
+	if (p == NULL) return;
+
+	*p = AMF_NUMBER;
+	f64be(p + 1, value);
+}
+
+//  Boolean
+void amf_boolean(struct flv_tag * const t, const uint8_t value)
+{
+	uint8_t * const p = flv_Reserve(t, 2);
+	if (p == NULL) return;
+
+	*p = AMF_BOOLEAN;
+	*(p + 1) = (value ? 1 : 0);
+}
+
+//  String
+void amf_string(struct flv_tag * const t, const char * const str)
+{
+	flv_U8(t, AMF_STRING);
+	pstring(t, str);
+}
+
+//  Null
+void amf_null(struct flv_tag * const t)
+{
+	flv_U8(t, AMF_NULL);
+}
+
+// Beginning of an (anonymous) Object
+//  entries are key / value pairs like an associative array, with no count
+void amf_object(struct flv_tag * const t)
+{
+	flv_U8(t, AMF_OBJECT);
+}
+
+// Closing an Object: same terminator as an associative array
+void amf_object_end(struct flv_tag * const t)
+{
+	flv_U24(t, AMF_OBJECT_END);
+}
+
+// Entry to an object, as string key and string value
+void amf_object_string(struct flv_tag * const t, const char * const key, const char * const str)
+{
+	pstring(t, key);
+	amf_string(t, str);
+}
+
+// Beginning of an Associative Array
+void amf_ecma_array(struct flv_tag * const t, const uint32_t entries)
+{
+	uint8_t * const p = flv_Reserve(t, 5);
+	if (p == NULL) return;
+
+	*p = AMF_ECMA_ARRAY;
+	u32be(p + 1, entries);
+}
+
+// Closing an Associative Array (final entry)
+//  this is an empty key followed by the object-end marker
+void amf_ecma_array_end(struct flv_tag * const t)
+{
+	flv_U24(t, AMF_OBJECT_END);
+}
+
+// Entry to an array, as string key and double value
+void amf_ecma_array_entry(struct flv_tag * const t, const char * const str, const double value)
+{
+	pstring(t, str);
+	amf_number(t, value);
+}
+
+// Beginning of a Strict Array: exactly count values follow, with no keys
+//  and no terminator
+void amf_strict_array(struct flv_tag * const t, const uint32_t count)
+{
+	uint8_t * const p = flv_Reserve(t, 5);
+	if (p == NULL) return;
+
+	*p = AMF_STRICT_ARRAY;
+	u32be(p + 1, count);
+}
+
+/* ************************************************************************ */
+// AMF deserializers
+const uint8_t * amf_Decode(const uint8_t * p, const uint8_t * const end, struct amf_value * const v)
+{
+	if (p >= end)
+		return NULL;
+
+	v->type = *p;
+	p ++;
+
+	switch (v->type) {
+	case AMF_NUMBER:
+		if (end - p < 8) return NULL;
+		v->number = parse_f64be(p);
+		return p + 8;
+
+	case AMF_BOOLEAN:
+		if (end - p < 1) return NULL;
+		v->number = (*p != 0);
+		return p + 1;
+
+	case AMF_STRING:
+		if (end - p < 2) return NULL;
+		v->len = parse_u16be(p);
+		p += 2;
+		break;
+
+	case AMF_LONG_STRING:
+		if (end - p < 4) return NULL;
+		v->len = parse_u32be(p);
+		p += 4;
+		break;
+
+	case AMF_DATE:
+		// milliseconds since epoch, then a (reserved) 16-bit timezone
+		if (end - p < 10) return NULL;
+		v->number = parse_f64be(p);
+		return p + 10;
+
+	case AMF_ECMA_ARRAY:
+	case AMF_STRICT_ARRAY:
+		if (end - p < 4) return NULL;
+		v->count = parse_u32be(p);
+		return p + 4;
+
+	case AMF_REFERENCE:
+		if (end - p < 2) return NULL;
+		v->number = parse_u16be(p);
+		return p + 2;
+
+	case AMF_OBJECT:
+	case AMF_NULL:
+	case AMF_UNDEFINED:
+	case AMF_OBJECT_END:
+		return p;
+
+	default:
+		// AMF3 switch, movieclip, recordset, XML, typed object: not supported
+		return NULL;
+	}
+
+	// finish up the two string types
+	if ((size_t)(end - p) < v->len)
+		return NULL;
+
+	v->str = p;
+	return p + v->len;
+}
+
+// Object and ECMA array keys are a bare pstring, with no type marker.
+//  The empty key is followed by AMF_OBJECT_END and closes the container.
+const uint8_t * amf_DecodeKey(const uint8_t * p, const uint8_t * const end, const uint8_t ** const key, uint32_t * const len)
+{
+	if (end - p < 2)
+		return NULL;
+
+	*len = parse_u16be(p);
+	p += 2;
+
+	if ((size_t)(end - p) < *len)
+		return NULL;
+
+	*key = p;
+	return p + *len;
+}
+
+static const uint8_t * amf_SkipDepth(const uint8_t * p, const uint8_t * end, int depth);
+
+// skip over the entries of an object or ECMA array, including the terminator
+static const uint8_t * amf_SkipObject(const uint8_t * p, const uint8_t * const end, const int depth)
+{
+	while (p != NULL) {
+		const uint8_t * key;
+		uint32_t len;
+
+		p = amf_DecodeKey(p, end, &key, &len);
+
+		if (p == NULL)
+			return NULL;
+
+		if (len == 0 && p < end && *p == AMF_OBJECT_END)
+			return p + 1;
+
+		p = amf_SkipDepth(p, end, depth);
+	}
+
+	return NULL;
+}
+
+// skip one value, and whatever it contains
+static const uint8_t * amf_SkipDepth(const uint8_t * p, const uint8_t * const end, const int depth)
+{
+	struct amf_value v;
+
+	if (depth > AMF_MAX_DEPTH)
+		return NULL;
+
+	p = amf_Decode(p, end, &v);
+
+	if (p == NULL)
+		return NULL;
+
+	switch (v.type) {
+	case AMF_OBJECT:
+	case AMF_ECMA_ARRAY:
+		return amf_SkipObject(p, end, depth + 1);
+
+	case AMF_STRICT_ARRAY:
+		for (uint32_t i = 0; i < v.count && p != NULL; i ++)
+			p = amf_SkipDepth(p, end, depth + 1);
+		return p;
+
+	case AMF_OBJECT_END:
+		// only valid as a container terminator
+		return NULL;
+
+	default:
+		return p;
+	}
+}
+
+// skip one complete value, including any nested containers
+const uint8_t * amf_Skip(const uint8_t * const p, const uint8_t * const end)
+{
+	return amf_SkipDepth(p, end, 0);
+}
+
+const uint8_t * amf_ScriptFind(const uint8_t * p, const uint8_t * const end, const char * const name, const char * const key)
+{
+	struct amf_value v;
+	const size_t name_length = strlen(name);
+	const size_t key_length = strlen(key);
+
+	// the script data name (e.g. "onMetaData") comes first...
+	p = amf_Decode(p, end, &v);
+
+	if (p == NULL || v.type != AMF_STRING || v.len != name_length || memcmp(v.str, name, name_length) != 0)
+		return NULL;
+
+	// ... then an object or associative array of properties
+	p = amf_Decode(p, end, &v);
+
+	if (p == NULL || (v.type != AMF_OBJECT && v.type != AMF_ECMA_ARRAY))
+		return NULL;
+
+	while (p != NULL) {
+		const uint8_t * prop;
+		uint32_t len;
+
+		p = amf_DecodeKey(p, end, &prop, &len);
+
+		if (p == NULL || (len == 0 && p < end && *p == AMF_OBJECT_END))
+			return NULL;
+
+		if (len == key_length && memcmp(prop, key, len) == 0)
+			return p;
+
+		p = amf_Skip(p, end);
+	}
+
+	return NULL;
+}
+
+const uint8_t * amf_MetaFind(const uint8_t * const p, const uint8_t * const end, const char * const key)
+{
+	return amf_ScriptFind(p, end, "onMetaData", key);
+}
+
+/* ************************************************************************ */
+// AVCDecoder record - some of this data comes out of the SPS for this block
+void h264_AVCDecoderConfigurationRecord(
+	struct flv_tag * const t,
+	const uint8_t * const sps,
+	const uint16_t sps_length,
+	const uint8_t * const pps,
+	const uint16_t pps_length)
+{
+	uint8_t * p = flv_Reserve(t, 6 + 2 + sps_length + 1 + 2 + pps_length);
+	if (p == NULL) return;
+
+	*p = 0x01;	// version
+	*(p + 1) = sps[1];	// Required profile ID
+	*(p + 2) = sps[2];	// Profile compatibility
+	*(p + 3) = sps[3];	// AVC Level (3.0)
+	*(p + 4) = 0b11111100 | 0b11;	// NAL lengthSizeMinusOne (4 bytes)
+	*(p + 5) = 0b11100000 | 1;	// number of SPS sets
+	p += 6;
+
+	// write the SPS - length (uint16), then data
+	p = u16be(p, sps_length);
+	memcpy(p, sps, sps_length);
+	p += sps_length;
+
+	// write the PPS now
+	*p = 1;	// number of PPS sets
+	p ++;
+	p = u16be(p, pps_length);
+	memcpy(p, pps, pps_length);
+}
+
+/* ************************************************************************ */
+// Timecodes
+static const char * const timecode_names[TIMECODES] = { "none", "onfi", "sei" };
+
+// marks our SEI among any others (x264 writes its settings in one)
+//  Neither it nor the ASCII digits after it contain a zero byte, so the NAL
+//  never needs emulation prevention bytes, and is written and read as is.
+static const uint8_t timecode_uuid[16] = {
+	0x77, 0x61, 0x6C, 0x6C, 0x63, 0x6C, 0x6F, 0x63,
+	0x6B, 0xA5, 0x3E, 0x91, 0xC4, 0x5D, 0x12, 0xE7
+};
+
+// NAL unit and SEI payload types
+#define NAL_TYPE_SEI 6
+#define SEI_USER_DATA_UNREGISTERED 5
+
+enum flv_timecode flv_Timecode(const char * const name)
+{
+	enum flv_timecode mode;
+
+	for (mode = 0; mode < TIMECODES; mode ++)
+		if (strcmp(name, timecode_names[mode]) == 0)
+			break;
+
+	return mode;
+}
+
+void flv_OnFI(struct flv_tag * const t, const uint64_t wallclock)
+{
+	const time_t seconds = wallclock / 1000000;
+	struct tm tm;
+	char sd[16], st[16];
+
+	gmtime_r(&seconds, &tm);
+	strftime(sd, sizeof(sd), "%d-%m-%Y", &tm);
+	const size_t n = strftime(st, sizeof(st), "%H:%M:%S", &tm);
+	snprintf(st + n, sizeof(st) - n, ".%03u", (unsigned int)(wallclock % 1000000 / 1000));
+
+	amf_string(t, "onFI");
+	amf_ecma_array(t, 3);
+	amf_object_string(t, "sd", sd);
+	amf_object_string(t, "st", st);
+	// microseconds since the epoch are well inside a double's 53 bit mantissa
+	amf_ecma_array_entry(t, "wallclock", wallclock);
+	amf_ecma_array_end(t);
+}
+
+void h264_TimecodeFrame(struct flv_tag * const t, const uint8_t * const nals, const size_t size, const uint64_t wallclock)
+{
+	// SEI goes after any SPS / PPS, but before the first slice (NAL types 1 - 5)
+	size_t slice = 0;
+
+	while (size - slice > 4) {
+		const uint8_t type = nals[slice + 4] & 0x1F;
+
+		if (type >= 1 && type <= 5)
+			break;
+
+		const uint32_t len = parse_u32be(nals + slice);
+
+		if (len > size - slice - 4)
+			break;
+
+		slice += 4 + len;
+	}
+
+	char digits[24];
+	const int n = snprintf(digits, sizeof(digits), "%llu", (unsigned long long)wallclock);
+
+	// length, NAL header, payload type and size, UUID, digits, trailing bits
+	flv_Write(t, nals, slice);
+
+	uint8_t * p = flv_Reserve(t, 4 + 3 + sizeof(timecode_uuid) + n + 1);
+	if (p == NULL) return;
+
+	p = u32be(p, 3 + sizeof(timecode_uuid) + n + 1);
+	*p++ = NAL_TYPE_SEI;
+	*p++ = SEI_USER_DATA_UNREGISTERED;
+	*p++ = sizeof(timecode_uuid) + n;
+	memcpy(p, timecode_uuid, sizeof(timecode_uuid));
+	memcpy(p + sizeof(timecode_uuid), digits, n);
+	p[sizeof(timecode_uuid) + n] = 0x80;
+
+	flv_Write(t, nals + slice, size - slice);
+}
+
+int flv_ParseOnFI(const uint8_t * const payload, const uint8_t * const end, uint64_t * const wallclock)
+{
+	const uint8_t * const p = amf_ScriptFind(payload, end, "onFI", "wallclock");
+	struct amf_value v;
+
+	if (p == NULL || amf_Decode(p, end, &v) == NULL || v.type != AMF_NUMBER || ! (v.number > 0))
+		return 0;
+
+	*wallclock = v.number;
+	return 1;
+}
+
+// Read an SEI payload type or size: 0xFF bytes each add 255, until the last
+static const uint8_t * sei_Value(const uint8_t * p, const uint8_t * const end, uint32_t * const value)
+{
+	*value = 0;
+
+	while (p < end && *p == 0xFF) {
+		*value += 255;
+		p ++;
+	}
+
+	if (p == end)
+		return NULL;
+
+	*value += *p;
+	return p + 1;
+}
+
+int h264_ParseTimecode(const uint8_t * const nals, const size_t size, uint64_t * const wallclock)
+{
+	size_t offset = 0;
+
+	while (size - offset > 4) {
+		const uint32_t len = parse_u32be(nals + offset);
+		const uint8_t * p = nals + offset + 4;
+
+		if (len > size - offset - 4)
+			return 0;
+
+		offset += 4 + len;
+
+		if (len == 0 || (*p & 0x1F) != NAL_TYPE_SEI)
+			continue;
+
+		// each SEI NAL holds messages up to the trailing bits
+		const uint8_t * const end = p + len;
+		p ++;
+
+		while (p < end && *p != 0x80) {
+			uint32_t type, length;
+
+			if ((p = sei_Value(p, end, &type)) == NULL ||
+				(p = sei_Value(p, end, &length)) == NULL ||
+				length > (size_t)(end - p))
+				break;
+
+			if (type == SEI_USER_DATA_UNREGISTERED && length > sizeof(timecode_uuid) &&
+				memcmp(p, timecode_uuid, sizeof(timecode_uuid)) == 0) {
+				uint64_t value = 0;
+
+				for (uint32_t i = sizeof(timecode_uuid); i < length; i ++) {
+					if (p[i] < '0' || p[i] > '9')
+						return 0;
+					value = value * 10 + (p[i] - '0');
+				}
+
+				*wallclock = value;
+				return 1;
+			}
+
+			p += length;
+		}
+	}
+
+	return 0;
+}
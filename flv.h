@@ -0,0 +1,412 @@
+/* ***************************************************
+flv: FLV tag and AMF0 serialization helpers
+Greg Kennedy 2021
+
+Shared by rtmpcast, testpattern and waveform.
+ Byte-level helpers are inline here, so they compile
+ down to a load / store (plus bswap) at each call site.
+*************************************************** */
+#ifndef FLV_H_
+#define FLV_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// maximum size of a tag is 11 byte header, 0xFFFFFF payload, 4 byte size
+#define MAX_TAG_SIZE (11 + 16777215 + 4)
+
+// FLV tag types
+#define FLV_TAG_AUDIO 8
+#define FLV_TAG_VIDEO 9
+#define FLV_TAG_SCRIPT 18
+
+/* ************************************************************************ */
+// Endianness is settled at compile time: FLV and AMF are big-endian,
+//  so on little-endian hosts every multi-byte value gets one bswap.
+//  Doubles are assumed to share the integer byte order, which holds
+//  for every platform librtmp builds on.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define flv_be16(x) ((uint16_t)(x))
+#define flv_be32(x) ((uint32_t)(x))
+#define flv_be64(x) ((uint64_t)(x))
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define flv_be16(x) __builtin_bswap16(x)
+#define flv_be32(x) __builtin_bswap32(x)
+#define flv_be64(x) __builtin_bswap64(x)
+#else
+#error "Unable to determine host byte order"
+#endif
+
+// write big-endian values to memory area
+//  each returns a pointer just past what it wrote
+static inline uint8_t * u16be(uint8_t * const p, const uint16_t value)
+{
+	const uint16_t be = flv_be16(value);
+	memcpy(p, &be, 2);
+	return p + 2;
+}
+
+static inline uint8_t * u24be(uint8_t * const p, const uint32_t value)
+{
+	const uint32_t be = flv_be32(value << 8);
+	memcpy(p, &be, 3);
+	return p + 3;
+}
+
+static inline uint8_t * u32be(uint8_t * const p, const uint32_t value)
+{
+	const uint32_t be = flv_be32(value);
+	memcpy(p, &be, 4);
+	return p + 4;
+}
+
+// host-native double to big-endian IEEE 754 double
+static inline uint8_t * f64be(uint8_t * const p, const double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, 8);
+	bits = flv_be64(bits);
+	memcpy(p, &bits, 8);
+	return p + 8;
+}
+
+// read big-endian values from memory area
+static inline uint16_t parse_u16be(const uint8_t * const p)
+{
+	uint16_t be;
+	memcpy(&be, p, 2);
+	return flv_be16(be);
+}
+
+static inline uint32_t parse_u24be(const uint8_t * const p)
+{
+	return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+static inline uint32_t parse_u32be(const uint8_t * const p)
+{
+	uint32_t be;
+	memcpy(&be, p, 4);
+	return flv_be32(be);
+}
+
+static inline double parse_f64be(const uint8_t * const p)
+{
+	uint64_t bits;
+	double value;
+	memcpy(&bits, p, 8);
+	bits = flv_be64(bits);
+	memcpy(&value, &bits, 8);
+	return value;
+}
+
+/* ************************************************************************ */
+// A tag under construction
+//  Every write is checked against the buffer capacity.  The first write
+//  that does not fit sets overflow, and all later writes are dropped,
+//  so a chain of calls only needs checking once, at flv_TagFinish.
+struct flv_tag {
+	uint8_t * buf;	// start of tag (header byte 0)
+	size_t cap;	// size of buf
+	size_t len;	// bytes written so far
+	int overflow;
+};
+
+// attach a tag to a buffer of cap bytes
+static inline void flv_TagInit(struct flv_tag * const t, uint8_t * const buf, const size_t cap)
+{
+	t->buf = buf;
+	t->cap = cap;
+	t->len = 0;
+	t->overflow = 0;
+}
+
+// claim n bytes at the end of the tag
+//  returns NULL (and marks the tag overflowed) if they do not fit
+static inline uint8_t * flv_Reserve(struct flv_tag * const t, const size_t n)
+{
+	if (t->overflow || n > t->cap - t->len) {
+		t->overflow = 1;
+		return NULL;
+	}
+
+	uint8_t * const p = t->buf + t->len;
+	t->len += n;
+	return p;
+}
+
+static inline void flv_U8(struct flv_tag * const t, const uint8_t value)
+{
+	uint8_t * const p = flv_Reserve(t, 1);
+	if (p) *p = value;
+}
+
+static inline void flv_U16(struct flv_tag * const t, const uint16_t value)
+{
+	uint8_t * const p = flv_Reserve(t, 2);
+	if (p) u16be(p, value);
+}
+
+static inline void flv_U24(struct flv_tag * const t, const uint32_t value)
+{
+	uint8_t * const p = flv_Reserve(t, 3);
+	if (p) u24be(p, value);
+}
+
+static inline void flv_U32(struct flv_tag * const t, const uint32_t value)
+{
+	uint8_t * const p = flv_Reserve(t, 4);
+	if (p) u32be(p, value);
+}
+
+static inline void flv_Write(struct flv_tag * const t, const void * const data, const size_t n)
+{
+	uint8_t * const p = flv_Reserve(t, n);
+	if (p) memcpy(p, data, n);
+}
+
+// sets up the first 11 bytes of a tag, discarding anything already in it
+static inline void flv_TagHeader(struct flv_tag * const t, const uint8_t type, const uint32_t timestamp)
+{
+	t->len = 0;
+	t->overflow = 0;
+
+	uint8_t * p = flv_Reserve(t, 11);
+	if (p == NULL) return;
+
+	*p = type; // message type
+	// p[1 - 3] are the message size, which we don't know yet
+	// FLV timestamp is written in an odd format: low 24 bits, then the high 8
+	u24be(p + 4, timestamp & 0x00FFFFFF);
+	p[7] = timestamp >> 24 & 0xFF;
+	u24be(p + 8, 0); // stream ID
+}
+
+// Finishes a tag (corrects Payload Size in bytes 1-3, and appends Tag Size)
+//  Returns complete tag size, ready for writing, or 0 if the tag overflowed
+static inline uint32_t flv_TagFinish(struct flv_tag * const t)
+{
+	const size_t payloadSize = t->len - 11;
+
+	if (t->overflow || payloadSize > 0xFFFFFF) {
+		t->overflow = 1;
+		return 0;
+	}
+
+	flv_U32(t, 11 + payloadSize);
+	if (t->overflow)
+		return 0;
+
+	u24be(t->buf + 1, payloadSize);
+	return t->len;
+}
+
+/* ************************************************************************ */
+// FLV reading
+//  The file header is 9 bytes ("FLV", version, flags, header size), then
+//  every tag is preceded by the 4 byte size of the one before it.
+#define FLV_HEADER_SIZE 9
+#define FLV_FLAG_AUDIO 0x04
+#define FLV_FLAG_VIDEO 0x01
+
+// The fixed part of a tag
+struct flv_tag_header {
+	uint8_t type;
+	uint32_t size;	// payload size, not counting header or trailer
+	uint32_t timestamp;	// milliseconds, extended byte already folded in
+	uint32_t stream_id;
+};
+
+// check an FLV file header
+//  returns the offset of the first tag header, or 0 if this is not FLV1
+static inline uint32_t flv_ParseHeader(const uint8_t * const p, uint8_t * const flags)
+{
+	if (parse_u32be(p) != 0x464C5601)
+		return 0;
+
+	const uint32_t offset = parse_u32be(p + 5);
+
+	if (offset < FLV_HEADER_SIZE || offset > UINT32_MAX - 4)
+		return 0;
+
+	*flags = p[4];
+	// skip PreviousTagSize0 too
+	return offset + 4;
+}
+
+// parse the 11 byte header at the start of a tag
+static inline void flv_ParseTagHeader(const uint8_t * const p, struct flv_tag_header * const h)
+{
+	h->type = p[0] & 0x1F;	// upper bits are reserved / the encryption flag
+	h->size = parse_u24be(p + 1);
+	// FLV timestamp is written in an odd format: low 24 bits, then the high 8
+	h->timestamp = parse_u24be(p + 4) | (uint32_t)p[7] << 24;
+	h->stream_id = parse_u24be(p + 8);
+}
+
+// change the timestamp of a tag where it is, p being the start of the tag
+static inline void flv_SetTimestamp(uint8_t * const p, const uint32_t timestamp)
+{
+	u24be(p + 4, timestamp & 0x00FFFFFF);
+	p[7] = timestamp >> 24 & 0xFF;
+}
+
+// the 4 byte trailer after a tag must repeat its total (header + payload) size
+//  p is the start of the tag
+static inline int flv_CheckTrailer(const uint8_t * const p, const struct flv_tag_header * const h)
+{
+	return parse_u32be(p + 11 + h->size) == 11 + h->size;
+}
+
+// walk to the next tag in an in-memory FLV
+//  parses the tag at p into h, and returns the start of the following tag,
+//  or NULL if the tag (with its trailer) runs past end
+static inline const uint8_t * flv_NextTag(const uint8_t * const p, const uint8_t * const end, struct flv_tag_header * const h)
+{
+	if (end - p < 11)
+		return NULL;
+
+	flv_ParseTagHeader(p, h);
+
+	if ((size_t)(end - p) < 11 + (size_t)h->size + 4)
+		return NULL;
+
+	return p + 11 + h->size + 4;
+}
+
+// frame type and codec details of audio / video payloads
+//  video: keyframe flag in the high nibble, AVC packet type (0 = sequence header)
+//  audio: AAC packet type (0 = AudioSpecificConfig)
+static inline int flv_IsKeyframe(const uint8_t * const payload, const uint32_t size)
+{
+	return size > 0 && (payload[0] >> 4) == 1;
+}
+
+static inline int flv_IsSequenceHeader(const uint8_t type, const uint8_t * const payload, const uint32_t size)
+{
+	if (type == FLV_TAG_VIDEO)
+		return size > 1 && (payload[0] & 0x0F) == 7 && payload[1] == 0;
+	if (type == FLV_TAG_AUDIO)
+		return size > 1 && (payload[0] >> 4) == 10 && payload[1] == 0;
+	return 0;
+}
+
+/* ************************************************************************ */
+// AMF (Action Message Format) value markers
+#define AMF_NUMBER 0x00
+#define AMF_BOOLEAN 0x01
+#define AMF_STRING 0x02
+#define AMF_OBJECT 0x03
+#define AMF_NULL 0x05
+#define AMF_UNDEFINED 0x06
+#define AMF_REFERENCE 0x07
+#define AMF_ECMA_ARRAY 0x08
+#define AMF_OBJECT_END 0x09
+#define AMF_STRICT_ARRAY 0x0A
+#define AMF_DATE 0x0B
+#define AMF_LONG_STRING 0x0C
+
+// AMF serializers
+void pstring(struct flv_tag * t, const char * str);
+void amf_number(struct flv_tag * t, double value);
+void amf_boolean(struct flv_tag * t, uint8_t value);
+void amf_string(struct flv_tag * t, const char * str);
+void amf_null(struct flv_tag * t);
+void amf_object(struct flv_tag * t);
+void amf_object_end(struct flv_tag * t);
+void amf_object_string(struct flv_tag * t, const char * key, const char * str);
+void amf_ecma_array(struct flv_tag * t, uint32_t entries);
+void amf_ecma_array_end(struct flv_tag * t);
+void amf_ecma_array_entry(struct flv_tag * t, const char * str, double value);
+void amf_strict_array(struct flv_tag * t, uint32_t count);
+
+// A decoded AMF value
+//  Strings point into the source buffer and are not terminated.
+//  For containers, count is the entry count (only a hint for ECMA arrays),
+//  and the entries follow the position returned by amf_Decode.
+struct amf_value {
+	uint8_t type;
+	double number;	// NUMBER, BOOLEAN, DATE
+	const uint8_t * str;	// STRING, LONG_STRING
+	uint32_t len;
+	uint32_t count;	// ECMA_ARRAY, STRICT_ARRAY
+};
+
+// AMF deserializers
+//  All take the end of the readable area and return a pointer just past
+//  what they consumed, or NULL if the input is truncated or malformed.
+const uint8_t * amf_Decode(const uint8_t * p, const uint8_t * end, struct amf_value * v);
+const uint8_t * amf_DecodeKey(const uint8_t * p, const uint8_t * end, const uint8_t ** key, uint32_t * len);
+const uint8_t * amf_Skip(const uint8_t * p, const uint8_t * end);
+// Find a top-level property of an onMetaData payload (tag body, after the
+//  11 byte header).  Returns pointer to its value, or NULL if not present.
+const uint8_t * amf_MetaFind(const uint8_t * payload, const uint8_t * end, const char * key);
+// The same, for any script tag named name (e.g. "onFI")
+const uint8_t * amf_ScriptFind(const uint8_t * payload, const uint8_t * end, const char * name, const char * key);
+
+/* ************************************************************************ */
+// some h264 / aac output helpers
+
+// AVCDecoder record - some of this data comes out of the SPS for this block
+void h264_AVCDecoderConfigurationRecord(struct flv_tag * t,
+	const uint8_t * sps, uint16_t sps_length,
+	const uint8_t * pps, uint16_t pps_length);
+
+// FLV Video Packet (AVC format)
+//  Composition Time is 0 for all-I frames, but otherwise should be the time diff. between PTS and DTS
+static inline void flv_AVCVideoPacket(struct flv_tag * const t, const unsigned int keyframe, const uint8_t type, const int32_t composition_time)
+{
+	uint8_t * const p = flv_Reserve(t, 5);
+	if (p == NULL) return;
+
+	*p = (keyframe ? 0x17 : 0x27);
+	*(p + 1) = type;
+	u24be(p + 2, composition_time & 0xFFFFFF);
+}
+
+// FLV Audio Packet (AAC format)
+//  High nibble is SoundFormat 10 (AAC).  For AAC the spec fixes the low nibble
+//  at 44khz, 16bit, stereo: players take the real rate, channels and SBR / PS
+//  from the AudioSpecificConfig, so this byte is the same for every profile.
+static inline void flv_AACAudioPacket(struct flv_tag * const t, const uint8_t type)
+{
+	uint8_t * const p = flv_Reserve(t, 2);
+	if (p == NULL) return;
+
+	*p = 10 << 4 | 3 << 2 | 1 << 1 | 1;
+	*(p + 1) = type;
+}
+
+/* ************************************************************************ */
+// Per-frame wallclock timecodes, to measure publish-to-ingest latency
+//  The send time (microseconds since the Unix epoch) goes either in an
+//  "onFI" script tag just ahead of the frame, as some hardware encoders
+//  send, or in an H.264 SEI "user data unregistered" NAL inside the video
+//  frame itself, which survives anything that passes frames through.
+enum flv_timecode {
+	TIMECODE_NONE,
+	TIMECODE_ONFI,
+	TIMECODE_SEI,
+	TIMECODES
+};
+
+// Look up a timecode mode by name ("none", "onfi", "sei")
+//  Returns TIMECODES if there is no such mode.
+enum flv_timecode flv_Timecode(const char * name);
+
+// Write the body of an onFI script tag: "sd" (date) and "st" (time) strings
+//  in UTC, as players expect, plus "wallclock" with the full resolution
+void flv_OnFI(struct flv_tag * t, uint64_t wallclock);
+
+// Write the NALs of an AVC frame (4 byte lengths, as from x264), with a
+//  timecode SEI added ahead of the first slice
+void h264_TimecodeFrame(struct flv_tag * t, const uint8_t * nals, size_t size, uint64_t wallclock);
+
+// Read the wallclock back out of an onFI payload (after the 11 byte header),
+//  or out of the NALs of an AVC frame (after its 5 byte packet header)
+//  Both return 0 if there is no timecode.
+int flv_ParseOnFI(const uint8_t * payload, const uint8_t * end, uint64_t * wallclock);
+int h264_ParseTimecode(const uint8_t * nals, size_t size, uint64_t * wallclock);
+
+#endif
@@ -0,0 +1,302 @@
+/* ***************************************************
+flvbench: microbenchmarks for the FLV / AMF helpers
+Greg Kennedy 2021
+
+Builds (and parses) the same kinds of tags the casting
+ tools produce, in a tight loop, and reports throughput.
+ Parsing can also be timed against a real FLV file.
+*************************************************** */
+#include "flv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Default number of tags per benchmark
+#define ITERATIONS 2000000
+
+// payload sizes: a typical P-frame, an IDR, and an AAC access unit
+#define PFRAME_SIZE 4096
+#define IFRAME_SIZE 65536
+#define AAC_SIZE 372
+
+static uint8_t payload[IFRAME_SIZE];
+
+// a synthetic FLV (or a mapped file) for the parse benchmarks
+static const uint8_t * flv;
+static const uint8_t * flvEnd;
+static const uint8_t * flvFirst;
+
+// keeps the compiler from discarding the work
+static volatile uint32_t sink;
+
+// every benchmark builds (or reads) one tag per call
+typedef uint32_t (*bench_fn)(struct flv_tag * tag, unsigned long i);
+
+static uint32_t bench_metadata(struct flv_tag * const tag, const unsigned long i)
+{
+	flv_TagHeader(tag, FLV_TAG_SCRIPT, 0);
+	amf_string(tag, "onMetaData");
+	amf_ecma_array(tag, 8);
+	amf_ecma_array_entry(tag, "width", 1280);
+	amf_ecma_array_entry(tag, "height", 720);
+	amf_ecma_array_entry(tag, "framerate", 30 + (i & 1));
+	amf_ecma_array_entry(tag, "videocodecid", 7);
+	amf_ecma_array_entry(tag, "audiocodecid", 10);
+	amf_ecma_array_entry(tag, "audiodatarate", 128);
+	amf_ecma_array_entry(tag, "audiosamplerate", 44100);
+	pstring(tag, "stereo");
+	amf_boolean(tag, 1);
+	amf_ecma_array_end(tag);
+	return flv_TagFinish(tag);
+}
+
+static uint32_t bench_video(struct flv_tag * const tag, const unsigned long i, const size_t size)
+{
+	flv_TagHeader(tag, FLV_TAG_VIDEO, i * 33);
+	flv_AVCVideoPacket(tag, size == IFRAME_SIZE, 1, 0);
+	flv_Write(tag, payload, size);
+	return flv_TagFinish(tag);
+}
+
+static uint32_t bench_pframe(struct flv_tag * const tag, const unsigned long i)
+{
+	return bench_video(tag, i, PFRAME_SIZE);
+}
+
+static uint32_t bench_iframe(struct flv_tag * const tag, const unsigned long i)
+{
+	return bench_video(tag, i, IFRAME_SIZE);
+}
+
+// the sequence header: AVC decoder config record with a typical SPS / PPS
+static uint32_t bench_avcconfig(struct flv_tag * const tag, const unsigned long i)
+{
+	static const uint8_t sps[] = { 0x67, 0x42, 0xC0, 0x1E, 0xD9, 0x00, 0xA0, 0x2F, 0xF9, 0x70, 0x11, 0x00, 0x00, 0x03, 0x00, 0x01, 0x00, 0x00, 0x03, 0x00, 0x30, 0x0F, 0x16, 0x2E, 0x48 };
+	static const uint8_t pps[] = { 0x68, 0xCB, 0x83, 0xCB, 0x20 };
+
+	flv_TagHeader(tag, FLV_TAG_VIDEO, i);
+	flv_AVCVideoPacket(tag, 1, 0, 0);
+	h264_AVCDecoderConfigurationRecord(tag, sps, sizeof(sps), pps, sizeof(pps));
+	return flv_TagFinish(tag);
+}
+
+static uint32_t bench_audio(struct flv_tag * const tag, const unsigned long i)
+{
+	flv_TagHeader(tag, FLV_TAG_AUDIO, i * 23);
+	flv_AACAudioPacket(tag, 1);
+	flv_Write(tag, payload, AAC_SIZE);
+	return flv_TagFinish(tag);
+}
+
+// look up the last property of an already-built onMetaData tag
+static uint32_t bench_metafind(struct flv_tag * const tag, const unsigned long i)
+{
+	(void)i;
+	const uint8_t * const p = amf_MetaFind(tag->buf + 11, tag->buf + tag->len - 4, "stereo");
+	return (p == NULL ? 0 : tag->len);
+}
+
+// parse one tag header, with a timestamp that needs the extended byte
+static uint32_t bench_parseheader(struct flv_tag * const tag, const unsigned long i)
+{
+	struct flv_tag_header h;
+
+	tag->buf[7] = i;
+	flv_ParseTagHeader(tag->buf, &h);
+	return h.timestamp >> 24;
+}
+
+// walk the whole FLV as rtmpcast does: tag header, size, trailer check
+//  returns bytes walked; each call counts as (tags in file) tags
+static unsigned long walkTags;
+
+static uint32_t bench_walk(struct flv_tag * const tag, const unsigned long i)
+{
+	(void)tag;
+	(void)i;
+	const uint8_t * p = flvFirst;
+	uint32_t bad = 0;
+	struct flv_tag_header h;
+
+	while (p != NULL && p < flvEnd) {
+		const uint8_t * const next = flv_NextTag(p, flvEnd, &h);
+
+		if (next == NULL)
+			break;
+
+		bad += ! flv_CheckTrailer(p, &h);
+		p = next;
+	}
+
+	return (p - flv) + bad;
+}
+
+// lay out a synthetic FLV: for every video tag, an audio tag, with the
+//  timestamps running past 24 bits so the extended byte is exercised
+static uint8_t * build_flv(const unsigned long tags, size_t * const size)
+{
+	const size_t cap = FLV_HEADER_SIZE + 4 + tags * (11 + IFRAME_SIZE + 5 + 4);
+	uint8_t * const buffer = malloc(cap);
+
+	if (buffer == NULL)
+		return NULL;
+
+	static const uint8_t flvHeader[] = { 0x46, 0x4C, 0x56, 0x01, 0x05, 0, 0, 0, 9, 0, 0, 0, 0 };
+	memcpy(buffer, flvHeader, sizeof(flvHeader));
+
+	struct flv_tag tag;
+	size_t len = sizeof(flvHeader);
+
+	for (unsigned long i = 0; i < tags; i ++) {
+		flv_TagInit(&tag, buffer + len, cap - len);
+		const uint32_t timestamp = 0xFFF000 + i * 20;
+
+		if (i % 2) {
+			flv_TagHeader(&tag, FLV_TAG_AUDIO, timestamp);
+			flv_AACAudioPacket(&tag, 1);
+			flv_Write(&tag, payload, AAC_SIZE);
+		} else {
+			flv_TagHeader(&tag, FLV_TAG_VIDEO, timestamp);
+			flv_AVCVideoPacket(&tag, i % 60 == 0, 1, 0);
+			flv_Write(&tag, payload, (i % 60 == 0 ? IFRAME_SIZE : PFRAME_SIZE));
+		}
+
+		len += flv_TagFinish(&tag);
+	}
+
+	*size = len;
+	return buffer;
+}
+
+static void run(const char * const name, const bench_fn fn, struct flv_tag * const tag, const unsigned long iterations)
+{
+	struct timespec start, end;
+	unsigned long bytes = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (unsigned long i = 0; i < iterations; i ++)
+		bytes += fn(tag, i);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	sink = bytes;
+
+	double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	// the walk benchmark handles a whole file per call
+	const double tags = (double)iterations * (fn == bench_walk ? walkTags : 1);
+	printf("%-20s %12.0f tags/sec %9.1f ns/tag %10.1f MB/s\n", name,
+		tags / (ns / 1e9), ns / tags, bytes / (ns / 1e3));
+}
+
+// count the tags once, so the walk benchmark can report per tag
+static void count_tags(void)
+{
+	const uint8_t * p = flvFirst;
+	struct flv_tag_header h;
+
+	for (walkTags = 0; p != NULL && p < flvEnd; walkTags ++)
+		if ((p = flv_NextTag(p, flvEnd, &h)) == NULL)
+			break;
+}
+
+/* *************************************************** */
+int main(int argc, char * argv[])
+{
+	unsigned long iterations = ITERATIONS;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+
+	if (iterations == 0 || argc > 3) {
+		printf("FLV helper microbenchmarks\nUsage:\n\t%s [iterations [INPUT.FLV]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	uint8_t * const tagBuffer = malloc(MAX_TAG_SIZE);
+
+	if (tagBuffer == NULL) {
+		perror("Failed to allocate tag buffer");
+		return EXIT_FAILURE;
+	}
+
+	struct flv_tag tag;
+	flv_TagInit(&tag, tagBuffer, MAX_TAG_SIZE);
+
+	for (size_t i = 0; i < sizeof(payload); i ++)
+		payload[i] = i * 7;
+
+	run("build onMetaData", bench_metadata, &tag, iterations);
+	run("build audio (AAC)", bench_audio, &tag, iterations);
+	run("build video (4K)", bench_pframe, &tag, iterations);
+	run("build video (64K)", bench_iframe, &tag, iterations / 16);
+
+	run("build AVC seq header", bench_avcconfig, &tag, iterations);
+
+	bench_metadata(&tag, 0);
+	run("find onMetaData key", bench_metafind, &tag, iterations);
+	run("parse tag header", bench_parseheader, &tag, iterations);
+
+	// Parse benchmarks walk an FLV in memory, either one from the
+	//  command line or a generated one
+	size_t size;
+	uint8_t * synthetic = NULL;
+	int fd = -1;
+
+	if (argc > 2) {
+		struct stat st;
+		fd = open(argv[2], O_RDONLY);
+
+		if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < FLV_HEADER_SIZE + 4) {
+			perror("Failed to open flv");
+			goto freeTag;
+		}
+
+		size = st.st_size;
+		flv = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (flv == MAP_FAILED) {
+			perror("Failed to map flv");
+			goto freeTag;
+		}
+	} else {
+		flv = synthetic = build_flv(1000, &size);
+
+		if (synthetic == NULL) {
+			perror("Failed to allocate FLV buffer");
+			goto freeTag;
+		}
+	}
+
+	uint8_t flags;
+	const uint32_t start = flv_ParseHeader(flv, &flags);
+
+	if (start == 0 || start > size) {
+		fputs("Does not appear to be valid FLV1 file\n", stderr);
+		goto unmap;
+	}
+
+	flvFirst = flv + start;
+	flvEnd = flv + size;
+	count_tags();
+
+	// each walk covers the whole file, so scale the count down to match
+	unsigned long walks = iterations / (walkTags ? walkTags : 1);
+	run("walk FLV tags", bench_walk, &tag, walks ? walks : 1);
+
+unmap:
+	if (synthetic)
+		free(synthetic);
+	else
+		munmap((void *)flv, size);
+freeTag:
+	if (fd >= 0)
+		close(fd);
+	free(tagBuffer);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,358 @@
+/* ***************************************************
+flvfilter: track filtering and metadata rewriting
+Greg Kennedy 2021
+*************************************************** */
+#include "flvfilter.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// messages, written out off the streaming thread
+#include "logger.h"
+
+// room for the properties the filter adds itself, and the array framing
+#define FIXED_SIZE 64
+
+// properties that go with each track, dropped from onMetaData along with it
+static const char * const audio_props[] = { "hasAudio", "audio", "stereo", NULL };
+static const char * const video_props[] = { "hasVideo", "video", "width", "height", "framerate", NULL };
+
+// properties a speed change scales: the duration shrinks by it, and the
+//  rates grow by it
+static const char * const per_second_props[] = { "framerate", "videodatarate", "audiodatarate", "totaldatarate", NULL };
+
+// is key one of the names (or, for "audio" and "video", starts with it)
+static int flvfilter_Match(const char * const * const names, const uint8_t * const key, const uint32_t len)
+{
+	for (unsigned int i = 0; names[i] != NULL; i ++) {
+		const size_t n = strlen(names[i]);
+		const int prefix = (strcmp(names[i], "audio") == 0 || strcmp(names[i], "video") == 0);
+
+		if ((len == n || (prefix && len > n)) && memcmp(names[i], key, n) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+// is key one set from the command line
+static int flvfilter_IsSet(const struct flvfilter * const f, const char * const key, const uint32_t len)
+{
+	for (unsigned int i = 0; i < f->propCount; i ++)
+		if (strlen(f->key[i]) == len && memcmp(f->key[i], key, len) == 0)
+			return 1;
+
+	return 0;
+}
+
+// what a timestamp becomes, without moving the unwrapping on
+static uint32_t flvfilter_Time(const struct flvfilter * const f, const uint32_t timestamp)
+{
+	// the first timestamp is taken as it is, and the rest as steps from it
+	const int64_t unwrapped = (f->started ? f->unwrapped + (int32_t)(timestamp - f->last) : timestamp);
+	const int64_t out = f->offset + llround(unwrapped / f->speed);
+
+	return (out > 0 ? (uint32_t)out : 0);
+}
+
+// does the metadata change at all
+static int flvfilter_Rewrites(const struct flvfilter * const f)
+{
+	return (f->propCount || f->dropAudio || f->dropVideo || f->speed != 1);
+}
+
+// The properties of an onMetaData payload, or NULL if it isn't one
+static const uint8_t * flvfilter_MetaProps(const uint8_t * const payload, const uint8_t * const end)
+{
+	struct amf_value v;
+	const uint8_t * p = amf_Decode(payload, end, &v);
+
+	if (p == NULL || v.type != AMF_STRING || v.len != 10 || memcmp(v.str, "onMetaData", 10) != 0)
+		return NULL;
+
+	p = amf_Decode(p, end, &v);
+
+	if (p == NULL || (v.type != AMF_OBJECT && v.type != AMF_ECMA_ARRAY))
+		return NULL;
+
+	return p;
+}
+
+// Write one property set from the command line, as a number, boolean or string
+static void flvfilter_Value(struct flv_tag * const t, const char * const value)
+{
+	char * end;
+	const double number = strtod(value, &end);
+
+	if (end != value && *end == '\0')
+		amf_number(t, number);
+	else if (strcmp(value, "true") == 0 || strcmp(value, "false") == 0)
+		amf_boolean(t, value[0] == 't');
+	else
+		amf_string(t, value);
+}
+
+// Build onMetaData into the filter's buffer: the original properties from
+//  p to end (if any) less those replaced or dropped, then the new ones
+//  Returns the tag size, or 0 if it could not be built.
+static uint32_t flvfilter_Meta(struct flvfilter * const f, const uint8_t * p, const uint8_t * const end, const uint32_t timestamp)
+{
+	size_t capacity = 11 + (p ? (size_t)(end - p) : 0) + FIXED_SIZE + 4;
+
+	for (unsigned int i = 0; i < f->propCount; i ++)
+		capacity += 2 + strlen(f->key[i]) + 3 + (f->value[i] ? strlen(f->value[i]) : 0) + 9;
+
+	if (capacity > MAX_TAG_SIZE)
+		return 0;
+
+	if (capacity > f->metaCapacity) {
+		uint8_t * const meta = realloc(f->meta, capacity);
+
+		if (meta == NULL)
+			return 0;
+
+		f->meta = meta;
+		f->metaCapacity = capacity;
+	}
+
+	struct flv_tag t;
+	flv_TagInit(&t, f->meta, f->metaCapacity);
+	flv_TagHeader(&t, FLV_TAG_SCRIPT, timestamp);
+	amf_string(&t, "onMetaData");
+
+	// the entry count goes in once they are all written
+	const size_t count = t.len + 1;
+	uint32_t entries = 0;
+
+	amf_ecma_array(&t, 0);
+
+	// the original entries that stay are copied as they are
+	while (p != NULL) {
+		const uint8_t * const entry = p;
+		const uint8_t * key;
+		uint32_t len;
+
+		p = amf_DecodeKey(p, end, &key, &len);
+
+		if (p == NULL || (len == 0 && p < end && *p == AMF_OBJECT_END))
+			break;
+
+		const uint8_t * const value = p;
+		p = amf_Skip(p, end);
+
+		if (p == NULL)
+			break;
+
+		if (flvfilter_IsSet(f, (const char *)key, len) ||
+			(f->dropAudio && flvfilter_Match(audio_props, key, len)) ||
+			(f->dropVideo && flvfilter_Match(video_props, key, len)))
+			continue;
+
+		// timing the filter itself changes: the key is kept, with a new number
+		if (f->speed != 1) {
+			const int isDuration = (len == 8 && memcmp(key, "duration", 8) == 0);
+			struct amf_value v;
+
+			if ((isDuration || flvfilter_Match(per_second_props, key, len)) &&
+				amf_Decode(value, end, &v) && v.type == AMF_NUMBER) {
+				flv_Write(&t, entry, value - entry);
+				amf_number(&t, (isDuration ? v.number / f->speed : v.number * f->speed));
+				entries ++;
+				continue;
+			}
+		}
+
+		flv_Write(&t, entry, p - entry);
+		entries ++;
+	}
+
+	// what the filter itself changes, unless set outright
+	if (f->dropAudio && ! flvfilter_IsSet(f, "hasAudio", 8)) {
+		pstring(&t, "hasAudio");
+		amf_boolean(&t, 0);
+		entries ++;
+	}
+
+	if (f->dropVideo && ! flvfilter_IsSet(f, "hasVideo", 8)) {
+		pstring(&t, "hasVideo");
+		amf_boolean(&t, 0);
+		entries ++;
+	}
+
+	for (unsigned int i = 0; i < f->propCount; i ++) {
+		if (f->value[i] == NULL)
+			continue;
+
+		pstring(&t, f->key[i]);
+		flvfilter_Value(&t, f->value[i]);
+		entries ++;
+	}
+
+	amf_ecma_array_end(&t);
+
+	if (t.overflow)
+		return 0;
+
+	u32be(f->meta + count, entries);
+	return flv_TagFinish(&t);
+}
+
+/* ************************************************************************ */
+void flvfilter_Init(struct flvfilter * const f)
+{
+	memset(f, 0, sizeof(*f));
+	f->speed = 1;
+}
+
+int flvfilter_Drop(struct flvfilter * const f, const char * types)
+{
+	for (; *types; types ++) {
+		switch (*types) {
+		case 'a':
+			f->dropAudio = 1;
+			break;
+		case 'v':
+			f->dropVideo = 1;
+			break;
+		case 's':
+			f->dropScript = 1;
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int flvfilter_Set(struct flvfilter * const f, const char * const assignment)
+{
+	const char * const equals = strchr(assignment, '=');
+
+	if (equals == NULL || equals == assignment || f->propCount == FLVFILTER_PROPS)
+		return 0;
+
+	// the key is cut out into a copy, freed by flvfilter_Close; the value
+	//  stays where it is, in argv
+	char * const key = strndup(assignment, equals - assignment);
+
+	if (key == NULL)
+		return 0;
+
+	f->key[f->propCount] = key;
+	f->value[f->propCount] = (equals[1] ? equals + 1 : NULL);
+	f->propCount ++;
+	return 1;
+}
+
+int flvfilter_Active(const struct flvfilter * const f)
+{
+	return (f->dropAudio || f->dropVideo || f->dropScript || f->offset || flvfilter_Rewrites(f));
+}
+
+uint8_t * flvfilter_Inject(struct flvfilter * const f, const uint8_t * const tag, const struct flv_tag_header * const h, uint32_t * const size)
+{
+	if (f->tags || f->propCount == 0)
+		return NULL;
+
+	if (h->type == FLV_TAG_SCRIPT && flvfilter_MetaProps(tag + 11, tag + 11 + h->size))
+		return NULL;
+
+	*size = flvfilter_Meta(f, NULL, NULL, flvfilter_Time(f, h->timestamp));
+
+	if (*size == 0) {
+		logger_Printf(stderr, "Failed to build onMetaData\n");
+		return NULL;
+	}
+
+	f->injected ++;
+	return f->meta;
+}
+
+uint8_t * flvfilter_Tag(struct flvfilter * const f, uint8_t * tag, struct flv_tag_header * const h, uint32_t * const size)
+{
+	f->tags ++;
+
+	// every tag moves the timestamps on, even those dropped
+	const uint32_t timestamp = flvfilter_Time(f, h->timestamp);
+
+	f->unwrapped = (f->started ? f->unwrapped + (int32_t)(h->timestamp - f->last) : h->timestamp);
+	f->last = h->timestamp;
+	f->started = 1;
+
+	const uint8_t * const payload = tag + 11;
+	int drop;
+
+	switch (h->type) {
+	case FLV_TAG_AUDIO:
+		drop = f->dropAudio;
+		break;
+	case FLV_TAG_VIDEO:
+		drop = f->dropVideo;
+		break;
+	case FLV_TAG_SCRIPT:
+	{
+		const uint8_t * const props = flvfilter_MetaProps(payload, payload + h->size);
+
+		// an onMetaData being rewritten is kept, even with script data dropped
+		if (props && flvfilter_Rewrites(f)) {
+			const uint32_t built = flvfilter_Meta(f, props, payload + h->size, timestamp);
+
+			if (built) {
+				f->rewritten ++;
+				tag = f->meta;
+				*size = built;
+				flv_ParseTagHeader(tag, h);
+				return tag;
+			}
+
+			LOGGER_EVERY(1000, stderr, "Failed to rewrite onMetaData, sending it unchanged\n");
+		}
+
+		drop = f->dropScript;
+		break;
+	}
+	default:
+		drop = 0;
+	}
+
+	if (drop) {
+		f->dropped ++;
+		f->droppedBytes += *size;
+		return NULL;
+	}
+
+	// the rest are edited in place
+	if (timestamp != h->timestamp) {
+		flv_SetTimestamp(tag, timestamp);
+		h->timestamp = timestamp;
+	}
+
+	// AVC frames carry their presentation time as an offset, which scales too
+	if (f->speed != 1 && h->type == FLV_TAG_VIDEO && h->size >= 5 && (payload[0] & 0x0F) == 7 && payload[1] == 1) {
+		const int32_t composition = (int32_t)(parse_u24be(payload + 2) << 8) >> 8;
+
+		if (composition)
+			u24be(tag + 13, (uint32_t)llround(composition / f->speed) & 0xFFFFFF);
+	}
+
+	return tag;
+}
+
+void flvfilter_Report(const struct flvfilter * const f, FILE * const out)
+{
+	fprintf(out, "Filter: %lu tags, dropped %lu (%llu bytes), onMetaData rewritten %lu times, injected %lu times\n",
+		f->tags, f->dropped, (unsigned long long)f->droppedBytes, f->rewritten, f->injected);
+}
+
+void flvfilter_Close(struct flvfilter * const f)
+{
+	for (unsigned int i = 0; i < f->propCount; i ++)
+		free((char *)f->key[i]);
+	f->propCount = 0;
+
+	free(f->meta);
+	f->meta = NULL;
+	f->metaCapacity = 0;
+}
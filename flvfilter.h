@@ -0,0 +1,86 @@
+/* ***************************************************
+flvfilter: track filtering and metadata rewriting
+Greg Kennedy 2021
+
+Edits a stream of FLV tags on the way from rtmpcast's
+ reader to the connection.  Audio, video or script data
+ tags can be dropped, and timestamps moved by an offset
+ and scaled for fast-forward (the AVC composition time
+ too).  Those edits go into the tag headers where the
+ tags already are, so no payload is ever copied.  The
+ onMetaData object can have properties set or removed:
+ only that tag is rebuilt, and if the file has none,
+ one is made up and sent ahead of the first tag.
+ Dropping a track also marks it missing in onMetaData.
+*************************************************** */
+#ifndef FLVFILTER_H_
+#define FLVFILTER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "flv.h"
+
+// onMetaData properties that can be set from the command line
+#define FLVFILTER_PROPS 32
+
+struct flvfilter {
+	// tag types to drop
+	int dropAudio, dropVideo, dropScript;
+
+	// timestamps become offset + timestamp / speed, counting on past the wrap
+	int64_t offset;
+	double speed;
+
+	// onMetaData properties to set, from "key=value": NULL value removes it
+	unsigned int propCount;
+	const char * key[FLVFILTER_PROPS];
+	const char * value[FLVFILTER_PROPS];
+
+	// timestamp unwrapping
+	int started;
+	uint32_t last;
+	int64_t unwrapped;
+
+	// the rebuilt onMetaData tag
+	uint8_t * meta;
+	uint32_t metaCapacity;
+	int metaSeen;
+
+	// what was done, for flvfilter_Report
+	unsigned long tags, dropped, rewritten, injected;
+	uint64_t droppedBytes;
+};
+
+// Set up a filter that passes everything unchanged
+void flvfilter_Init(struct flvfilter * f);
+
+// Drop the tag types named by letters: a(udio), v(ideo), s(cript data)
+//  Returns 0 on any other letter.
+int flvfilter_Drop(struct flvfilter * f, const char * types);
+
+// Set an onMetaData property from "key=value", or remove it with "key="
+//  Values are numbers, true / false, or else strings.  Returns 0 if there is
+//  no '=', or too many properties.
+int flvfilter_Set(struct flvfilter * f, const char * assignment);
+
+// Whether the filter changes anything at all
+int flvfilter_Active(const struct flvfilter * f);
+
+// Filter one complete tag (header, payload and trailer), whose header is h
+//  Audio and video are edited in place; a rewritten onMetaData is built in
+//  the filter's own buffer.  Returns the tag to send, with h and *size
+//  updated to match, or NULL to drop it.  The result is valid until the next
+//  call.
+uint8_t * flvfilter_Tag(struct flvfilter * f, uint8_t * tag, struct flv_tag_header * h, uint32_t * size);
+
+// An onMetaData tag to send ahead of the first tag, when properties are
+//  being set and the file does not start with one
+//  Call before flvfilter_Tag.  Returns NULL otherwise, and after the first tag.
+uint8_t * flvfilter_Inject(struct flvfilter * f, const uint8_t * tag, const struct flv_tag_header * h, uint32_t * size);
+
+void flvfilter_Report(const struct flvfilter * f, FILE * out);
+
+void flvfilter_Close(struct flvfilter * f);
+
+#endif
@@ -0,0 +1,73 @@
+/* ***************************************************
+flvfuzz: libFuzzer harness for the FLV tag reader
+Greg Kennedy 2021
+
+Each input is walked as an FLV file: the header, then
+ tags with flv_NextTag and flv_ParseTagHeader, as
+ rtmpcast and flvstat read them.  Script tag payloads
+ go through amf_MetaFind and amf_Skip, as onMetaData
+ does.  An input that isn't FLV is also walked as bare
+ tags, so the fuzzer needn't find the file header
+ first.  Build with `make fuzz`.
+*************************************************** */
+#include "flv.h"
+
+// the properties the tools look up
+static const char * const keys[] = { "duration", "width", "height", "framerate", "nonexistent" };
+
+static void fuzz_Script(const uint8_t * const payload, const uint8_t * const end)
+{
+	struct amf_value v;
+
+	for (unsigned int i = 0; i < sizeof(keys) / sizeof(keys[0]); i ++) {
+		const uint8_t * const value = amf_MetaFind(payload, end, keys[i]);
+
+		if (value && value <= end)
+			amf_Decode(value, end, &v);
+	}
+
+	// every value in turn, as flvstat and flvfilter skip over them
+	const uint8_t * p = payload;
+
+	while (p && p < end)
+		p = amf_Skip(p, end);
+}
+
+static void fuzz_Tags(const uint8_t * p, const uint8_t * const end)
+{
+	struct flv_tag_header h;
+	const uint8_t * next;
+
+	while ((next = flv_NextTag(p, end, &h)) != NULL) {
+		flv_CheckTrailer(p, &h);
+
+		const uint8_t * const payload = p + 11;
+
+		if (h.type == FLV_TAG_SCRIPT)
+			fuzz_Script(payload, payload + h.size);
+		else {
+			flv_IsKeyframe(payload, h.size);
+			flv_IsSequenceHeader(h.type, payload, h.size);
+		}
+
+		p = next;
+	}
+
+	// whatever is left over is still a header to parse, if there's enough of it
+	if (end - p >= 11)
+		flv_ParseTagHeader(p, &h);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * const data, const size_t size)
+{
+	const uint8_t * const end = data + size;
+	uint8_t flags;
+	uint32_t first;
+
+	if (size >= FLV_HEADER_SIZE && (first = flv_ParseHeader(data, &flags)) != 0 && first <= size)
+		fuzz_Tags(data + first, end);
+	else
+		fuzz_Tags(data, end);
+
+	return 0;
+}
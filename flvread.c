@@ -0,0 +1,266 @@
+/* ***************************************************
+flvread: FLV tags from a file, for rtmpcast
+Greg Kennedy 2021
+*************************************************** */
+#include "flvread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// messages, written out off the streaming thread
+#include "logger.h"
+
+// Start reading the block after the last one into block i
+static int flvread_Queue(struct flvread * const r, const unsigned int i)
+{
+	uint8_t * const buf = r->blocks + (size_t)i * FLVREAD_BLOCK;
+	const int queued = (r->fixed ?
+		uring_ReadFixed(&r->ring, r->fd, buf, FLVREAD_BLOCK, r->next, 0, i) :
+		uring_Read(&r->ring, r->fd, buf, FLVREAD_BLOCK, r->next, i));
+
+	if (! queued)
+		return 0;
+
+	r->busy[i] = 1;
+	r->next += FLVREAD_BLOCK;
+	return 1;
+}
+
+// Take in whatever reads have completed, waiting for at least one if asked
+//  Any reads queued meanwhile go to the kernel in the same call.
+static int flvread_Reap(struct flvread * const r, const unsigned int wait)
+{
+	if (wait || r->ring.queued) {
+		r->reads ++;
+		if (! uring_Submit(&r->ring, wait)) {
+			logger_Printf(stderr, "Failed to read FLV file: %s\n", strerror(errno));
+			return 0;
+		}
+	}
+
+	uint64_t user;
+	int32_t res;
+
+	while (uring_Complete(&r->ring, &user, &res)) {
+		r->busy[user] = 0;
+		r->len[user] = res;
+	}
+
+	return 1;
+}
+
+// Wait for the block being parsed to be read
+static int flvread_Wait(struct flvread * const r)
+{
+	while (r->busy[r->cur]) {
+		if (! flvread_Reap(r, 1))
+			return 0;
+	}
+
+	if (r->len[r->cur] < 0) {
+		logger_Printf(stderr, "Failed to read FLV file: %s\n", strerror(-r->len[r->cur]));
+		return 0;
+	}
+
+	return 1;
+}
+
+// Wait for the first block, without complaint if it can't be read
+//  A kernel older than 5.6 has no IORING_OP_READ, and fails plain reads
+//  with -EINVAL: with the buffers not registered (RLIMIT_MEMLOCK), that
+//  is every read, so the caller goes back to stdio instead.
+static int flvread_First(struct flvread * const r)
+{
+	while (r->busy[0]) {
+		r->reads ++;
+		if (! uring_Submit(&r->ring, 1))
+			return 0;
+
+		uint64_t user;
+		int32_t res;
+
+		while (uring_Complete(&r->ring, &user, &res)) {
+			r->busy[user] = 0;
+			r->len[user] = res;
+		}
+	}
+
+	return (r->len[0] >= 0);
+}
+
+// Move on from a block parsed to its end, reading the next into it
+//  Returns 1, 0 at the end of the file, or -1 on error.
+static int flvread_Advance(struct flvread * const r)
+{
+	// a short block was the end of the file
+	if (r->len[r->cur] < FLVREAD_BLOCK)
+		return 0;
+
+	if (! flvread_Queue(r, r->cur))
+		return -1;
+
+	r->cur = (r->cur + 1) % FLVREAD_BLOCKS;
+	r->pos = 0;
+	return (flvread_Wait(r) ? 1 : -1);
+}
+
+// Copy the next n bytes out, across blocks
+//  Returns 1, 0 if the file ends first, or -1 on error.
+static int flvread_Copy(struct flvread * const r, uint8_t * dst, uint32_t n)
+{
+	while (n) {
+		const uint32_t avail = r->len[r->cur] - r->pos;
+
+		if (avail == 0) {
+			const int more = flvread_Advance(r);
+			if (more <= 0)
+				return more;
+			continue;
+		}
+
+		const uint32_t take = (n < avail ? n : avail);
+		memcpy(dst, r->blocks + (size_t)r->cur * FLVREAD_BLOCK + r->pos, take);
+		r->pos += take;
+		dst += take;
+		n -= take;
+	}
+
+	return 1;
+}
+
+// The existing path: a tag's parts read straight into scratch
+static int flvread_Stdio(struct flvread * const r, uint8_t * const scratch, struct flv_tag_header * const h)
+{
+	if (fread(scratch, 1, 11, r->f) != 11) {
+		// failed to read next tag - probably end-of-file.
+		if (feof(r->f))
+			return 0;
+
+		logger_Printf(stderr, "Short read looking for next tag header: %s\n", strerror(errno));
+		return -1;
+	}
+
+	flv_ParseTagHeader(scratch, h);
+
+	if (fread(scratch + 11, 1, h->size, r->f) != h->size) {
+		logger_Printf(stderr, "Short read trying to get payload: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// Remember the 4-byte tag length at the end.
+	if (fread(scratch + 11 + h->size, 1, 4, r->f) != 4) {
+		logger_Printf(stderr, "Short read trying to get tag size: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 1;
+}
+
+/* ************************************************************************ */
+int flvread_Open(struct flvread * const r, FILE * const f, const uint64_t offset, const int uring)
+{
+	memset(r, 0, sizeof(*r));
+	r->f = f;
+	r->fd = fileno(f);
+	r->ring.fd = -1;
+
+	// reads go by file offset, so only a regular file can be read ahead
+	struct stat st;
+
+	if (uring && fstat(r->fd, &st) == 0 && S_ISREG(st.st_mode) && uring_Init(&r->ring, FLVREAD_BLOCKS)) {
+		r->blocks = aligned_alloc(4096, (size_t)FLVREAD_BLOCKS * FLVREAD_BLOCK);
+
+		if (r->blocks) {
+			// registering saves the kernel mapping the pages on every read,
+			//  but counts against RLIMIT_MEMLOCK: plain reads do without
+			const struct iovec iov = { r->blocks, (size_t)FLVREAD_BLOCKS * FLVREAD_BLOCK };
+			r->fixed = uring_Register(&r->ring, &iov, 1);
+			r->next = offset;
+
+			for (unsigned int i = 0; i < FLVREAD_BLOCKS; i ++)
+				flvread_Queue(r, i);
+
+			if (flvread_First(r))
+				return 1;
+
+			flvread_Close(r);
+		} else
+			uring_Close(&r->ring);
+	}
+
+	if (fseeko(f, offset, SEEK_SET) != 0) {
+		logger_Printf(stderr, "Failed to seek to the first tag: %s\n", strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+int flvread_Uring(const struct flvread * const r)
+{
+	return (r->ring.fd >= 0);
+}
+
+int flvread_Next(struct flvread * const r, uint8_t * const scratch, uint8_t ** const tag, struct flv_tag_header * const h)
+{
+	*tag = scratch;
+
+	if (r->ring.fd < 0)
+		return flvread_Stdio(r, scratch, h);
+
+	// hand back blocks as they are finished with, without waiting
+	if (r->ring.queued && ! flvread_Reap(r, 0))
+		return -1;
+
+	if (r->pos == (uint32_t)r->len[r->cur]) {
+		const int more = flvread_Advance(r);
+		if (more <= 0)
+			return more;
+	}
+
+	const unsigned int block = r->cur;
+	const uint32_t start = r->pos;
+	uint8_t head[11];
+
+	// a partial header at the end is taken as the end, as stdio does
+	const int got = flvread_Copy(r, head, sizeof(head));
+	if (got <= 0)
+		return got;
+
+	flv_ParseTagHeader(head, h);
+
+	// a tag that lies within the block is used where it is
+	const uint32_t rest = h->size + 4;
+
+	if (r->cur == block && r->len[block] - r->pos >= rest) {
+		*tag = r->blocks + (size_t)block * FLVREAD_BLOCK + start;
+		r->pos += rest;
+		return 1;
+	}
+
+	memcpy(scratch, head, sizeof(head));
+
+	const int copied = flvread_Copy(r, scratch + 11, rest);
+	if (copied == 0)
+		logger_Printf(stderr, "FLV file ends partway through a tag\n");
+
+	return (copied > 0 ? 1 : -1);
+}
+
+void flvread_Close(struct flvread * const r)
+{
+	if (r->ring.fd >= 0) {
+		// the kernel may still be reading into the blocks
+		for (unsigned int i = 0; i < FLVREAD_BLOCKS; i ++) {
+			while (r->busy[i] && flvread_Reap(r, 1))
+				;
+		}
+
+		uring_Close(&r->ring);
+	}
+
+	free(r->blocks);
+	r->blocks = NULL;
+}
@@ -0,0 +1,62 @@
+/* ***************************************************
+flvread: FLV tags from a file, for rtmpcast
+Greg Kennedy 2021
+
+Reads the tags of an FLV file in order.  With io_uring,
+ the file is read a large block at a time into a few
+ buffers registered with the kernel, with every block
+ but the one being parsed already in flight: each
+ io_uring_enter hands back the blocks that were consumed
+ and waits for the next, so a whole block of tags costs
+ one system call, and tags that lie within a block are
+ used where they are, not copied.  Without io_uring,
+ tags are read with stdio, a few freads each.
+*************************************************** */
+#ifndef FLVREAD_H_
+#define FLVREAD_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "flv.h"
+#include "uring.h"
+
+// block size and how many are in flight: a few MB/s of stream is a block
+//  every couple of seconds
+#define FLVREAD_BLOCK (256 * 1024)
+#define FLVREAD_BLOCKS 4
+
+struct flvread {
+	FILE * f;
+	int fd;
+
+	// the io_uring path, when ring.fd >= 0
+	struct uring ring;
+	int fixed;	// the blocks are registered buffers
+	uint8_t * blocks;	// FLVREAD_BLOCKS of FLVREAD_BLOCK bytes
+	int32_t len[FLVREAD_BLOCKS];	// bytes read into each, or an error
+	int busy[FLVREAD_BLOCKS];	// a read is in flight
+	uint64_t next;	// file offset for the next block read
+	unsigned int cur;	// block being parsed
+	uint32_t pos;	// and where in it
+
+	unsigned long reads;	// system calls made to read (io_uring_enter, on that path)
+};
+
+// Read tags from f, starting at offset (just past the first PreviousTagSize)
+//  uring picks the io_uring path, if the kernel has it.  Returns 0 on failure.
+//  f stays the caller's to close, after flvread_Close.
+int flvread_Open(struct flvread * r, FILE * f, uint64_t offset, int uring);
+
+// Whether tags are read with io_uring
+int flvread_Uring(const struct flvread * r);
+
+// The next whole tag, header to PreviousTagSize, at *tag
+//  It is in scratch (MAX_TAG_SIZE bytes) or in the reader's own buffers, and
+//  valid until the next call.  Returns 1 for a tag, 0 at the end of the file,
+//  and -1 if the file is cut short or can't be read.
+int flvread_Next(struct flvread * r, uint8_t * scratch, uint8_t ** tag, struct flv_tag_header * h);
+
+void flvread_Close(struct flvread * r);
+
+#endif
@@ -0,0 +1,302 @@
+/* ***************************************************
+flvrec: seekable FLV recording
+Greg Kennedy 2021
+*************************************************** */
+#include "flvrec.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+// FLV tag and AMF serialization
+#include "flv.h"
+
+// room kept for the stream's own onMetaData properties; any that do not fit are left out
+#define PROPS_MAX 4096
+// room for the properties flvrec adds itself, and the array and object framing
+#define FIXED_SIZE 512
+// each index entry is two AMF numbers: a time and a file position
+#define ENTRY_SIZE 18
+
+// properties flvrec writes itself, so the stream's copies are dropped
+static const char * const own_props[] = {
+	"duration", "filesize", "hasVideo", "hasAudio", "hasKeyframes", "keyframes",
+	"lastkeyframetimestamp", "lastkeyframelocation", "filler", NULL
+};
+
+/* ************************************************************************ */
+// Build the onMetaData tag into buf, exactly filling the reserved space
+//  Returns 0 if it does not fit, which the reservation should rule out.
+static int flvrec_Meta(const struct flvrec * const r, uint8_t * const buf)
+{
+	const uint32_t tagSize = 11 + r->reserved + 4;
+	struct flv_tag t;
+
+	flv_TagInit(&t, buf, tagSize);
+	flv_TagHeader(&t, FLV_TAG_SCRIPT, 0);
+	amf_string(&t, "onMetaData");
+	amf_ecma_array(&t, r->propCount + (r->count ? 9 : 7));
+
+	flv_Write(&t, r->props, r->propsSize);
+
+	amf_ecma_array_entry(&t, "duration", r->haveTimestamp ? (r->lastTimestamp - r->firstTimestamp) / 1000.0 : 0);
+	amf_ecma_array_entry(&t, "filesize", r->size);
+	pstring(&t, "hasVideo");
+	amf_boolean(&t, r->flags & FLV_FLAG_VIDEO);
+	pstring(&t, "hasAudio");
+	amf_boolean(&t, r->flags & FLV_FLAG_AUDIO);
+	pstring(&t, "hasKeyframes");
+	amf_boolean(&t, r->count > 0);
+
+	if (r->count) {
+		amf_ecma_array_entry(&t, "lastkeyframetimestamp", r->times[r->count - 1] / 1000.0);
+		amf_ecma_array_entry(&t, "lastkeyframelocation", r->positions[r->count - 1]);
+	}
+
+	// the index players seek with: the time of each keyframe (s), and where its tag starts
+	pstring(&t, "keyframes");
+	amf_object(&t);
+	pstring(&t, "times");
+	amf_strict_array(&t, r->count);
+	for (unsigned int i = 0; i < r->count; i ++)
+		amf_number(&t, r->times[i] / 1000.0);
+	pstring(&t, "filepositions");
+	amf_strict_array(&t, r->count);
+	for (unsigned int i = 0; i < r->count; i ++)
+		amf_number(&t, r->positions[i]);
+	amf_object_end(&t);
+
+	// pad out the rest with a string of spaces, leaving room for the array end
+	pstring(&t, "filler");
+
+	const size_t used = t.len - 11 + 3;
+
+	if (t.overflow || used + 5 > r->reserved)
+		return 0;
+
+	size_t fill = r->reserved - used;
+
+	if (fill - 3 <= 0xFFFF) {
+		flv_U8(&t, AMF_STRING);
+		flv_U16(&t, fill - 3);
+		fill -= 3;
+	} else {
+		flv_U8(&t, AMF_LONG_STRING);
+		flv_U32(&t, fill - 5);
+		fill -= 5;
+	}
+
+	uint8_t * const p = flv_Reserve(&t, fill);
+	if (p) memset(p, ' ', fill);
+
+	amf_ecma_array_end(&t);
+	return (flv_TagFinish(&t) == tagSize);
+}
+
+// Keep the properties of an onMetaData payload, for the reserved metadata
+static void flvrec_Props(struct flvrec * const r, const uint8_t * const payload, const uint32_t size)
+{
+	const uint8_t * const end = payload + size;
+	struct amf_value v;
+
+	// skip the "onMetaData" name to the properties
+	const uint8_t * p = amf_Decode(payload, end, &v);
+	p = (p ? amf_Decode(p, end, &v) : NULL);
+
+	if (p == NULL || (v.type != AMF_OBJECT && v.type != AMF_ECMA_ARRAY))
+		return;
+
+	r->propsSize = r->propCount = 0;
+
+	while (p != NULL) {
+		const uint8_t * const entry = p;
+		const uint8_t * key;
+		uint32_t len;
+
+		p = amf_DecodeKey(p, end, &key, &len);
+
+		if (p == NULL || (len == 0 && p < end && *p == AMF_OBJECT_END))
+			break;
+
+		p = amf_Skip(p, end);
+
+		if (p == NULL)
+			break;
+
+		int own = 0;
+		for (unsigned int i = 0; own_props[i] != NULL; i ++)
+			own |= (strlen(own_props[i]) == len && memcmp(own_props[i], key, len) == 0);
+
+		if (own || r->propsSize + (p - entry) > PROPS_MAX)
+			continue;
+
+		memcpy(r->props + r->propsSize, entry, p - entry);
+		r->propsSize += p - entry;
+		r->propCount ++;
+	}
+}
+
+// Add a keyframe to the index, thinning it when it is full
+static void flvrec_Index(struct flvrec * const r, const uint32_t timestamp)
+{
+	if (++ r->skipped < r->stride)
+		return;
+
+	r->skipped = 0;
+
+	if (r->count == r->max) {
+		// out of room: keep every other entry, and index half as often from here
+		r->count = (r->count + 1) / 2;
+		for (unsigned int i = 1; i < r->count; i ++) {
+			r->times[i] = r->times[2 * i];
+			r->positions[i] = r->positions[2 * i];
+		}
+
+		r->stride *= 2;
+	}
+
+	r->times[r->count] = timestamp;
+	r->positions[r->count] = r->size;
+	r->count ++;
+}
+
+// Writing failed: report it once, and record no more
+static int flvrec_Fail(struct flvrec * const r)
+{
+	perror("Failed to write recording");
+	fclose(r->f);
+	r->f = NULL;
+	return 0;
+}
+
+/* ************************************************************************ */
+int flvrec_Open(struct flvrec * const r, const char * const path, const unsigned int maxKeyframes)
+{
+	memset(r, 0, sizeof(*r));
+
+	r->max = (maxKeyframes > 2 ? maxKeyframes : 2);
+	r->stride = 1;
+	r->reserved = PROPS_MAX + FIXED_SIZE + ENTRY_SIZE * r->max;
+
+	r->props = malloc(PROPS_MAX);
+	r->times = malloc(r->max * sizeof(*r->times));
+	r->positions = malloc(r->max * sizeof(*r->positions));
+	uint8_t * const buf = malloc(11 + r->reserved + 4);
+
+	if (r->props == NULL || r->times == NULL || r->positions == NULL || buf == NULL) {
+		perror("Failed to allocate recording index");
+		goto fail;
+	}
+
+	if ((r->f = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "Failed to open %s: ", path);
+		perror(NULL);
+		goto fail;
+	}
+
+	// the header, and an empty onMetaData holding the space until close
+	const uint8_t flvHeader[] = { 0x46, 0x4C, 0x56, 0x01, FLV_FLAG_AUDIO | FLV_FLAG_VIDEO, 0, 0, 0, 9, 0, 0, 0, 0 };
+
+	if (! flvrec_Meta(r, buf) ||
+		fwrite(flvHeader, sizeof(flvHeader), 1, r->f) != 1 ||
+		fwrite(buf, 11 + r->reserved + 4, 1, r->f) != 1) {
+		flvrec_Fail(r);
+		goto fail;
+	}
+
+	r->size = sizeof(flvHeader) + 11 + r->reserved + 4;
+	free(buf);
+	return 1;
+
+fail:
+	free(buf);
+	flvrec_Close(r);
+	return 0;
+}
+
+int flvrec_Tag(struct flvrec * const r, const uint8_t type, const uint32_t timestamp, const uint8_t * const payload, const uint32_t size)
+{
+	if (r->f == NULL)
+		return 1;
+
+	if (type == FLV_TAG_SCRIPT) {
+		struct amf_value v;
+
+		if (amf_Decode(payload, payload + size, &v) != NULL && v.type == AMF_STRING &&
+			v.len == 10 && memcmp(v.str, "onMetaData", 10) == 0) {
+			flvrec_Props(r, payload, size);
+			return 1;
+		}
+	} else {
+		r->flags |= (type == FLV_TAG_AUDIO ? FLV_FLAG_AUDIO : FLV_FLAG_VIDEO);
+
+		if (! r->haveTimestamp) {
+			r->haveTimestamp = 1;
+			r->firstTimestamp = timestamp;
+		}
+		r->lastTimestamp = timestamp;
+
+		// index only keyframes carrying a picture: not sequence headers,
+		//  nor the AVC end of sequence
+		if (type == FLV_TAG_VIDEO && flv_IsKeyframe(payload, size) && ! flv_IsSequenceHeader(type, payload, size) &&
+			! ((payload[0] & 0x0F) == 7 && (size < 2 || payload[1] != 1)))
+			flvrec_Index(r, timestamp);
+	}
+
+	uint8_t header[11];
+	uint8_t trailer[4];
+	struct flv_tag tag;
+
+	flv_TagInit(&tag, header, sizeof(header));
+	flv_TagHeader(&tag, type, timestamp);
+	u24be(header + 1, size);
+	u32be(trailer, 11 + size);
+
+	if (fwrite(header, sizeof(header), 1, r->f) != 1 ||
+		(size && fwrite(payload, size, 1, r->f) != 1) ||
+		fwrite(trailer, sizeof(trailer), 1, r->f) != 1)
+		return flvrec_Fail(r);
+
+	r->size += 11 + size + 4;
+	return 1;
+}
+
+int flvrec_Write(struct flvrec * const r, const uint8_t * const tag, const uint32_t size)
+{
+	struct flv_tag_header h;
+
+	if (size < 15)
+		return 1;
+
+	flv_ParseTagHeader(tag, &h);
+	return flvrec_Tag(r, h.type, h.timestamp, tag + 11, h.size);
+}
+
+int flvrec_Close(struct flvrec * const r)
+{
+	int ret = 1;
+
+	if (r->f) {
+		// fill in the reserved metadata, and the header flags for what was seen
+		uint8_t * const buf = malloc(11 + r->reserved + 4);
+
+		ret = (buf != NULL && flvrec_Meta(r, buf) &&
+			fseeko(r->f, FLV_HEADER_SIZE + 4, SEEK_SET) == 0 &&
+			fwrite(buf, 11 + r->reserved + 4, 1, r->f) == 1 &&
+			fseeko(r->f, 4, SEEK_SET) == 0 &&
+			fputc(r->flags, r->f) != EOF);
+
+		free(buf);
+
+		if (fclose(r->f) != 0)
+			ret = 0;
+		if (! ret)
+			perror("Failed to finish recording");
+	}
+
+	free(r->props);
+	free(r->times);
+	free(r->positions);
+	memset(r, 0, sizeof(*r));
+	return ret;
+}
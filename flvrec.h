@@ -0,0 +1,57 @@
+/* ***************************************************
+flvrec: seekable FLV recording
+Greg Kennedy 2021
+
+Writes a stream to an FLV file that players can seek in
+ without scanning it.  Room for onMetaData is reserved at
+ the front of the file, and on close it is filled in with
+ the stream's own metadata plus duration, filesize and a
+ keyframes index (times / filepositions).  The index is
+ thinned, dropping every other entry, whenever it would
+ outgrow the space reserved for it.
+*************************************************** */
+#ifndef FLVREC_H_
+#define FLVREC_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+// default keyframe index size: an hour of one keyframe per second
+#define FLVREC_KEYFRAMES 3600
+
+struct flvrec {
+	FILE * f;	// NULL when not recording
+	uint64_t size;	// bytes written, and so the offset of the next tag
+	uint32_t reserved;	// onMetaData payload bytes reserved after the file header
+	uint8_t flags;	// FLV_FLAG_AUDIO / FLV_FLAG_VIDEO, for tags seen
+
+	// the stream's own onMetaData properties, as raw AMF entries
+	uint8_t * props;
+	uint32_t propsSize, propCount;
+
+	// keyframe index: one kept for every stride seen
+	uint32_t * times;	// ms
+	uint64_t * positions;
+	unsigned int count, max, stride, skipped;
+
+	int haveTimestamp;
+	uint32_t firstTimestamp, lastTimestamp;
+};
+
+// Create path and reserve room for the metadata and maxKeyframes index entries
+//  Returns 0 on failure.  A zeroed struct flvrec records nothing, so callers
+//  need not check whether recording is on before each write.
+int flvrec_Open(struct flvrec * r, const char * path, unsigned int maxKeyframes);
+
+// Record one tag, as its parts or as a complete tag (header, payload and trailer)
+//  onMetaData is not written where it appears: its properties go into the
+//  reserved metadata at the front instead.  Returns 0 if writing failed, after
+//  which recording stops.
+int flvrec_Tag(struct flvrec * r, uint8_t type, uint32_t timestamp, const uint8_t * payload, uint32_t size);
+int flvrec_Write(struct flvrec * r, const uint8_t * tag, uint32_t size);
+
+// Fill in the metadata and index, and close the file
+//  Returns 0 if the file could not be finished.
+int flvrec_Close(struct flvrec * r);
+
+#endif
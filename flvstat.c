@@ -0,0 +1,481 @@
+/* ***************************************************
+flvstat: FLV file analyzer
+Greg Kennedy 2021
+
+Walks the tags of one or more FLV files, using the
+ same tag parsing as rtmpcast, and reports per-stream
+ bitrate over time, GOP structure, timestamp problems
+ and broken tag trailers as JSON.
+*************************************************** */
+#include "flv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// at most this many individual events are listed per problem type,
+//  though all of them are counted
+#define MAX_EVENTS 100
+
+// bitrate buckets stop growing past this, so a garbage timestamp
+//  cannot make us allocate the whole address space: tags later than
+//  that are counted, but left out of the bitrate series
+#define MAX_BUCKETS (1 << 22)
+
+// report settings, from the command line
+static unsigned long interval = 1000;	// bitrate bucket width (ms)
+static unsigned long gapThreshold = 1000;	// timestamp jump counted as a gap (ms)
+static unsigned long largestCount = 10;	// how many of the largest tags to list
+
+// a problem spotted at some file offset
+struct event {
+	uint64_t offset;
+	uint32_t a, b;
+};
+
+struct event_list {
+	unsigned long count;
+	struct event list[MAX_EVENTS];
+};
+
+static void event_Add(struct event_list * const e, const uint64_t offset, const uint32_t a, const uint32_t b)
+{
+	if (e->count < MAX_EVENTS) {
+		e->list[e->count].offset = offset;
+		e->list[e->count].a = a;
+		e->list[e->count].b = b;
+	}
+
+	e->count ++;
+}
+
+// min / max / total of a series
+struct summary {
+	unsigned long count;
+	uint32_t min, max;
+	uint64_t total;
+};
+
+static void summary_Add(struct summary * const s, const uint32_t value)
+{
+	if (s->count == 0 || value < s->min) s->min = value;
+	if (s->count == 0 || value > s->max) s->max = value;
+	s->total += value;
+	s->count ++;
+}
+
+// everything tracked per stream (audio, video, script)
+struct stream {
+	const char * name;
+	unsigned long tags;
+	uint64_t bytes;	// payload bytes
+	int seen;
+	uint32_t first, last;	// timestamps (ms)
+	uint32_t min, max;	// which differ from first / last if the stream goes backwards
+
+	// payload bytes in each interval
+	uint64_t * buckets;
+	size_t nbuckets;
+	unsigned long unbucketed;	// tags past MAX_BUCKETS
+
+	struct event_list gaps;	// a = previous timestamp, b = this one
+	struct event_list backwards;
+
+	// video only: GOP length in frames, and time between keyframes
+	unsigned long keyframes;
+	unsigned long frames;	// frames since last keyframe
+	uint32_t lastKeyframe;
+	struct summary gopFrames;
+	struct summary keyframeInterval;
+};
+
+// a tag for the "largest tags" list
+struct large_tag {
+	uint64_t offset;
+	uint8_t type;
+	uint32_t size;
+	uint32_t timestamp;
+};
+
+/* ************************************************************************ */
+// add a tag's bytes to the bitrate bucket for its timestamp
+static int stream_Bucket(struct stream * const s, const uint32_t timestamp, const uint32_t size)
+{
+	const size_t index = timestamp / interval;
+
+	if (index >= MAX_BUCKETS) {
+		s->unbucketed ++;
+		return 1;
+	}
+
+	if (index >= s->nbuckets) {
+		size_t n = (s->nbuckets ? s->nbuckets * 2 : 64);
+		while (n <= index) n *= 2;
+		if (n > MAX_BUCKETS) n = MAX_BUCKETS;
+
+		uint64_t * const buckets = realloc(s->buckets, n * sizeof(uint64_t));
+
+		if (buckets == NULL)
+			return 0;
+
+		memset(buckets + s->nbuckets, 0, (n - s->nbuckets) * sizeof(uint64_t));
+		s->buckets = buckets;
+		s->nbuckets = n;
+	}
+
+	s->buckets[index] += size;
+	return 1;
+}
+
+static int stream_Add(struct stream * const s, const uint64_t offset, const struct flv_tag_header * const h, const uint8_t * const payload)
+{
+	// timestamp checks, against the previous tag of the same stream
+	if (s->seen) {
+		if (h->timestamp < s->last)
+			event_Add(&s->backwards, offset, s->last, h->timestamp);
+		else if (h->timestamp - s->last > gapThreshold)
+			event_Add(&s->gaps, offset, s->last, h->timestamp);
+	} else {
+		s->first = s->min = s->max = h->timestamp;
+		s->seen = 1;
+	}
+
+	if (h->timestamp < s->min) s->min = h->timestamp;
+	if (h->timestamp > s->max) s->max = h->timestamp;
+
+	s->last = h->timestamp;
+	s->tags ++;
+	s->bytes += h->size;
+
+	// GOP structure, counting only real frames (not the decoder config)
+	if (h->type == FLV_TAG_VIDEO && ! flv_IsSequenceHeader(h->type, payload, h->size)) {
+		if (flv_IsKeyframe(payload, h->size)) {
+			if (s->keyframes) {
+				summary_Add(&s->gopFrames, s->frames);
+				if (h->timestamp >= s->lastKeyframe)
+					summary_Add(&s->keyframeInterval, h->timestamp - s->lastKeyframe);
+			}
+
+			s->keyframes ++;
+			s->lastKeyframe = h->timestamp;
+			s->frames = 0;
+		}
+
+		s->frames ++;
+	}
+
+	return stream_Bucket(s, h->timestamp, h->size);
+}
+
+// at the end of the file, the last GOP is complete too
+static void stream_Finish(struct stream * const s)
+{
+	if (s->keyframes && s->frames)
+		summary_Add(&s->gopFrames, s->frames);
+
+	s->frames = 0;
+}
+
+// keep the largest tags, sorted biggest first
+static void largest_Add(struct large_tag * const largest, unsigned long * const n, const uint64_t offset, const struct flv_tag_header * const h)
+{
+	if (*n == largestCount && (largestCount == 0 || largest[*n - 1].size >= h->size))
+		return;
+
+	unsigned long i = (*n < largestCount ? (*n) ++ : *n - 1);
+
+	for (; i > 0 && largest[i - 1].size < h->size; i --)
+		largest[i] = largest[i - 1];
+
+	largest[i].offset = offset;
+	largest[i].type = h->type;
+	largest[i].size = h->size;
+	largest[i].timestamp = h->timestamp;
+}
+
+/* ************************************************************************ */
+// JSON output
+static void json_String(const char * s)
+{
+	putchar('"');
+
+	for (; *s; s ++) {
+		const unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+
+	putchar('"');
+}
+
+static const char * tag_Name(const uint8_t type)
+{
+	switch (type) {
+	case FLV_TAG_AUDIO: return "audio";
+	case FLV_TAG_VIDEO: return "video";
+	case FLV_TAG_SCRIPT: return "script";
+	default: return "other";
+	}
+}
+
+static void json_Events(const char * const name, const struct event_list * const e, const char * const a, const char * const b)
+{
+	printf("\"%s\": {\"count\": %lu, \"events\": [", name, e->count);
+
+	for (unsigned long i = 0; i < e->count && i < MAX_EVENTS; i ++)
+		printf("%s{\"offset\": %llu, \"%s\": %lu, \"%s\": %lu}", (i ? ", " : ""),
+			(unsigned long long)e->list[i].offset, a, (unsigned long)e->list[i].a, b, (unsigned long)e->list[i].b);
+
+	printf("]}");
+}
+
+static void json_Summary(const char * const name, const struct summary * const s)
+{
+	if (s->count == 0)
+		printf("\"%s\": null", name);
+	else
+		printf("\"%s\": {\"min\": %lu, \"max\": %lu, \"avg\": %.2f}", name,
+			(unsigned long)s->min, (unsigned long)s->max, (double)s->total / s->count);
+}
+
+static void json_Stream(const struct stream * const s)
+{
+	printf("\t\t\"%s\": {\"tags\": %lu, \"bytes\": %llu", s->name, s->tags, (unsigned long long)s->bytes);
+
+	if (s->tags == 0) {
+		printf("}");
+		return;
+	}
+
+	const uint32_t duration = s->max - s->min;
+	printf(", \"first_ms\": %lu, \"last_ms\": %lu, \"avg_kbps\": %.1f,\n", (unsigned long)s->first, (unsigned long)s->last,
+		duration ? s->bytes * 8.0 / duration : 0.0);
+
+	// one entry per interval, from the earliest timestamp to the latest
+	//  (bits per millisecond is kbps)
+	printf("\t\t\t\"bitrate_interval_ms\": %lu, \"bitrate_start_ms\": %lu, \"bitrate_kbps\": [", interval, (s->min / interval) * interval);
+	size_t used = s->max / interval + 1;
+	if (used > s->nbuckets) used = s->nbuckets;
+
+	for (size_t i = s->min / interval; i < used; i ++)
+		printf("%s%.1f", (i > s->min / interval ? ", " : ""), s->buckets[i] * 8.0 / interval);
+
+	printf("], \"unbucketed_tags\": %lu,\n\t\t\t", s->unbucketed);
+	json_Events("timestamp_gaps", &s->gaps, "from_ms", "to_ms");
+	printf(",\n\t\t\t");
+	json_Events("non_monotonic", &s->backwards, "from_ms", "to_ms");
+
+	if (s->keyframes) {
+		printf(",\n\t\t\t\"keyframes\": %lu, ", s->keyframes);
+		json_Summary("gop_frames", &s->gopFrames);
+		printf(", ");
+		json_Summary("keyframe_interval_ms", &s->keyframeInterval);
+	}
+
+	printf("}");
+}
+
+/* ************************************************************************ */
+// analyze one file, and print its JSON object
+//  returns 0 if the file could not be read at all
+static int analyze(const char * const path)
+{
+	int ret = 1;
+	const char * error = NULL;
+
+	printf("{\"file\": ");
+	json_String(path);
+
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		error = strerror(errno);
+		ret = 0;
+		goto exit;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) != 0) {
+		error = strerror(errno);
+		ret = 0;
+		goto closeFile;
+	}
+
+	const size_t size = st.st_size;
+
+	if (size < FLV_HEADER_SIZE + 4) {
+		error = "File too short for FLV";
+		ret = 0;
+		goto closeFile;
+	}
+
+	// Map the whole file, and tell the kernel we will read it front to back
+	//  so it can read ahead aggressively
+	uint8_t * const map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (map == MAP_FAILED) {
+		error = strerror(errno);
+		ret = 0;
+		goto closeFile;
+	}
+
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	uint8_t flags;
+	const uint32_t start = flv_ParseHeader(map, &flags);
+
+	if (start == 0 || start > size) {
+		error = "Does not appear to be valid FLV1 file";
+		ret = 0;
+		goto unmap;
+	}
+
+	printf(", \"bytes\": %llu, \"audio\": %s, \"video\": %s", (unsigned long long)size,
+		(flags & FLV_FLAG_AUDIO ? "true" : "false"), (flags & FLV_FLAG_VIDEO ? "true" : "false"));
+
+	struct stream streams[3] = { { .name = "audio" }, { .name = "video" }, { .name = "script" } };
+	unsigned long tags = 0, otherTags = 0;
+	struct event_list * const trailers = calloc(1, sizeof(struct event_list));
+	struct large_tag * const largest = calloc(largestCount + 1, sizeof(struct large_tag));
+	unsigned long nLargest = 0;
+
+	if (trailers == NULL || largest == NULL) {
+		error = "Out of memory";
+		ret = 0;
+		goto freeStats;
+	}
+
+	// Walk the tags
+	const uint8_t * p = map + start;
+	const uint8_t * const end = map + size;
+	const uint8_t * truncated = NULL;
+
+	while (p < end) {
+		struct flv_tag_header h;
+		const uint8_t * const next = flv_NextTag(p, end, &h);
+
+		if (next == NULL) {
+			truncated = p;
+			break;
+		}
+
+		const uint64_t offset = p - map;
+
+		if (! flv_CheckTrailer(p, &h))
+			event_Add(trailers, offset, 11 + h.size, parse_u32be(p + 11 + h.size));
+
+		struct stream * s = NULL;
+		if (h.type == FLV_TAG_AUDIO) s = &streams[0];
+		else if (h.type == FLV_TAG_VIDEO) s = &streams[1];
+		else if (h.type == FLV_TAG_SCRIPT) s = &streams[2];
+		else otherTags ++;
+
+		if (s != NULL && ! stream_Add(s, offset, &h, p + 11)) {
+			error = "Out of memory";
+			ret = 0;
+			goto freeStats;
+		}
+
+		largest_Add(largest, &nLargest, offset, &h);
+		tags ++;
+		p = next;
+	}
+
+	for (int i = 0; i < 3; i ++)
+		stream_Finish(&streams[i]);
+
+	printf(", \"tags\": %lu, \"other_tags\": %lu, \"truncated_at\": ", tags, otherTags);
+	if (truncated)
+		printf("%llu", (unsigned long long)(truncated - map));
+	else
+		printf("null");
+
+	printf(",\n\t\"streams\": {\n");
+	for (int i = 0; i < 3; i ++) {
+		json_Stream(&streams[i]);
+		printf("%s\n", (i < 2 ? "," : ""));
+	}
+
+	printf("\t},\n\t");
+	json_Events("trailer_mismatches", trailers, "expected", "found");
+
+	printf(",\n\t\"largest_tags\": [");
+	for (unsigned long i = 0; i < nLargest; i ++)
+		printf("%s{\"offset\": %llu, \"type\": \"%s\", \"size\": %lu, \"timestamp_ms\": %lu}", (i ? ", " : ""),
+			(unsigned long long)largest[i].offset, tag_Name(largest[i].type),
+			(unsigned long)largest[i].size, (unsigned long)largest[i].timestamp);
+	printf("]");
+
+freeStats:
+	for (int i = 0; i < 3; i ++)
+		free(streams[i].buckets);
+	free(largest);
+	free(trailers);
+unmap:
+	munmap(map, size);
+closeFile:
+	close(fd);
+exit:
+	if (error) {
+		printf(", \"error\": ");
+		json_String(error);
+	}
+
+	printf("}");
+	return ret;
+}
+
+/* *************************************************** */
+int main(int argc, char * argv[])
+{
+	int ret = EXIT_SUCCESS;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "i:g:n:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'g':
+			gapThreshold = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			largestCount = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			optind = argc + 1;
+		}
+	}
+
+	if (optind >= argc || interval == 0) {
+		printf("FLV analyzer\nUsage:\n\t%s [-i interval_ms] [-g gap_ms] [-n largest] <INPUT.FLV> [...]\n"
+			"Options:\n\t-i\twidth of bitrate buckets (default 1000 ms)\n"
+			"\t-g\ttimestamp jump reported as a gap (default 1000 ms)\n"
+			"\t-n\tnumber of largest tags to list (default 10)\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	puts("[");
+
+	for (int i = optind; i < argc; i ++) {
+		if (! analyze(argv[i]))
+			ret = EXIT_FAILURE;
+
+		puts(i + 1 < argc ? "," : "");
+	}
+
+	puts("]");
+	return ret;
+}
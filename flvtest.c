@@ -0,0 +1,222 @@
+/* ***************************************************
+flvtest: unit tests for the FLV / AMF helpers
+Greg Kennedy 2021
+
+Checks the byte-level code every tool depends on:
+ tag header parsing (with the extended timestamp
+ byte), the trailer check, overflow handling in
+ flv_TagFinish, and the exact bytes of an AVC
+ sequence header.  Prints each failure, and exits
+ non-zero if there were any.
+*************************************************** */
+#include "flv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned int checks, failures;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static void check(const int ok, const char * const what, const char * const file, const int line)
+{
+	checks ++;
+
+	if (! ok) {
+		failures ++;
+		fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+	}
+}
+
+// a header with every field distinct, and the extended timestamp byte set
+static void test_ParseTagHeader(void)
+{
+	const uint8_t p[11] = { 0x09, 0x01, 0x02, 0x03, 0xAB, 0xCD, 0xEF, 0x12, 0x00, 0x00, 0x01 };
+	struct flv_tag_header h;
+
+	flv_ParseTagHeader(p, &h);
+	CHECK(h.type == FLV_TAG_VIDEO);
+	CHECK(h.size == 0x010203);
+	CHECK(h.timestamp == 0x12ABCDEF);
+	CHECK(h.stream_id == 1);
+
+	// the reserved / encryption bits are not part of the type
+	const uint8_t q[11] = { 0x20 | FLV_TAG_AUDIO, 0, 0, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0 };
+
+	flv_ParseTagHeader(q, &h);
+	CHECK(h.type == FLV_TAG_AUDIO);
+	CHECK(h.size == 0);
+	CHECK(h.timestamp == UINT32_MAX);
+
+	// and it reads back what flv_TagHeader writes, across the 24-bit boundary
+	const uint32_t timestamps[] = { 0, 1, 0x00FFFFFF, 0x01000000, 0x7FFFFFFF, 0x80000000, UINT32_MAX };
+	uint8_t buf[32] = { 0 };
+	struct flv_tag t;
+
+	for (unsigned int i = 0; i < sizeof(timestamps) / sizeof(timestamps[0]); i ++) {
+		flv_TagInit(&t, buf, sizeof(buf));
+		flv_TagHeader(&t, FLV_TAG_SCRIPT, timestamps[i]);
+		flv_ParseTagHeader(buf, &h);
+		CHECK(h.timestamp == timestamps[i]);
+		CHECK(buf[7] == timestamps[i] >> 24);
+
+		flv_SetTimestamp(buf, ~timestamps[i]);
+		flv_ParseTagHeader(buf, &h);
+		CHECK(h.timestamp == ~timestamps[i]);
+	}
+}
+
+static void test_CheckTrailer(void)
+{
+	uint8_t buf[64];
+	struct flv_tag t;
+	struct flv_tag_header h;
+
+	flv_TagInit(&t, buf, sizeof(buf));
+	flv_TagHeader(&t, FLV_TAG_AUDIO, 1000);
+	flv_AACAudioPacket(&t, 1);
+	flv_U32(&t, 0xDEADBEEF);
+
+	const uint32_t size = flv_TagFinish(&t);
+
+	CHECK(size == 11 + 6 + 4);
+	flv_ParseTagHeader(buf, &h);
+	CHECK(h.size == 6);
+	CHECK(flv_CheckTrailer(buf, &h));
+	CHECK(parse_u32be(buf + 11 + 6) == 11 + 6);
+
+	// one byte off either way fails
+	u32be(buf + 11 + 6, 11 + 6 + 1);
+	CHECK(! flv_CheckTrailer(buf, &h));
+	u32be(buf + 11 + 6, 11 + 6 - 1);
+	CHECK(! flv_CheckTrailer(buf, &h));
+
+	// a bare size, as if the header were not counted
+	u32be(buf + 11 + 6, 6);
+	CHECK(! flv_CheckTrailer(buf, &h));
+
+	// and flv_NextTag finds the end of the tag, but not past the buffer
+	u32be(buf + 11 + 6, 11 + 6);
+	CHECK(flv_NextTag(buf, buf + size, &h) == buf + size);
+	CHECK(flv_NextTag(buf, buf + size - 1, &h) == NULL);
+	CHECK(flv_NextTag(buf, buf + 10, &h) == NULL);
+}
+
+static void test_TagFinish(void)
+{
+	static const uint8_t zero[64];
+	uint8_t buf[32];
+	struct flv_tag t;
+
+	// exactly full: header, 17 bytes of payload, trailer
+	flv_TagInit(&t, buf, sizeof(buf));
+	flv_TagHeader(&t, FLV_TAG_SCRIPT, 0);
+	flv_Write(&t, zero, 17);
+	CHECK(flv_TagFinish(&t) == sizeof(buf));
+	CHECK(! t.overflow);
+	CHECK(parse_u24be(buf + 1) == 17);
+
+	// no room for the trailer
+	flv_TagInit(&t, buf, sizeof(buf));
+	flv_TagHeader(&t, FLV_TAG_SCRIPT, 0);
+	flv_Write(&t, zero, 18);
+	CHECK(flv_TagFinish(&t) == 0);
+	CHECK(t.overflow);
+
+	// a payload that overflowed, with later writes that would have fit
+	flv_TagInit(&t, buf, sizeof(buf));
+	flv_TagHeader(&t, FLV_TAG_SCRIPT, 0);
+	amf_string(&t, "a string that is too long for the buffer");
+	amf_number(&t, 1);
+	CHECK(t.overflow);
+	CHECK(flv_TagFinish(&t) == 0);
+
+	// a buffer too small for even the header
+	flv_TagInit(&t, buf, 10);
+	flv_TagHeader(&t, FLV_TAG_SCRIPT, 0);
+	CHECK(flv_TagFinish(&t) == 0);
+
+	// a header rewritten after an overflow starts the tag afresh
+	flv_TagInit(&t, buf, sizeof(buf));
+	flv_Write(&t, zero, sizeof(buf) + 1);
+	flv_TagHeader(&t, FLV_TAG_VIDEO, 0);
+	CHECK(flv_TagFinish(&t) == 11 + 4);
+}
+
+static void test_AVCDecoderConfigurationRecord(void)
+{
+	// SPS for High profile, level 3.1, and a PPS, as x264 emits them
+	const uint8_t sps[] = { 0x67, 0x64, 0x00, 0x1F, 0xAC, 0xD9, 0x40 };
+	const uint8_t pps[] = { 0x68, 0xEB, 0xE3, 0xCB };
+	const uint8_t expected[] = {
+		0x01,	// version
+		0x64, 0x00, 0x1F,	// profile, compatibility, level from the SPS
+		0xFF,	// 4 byte NAL lengths
+		0xE1,	// one SPS
+		0x00, 0x07, 0x67, 0x64, 0x00, 0x1F, 0xAC, 0xD9, 0x40,
+		0x01,	// one PPS
+		0x00, 0x04, 0x68, 0xEB, 0xE3, 0xCB
+	};
+	uint8_t buf[64];
+	struct flv_tag t;
+
+	flv_TagInit(&t, buf, sizeof(buf));
+	h264_AVCDecoderConfigurationRecord(&t, sps, sizeof(sps), pps, sizeof(pps));
+	CHECK(! t.overflow);
+	CHECK(t.len == sizeof(expected));
+	CHECK(memcmp(buf, expected, sizeof(expected)) == 0);
+
+	// a record that doesn't fit writes nothing
+	flv_TagInit(&t, buf, sizeof(expected) - 1);
+	h264_AVCDecoderConfigurationRecord(&t, sps, sizeof(sps), pps, sizeof(pps));
+	CHECK(t.overflow);
+	CHECK(t.len == 0);
+}
+
+static void test_MetaFind(void)
+{
+	uint8_t buf[256];
+	struct flv_tag t;
+	struct amf_value v;
+
+	flv_TagInit(&t, buf, sizeof(buf));
+	flv_TagHeader(&t, FLV_TAG_SCRIPT, 0);
+	amf_string(&t, "onMetaData");
+	amf_ecma_array(&t, 3);
+	pstring(&t, "encoder");
+	amf_string(&t, "flvtest");
+	pstring(&t, "nested");
+	amf_ecma_array(&t, 1);
+	amf_ecma_array_entry(&t, "width", 1);
+	amf_ecma_array_end(&t);
+	amf_ecma_array_entry(&t, "width", 1280);
+	amf_ecma_array_end(&t);
+
+	const uint32_t size = flv_TagFinish(&t);
+	CHECK(size != 0);
+
+	const uint8_t * const payload = buf + 11, * const end = buf + size - 4;
+	const uint8_t * const width = amf_MetaFind(payload, end, "width");
+
+	// the top-level width, not the nested one
+	CHECK(width != NULL && amf_Decode(width, end, &v) != NULL && v.type == AMF_NUMBER && v.number == 1280);
+	CHECK(amf_MetaFind(payload, end, "height") == NULL);
+
+	// truncated anywhere, it never points past the end
+	for (const uint8_t * e = payload; e < end; e ++) {
+		const uint8_t * const found = amf_MetaFind(payload, e, "width");
+		CHECK(found == NULL || found <= e);
+	}
+}
+
+int main(void)
+{
+	test_ParseTagHeader();
+	test_CheckTrailer();
+	test_TagFinish();
+	test_AVCDecoderConfigurationRecord();
+	test_MetaFind();
+
+	printf("%u checks, %u failed\n", checks, failures);
+	return (failures ? EXIT_FAILURE : EXIT_SUCCESS);
+}
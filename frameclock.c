@@ -0,0 +1,191 @@
+/* ***************************************************
+frameclock: pacing for the encode loops
+Greg Kennedy 2021
+*************************************************** */
+#include "frameclock.h"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+// runtime statistics
+#include "metrics.h"
+// real or virtual time
+#include "vclock.h"
+
+static const char * const policy_names[FRAMECLOCK_POLICIES] = { "burst", "skip", "rebase" };
+
+static const uint64_t jitter_bounds[FRAMECLOCK_BUCKETS] = { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000 };
+
+// when a frame is due, in ns since start
+//  split so that frame * num * 1e9 can't overflow on a long run
+static uint64_t frameclock_Offset(const struct frameclock * const c, const unsigned long frame)
+{
+	return (frame / c->den) * c->num * 1000000000 + (frame % c->den) * c->num * 1000000000 / c->den;
+}
+
+// Sleep until an absolute CLOCK_MONOTONIC time (or virtual time)
+//  Returns 0 if a signal cut the sleep short.
+static int frameclock_Sleep(const struct frameclock * const c, const uint64_t deadline)
+{
+#ifdef __linux__
+	if (c->fd >= 0) {
+		const struct itimerspec its = { .it_value = { .tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000 } };
+		uint64_t expirations;
+
+		if (timerfd_settime(c->fd, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+			return (read(c->fd, &expirations, sizeof(expirations)) == sizeof(expirations));
+	}
+#else
+	(void)c;
+#endif
+
+	return vclock_Sleep(deadline);
+}
+
+static void frameclock_Jitter(struct frameclock * const c, const uint64_t us)
+{
+	unsigned int i = 0;
+
+	while (i < FRAMECLOCK_BUCKETS && us > jitter_bounds[i])
+		i ++;
+
+	c->frames ++;
+	c->jitter[i] ++;
+	if (us > c->maxJitter)
+		c->maxJitter = us;
+
+	metrics_Observe(METRIC_SCHEDULE_LAG_TIME, us);
+}
+
+/* ************************************************************************ */
+enum frameclock_policy frameclock_Policy(const char * const name)
+{
+	enum frameclock_policy policy;
+
+	for (policy = 0; policy < FRAMECLOCK_POLICIES; policy ++)
+		if (strcmp(name, policy_names[policy]) == 0)
+			break;
+
+	return policy;
+}
+
+void frameclock_Init(struct frameclock * const c, const uint64_t num, const uint64_t den, const enum frameclock_policy policy)
+{
+	memset(c, 0, sizeof(*c));
+
+	c->policy = policy;
+	c->num = num;
+	c->den = den;
+
+	// without a timerfd, clock_nanosleep does the same job
+	//  and virtual time has nothing to wait for
+#ifdef __linux__
+	c->fd = (vclock_IsVirtual() ? -1 : timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC));
+#else
+	c->fd = -1;
+#endif
+
+	c->start = vclock_Now();
+}
+
+void frameclock_Restart(struct frameclock * const c, const unsigned long frame)
+{
+	c->frame = frame;
+	c->start = vclock_Now() - frameclock_Offset(c, frame);
+}
+
+unsigned long frameclock_Next(struct frameclock * const c)
+{
+	const uint64_t period = frameclock_Offset(c, 1);
+
+	c->frame ++;
+
+	const uint64_t deadline = c->start + frameclock_Offset(c, c->frame);
+	const uint64_t now = vclock_Now();
+
+	// ms behind schedule before sleeping: negative is the slack left
+	metrics_Set(METRIC_SCHEDULE_LAG, ((int64_t)now - (int64_t)deadline) / 1000000);
+
+	if (now < deadline) {
+		if (! frameclock_Sleep(c, deadline))
+			return c->frame;
+
+		frameclock_Jitter(c, (vclock_Now() - deadline) / 1000);
+		return c->frame;
+	}
+
+	// already due: how late it is counts as jitter too
+	const uint64_t lag = now - deadline;
+	frameclock_Jitter(c, lag / 1000);
+
+	if (lag < period)
+		return c->frame;
+
+	c->late ++;
+
+	switch (c->policy) {
+	case FRAMECLOCK_BURST:
+		// deadlines stay put, so the frames after this one are due at once too
+		break;
+	case FRAMECLOCK_SKIP:
+	{
+		// jump to the newest frame that is due
+		unsigned long skip = lag / period;
+
+		while (c->start + frameclock_Offset(c, c->frame + skip) > now)
+			skip --;
+
+		c->frame += skip;
+		c->skipped += skip;
+		metrics_Add(METRIC_FRAMES_SKIPPED, skip);
+		break;
+	}
+	case FRAMECLOCK_REBASE:
+		// this frame is now on time, and the rest follow from it
+		c->start += lag;
+		c->rebases ++;
+		metrics_Add(METRIC_CLOCK_REBASES, 1);
+		break;
+	default:
+		break;
+	}
+
+	return c->frame;
+}
+
+void frameclock_Report(const struct frameclock * const c, FILE * const f)
+{
+	fprintf(f, "Frame clock (%s, %s): %lu frames, %lu more than a period late, %lu skipped, %lu rebases, worst %.3f ms\n",
+		policy_names[c->policy], (c->fd >= 0 ? "timerfd" : vclock_IsVirtual() ? "virtual" : "clock_nanosleep"),
+		c->frames, c->late, c->skipped, c->rebases, c->maxJitter / 1000.0);
+
+	if (c->frames == 0)
+		return;
+
+	// wake-up jitter: how long after its deadline each frame went out
+	unsigned long seen = 0;
+
+	for (unsigned int i = 0; i <= FRAMECLOCK_BUCKETS; i ++) {
+		if (c->jitter[i] == 0)
+			continue;
+
+		seen += c->jitter[i];
+
+		if (i < FRAMECLOCK_BUCKETS)
+			fprintf(f, "\t<= %6.3f ms: %8lu (%5.1f%%)\n", jitter_bounds[i] / 1000.0, c->jitter[i], 100.0 * seen / c->frames);
+		else
+			fprintf(f, "\t>  %6.3f ms: %8lu (%5.1f%%)\n", jitter_bounds[i - 1] / 1000.0, c->jitter[i], 100.0 * seen / c->frames);
+	}
+}
+
+void frameclock_Close(struct frameclock * const c)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+}
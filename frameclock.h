@@ -0,0 +1,68 @@
+/* ***************************************************
+frameclock: pacing for the encode loops
+Greg Kennedy 2021
+
+Frame n is due at start + n * period, on CLOCK_MONOTONIC,
+ so NTP steps don't disturb the pacing and rounding does
+ not accumulate.  The loop sleeps to each deadline as an
+ absolute time (a timerfd on Linux, clock_nanosleep
+ elsewhere), and how late each wake-up was is kept in a
+ jitter histogram.  A frame that is more than a whole
+ period late is handled by the chosen policy.  On a
+ virtual clock (vclock.h) the waits take no time at all.
+*************************************************** */
+#ifndef FRAMECLOCK_H_
+#define FRAMECLOCK_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+// what to do when frames fall more than a period behind
+enum frameclock_policy {
+	FRAMECLOCK_BURST,	// send the missed frames back to back until caught up
+	FRAMECLOCK_SKIP,	// jump the frame counter to the current slot
+	FRAMECLOCK_REBASE,	// move the schedule back, so the late frame is on time
+	FRAMECLOCK_POLICIES
+};
+
+// jitter histogram bucket upper bounds, in microseconds
+#define FRAMECLOCK_BUCKETS 12
+
+struct frameclock {
+	enum frameclock_policy policy;
+
+	// period is num / den seconds
+	uint64_t num, den;
+	uint64_t start;	// ns, when frame 0 was due
+	unsigned long frame;
+
+	int fd;	// timerfd, or -1 to use clock_nanosleep
+
+	// what happened, for frameclock_Report
+	unsigned long frames, late, skipped, rebases;
+	uint64_t maxJitter;	// us
+	unsigned long jitter[FRAMECLOCK_BUCKETS + 1];
+};
+
+// Look up a policy by name ("burst", "skip" or "rebase")
+//  Returns FRAMECLOCK_POLICIES if there is no such policy.
+enum frameclock_policy frameclock_Policy(const char * name);
+
+// Start the clock: frame 0 is due now, and every num / den seconds after
+void frameclock_Init(struct frameclock * c, uint64_t num, uint64_t den, enum frameclock_policy policy);
+
+// Restart the schedule so that frame is due now, and the rest follow from it
+//  e.g. once frames encoded ahead of time have all been sent
+void frameclock_Restart(struct frameclock * c, unsigned long frame);
+
+// Move on to the next frame, and wait until it is due
+//  Returns the frame to produce, which is usually one more than the last,
+//  but jumps ahead under FRAMECLOCK_SKIP.  Returns early if a signal arrives.
+unsigned long frameclock_Next(struct frameclock * c);
+
+// Print the jitter histogram and late frame counts
+void frameclock_Report(const struct frameclock * c, FILE * f);
+
+void frameclock_Close(struct frameclock * c);
+
+#endif
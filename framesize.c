@@ -0,0 +1,98 @@
+/* ***************************************************
+framesize: encoded frame size and burst statistics
+Greg Kennedy 2021
+*************************************************** */
+#include "framesize.h"
+
+#include <string.h>
+
+// Histogram bucket of a size: sizes under 32 have their own, and above
+//  that each power of two is split in 16 by the 4 bits under the top one
+static unsigned int framesize_Bucket(const uint32_t bytes)
+{
+	if (bytes < 32)
+		return bytes;
+
+	const unsigned int top = 31 - __builtin_clz(bytes);
+	return (top - 3) * 16 + (bytes >> (top - 4) & 15);
+}
+
+// the largest size that falls in bucket b
+static uint32_t framesize_Bound(const unsigned int b)
+{
+	if (b < 32)
+		return b;
+
+	const unsigned int shift = b / 16 - 1;
+	return ((uint64_t)(16 + b % 16 + 1) << shift) - 1;
+}
+
+void framesize_Init(struct framesize * const s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+void framesize_Add(struct framesize * const s, const uint32_t timestamp, const uint32_t bytes)
+{
+	if (s->frames == 0)
+		s->first = timestamp;
+	s->last = timestamp;
+
+	s->frames ++;
+	s->bytes += bytes;
+	if (bytes > s->max)
+		s->max = bytes;
+	s->hist[framesize_Bucket(bytes)] ++;
+
+	// drop frames that have left the window, which ends at this one
+	while (s->count && (timestamp - s->time[s->tail] >= FRAMESIZE_WINDOW || s->count == FRAMESIZE_RING)) {
+		s->window -= s->size[s->tail];
+		s->tail = (s->tail + 1) % FRAMESIZE_RING;
+		s->count --;
+	}
+
+	const unsigned int head = (s->tail + s->count) % FRAMESIZE_RING;
+	s->time[head] = timestamp;
+	s->size[head] = bytes;
+	s->count ++;
+	s->window += bytes;
+
+	if (s->window > s->maxBurst)
+		s->maxBurst = s->window;
+}
+
+void framesize_Report(const struct framesize * const s, const char * const label, FILE * const f)
+{
+	if (s->frames == 0) {
+		fprintf(f, "Frame sizes (%s): no frames\n", label);
+		return;
+	}
+
+	// 99th percentile: the top of the bucket it falls in, but no more than the largest
+	const unsigned long rank = s->frames - s->frames / 100;
+	unsigned long seen = 0;
+	uint32_t p99 = s->max;
+
+	for (unsigned int b = 0; b < FRAMESIZE_BUCKETS; b ++) {
+		seen += s->hist[b];
+		if (seen >= rank) {
+			if (framesize_Bound(b) < p99)
+				p99 = framesize_Bound(b);
+			break;
+		}
+	}
+
+	const double mean = (double)s->bytes / s->frames;
+	fprintf(f, "Frame sizes (%s): %lu frames, mean %.0f bytes, p99 %u, max %u (%.1fx the mean)\n",
+		label, s->frames, mean, p99, s->max, s->max / mean);
+
+	// the burst against what an even stream would send in the same window
+	//  the span is taken modulo 32 bits, as timestamps wrap
+	const uint32_t span = s->last - s->first;
+
+	if (span) {
+		const double average = mean * (s->frames - 1) * FRAMESIZE_WINDOW / span;
+		fprintf(f, "\tlargest %d ms burst %llu bytes, %.1fx the average of %.0f\n",
+			FRAMESIZE_WINDOW, (unsigned long long)s->maxBurst, s->maxBurst / average, average);
+	}
+}
@@ -0,0 +1,48 @@
+/* ***************************************************
+framesize: encoded frame size and burst statistics
+Greg Kennedy 2021
+
+Keeps the size of every encoded video frame: the mean,
+ the 99th percentile (from a log-scale histogram, to
+ within 1/16th), the largest frame, and the most bytes
+ encoded in any 100 ms of media time.  That last is the
+ burst an uplink has to absorb at a keyframe, which
+ intra refresh is meant to spread out.
+*************************************************** */
+#ifndef FRAMESIZE_H_
+#define FRAMESIZE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+// the burst window, in ms of media time
+#define FRAMESIZE_WINDOW 100
+// most frames held in the window, far more than any real frame rate needs
+#define FRAMESIZE_RING 256
+// 16 buckets per power of two
+#define FRAMESIZE_BUCKETS (29 * 16)
+
+struct framesize {
+	unsigned long frames;
+	uint64_t bytes;
+	uint32_t max;
+	uint32_t first, last;	// timestamps, ms
+
+	// the frames in the current window, oldest at tail
+	uint32_t time[FRAMESIZE_RING], size[FRAMESIZE_RING];
+	unsigned int tail, count;
+	uint64_t window, maxBurst;
+
+	unsigned long hist[FRAMESIZE_BUCKETS];
+};
+
+void framesize_Init(struct framesize * s);
+
+// Count a frame of bytes, at timestamp ms
+//  Timestamps must not go backwards, though they may wrap at 32 bits.
+void framesize_Add(struct framesize * s, uint32_t timestamp, uint32_t bytes);
+
+// Print the statistics, for the stream named by label
+void framesize_Report(const struct framesize * s, const char * label, FILE * f);
+
+#endif
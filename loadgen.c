@@ -0,0 +1,862 @@
+/* ***************************************************
+loadgen: parallel synthetic RTMP publisher
+Greg Kennedy 2021
+
+Runs many testpattern / waveform style streams in one
+ process, for ingest capacity tests.  Every stream has
+ its own encoders but no thread: a pool of workers, one
+ per core, each keep a heap of streams ordered by their
+ next frame deadline, and steal due streams from each
+ other when idle.  The stream count ramps up in steps,
+ and each step reports how many frames missed their
+ deadline, ending with the streams per core sustained
+ before deadlines slipped.
+*************************************************** */
+
+// push packets to stream
+#include <librtmp/log.h>
+
+// libfdk's AAC encoder header
+#include <fdk-aac/aacenc_lib.h>
+
+// other necessary includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <stdint.h>
+
+// h.264 encoder lib
+//  this requires stdint.h first or else it complains...
+#include <x264.h>
+
+// FLV tag and AMF serialization
+#include "flv.h"
+// runtime statistics
+#include "metrics.h"
+// RTMP connection, with reconnect
+#include "rtmpout.h"
+// messages, written out off the streaming threads
+#include "logger.h"
+
+// video output parameters, as testpattern
+#define WIDTH 640
+#define HEIGHT 360
+#define FPS 24
+
+// audio parameters, as waveform
+#define SAMPLE_RATE 44100
+#define CHANNELS 2
+#define SAMPLE_COUNT 1024
+#define AUDIO_BITRATE 128
+
+// frame intervals, in microseconds
+#define VIDEO_INTERVAL (1000000.0 / FPS)
+#define AUDIO_INTERVAL (1000000.0 * SAMPLE_COUNT / SAMPLE_RATE)
+
+// an idle worker looks for work to steal this often (us)
+#define STEAL_INTERVAL 500
+
+// a ramp step holds if no more than this share of frames missed (percent)
+#define MISS_THRESHOLD 1.0
+
+// lateness histogram, upper bounds in microseconds
+static const uint64_t late_bounds[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000 };
+#define LATE_BUCKETS (sizeof(late_bounds) / sizeof(late_bounds[0]))
+
+/* ************************************************************************ */
+enum stream_kind { KIND_VIDEO, KIND_AUDIO, KIND_BOTH, KINDS };
+static const char * const kind_names[KINDS] = { "video", "audio", "both" };
+
+struct stream {
+	unsigned int id;
+	enum stream_kind kind;
+
+	// schedule: start time, and the next deadline of each track (us)
+	uint64_t start;
+	uint64_t nextVideo, nextAudio;
+	unsigned long videoFrame, audioBlock, audioUnit;
+
+	x264_t * encoder;
+	x264_picture_t pic_in;
+
+	HANDLE_AACENCODER aac;
+	AACENC_InfoStruct info;
+	INT_PCM pcm[SAMPLE_COUNT * CHANNELS];
+
+	// tags are built here, and the buffer grows to fit the largest frame
+	struct flv_tag tag;
+	uint8_t * buffer;
+	size_t bufferSize;
+
+	// where the tags go: nowhere, without a URL
+	char url[512];
+	int publishing;
+	struct rtmpout out;
+};
+
+static uint64_t stream_Deadline(const struct stream * const s)
+{
+	return (s->nextVideo < s->nextAudio ? s->nextVideo : s->nextAudio);
+}
+
+// A worker: its streams, in a min-heap by deadline, and what it measured
+//  since the report last collected it
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+
+	pthread_mutex_t lock;
+	struct stream ** heap;
+	unsigned int count, capacity;
+
+	atomic_ulong frames, missed, steals;
+	atomic_ulong late[LATE_BUCKETS + 1];
+};
+
+static struct worker * workers;
+static unsigned int workerCount;
+
+// Flag to indicate whether we should keep running
+//  Set to 0 to close the program
+static volatile sig_atomic_t running;
+// replacement signal handler that sets running to 0 for clean shutdown
+static void sig_handler(int signum)
+{
+	(void)signum;
+	running = 0;
+}
+
+/* ************************************************************************ */
+// heap operations; callers hold the worker lock
+static int heap_Push(struct worker * const w, struct stream * const s)
+{
+	if (w->count == w->capacity) {
+		const unsigned int capacity = (w->capacity ? w->capacity * 2 : 16);
+		struct stream ** const heap = realloc(w->heap, capacity * sizeof(*heap));
+
+		if (heap == NULL)
+			return 0;
+
+		w->heap = heap;
+		w->capacity = capacity;
+	}
+
+	unsigned int i = w->count ++;
+
+	while (i > 0 && stream_Deadline(w->heap[(i - 1) / 2]) > stream_Deadline(s)) {
+		w->heap[i] = w->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+
+	w->heap[i] = s;
+	return 1;
+}
+
+static struct stream * heap_Pop(struct worker * const w)
+{
+	struct stream * const top = w->heap[0];
+	struct stream * const last = w->heap[-- w->count];
+	unsigned int i = 0;
+
+	for (;;) {
+		unsigned int child = 2 * i + 1;
+
+		if (child >= w->count)
+			break;
+		if (child + 1 < w->count && stream_Deadline(w->heap[child + 1]) < stream_Deadline(w->heap[child]))
+			child ++;
+		if (stream_Deadline(w->heap[child]) >= stream_Deadline(last))
+			break;
+
+		w->heap[i] = w->heap[child];
+		i = child;
+	}
+
+	if (w->count)
+		w->heap[i] = last;
+
+	return top;
+}
+
+// Take the earliest stream off a heap, if it is due
+static struct stream * worker_TakeDue(struct worker * const w, const uint64_t now, uint64_t * const next)
+{
+	struct stream * s = NULL;
+
+	pthread_mutex_lock(&w->lock);
+
+	if (w->count && stream_Deadline(w->heap[0]) <= now)
+		s = heap_Pop(w);
+	else if (next)
+		*next = (w->count ? stream_Deadline(w->heap[0]) : UINT64_MAX);
+
+	pthread_mutex_unlock(&w->lock);
+	return s;
+}
+
+/* ************************************************************************ */
+// make a test pattern, as testpattern: moving grey bars
+static void build_picture(x264_picture_t * const pic, const unsigned long frame)
+{
+	for (unsigned int y = 0; y < HEIGHT; y ++)
+		memset(pic->img.plane[0] + y * WIDTH, (y + frame) % 256, WIDTH);
+
+	memset(pic->img.plane[1], 127, WIDTH * HEIGHT / 4);
+	memset(pic->img.plane[2], 127, WIDTH * HEIGHT / 4);
+}
+
+// make a test waveform, as waveform: a ramp and some noise
+static void build_waveform(INT_PCM * const buffer, const unsigned long block, unsigned int * const seed)
+{
+	const INT_PCM start_value = buffer[CHANNELS * (SAMPLE_COUNT - 1)];
+
+	for (unsigned long i = 0; i < SAMPLE_COUNT; i ++) {
+		buffer[CHANNELS * i] = start_value + (i + 1) * (block % 1024);
+		if (CHANNELS == 2)
+			buffer[2 * i + 1] = rand_r(seed);
+	}
+}
+
+// Make room in the tag buffer for a payload
+static int stream_Reserve(struct stream * const s, const size_t payload)
+{
+	const size_t size = 11 + payload + 4;
+
+	if (size > s->bufferSize) {
+		uint8_t * const buffer = realloc(s->buffer, size);
+
+		if (buffer == NULL)
+			return 0;
+
+		s->buffer = buffer;
+		s->bufferSize = size;
+	}
+
+	flv_TagInit(&s->tag, s->buffer, s->bufferSize);
+	return 1;
+}
+
+// Finish the tag in the buffer and send it, if there is anywhere to send it
+static int stream_Send(struct stream * const s)
+{
+	const uint32_t tagSize = flv_TagFinish(&s->tag);
+
+	if (tagSize == 0) {
+		logger_Printf(stderr, "Stream %u: tag does not fit its buffer\n", s->id);
+		return 0;
+	}
+
+	return (s->publishing ? rtmpout_Write(&s->out, s->tag.buf, tagSize) : 1);
+}
+
+/* ************************************************************************ */
+// Set up the encoders and connection, and send the stream headers
+static int stream_Open(struct stream * const s, const char * const url)
+{
+	const int video = (s->kind != KIND_AUDIO);
+	const int audio = (s->kind != KIND_VIDEO);
+
+	if (! stream_Reserve(s, 4096)) {
+		logger_Printf(stderr, "Failed to allocate tag buffer: %s\n", strerror(errno));
+		return 0;
+	}
+
+	if (video) {
+		x264_param_t param;
+		x264_param_default_preset(&param, "veryfast", "zerolatency");
+		param.i_log_level = X264_LOG_WARNING;
+		param.pf_log = logger_X264;
+		// the pool provides the parallelism: one thread per encoder
+		param.i_threads = 1;
+		param.i_width = WIDTH;
+		param.i_height = HEIGHT;
+		param.i_fps_num = FPS;
+		param.i_fps_den = 1;
+		param.i_keyint_max = FPS;
+		param.rc.i_rc_method = X264_RC_CRF;
+		param.rc.f_rf_constant = 25;
+		param.rc.f_rf_constant_max = 35;
+		param.b_aud = 0;
+		param.b_repeat_headers = 1;
+		param.b_annexb = 0;
+		x264_param_apply_profile(&param, "baseline");
+
+		s->encoder = x264_encoder_open(&param);
+		x264_param_cleanup(&param);
+
+		if (s->encoder == NULL || x264_picture_alloc(&s->pic_in, X264_CSP_I420, WIDTH, HEIGHT) != 0) {
+			logger_Printf(stderr, "Stream %u: failed to open x264 encoder\n", s->id);
+			return 0;
+		}
+	}
+
+	if (audio) {
+		AACENC_ERROR err = aacEncOpen(&s->aac, 0x01, CHANNELS);
+
+		if (err == AACENC_OK) err = aacEncoder_SetParam(s->aac, AACENC_AOT, AOT_AAC_LC);
+		if (err == AACENC_OK) err = aacEncoder_SetParam(s->aac, AACENC_TRANSMUX, TT_MP4_RAW);
+		if (err == AACENC_OK) err = aacEncoder_SetParam(s->aac, AACENC_BITRATE, AUDIO_BITRATE * 1000);
+		if (err == AACENC_OK) err = aacEncoder_SetParam(s->aac, AACENC_SAMPLERATE, SAMPLE_RATE);
+		if (err == AACENC_OK) err = aacEncoder_SetParam(s->aac, AACENC_CHANNELMODE, (CHANNELS == 2 ? MODE_2 : MODE_1));
+		if (err == AACENC_OK) err = aacEncoder_SetParam(s->aac, AACENC_CHANNELORDER, 1);
+		// "lock in" the settings, then read back the AudioSpecificConfig
+		if (err == AACENC_OK) err = aacEncEncode(s->aac, NULL, NULL, NULL, NULL);
+		if (err == AACENC_OK) err = aacEncInfo(s->aac, &s->info);
+
+		if (err != AACENC_OK) {
+			logger_Printf(stderr, "Stream %u: failed to open AAC encoder: %d\n", s->id, err);
+			return 0;
+		}
+	}
+
+	if (url) {
+		snprintf(s->url, sizeof(s->url), "%s-%u", url, s->id);
+
+		if (! rtmpout_Open(&s->out, s->url, 0))
+			return 0;
+
+		s->publishing = 1;
+	}
+
+	// onMetaData
+	flv_TagHeader(&s->tag, FLV_TAG_SCRIPT, 0);
+	amf_string(&s->tag, "onMetaData");
+	amf_ecma_array(&s->tag, (video ? 4 : 0) + (audio ? 4 : 0));
+	if (video) {
+		amf_ecma_array_entry(&s->tag, "width", WIDTH);
+		amf_ecma_array_entry(&s->tag, "height", HEIGHT);
+		amf_ecma_array_entry(&s->tag, "framerate", FPS);
+		amf_ecma_array_entry(&s->tag, "videocodecid", 7);
+	}
+	if (audio) {
+		amf_ecma_array_entry(&s->tag, "audiocodecid", 10);
+		amf_ecma_array_entry(&s->tag, "audiodatarate", AUDIO_BITRATE);
+		amf_ecma_array_entry(&s->tag, "audiosamplerate", SAMPLE_RATE);
+		pstring(&s->tag, "stereo");
+		amf_boolean(&s->tag, CHANNELS == 2);
+	}
+	amf_ecma_array_end(&s->tag);
+
+	if (! stream_Send(s))
+		return 0;
+
+	if (video) {
+		x264_nal_t * pp_nal;
+		int pi_nal;
+		int sps_id = -1, pps_id = -1;
+
+		if (x264_encoder_headers(s->encoder, &pp_nal, &pi_nal) <= 0)
+			return 0;
+
+		for (int i = 0; i < pi_nal; i ++) {
+			if (pp_nal[i].i_type == NAL_SPS)
+				sps_id = i;
+			else if (pp_nal[i].i_type == NAL_PPS)
+				pps_id = i;
+		}
+
+		if (sps_id == -1 || pps_id == -1) {
+			logger_Printf(stderr, "Stream %u: x264_encoder_headers missing SPS or PPS\n", s->id);
+			return 0;
+		}
+
+		flv_TagHeader(&s->tag, FLV_TAG_VIDEO, 0);
+		flv_AVCVideoPacket(&s->tag, 1, 0, 0);
+		h264_AVCDecoderConfigurationRecord(&s->tag,
+			pp_nal[sps_id].p_payload + 4, pp_nal[sps_id].i_payload - 4,
+			pp_nal[pps_id].p_payload + 4, pp_nal[pps_id].i_payload - 4);
+
+		if (! stream_Send(s))
+			return 0;
+	}
+
+	if (audio) {
+		flv_TagHeader(&s->tag, FLV_TAG_AUDIO, 0);
+		flv_AACAudioPacket(&s->tag, 0);
+		flv_Write(&s->tag, s->info.confBuf, s->info.confSize);
+
+		if (! stream_Send(s))
+			return 0;
+	}
+
+	s->start = metrics_Now();
+	s->nextVideo = (video ? s->start : UINT64_MAX);
+	s->nextAudio = (audio ? s->start : UINT64_MAX);
+	return 1;
+}
+
+static void stream_Close(struct stream * const s)
+{
+	if (s->publishing)
+		rtmpout_Close(&s->out);
+	if (s->encoder) {
+		x264_encoder_close(s->encoder);
+		x264_picture_clean(&s->pic_in);
+	}
+	if (s->aac)
+		aacEncClose(&s->aac);
+	free(s->buffer);
+}
+
+/* ************************************************************************ */
+// Note how late a frame started against its deadline
+static void worker_Late(struct worker * const w, const uint64_t late, const double interval)
+{
+	unsigned int i = 0;
+
+	while (i < LATE_BUCKETS && late > late_bounds[i])
+		i ++;
+
+	atomic_fetch_add_explicit(&w->late[i], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&w->frames, 1, memory_order_relaxed);
+
+	// missed: by the time this frame started, the next one was due
+	if (late > interval)
+		atomic_fetch_add_explicit(&w->missed, 1, memory_order_relaxed);
+}
+
+// Produce whichever frames of a stream are due
+//  A stream that has fallen behind stays due, and catches up a frame at a time.
+static int stream_Run(struct stream * const s, struct worker * const w, const uint64_t now)
+{
+	if (s->nextVideo <= now) {
+		worker_Late(w, now - s->nextVideo, VIDEO_INTERVAL);
+
+		build_picture(&s->pic_in, s->videoFrame);
+		s->pic_in.i_pts = s->videoFrame;
+
+		x264_nal_t * nals;
+		int i_nals;
+		x264_picture_t pic_out;
+		const uint64_t encode_start = metrics_Now();
+		const int frame_size = x264_encoder_encode(s->encoder, &nals, &i_nals, &s->pic_in, &pic_out);
+		metrics_Observe(METRIC_VIDEO_ENCODE_TIME, metrics_Now() - encode_start);
+
+		if (frame_size < 0) {
+			logger_Printf(stderr, "Stream %u: error when encoding frame\n", s->id);
+			return 0;
+		}
+
+		if (frame_size > 0) {
+			if (! stream_Reserve(s, 5 + frame_size))
+				return 0;
+
+			flv_TagHeader(&s->tag, FLV_TAG_VIDEO, s->videoFrame * (1000.0 / FPS));
+			flv_AVCVideoPacket(&s->tag, pic_out.b_keyframe, 1, 0);
+			flv_Write(&s->tag, nals[0].p_payload, frame_size);
+
+			if (! stream_Send(s))
+				return 0;
+		}
+
+		s->videoFrame ++;
+		s->nextVideo = s->start + s->videoFrame * VIDEO_INTERVAL;
+	}
+
+	if (s->nextAudio <= now) {
+		worker_Late(w, now - s->nextAudio, AUDIO_INTERVAL);
+
+		unsigned int seed = s->id + s->audioBlock;
+		build_waveform(s->pcm, s->audioBlock, &seed);
+
+		AACENC_BufDesc in_buf = { 0 }, out_buf = { 0 };
+		AACENC_InArgs in_args = { 0 };
+		AACENC_OutArgs out_args;
+		uint8_t outBuffer[768 * CHANNELS];
+
+		void * in_buffers[] = { s->pcm };
+		int in_buffer_sizes[] = { sizeof(s->pcm) };
+		int in_buffer_element_sizes[] = { sizeof(INT_PCM) };
+		int in_buffer_identifiers[] = { IN_AUDIO_DATA };
+		void * out_buffers[] = { outBuffer };
+		int out_buffer_sizes[] = { sizeof(outBuffer) };
+		int out_buffer_element_sizes[] = { sizeof(uint8_t) };
+		int out_buffer_identifiers[] = { OUT_BITSTREAM_DATA };
+
+		in_args.numInSamples = SAMPLE_COUNT * CHANNELS;
+		in_buf.numBufs = 1;
+		in_buf.bufs = in_buffers;
+		in_buf.bufferIdentifiers = in_buffer_identifiers;
+		in_buf.bufSizes = in_buffer_sizes;
+		in_buf.bufElSizes = in_buffer_element_sizes;
+		out_buf.numBufs = 1;
+		out_buf.bufs = out_buffers;
+		out_buf.bufferIdentifiers = out_buffer_identifiers;
+		out_buf.bufSizes = out_buffer_sizes;
+		out_buf.bufElSizes = out_buffer_element_sizes;
+
+		const uint64_t encode_start = metrics_Now();
+		const AACENC_ERROR err = aacEncEncode(s->aac, &in_buf, &out_buf, &in_args, &out_args);
+		metrics_Observe(METRIC_AUDIO_ENCODE_TIME, metrics_Now() - encode_start);
+
+		if (err != AACENC_OK) {
+			logger_Printf(stderr, "Stream %u: audio encoding failed: %d\n", s->id, err);
+			return 0;
+		}
+
+		if (out_args.numOutBytes > 0) {
+			if (! stream_Reserve(s, 2 + out_args.numOutBytes))
+				return 0;
+
+			flv_TagHeader(&s->tag, FLV_TAG_AUDIO, s->audioUnit * (1000.0 * s->info.frameLength / SAMPLE_RATE));
+			flv_AACAudioPacket(&s->tag, 1);
+			flv_Write(&s->tag, outBuffer, out_args.numOutBytes);
+			s->audioUnit ++;
+
+			if (! stream_Send(s))
+				return 0;
+		}
+
+		s->audioBlock ++;
+		s->nextAudio = s->start + s->audioBlock * AUDIO_INTERVAL;
+	}
+
+	if (s->publishing && ! rtmpout_Poll(&s->out))
+		return 0;
+
+	return 1;
+}
+
+// Run due streams: our own first, else steal from the others, else nap
+static void * worker_Main(void * const arg)
+{
+	struct worker * const w = arg;
+
+	while (running) {
+		uint64_t now = metrics_Now();
+		uint64_t next = UINT64_MAX;
+		struct stream * s = worker_TakeDue(w, now, &next);
+
+		// nothing due here: look for a due stream elsewhere, starting
+		//  with our neighbour so thieves spread across victims
+		for (unsigned int i = 1; s == NULL && i < workerCount; i ++) {
+			if ((s = worker_TakeDue(&workers[(w->id + i) % workerCount], now, NULL)) != NULL)
+				atomic_fetch_add_explicit(&w->steals, 1, memory_order_relaxed);
+		}
+
+		if (s == NULL) {
+			// sleep to our own next deadline, but wake to check for work to steal
+			if (next > now + STEAL_INTERVAL)
+				next = now + STEAL_INTERVAL;
+
+			usleep(next - now);
+			continue;
+		}
+
+		// a stream that fails is dropped, and the rest carry on
+		if (! stream_Run(s, w, metrics_Now())) {
+			logger_Printf(stderr, "Stream %u stopped\n", s->id);
+			stream_Close(s);
+			free(s);
+			continue;
+		}
+
+		// a stolen stream now lives here
+		pthread_mutex_lock(&w->lock);
+		if (! heap_Push(w, s)) {
+			logger_Printf(stderr, "Stream %u: out of memory\n", s->id);
+			stream_Close(s);
+			free(s);
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return NULL;
+}
+
+/* ************************************************************************ */
+// Parse a mix like "video:2,audio:1,both:1" into a repeating pattern of kinds
+static unsigned int parse_mix(const char * mix, enum stream_kind * const pattern, const unsigned int size)
+{
+	unsigned int len = 0;
+
+	while (*mix) {
+		enum stream_kind kind;
+		size_t nameLen = strcspn(mix, ":,");
+
+		for (kind = 0; kind < KINDS; kind ++)
+			if (strlen(kind_names[kind]) == nameLen && strncmp(mix, kind_names[kind], nameLen) == 0)
+				break;
+
+		if (kind == KINDS)
+			return 0;
+
+		mix += nameLen;
+		unsigned long weight = 1;
+
+		if (*mix == ':')
+			weight = strtoul(mix + 1, (char **)&mix, 10);
+
+		for (unsigned long i = 0; i < weight; i ++) {
+			if (len == size)
+				return 0;
+			pattern[len ++] = kind;
+		}
+
+		if (*mix == ',')
+			mix ++;
+		else if (*mix)
+			return 0;
+	}
+
+	return len;
+}
+
+// Forget what the workers measured so far
+static void stats_Reset(void)
+{
+	for (unsigned int i = 0; i < workerCount; i ++) {
+		atomic_store_explicit(&workers[i].frames, 0, memory_order_relaxed);
+		atomic_store_explicit(&workers[i].missed, 0, memory_order_relaxed);
+		atomic_store_explicit(&workers[i].steals, 0, memory_order_relaxed);
+		for (unsigned int b = 0; b <= LATE_BUCKETS; b ++)
+			atomic_store_explicit(&workers[i].late[b], 0, memory_order_relaxed);
+	}
+}
+
+// Gather (and reset) what the workers measured, for one report line
+//  Returns whether the step held its deadlines.
+static int report(const unsigned int streams, const double seconds)
+{
+	unsigned long frames = 0, missed = 0, steals = 0;
+	unsigned long late[LATE_BUCKETS + 1] = { 0 };
+
+	for (unsigned int i = 0; i < workerCount; i ++) {
+		frames += atomic_exchange_explicit(&workers[i].frames, 0, memory_order_relaxed);
+		missed += atomic_exchange_explicit(&workers[i].missed, 0, memory_order_relaxed);
+		steals += atomic_exchange_explicit(&workers[i].steals, 0, memory_order_relaxed);
+		for (unsigned int b = 0; b <= LATE_BUCKETS; b ++)
+			late[b] += atomic_exchange_explicit(&workers[i].late[b], 0, memory_order_relaxed);
+	}
+
+	// 99th percentile lateness, to the bucket
+	unsigned long seen = 0;
+	unsigned int p99 = 0;
+
+	while (p99 < LATE_BUCKETS && (seen += late[p99]) < frames * 0.99)
+		p99 ++;
+
+	const double missPercent = (frames ? 100.0 * missed / frames : 0);
+	const int held = (frames > 0 && missPercent <= MISS_THRESHOLD);
+
+	char p99text[16] = ">1000";
+	if (p99 < LATE_BUCKETS)
+		snprintf(p99text, sizeof(p99text), "%.1f", late_bounds[p99] / 1000.0);
+
+	printf("%7u %8.1f %10.0f %7.2f %10s %8.0f  %s\n", streams, (double)streams / workerCount,
+		frames / seconds, missPercent, p99text, steals / seconds, (held ? "ok" : "SLIPPING"));
+	fflush(stdout);
+
+	return held;
+}
+
+// Sleep for a while, unless asked to stop
+static void nap(const double seconds)
+{
+	const uint64_t until = metrics_Now() + seconds * 1e6;
+
+	while (running && metrics_Now() < until)
+		usleep(100000);
+}
+
+/* *************************************************** */
+int main(int argc, char * argv[])
+{
+	int ret = EXIT_SUCCESS;
+
+	unsigned int total = 256;
+	unsigned int rampStart = 0, rampStep = 0;
+	double rampSeconds = 5;
+	const char * mix = "both";
+	const char * metricsAddress = NULL;
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	workerCount = (cores > 0 ? cores : 1);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:j:x:r:m:")) != -1) {
+		switch (opt) {
+		case 'n':
+			total = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			workerCount = strtoul(optarg, NULL, 10);
+			break;
+		case 'x':
+			mix = optarg;
+			break;
+		case 'r':
+			if (sscanf(optarg, "%u,%u,%lf", &rampStart, &rampStep, &rampSeconds) != 3)
+				rampSeconds = 0;
+			break;
+		case 'm':
+			metricsAddress = optarg;
+			break;
+		default:
+			optind = argc + 1;
+		}
+	}
+
+	enum stream_kind pattern[64];
+	const unsigned int patternLen = parse_mix(mix, pattern, 64);
+
+	if (optind < argc - 1 || optind > argc || total == 0 || workerCount == 0 || rampSeconds <= 0 || patternLen == 0) {
+		printf("Parallel synthetic RTMP publisher\nUsage:\n\t%s [-n streams] [-j threads] [-x mix] [-r start,step,seconds] [-m metrics_address] [URL]\n"
+			"Options:\n\t-n\ttotal streams (default 256)\n"
+			"\t-j\tworker threads (default: one per core)\n"
+			"\t-x\tstream mix of video, audio and both, e.g. video:2,audio:1 (default both)\n"
+			"\t-r\tramp: start with this many streams, then add step more every so many seconds\n"
+			"\t\t(default: one per thread, then one per thread every 5 s)\n"
+			"\t-m\tserve Prometheus metrics on [host:]port or a Unix socket path\n"
+			"Stream n publishes to URL-n.  Without a URL, streams are encoded and discarded.\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const char * const url = (optind < argc ? argv[optind] : NULL);
+
+	if (rampStart == 0)
+		rampStart = workerCount;
+	if (rampStep == 0)
+		rampStep = workerCount;
+
+	if (metricsAddress && ! metrics_Listen("loadgen", metricsAddress))
+		return EXIT_FAILURE;
+
+	// librtmp's messages, and the streams', are written out by the logger
+	//  thread, not the workers
+	RTMP_LogSetLevel(RTMP_LOGWARNING);
+	RTMP_LogSetCallback(logger_RTMP);
+	logger_Start();
+
+	/* *************************************************** */
+	// Start the pool
+	workers = calloc(workerCount, sizeof(*workers));
+
+	if (workers == NULL) {
+		perror("Failed to allocate workers");
+		logger_Stop();
+		return EXIT_FAILURE;
+	}
+
+	running = 1;
+	signal(SIGTERM, sig_handler);
+	signal(SIGINT, sig_handler);
+	signal(SIGQUIT, sig_handler);
+	signal(SIGHUP, sig_handler);
+
+	unsigned int started = 0;
+
+	for (; started < workerCount; started ++) {
+		workers[started].id = started;
+		pthread_mutex_init(&workers[started].lock, NULL);
+
+		if (pthread_create(&workers[started].thread, NULL, worker_Main, &workers[started]) != 0) {
+			fputs("Failed to start worker thread\n", stderr);
+			ret = EXIT_FAILURE;
+			goto stop;
+		}
+	}
+
+	printf("%u worker threads, stream mix %s, %s\n", workerCount, mix, (url ? url : "no output"));
+	printf("%7s %8s %10s %7s %10s %8s\n", "streams", "per core", "frames/s", "late %", "p99 ms", "steals/s");
+
+	/* *************************************************** */
+	// Ramp up, reporting each step, until the streams are all running or
+	//  deadlines start slipping
+	unsigned int streams = 0, sustained = 0;
+	unsigned int target = (rampStart < total ? rampStart : total);
+
+	while (running) {
+		for (; streams < target && running; streams ++) {
+			struct stream * const s = calloc(1, sizeof(*s));
+
+			if (s == NULL) {
+				perror("Failed to allocate stream");
+				ret = EXIT_FAILURE;
+				goto stop;
+			}
+
+			s->id = streams;
+			s->kind = pattern[streams % patternLen];
+
+			if (! stream_Open(s, url)) {
+				fprintf(stderr, "Failed to start stream %u\n", s->id);
+				stream_Close(s);
+				free(s);
+				ret = EXIT_FAILURE;
+				goto stop;
+			}
+
+			// new streams go round the workers: stealing evens out the rest
+			struct worker * const w = &workers[streams % workerCount];
+			pthread_mutex_lock(&w->lock);
+			const int pushed = heap_Push(w, s);
+			pthread_mutex_unlock(&w->lock);
+
+			if (! pushed) {
+				fputs("Failed to schedule stream\n", stderr);
+				stream_Close(s);
+				free(s);
+				ret = EXIT_FAILURE;
+				goto stop;
+			}
+		}
+
+		// measure only the steady state of this step, not the connecting
+		stats_Reset();
+		nap(rampSeconds);
+
+		if (! running)
+			break;
+
+		if (! report(streams, rampSeconds))
+			break;
+
+		sustained = streams;
+
+		if (streams == total)
+			break;
+
+		target = (streams + rampStep < total ? streams + rampStep : total);
+	}
+
+	if (sustained)
+		printf("Sustained %u streams on %u threads (%.1f per core) before deadlines slipped\n",
+			sustained, workerCount, (double)sustained / workerCount);
+	else
+		puts("Deadlines slipped at the first step: try fewer streams per step");
+
+	/* *************************************************** */
+	// CLEANUP CODE
+stop:
+	running = 0;
+
+	for (unsigned int i = 0; i < started; i ++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (unsigned int i = 0; i < workerCount; i ++) {
+		for (unsigned int j = 0; j < workers[i].count; j ++) {
+			stream_Close(workers[i].heap[j]);
+			free(workers[i].heap[j]);
+		}
+		free(workers[i].heap);
+		if (i < started)
+			pthread_mutex_destroy(&workers[i].lock);
+	}
+
+	free(workers);
+	logger_Stop();
+
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+
+	return ret;
+}
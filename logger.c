@@ -0,0 +1,303 @@
+/* ***************************************************
+logger: asynchronous logging, off the streaming path
+Greg Kennedy 2021
+*************************************************** */
+#include "logger.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct logger_slot {
+	uint64_t time;	// us, for merging the rings back in order
+	FILE * stream;
+	uint32_t len;
+	char text[LOGGER_LINE];
+};
+
+// One thread's messages: it alone moves head, and the writer alone moves tail
+//  Rings are never freed: one whose thread has exited is taken over by the
+//  next new thread, so threads that come and go (rtmpout's connect thread)
+//  don't add up.
+struct logger_ring {
+	struct logger_ring * next;
+	atomic_int owned;
+
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+	atomic_ulong dropped;
+
+	struct logger_slot slot[LOGGER_SLOTS];
+};
+
+static atomic_int running;
+static atomic_int stopping;
+static pthread_t writer;
+
+// every ring made, newest first: only ever added to
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct logger_ring * _Atomic rings;
+
+// each thread's ring, handed back when the thread exits
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+// librtmp's names for its levels, as its own output uses
+static const char * const rtmp_levels[] = { "CRIT", "ERROR", "WARNING", "INFO", "DEBUG", "DEBUG2" };
+// and x264's
+static const char * const x264_levels[] = { "error", "warning", "info", "debug" };
+
+/* ************************************************************************ */
+static void logger_Release(void * const r)
+{
+	atomic_store_explicit(&((struct logger_ring *)r)->owned, 0, memory_order_release);
+}
+
+static void logger_Key(void)
+{
+	pthread_key_create(&key, logger_Release);
+}
+
+// This thread's ring: one left by an exited thread, or a new one
+static struct logger_ring * logger_Ring(void)
+{
+	struct logger_ring * r = pthread_getspecific(key);
+
+	if (r != NULL)
+		return r;
+
+	for (r = atomic_load_explicit(&rings, memory_order_acquire); r != NULL; r = r->next) {
+		int expected = 0;
+
+		if (atomic_compare_exchange_strong(&r->owned, &expected, 1))
+			break;
+	}
+
+	if (r == NULL) {
+		if ((r = calloc(1, sizeof(*r))) == NULL)
+			return NULL;
+		atomic_init(&r->owned, 1);
+
+		pthread_mutex_lock(&rings_mutex);
+		r->next = atomic_load_explicit(&rings, memory_order_relaxed);
+		atomic_store_explicit(&rings, r, memory_order_release);
+		pthread_mutex_unlock(&rings_mutex);
+	}
+
+	pthread_setspecific(key, r);
+	return r;
+}
+
+// Write out what the rings hold now, oldest first
+//  Returns the number of messages written.
+static unsigned long logger_Drain(void)
+{
+	struct logger_ring * const first = atomic_load_explicit(&rings, memory_order_acquire);
+	unsigned long written = 0;
+	int out = 0, err = 0;
+
+	for (;;) {
+		// the ring whose next message is oldest
+		struct logger_ring * oldest = NULL;
+		const struct logger_slot * slot = NULL;
+
+		for (struct logger_ring * r = first; r != NULL; r = r->next) {
+			const unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+			if (tail == atomic_load_explicit(&r->head, memory_order_acquire))
+				continue;
+
+			const struct logger_slot * const s = &r->slot[tail % LOGGER_SLOTS];
+
+			if (slot == NULL || s->time < slot->time) {
+				oldest = r;
+				slot = s;
+			}
+		}
+
+		if (oldest == NULL)
+			break;
+
+		fwrite(slot->text, 1, slot->len, slot->stream);
+		if (slot->stream == stdout)
+			out = 1;
+		else
+			err = 1;
+
+		atomic_fetch_add_explicit(&oldest->tail, 1, memory_order_release);
+		written ++;
+	}
+
+	for (struct logger_ring * r = first; r != NULL; r = r->next) {
+		const unsigned long dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+
+		if (dropped) {
+			fprintf(stderr, "Logger: dropped %lu messages, the log could not keep up\n", dropped);
+			err = 1;
+		}
+	}
+
+	// the one place that waits on the log pipe
+	if (out)
+		fflush(stdout);
+	if (err)
+		fflush(stderr);
+
+	return written;
+}
+
+static void * logger_Main(void * const arg)
+{
+	(void)arg;
+	const struct timespec interval = { 0, LOGGER_INTERVAL * 1000000L };
+
+	for (;;) {
+		// drain once more after being told to stop, for anything logged before it
+		const int stop = atomic_load(&stopping);
+
+		if (logger_Drain() == 0) {
+			if (stop)
+				break;
+			nanosleep(&interval, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+/* ************************************************************************ */
+int logger_Start(void)
+{
+	if (atomic_load(&running))
+		return 1;
+
+	pthread_once(&key_once, logger_Key);
+	atomic_store(&stopping, 0);
+
+	if (pthread_create(&writer, NULL, logger_Main, NULL) != 0) {
+		fputs("Failed to start the logger thread, logging synchronously\n", stderr);
+		return 0;
+	}
+
+	atomic_store(&running, 1);
+	return 1;
+}
+
+void logger_Stop(void)
+{
+	if (! atomic_load(&running))
+		return;
+
+	atomic_store(&running, 0);
+	atomic_store(&stopping, 1);
+	pthread_join(writer, NULL);
+}
+
+void logger_VPrintf(FILE * const stream, const char * const format, va_list args)
+{
+	struct logger_ring * const r = (atomic_load_explicit(&running, memory_order_acquire) ? logger_Ring() : NULL);
+
+	if (r == NULL) {
+		vfprintf(stream, format, args);
+		return;
+	}
+
+	const unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == LOGGER_SLOTS) {
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	struct logger_slot * const s = &r->slot[head % LOGGER_SLOTS];
+	const int n = vsnprintf(s->text, LOGGER_LINE, format, args);
+
+	if (n <= 0)
+		return;
+
+	// a message cut short still ends the line
+	if (n >= LOGGER_LINE) {
+		s->len = LOGGER_LINE - 1;
+		s->text[s->len - 1] = '\n';
+	} else
+		s->len = n;
+
+	s->time = metrics_Now();
+	s->stream = stream;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+void logger_Printf(FILE * const stream, const char * const format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	logger_VPrintf(stream, format, args);
+	va_end(args);
+}
+
+// Pass the message if its interval has come around, noting how many were not
+static void logger_VLimited(struct logger_limit * const l, const unsigned int interval, FILE * const stream, const char * const format, va_list args)
+{
+	const uint64_t now = metrics_Now();
+	uint64_t next = atomic_load_explicit(&l->next, memory_order_relaxed);
+
+	if (now < next || ! atomic_compare_exchange_strong_explicit(&l->next, &next, now + interval * 1000ULL, memory_order_relaxed, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&l->suppressed, 1, memory_order_relaxed);
+		return;
+	}
+
+	const unsigned long suppressed = atomic_exchange_explicit(&l->suppressed, 0, memory_order_relaxed);
+
+	if (suppressed == 0) {
+		logger_VPrintf(stream, format, args);
+		return;
+	}
+
+	char line[LOGGER_LINE];
+	int n = vsnprintf(line, sizeof(line), format, args);
+
+	if (n < 0)
+		return;
+	if (n >= (int)sizeof(line))
+		n = sizeof(line) - 1;
+	if (n > 0 && line[n - 1] == '\n')
+		n --;
+
+	logger_Printf(stream, "%.*s (and %lu more like it)\n", n, line, suppressed);
+}
+
+void logger_Limited(struct logger_limit * const l, const unsigned int interval, FILE * const stream, const char * const format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	logger_VLimited(l, interval, stream, format, args);
+	va_end(args);
+}
+
+void logger_RTMP(const int level, const char * const format, va_list args)
+{
+	char line[LOGGER_LINE];
+	vsnprintf(line, sizeof(line), format, args);
+
+	const int count = sizeof(rtmp_levels) / sizeof(rtmp_levels[0]);
+	logger_Printf(stderr, "%s: %s\n", rtmp_levels[level >= 0 && level < count ? level : count - 1], line);
+}
+
+void logger_X264(void * const priv, const int level, const char * const format, va_list args)
+{
+	(void)priv;
+	static struct logger_limit debug;
+
+	char line[LOGGER_LINE];
+	vsnprintf(line, sizeof(line), format, args);
+
+	const int count = sizeof(x264_levels) / sizeof(x264_levels[0]);
+	const char * const name = x264_levels[level >= 0 && level < count ? level : count - 1];
+
+	// at debug level x264 reports every frame
+	if (level >= count - 1)
+		logger_Limited(&debug, 1000, stderr, "x264 [%s]: %s", name, line);
+	else
+		logger_Printf(stderr, "x264 [%s]: %s", name, line);
+}
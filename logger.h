@@ -0,0 +1,63 @@
+/* ***************************************************
+logger: asynchronous logging, off the streaming path
+Greg Kennedy 2021
+
+Each thread formats its messages into its own ring of
+ fixed-size slots, with no locks and no system calls, and
+ a background thread writes them out, merged back into
+ time order.  A full ring drops the message (and counts
+ it) rather than wait, so a log pipe that backs up never
+ holds up a stream.  Messages made every frame should go
+ through LOGGER_EVERY, which passes one per interval.
+ Before logger_Start and after logger_Stop, messages are
+ written straight out, as fprintf would.
+*************************************************** */
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// slots in each thread's ring, and the longest message kept (longer ones are cut)
+#define LOGGER_SLOTS 256
+#define LOGGER_LINE 240
+
+// how often the writer looks for messages when there were none (ms)
+#define LOGGER_INTERVAL 10
+
+// Start the writer thread.  Returns 0 on failure, and messages are still
+//  written, just synchronously.
+int logger_Start(void);
+
+// Write out everything queued, and stop the writer
+//  No other thread may be logging.  Safe to call more than once.
+void logger_Stop(void);
+
+// Queue a message for stream (stdout or stderr)
+void logger_Printf(FILE * stream, const char * format, ...) __attribute__((format(printf, 2, 3)));
+void logger_VPrintf(FILE * stream, const char * format, va_list args);
+
+// One call site's rate limit: the first message in each interval is
+//  passed, and says how many were held back since the last
+struct logger_limit {
+	_Atomic uint64_t next;	// us
+	atomic_ulong suppressed;
+};
+
+void logger_Limited(struct logger_limit * l, unsigned int interval, FILE * stream, const char * format, ...) __attribute__((format(printf, 4, 5)));
+
+// at most one message per interval ms from this line
+#define LOGGER_EVERY(interval, stream, ...) do { \
+	static struct logger_limit logger_limit_; \
+	logger_Limited(&logger_limit_, (interval), (stream), __VA_ARGS__); \
+} while (0)
+
+// Callbacks for librtmp (RTMP_LogSetCallback) and x264 (param.pf_log),
+//  which otherwise write to stderr on whatever thread they are in
+//  x264's per-frame debug messages are rate limited.
+void logger_RTMP(int level, const char * format, va_list args);
+void logger_X264(void * priv, int level, const char * format, va_list args);
+
+#endif
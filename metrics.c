@@ -0,0 +1,274 @@
+/* ***************************************************
+metrics: runtime statistics for the casting tools
+Greg Kennedy 2021
+*************************************************** */
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// histogram bucket upper bounds, in microseconds: 50us to 2.5s
+static const uint64_t bucket_bounds[] = { 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000 };
+#define BUCKETS (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]))
+
+struct histogram {
+	atomic_uint_fast64_t bucket[BUCKETS + 1];	// last one is +Inf
+	atomic_uint_fast64_t sum;
+};
+
+static atomic_uint_fast64_t counters[METRIC_COUNTERS];
+static atomic_int_fast64_t gauges[METRIC_GAUGES];
+static struct histogram histograms[METRIC_HISTOGRAMS];
+
+// names and help text, in enum order
+static const char * const counter_names[][2] = {
+	{ "rtmp_sent_bytes_total", "Bytes of FLV tags passed to RTMP_Write" },
+	{ "rtmp_sent_tags_total", "FLV tags passed to RTMP_Write" },
+	{ "rtmp_control_packets_total", "Packets received from the server" },
+	{ "rtmp_reconnects_total", "Reconnections to the server" },
+	{ "rtmp_dropped_tags_total", "Tags dropped while disconnected or waiting for a keyframe" },
+	{ "rtmp_congestion_events_total", "Times the socket backlog went over the latency budget" },
+	{ "rtmp_congestion_dropped_tags_total", "Video tags dropped to get back under the latency budget" },
+	{ "rtmp_congestion_dropped_bytes_total", "Bytes of video dropped to get back under the latency budget" },
+	{ "rtmp_congestion_protected_tags_total", "Audio, script and keyframe tags sent while over the latency budget" },
+	{ "rtmp_skipped_frames_total", "Frames skipped to catch up with the frame clock" },
+	{ "rtmp_clock_rebases_total", "Times the frame clock moved its schedule back after falling behind" },
+	{ "rtmp_shaper_held_tags_total", "Tags held back by the bitrate shaper until its token bucket allowed them" },
+};
+
+static const char * const gauge_names[][2] = {
+	{ "rtmp_schedule_lag_milliseconds", "How far the last frame was behind schedule" },
+	{ "rtmp_rtt_milliseconds", "Round trip time of the last ping" },
+	{ "rtmp_send_latency_milliseconds", "Time from writing the last acknowledged byte to its acknowledgement" },
+	{ "rtmp_unacked_bytes", "Bytes sent but not yet acknowledged by the server" },
+	{ "rtmp_ack_window_bytes", "Acknowledgement window set by the server" },
+	{ "rtmp_socket_backlog_bytes", "Bytes written to the socket and not yet acknowledged" },
+	{ "rtmp_queue_delay_milliseconds", "Media time the socket backlog amounts to" },
+	{ "rtmp_first_frame_milliseconds", "Time from starting to connect to the first audio or video tag sent" },
+	{ "rtmp_send_rate_bytes_per_second", "Rate the socket backlog drained at, over the last millisecond sampled by the bitrate shaper" },
+};
+
+static const char * const histogram_names[][2] = {
+	{ "rtmp_write_seconds", "Time spent in RTMP_Write per tag" },
+	{ "rtmp_video_encode_seconds", "Time spent encoding each video frame" },
+	{ "rtmp_audio_encode_seconds", "Time spent encoding each audio block" },
+	{ "rtmp_schedule_lag_seconds", "How late each frame was sent, against its deadline" },
+	{ "rtmp_reconnect_seconds", "Time from losing the connection to resuming" },
+	{ "rtmp_rtt_seconds", "Round trip time of each ping" },
+	{ "rtmp_send_latency_seconds", "Time from writing a byte to the server acknowledging it" },
+};
+
+// the tool label, and the listening socket
+static const char * label;
+static int listen_fd = -1;
+
+/* ************************************************************************ */
+void metrics_Add(const enum metric_counter counter, const uint64_t value)
+{
+	atomic_fetch_add_explicit(&counters[counter], value, memory_order_relaxed);
+}
+
+void metrics_Set(const enum metric_gauge gauge, const int64_t value)
+{
+	atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+}
+
+void metrics_Observe(const enum metric_histogram histogram, const uint64_t us)
+{
+	struct histogram * const h = &histograms[histogram];
+	unsigned int i = 0;
+
+	while (i < BUCKETS && us > bucket_bounds[i])
+		i ++;
+
+	atomic_fetch_add_explicit(&h->bucket[i], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum, us, memory_order_relaxed);
+}
+
+/* ************************************************************************ */
+// Format everything in Prometheus text exposition format
+//  returns length written, truncated to size
+static size_t metrics_Format(char * const buf, const size_t size)
+{
+	size_t len = 0;
+
+#define out(...) { int n = snprintf(buf + len, size - len, __VA_ARGS__); if (n > 0) len += n; if (len >= size) return size - 1; }
+
+	for (unsigned int i = 0; i < METRIC_COUNTERS; i ++) {
+		out("# HELP %s %s.\n# TYPE %s counter\n", counter_names[i][0], counter_names[i][1], counter_names[i][0]);
+		out("%s{tool=\"%s\"} %llu\n", counter_names[i][0], label,
+			(unsigned long long)atomic_load_explicit(&counters[i], memory_order_relaxed));
+	}
+
+	for (unsigned int i = 0; i < METRIC_GAUGES; i ++) {
+		out("# HELP %s %s.\n# TYPE %s gauge\n", gauge_names[i][0], gauge_names[i][1], gauge_names[i][0]);
+		out("%s{tool=\"%s\"} %lld\n", gauge_names[i][0], label,
+			(long long)atomic_load_explicit(&gauges[i], memory_order_relaxed));
+	}
+
+	for (unsigned int i = 0; i < METRIC_HISTOGRAMS; i ++) {
+		const char * const name = histogram_names[i][0];
+		uint64_t count = 0;
+
+		out("# HELP %s %s.\n# TYPE %s histogram\n", name, histogram_names[i][1], name);
+
+		// Prometheus buckets are cumulative
+		for (unsigned int b = 0; b <= BUCKETS; b ++) {
+			char le[16] = "+Inf";
+			count += atomic_load_explicit(&histograms[i].bucket[b], memory_order_relaxed);
+
+			if (b < BUCKETS)
+				snprintf(le, sizeof(le), "%g", bucket_bounds[b] / 1e6);
+
+			out("%s_bucket{tool=\"%s\",le=\"%s\"} %llu\n", name, label, le, (unsigned long long)count);
+		}
+
+		out("%s_sum{tool=\"%s\"} %.6f\n", name, label,
+			atomic_load_explicit(&histograms[i].sum, memory_order_relaxed) / 1e6);
+		out("%s_count{tool=\"%s\"} %llu\n", name, label, (unsigned long long)count);
+	}
+
+#undef out
+
+	return len;
+}
+
+// Answer each connection with the current metrics, whatever it asked for
+static void * metrics_Serve(void * const arg)
+{
+	(void)arg;
+	static char body[32768];
+	char header[128];
+
+	for (;;) {
+		const int fd = accept(listen_fd, NULL, NULL);
+
+		if (fd < 0) {
+			// a client that gave up, or a signal: just carry on
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			// the listening socket itself is gone: nothing more will come
+			if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK) {
+				fprintf(stderr, "Metrics server stopped: %s\n", strerror(errno));
+				break;
+			}
+
+			// out of descriptors or memory (EMFILE, ENFILE, ENOBUFS...): the
+			//  connection stays queued, so wait for some to free up rather
+			//  than spin on accept
+			usleep(100000);
+			continue;
+		}
+
+		// read (and ignore) the request, but don't wait on a silent client
+		struct timeval tv = { 1, 0 };
+		char request[1024];
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (recv(fd, request, sizeof(request), 0) >= 0) {
+			const size_t len = metrics_Format(body, sizeof(body));
+			const int header_len = snprintf(header, sizeof(header),
+				"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+
+			if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len)
+				send(fd, body, len, MSG_NOSIGNAL);
+		}
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+int metrics_Listen(const char * const tool, const char * const address)
+{
+	label = tool;
+
+	if (strchr(address, '/')) {
+		// Unix socket
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+		if (strlen(address) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "Metrics socket path too long: %s\n", address);
+			return 0;
+		}
+
+		strcpy(addr.sun_path, address);
+		unlink(address);
+
+		listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+			perror("Failed to bind metrics socket");
+			goto fail;
+		}
+	} else {
+		// TCP, [host:]port
+		struct sockaddr_in addr = { .sin_family = AF_INET };
+		const char * const colon = strrchr(address, ':');
+		char host[64] = "127.0.0.1";
+
+		if (colon) {
+			if ((size_t)(colon - address) >= sizeof(host)) {
+				fprintf(stderr, "Metrics host too long: %s\n", address);
+				return 0;
+			}
+
+			memcpy(host, address, colon - address);
+			host[colon - address] = '\0';
+		}
+
+		addr.sin_port = htons(atoi(colon ? colon + 1 : address));
+
+		if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+			fprintf(stderr, "Bad metrics address: %s\n", address);
+			return 0;
+		}
+
+		const int one = 1;
+		listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (listen_fd >= 0)
+			setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+			perror("Failed to bind metrics socket");
+			goto fail;
+		}
+	}
+
+	if (listen(listen_fd, 8) != 0) {
+		perror("Failed to listen on metrics socket");
+		goto fail;
+	}
+
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, metrics_Serve, NULL) != 0) {
+		fputs("Failed to start metrics thread\n", stderr);
+		goto fail;
+	}
+
+	pthread_detach(thread);
+	return 1;
+
+fail:
+	if (listen_fd >= 0)
+		close(listen_fd);
+	listen_fd = -1;
+	return 0;
+}
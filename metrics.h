@@ -0,0 +1,78 @@
+/* ***************************************************
+metrics: runtime statistics for the casting tools
+Greg Kennedy 2021
+
+Counters, gauges and fixed-bucket histograms, updated
+ with relaxed atomics so they are cheap enough for the
+ per-tag path.  A background thread serves them in
+ Prometheus text format over HTTP, on a TCP port or a
+ Unix socket.
+*************************************************** */
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+// Counters only ever go up
+enum metric_counter {
+	METRIC_BYTES_SENT,
+	METRIC_TAGS_SENT,
+	METRIC_CONTROL_PACKETS,	// packets read from the server
+	METRIC_RECONNECTS,
+	METRIC_TAGS_DROPPED,	// while disconnected, or waiting for a keyframe
+	METRIC_CONGESTION_EVENTS,	// times the latency budget was exceeded
+	METRIC_CONGESTION_DROPPED_TAGS,	// video dropped to get back under it
+	METRIC_CONGESTION_DROPPED_BYTES,
+	METRIC_CONGESTION_PROTECTED_TAGS,	// audio, script and keyframes sent over budget
+	METRIC_FRAMES_SKIPPED,	// by the frame clock, to catch up
+	METRIC_CLOCK_REBASES,	// times the frame clock moved its schedule back
+	METRIC_SHAPER_HELD_TAGS,	// tags the bitrate shaper made wait for tokens
+	METRIC_COUNTERS
+};
+
+// Gauges hold the latest value
+enum metric_gauge {
+	METRIC_SCHEDULE_LAG,	// ms behind the frame schedule (negative = ahead)
+	METRIC_RTT,	// ms, from the last ping response
+	METRIC_SEND_LATENCY,	// ms, from writing a byte to its acknowledgement
+	METRIC_UNACKED_BYTES,	// sent, but not yet acknowledged by the server
+	METRIC_ACK_WINDOW,	// the server's acknowledgement window
+	METRIC_SOCKET_BACKLOG,	// bytes queued in the socket
+	METRIC_QUEUE_DELAY,	// ms of media that backlog amounts to
+	METRIC_FIRST_FRAME,	// ms from starting to connect to the first frame sent
+	METRIC_SEND_RATE,	// bytes per second the socket drained at, last sampled
+	METRIC_GAUGES
+};
+
+// Histograms of durations, in microseconds
+enum metric_histogram {
+	METRIC_WRITE_TIME,	// RTMP_Write
+	METRIC_VIDEO_ENCODE_TIME,	// x264_encoder_encode
+	METRIC_AUDIO_ENCODE_TIME,	// aacEncEncode
+	METRIC_SCHEDULE_LAG_TIME,	// how late each frame was sent
+	METRIC_RECONNECT_TIME,	// from losing the connection to resuming
+	METRIC_RTT_TIME,	// ping round trips
+	METRIC_SEND_LATENCY_TIME,	// write to acknowledgement
+	METRIC_HISTOGRAMS
+};
+
+void metrics_Add(enum metric_counter counter, uint64_t value);
+void metrics_Set(enum metric_gauge gauge, int64_t value);
+void metrics_Observe(enum metric_histogram histogram, uint64_t us);
+
+// monotonic clock in microseconds, for timing things to Observe
+static inline uint64_t metrics_Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Start serving metrics, labelled with the tool name
+//  address is a path (containing '/') for a Unix socket,
+//  else "[host:]port" for TCP, where host defaults to 127.0.0.1
+//  Returns 0 on failure.
+int metrics_Listen(const char * tool, const char * address);
+
+#endif
@@ -0,0 +1,528 @@
+/* ***************************************************
+mp4read: FLV tags from an MP4 file, for rtmpcast
+Greg Kennedy 2021
+*************************************************** */
+#include "mp4read.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FOURCC(a, b, c, d) ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (uint32_t)(d))
+
+// the FLV codec ids, for onMetaData
+#define CODEC_AVC 7
+#define CODEC_AAC 10
+
+// MPEG-4 descriptor tags in esds, and the AAC object types
+#define ES_DESCRIPTOR 3
+#define DECODER_CONFIG 4
+#define DECODER_SPECIFIC 5
+#define OTI_AAC 0x40
+#define OTI_AAC_MPEG2_FIRST 0x66
+#define OTI_AAC_MPEG2_LAST 0x68
+
+// a box, between the end of its header and the end of its contents
+struct box {
+	uint32_t type;
+	const uint8_t * body;
+	const uint8_t * end;
+};
+
+// The box at p, which must lie within end
+//  Returns 0 if it is truncated, or there is no box there.
+static int mp4_Box(const uint8_t * const p, const uint8_t * const end, struct box * const b)
+{
+	if (end - p < 8)
+		return 0;
+
+	uint64_t size = parse_u32be(p);
+	const uint8_t * body = p + 8;
+
+	// 1 is a 64-bit size after the type, 0 runs to the end of the parent
+	if (size == 1) {
+		if (end - p < 16)
+			return 0;
+		size = (uint64_t)parse_u32be(p + 8) << 32 | parse_u32be(p + 12);
+		body = p + 16;
+	} else if (size == 0)
+		size = end - p;
+
+	if (size < (uint64_t)(body - p) || size > (uint64_t)(end - p))
+		return 0;
+
+	b->type = parse_u32be(p + 4);
+	b->body = body;
+	b->end = p + size;
+	return 1;
+}
+
+// The first box of a type, among the boxes from p to end
+static int mp4_Find(const uint8_t * p, const uint8_t * const end, const uint32_t type, struct box * const b)
+{
+	while (mp4_Box(p, end, b)) {
+		if (b->type == type)
+			return 1;
+		p = b->end;
+	}
+
+	return 0;
+}
+
+// An MPEG-4 descriptor header: a tag, then a length in up to four 7-bit bytes
+//  Returns the start of its contents, or NULL if they run past end.
+static const uint8_t * mp4_Descriptor(const uint8_t * p, const uint8_t * const end, uint8_t * const tag, uint32_t * const len)
+{
+	if (p >= end)
+		return NULL;
+
+	*tag = *p++;
+	*len = 0;
+
+	for (int i = 0; i < 4; i ++) {
+		if (p >= end)
+			return NULL;
+
+		const uint8_t b = *p++;
+		*len = *len << 7 | (b & 0x7F);
+
+		if (! (b & 0x80))
+			break;
+	}
+
+	return ((size_t)(end - p) >= *len ? p : NULL);
+}
+
+// The AudioSpecificConfig in an esds box, down through its descriptors
+static int mp4_ESDS(const struct box * const esds, const uint8_t ** const config, uint32_t * const size)
+{
+	const uint8_t * p = esds->body + 4;	// version and flags
+	const uint8_t * end = esds->end;
+	uint8_t tag;
+	uint32_t len;
+
+	// ES_Descriptor: ES_ID, flags, then whichever optional fields the flags say
+	p = (p < end ? mp4_Descriptor(p, end, &tag, &len) : NULL);
+	if (p == NULL || tag != ES_DESCRIPTOR || len < 3)
+		return 0;
+
+	end = p + len;
+	const uint8_t flags = p[2];
+	p += 3;
+
+	if (flags & 0x80)
+		p += 2;
+	if ((flags & 0x40) && p < end)
+		p += 1 + *p;
+	if (flags & 0x20)
+		p += 2;
+
+	// DecoderConfigDescriptor: object type, stream type, buffer size, bitrates
+	p = (p < end ? mp4_Descriptor(p, end, &tag, &len) : NULL);
+	if (p == NULL || tag != DECODER_CONFIG || len < 13)
+		return 0;
+
+	if (p[0] != OTI_AAC && (p[0] < OTI_AAC_MPEG2_FIRST || p[0] > OTI_AAC_MPEG2_LAST))
+		return 0;
+
+	end = p + len;
+	p += 13;
+
+	// DecoderSpecificInfo: the AudioSpecificConfig itself
+	p = mp4_Descriptor(p, end, &tag, &len);
+	if (p == NULL || tag != DECODER_SPECIFIC || len == 0)
+		return 0;
+
+	*config = p;
+	*size = len;
+	return 1;
+}
+
+// Build the sample index for a track from its sample tables
+//  Returns 0 if the tables are missing, or don't agree with each other.
+static int mp4read_Index(const struct mp4read * const m, struct mp4_track * const t, const struct box * const stbl)
+{
+	struct box stts, ctts, stsc, stsz, stco, stss;
+	int co64 = 0;
+
+	if (! mp4_Find(stbl->body, stbl->end, FOURCC('s','t','c','o'), &stco)) {
+		if (! mp4_Find(stbl->body, stbl->end, FOURCC('c','o','6','4'), &stco))
+			return 0;
+		co64 = 1;
+	}
+
+	if (! mp4_Find(stbl->body, stbl->end, FOURCC('s','t','t','s'), &stts) ||
+		! mp4_Find(stbl->body, stbl->end, FOURCC('s','t','s','c'), &stsc) ||
+		! mp4_Find(stbl->body, stbl->end, FOURCC('s','t','s','z'), &stsz))
+		return 0;
+
+	const int haveCtts = mp4_Find(stbl->body, stbl->end, FOURCC('c','t','t','s'), &ctts);
+	const int haveStss = mp4_Find(stbl->body, stbl->end, FOURCC('s','t','s','s'), &stss);
+
+	// every table is a full box (version and flags), then a count, then entries
+	//  stsz has a fixed size ahead of its count, and entries only without it
+	if (stsz.end - stsz.body < 12 || stts.end - stts.body < 8 || stsc.end - stsc.body < 8 || stco.end - stco.body < 8 ||
+		(haveCtts && ctts.end - ctts.body < 8) || (haveStss && stss.end - stss.body < 8))
+		return 0;
+
+	const uint32_t fixedSize = parse_u32be(stsz.body + 4);
+	const uint32_t count = parse_u32be(stsz.body + 8);
+	const uint32_t sttsCount = parse_u32be(stts.body + 4);
+	const uint32_t stscCount = parse_u32be(stsc.body + 4);
+	const uint32_t chunkCount = parse_u32be(stco.body + 4);
+	const uint32_t cttsCount = (haveCtts ? parse_u32be(ctts.body + 4) : 0);
+	const uint32_t stssCount = (haveStss ? parse_u32be(stss.body + 4) : 0);
+
+	if ((fixedSize == 0 && (uint64_t)(stsz.end - stsz.body - 12) / 4 < count) ||
+		(uint64_t)(stts.end - stts.body - 8) / 8 < sttsCount ||
+		(uint64_t)(stsc.end - stsc.body - 8) / 12 < stscCount ||
+		(uint64_t)(stco.end - stco.body - 8) / (co64 ? 8 : 4) < chunkCount ||
+		(haveCtts && (uint64_t)(ctts.end - ctts.body - 8) / 8 < cttsCount) ||
+		(haveStss && (uint64_t)(stss.end - stss.body - 8) / 4 < stssCount))
+		return 0;
+
+	t->samples = calloc(count ? count : 1, sizeof(*t->samples));
+	if (t->samples == NULL)
+		return 0;
+	t->count = count;
+
+	// sizes, which must fit in a tag after the audio / video packet header
+	for (uint32_t s = 0; s < count; s ++) {
+		const uint32_t size = (fixedSize ? fixedSize : parse_u32be(stsz.body + 12 + (size_t)4 * s));
+
+		if (size > 0xFFFFFF - 5)
+			return 0;
+
+		t->samples[s].size = size;
+	}
+
+	// offsets: stsc gives the samples in each run of chunks, stco where the chunks are
+	uint32_t s = 0;
+
+	for (uint32_t e = 0; e < stscCount && s < count; e ++) {
+		const uint8_t * const entry = stsc.body + 8 + (size_t)12 * e;
+		const uint32_t first = parse_u32be(entry);
+		const uint32_t perChunk = parse_u32be(entry + 4);
+		const uint32_t last = (e + 1 < stscCount ? parse_u32be(entry + 12) : chunkCount + 1);
+
+		if (first == 0 || last < first || last > chunkCount + 1)
+			return 0;
+
+		for (uint32_t c = first; c < last && s < count; c ++) {
+			uint64_t offset = (co64 ?
+				(uint64_t)parse_u32be(stco.body + 8 + (size_t)8 * (c - 1)) << 32 | parse_u32be(stco.body + 12 + (size_t)8 * (c - 1)) :
+				parse_u32be(stco.body + 8 + (size_t)4 * (c - 1)));
+
+			for (uint32_t i = 0; i < perChunk && s < count; i ++, s ++) {
+				if (offset > m->size || t->samples[s].size > m->size - offset)
+					return 0;
+
+				t->samples[s].offset = offset;
+				offset += t->samples[s].size;
+			}
+		}
+	}
+
+	if (s < count)
+		return 0;
+
+	// decode times from stts, and composition offsets from ctts, both in
+	//  runs of samples: ms are worked out from the running total of ticks,
+	//  so rounding never accumulates
+	uint64_t ticks = 0;
+	uint32_t sttsEntry = 0, sttsLeft = 0, delta = 0;
+	uint32_t cttsEntry = 0, cttsLeft = 0;
+	int32_t offset = 0;
+
+	for (s = 0; s < count; s ++) {
+		while (sttsLeft == 0) {
+			if (sttsEntry == sttsCount)
+				return 0;
+			sttsLeft = parse_u32be(stts.body + 8 + (size_t)8 * sttsEntry);
+			delta = parse_u32be(stts.body + 12 + (size_t)8 * sttsEntry);
+			sttsEntry ++;
+		}
+
+		while (cttsLeft == 0 && cttsEntry < cttsCount) {
+			cttsLeft = parse_u32be(ctts.body + 8 + (size_t)8 * cttsEntry);
+			offset = (int32_t)parse_u32be(ctts.body + 12 + (size_t)8 * cttsEntry);
+			cttsEntry ++;
+		}
+
+		if (cttsLeft)
+			cttsLeft --;
+		else
+			offset = 0;
+
+		const int64_t dts = ticks * 1000 / t->timescale;
+		t->samples[s].dts = (uint32_t)dts;
+		t->samples[s].cts = (int32_t)(((int64_t)ticks + offset) * 1000 / t->timescale - dts);
+
+		ticks += delta;
+		sttsLeft --;
+	}
+
+	if (t->duration == 0)
+		t->duration = ticks;
+
+	// without stss, every sample is a sync sample
+	if (! haveStss) {
+		for (s = 0; s < count; s ++)
+			t->samples[s].size |= MP4_SYNC;
+	} else {
+		for (uint32_t i = 0; i < stssCount; i ++) {
+			const uint32_t sample = parse_u32be(stss.body + 8 + (size_t)4 * i);
+
+			if (sample > 0 && sample <= count)
+				t->samples[sample - 1].size |= MP4_SYNC;
+		}
+	}
+
+	return 1;
+}
+
+// Take a track, if it is the first H.264 or AAC one
+//  Returns 0 only if it is one of those, and can't be indexed.
+static int mp4read_Track(struct mp4read * const m, const struct box * const trak)
+{
+	struct box mdia, hdlr, mdhd, minf, stbl, stsd, entry, config;
+
+	if (! mp4_Find(trak->body, trak->end, FOURCC('m','d','i','a'), &mdia) ||
+		! mp4_Find(mdia.body, mdia.end, FOURCC('h','d','l','r'), &hdlr) ||
+		! mp4_Find(mdia.body, mdia.end, FOURCC('m','d','h','d'), &mdhd) ||
+		! mp4_Find(mdia.body, mdia.end, FOURCC('m','i','n','f'), &minf) ||
+		! mp4_Find(minf.body, minf.end, FOURCC('s','t','b','l'), &stbl) ||
+		! mp4_Find(stbl.body, stbl.end, FOURCC('s','t','s','d'), &stsd))
+		return 1;
+
+	// the first sample description is the one used
+	if (hdlr.end - hdlr.body < 12 || stsd.end - stsd.body < 8 || ! mp4_Box(stsd.body + 8, stsd.end, &entry))
+		return 1;
+
+	const uint32_t handler = parse_u32be(hdlr.body + 8);
+	struct mp4_track * t;
+
+	if (handler == FOURCC('v','i','d','e') && (entry.type == FOURCC('a','v','c','1') || entry.type == FOURCC('a','v','c','3'))) {
+		// VisualSampleEntry: the size is 24 bytes in, and boxes start after 78
+		if (m->video.type || entry.end - entry.body < 78 ||
+			! mp4_Find(entry.body + 78, entry.end, FOURCC('a','v','c','C'), &config))
+			return 1;
+
+		t = &m->video;
+		t->type = FLV_TAG_VIDEO;
+		t->width = parse_u16be(entry.body + 24);
+		t->height = parse_u16be(entry.body + 26);
+		t->config = config.body;
+		t->configSize = config.end - config.body;
+	} else if (handler == FOURCC('s','o','u','n') && entry.type == FOURCC('m','p','4','a')) {
+		// AudioSampleEntry: boxes start after 28 bytes, more for QuickTime's versions 1 and 2
+		if (m->audio.type || entry.end - entry.body < 28)
+			return 1;
+
+		const uint16_t version = parse_u16be(entry.body + 8);
+		const size_t boxes = 28 + (version == 1 ? 16 : version == 2 ? 36 : 0);
+
+		if ((size_t)(entry.end - entry.body) < boxes ||
+			! mp4_Find(entry.body + boxes, entry.end, FOURCC('e','s','d','s'), &config))
+			return 1;
+
+		t = &m->audio;
+		if (! mp4_ESDS(&config, &t->config, &t->configSize)) {
+			fprintf(stderr, "Skipping an audio track that is not AAC\n");
+			return 1;
+		}
+
+		t->type = FLV_TAG_AUDIO;
+		t->channels = parse_u16be(entry.body + 16);
+		t->sampleRate = parse_u32be(entry.body + 24) >> 16;
+	} else {
+		if (handler == FOURCC('v','i','d','e') || handler == FOURCC('s','o','u','n'))
+			fprintf(stderr, "Skipping a track that is not H.264 or AAC\n");
+		return 1;
+	}
+
+	// the media header's time scale, for every time in the tables
+	const uint8_t version = (mdhd.end - mdhd.body > 0 ? mdhd.body[0] : 0);
+
+	if (mdhd.end - mdhd.body < (version == 1 ? 32 : 20))
+		return 0;
+
+	t->timescale = parse_u32be(mdhd.body + (version == 1 ? 20 : 12));
+	t->duration = (version == 1 ?
+		(uint64_t)parse_u32be(mdhd.body + 24) << 32 | parse_u32be(mdhd.body + 28) :
+		parse_u32be(mdhd.body + 16));
+
+	if (t->timescale == 0)
+		return 0;
+
+	return mp4read_Index(m, t, &stbl);
+}
+
+// onMetaData, from what the tracks say about themselves
+static void mp4read_Meta(const struct mp4read * const m, struct flv_tag * const t)
+{
+	const struct mp4_track * const v = &m->video, * const a = &m->audio;
+	double duration = 0;
+
+	if (v->type)
+		duration = (double)v->duration / v->timescale;
+	if (a->type && (double)a->duration / a->timescale > duration)
+		duration = (double)a->duration / a->timescale;
+
+	flv_TagHeader(t, FLV_TAG_SCRIPT, 0);
+	amf_string(t, "onMetaData");
+	amf_ecma_array(t, 3 + (v->type ? 4 : 0) + (a->type ? 3 : 0));
+
+	amf_ecma_array_entry(t, "duration", duration);
+
+	if (v->type) {
+		amf_ecma_array_entry(t, "width", v->width);
+		amf_ecma_array_entry(t, "height", v->height);
+		amf_ecma_array_entry(t, "framerate", v->duration ? (double)v->count * v->timescale / v->duration : 0);
+		amf_ecma_array_entry(t, "videocodecid", CODEC_AVC);
+	}
+
+	if (a->type) {
+		amf_ecma_array_entry(t, "audiocodecid", CODEC_AAC);
+		amf_ecma_array_entry(t, "audiosamplerate", a->sampleRate);
+		pstring(t, "stereo");
+		amf_boolean(t, a->channels > 1);
+	}
+
+	pstring(t, "hasVideo");
+	amf_boolean(t, v->type != 0);
+	pstring(t, "hasAudio");
+	amf_boolean(t, a->type != 0);
+	amf_ecma_array_end(t);
+}
+
+/* ************************************************************************ */
+int mp4read_Probe(const uint8_t * const head, const size_t len)
+{
+	if (len < 8)
+		return 0;
+
+	// files start with ftyp, or with a box that QuickTime writers put first
+	const uint32_t type = parse_u32be(head + 4);
+
+	return (type == FOURCC('f','t','y','p') || type == FOURCC('m','o','o','v') || type == FOURCC('m','d','a','t') ||
+		type == FOURCC('f','r','e','e') || type == FOURCC('s','k','i','p') || type == FOURCC('w','i','d','e'));
+}
+
+int mp4read_Open(struct mp4read * const m, FILE * const f)
+{
+	memset(m, 0, sizeof(*m));
+
+	struct stat st;
+
+	if (fstat(fileno(f), &st) != 0 || ! S_ISREG(st.st_mode) || st.st_size == 0) {
+		fputs("MP4 input must be a regular file\n", stderr);
+		return 0;
+	}
+
+	// the whole file is mapped, and only the pages of moov, then of each
+	//  sample as it is sent, are ever read
+	void * const map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+
+	if (map == MAP_FAILED) {
+		perror("Failed to map MP4 file");
+		return 0;
+	}
+
+	m->map = map;
+	m->size = st.st_size;
+	posix_madvise(map, m->size, POSIX_MADV_SEQUENTIAL);
+
+	struct box moov, trak;
+
+	if (! mp4_Find(m->map, m->map + m->size, FOURCC('m','o','o','v'), &moov)) {
+		fputs("MP4 file has no moov box\n", stderr);
+		goto fail;
+	}
+
+	for (const uint8_t * p = moov.body; mp4_Box(p, moov.end, &trak); p = trak.end) {
+		if (trak.type == FOURCC('t','r','a','k') && ! mp4read_Track(m, &trak)) {
+			fputs("MP4 sample tables are damaged\n", stderr);
+			goto fail;
+		}
+	}
+
+	if (! m->video.type && ! m->audio.type) {
+		fputs("MP4 file has no H.264 or AAC track (fragmented MP4 is not supported)\n", stderr);
+		goto fail;
+	}
+
+	return 1;
+
+fail:
+	mp4read_Close(m);
+	return 0;
+}
+
+int mp4read_Next(struct mp4read * const m, uint8_t * const scratch, uint8_t ** const tag, struct flv_tag_header * const h)
+{
+	struct mp4_track * const v = &m->video, * const a = &m->audio;
+	struct flv_tag t;
+
+	flv_TagInit(&t, scratch, MAX_TAG_SIZE);
+	*tag = scratch;
+
+	// onMetaData first, then the sequence headers of the tracks there are
+	if (m->headers == 0) {
+		m->headers ++;
+		mp4read_Meta(m, &t);
+	} else if (m->headers == 1 && v->type) {
+		m->headers ++;
+		flv_TagHeader(&t, FLV_TAG_VIDEO, 0);
+		flv_AVCVideoPacket(&t, 1, 0, 0);
+		flv_Write(&t, v->config, v->configSize);
+	} else if (m->headers <= 2 && a->type) {
+		m->headers = 3;
+		flv_TagHeader(&t, FLV_TAG_AUDIO, 0);
+		flv_AACAudioPacket(&t, 0);
+		flv_Write(&t, a->config, a->configSize);
+	} else {
+		// then samples, whichever is next to decode
+		struct mp4_track * track;
+
+		m->headers = 3;
+
+		if (v->next < v->count && (a->next == a->count || (int32_t)(v->samples[v->next].dts - a->samples[a->next].dts) <= 0))
+			track = v;
+		else if (a->next < a->count)
+			track = a;
+		else
+			return 0;
+
+		const struct mp4_sample * const s = &track->samples[track->next ++];
+		const uint32_t size = s->size & ~MP4_SYNC;
+
+		flv_TagHeader(&t, track->type, s->dts);
+
+		if (track->type == FLV_TAG_VIDEO)
+			flv_AVCVideoPacket(&t, s->size & MP4_SYNC, 1, s->cts);
+		else
+			flv_AACAudioPacket(&t, 1);
+
+		flv_Write(&t, m->map + s->offset, size);
+	}
+
+	if (flv_TagFinish(&t) == 0)
+		return -1;
+
+	flv_ParseTagHeader(scratch, h);
+	return 1;
+}
+
+void mp4read_Close(struct mp4read * const m)
+{
+	free(m->video.samples);
+	free(m->audio.samples);
+	m->video.samples = m->audio.samples = NULL;
+
+	if (m->map)
+		munmap((void *)m->map, m->size);
+	m->map = NULL;
+}
@@ -0,0 +1,78 @@
+/* ***************************************************
+mp4read: FLV tags from an MP4 file, for rtmpcast
+Greg Kennedy 2021
+
+Reads H.264 / AAC MP4 (and MOV) files directly, so they
+ need not be remuxed to FLV before casting.  The file is
+ mapped into memory, and only the moov box is parsed up
+ front: its sample tables (stts, ctts, stsc, stsz, stco
+ or co64, stss) become one compact index entry per
+ sample, with the file offset, size, decode time and
+ composition offset in ms, and the keyframe flag.  The
+ first tags are onMetaData and the AVC and AAC sequence
+ headers, built from avcC and esds; after that, samples
+ of both tracks go out as FLV tags in decode order, read
+ straight from the mapping.  Fragmented MP4 (moof) and
+ edit lists are not supported.
+*************************************************** */
+#ifndef MP4READ_H_
+#define MP4READ_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "flv.h"
+
+// set in a sample's size for a sync sample (keyframe)
+#define MP4_SYNC 0x80000000
+
+struct mp4_sample {
+	uint64_t offset;
+	uint32_t size;	// bytes, | MP4_SYNC
+	uint32_t dts;	// decode time, ms
+	int32_t cts;	// composition offset, ms
+};
+
+struct mp4_track {
+	uint8_t type;	// FLV_TAG_VIDEO or FLV_TAG_AUDIO, 0 if there is none
+	uint32_t timescale;
+	uint64_t duration;	// in timescale units
+
+	// avcC record or AudioSpecificConfig, within the mapping
+	const uint8_t * config;
+	uint32_t configSize;
+
+	uint16_t width, height;	// video
+	uint16_t channels;	// audio
+	uint32_t sampleRate;
+
+	struct mp4_sample * samples;
+	uint32_t count, next;
+};
+
+struct mp4read {
+	const uint8_t * map;
+	size_t size;
+
+	// the first H.264 and AAC tracks: others are skipped
+	struct mp4_track video, audio;
+
+	unsigned int headers;	// of the onMetaData and sequence header tags, sent so far
+};
+
+// Whether the start of a file (at least 8 bytes) looks like MP4
+int mp4read_Probe(const uint8_t * head, size_t len);
+
+// Map f and index its samples
+//  Returns 0 if it can't be read, or has no H.264 or AAC track.
+//  f stays the caller's to close, after mp4read_Close.
+int mp4read_Open(struct mp4read * m, FILE * f);
+
+// The next tag, header to PreviousTagSize, built in scratch (MAX_TAG_SIZE bytes)
+//  Returns 1 for a tag, 0 after the last sample.
+int mp4read_Next(struct mp4read * m, uint8_t * scratch, uint8_t ** tag, struct flv_tag_header * h);
+
+void mp4read_Close(struct mp4read * m);
+
+#endif
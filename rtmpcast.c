@@ -2,9 +2,8 @@
 rtmpcast: librtmp example code
 Greg Kennedy 2021
 
-Sends an input FLV file to a designated RTMP URL.
+Sends an input FLV (or MP4) file to a designated RTMP URL.
 *************************************************** */
-#include <librtmp/rtmp.h>
 #include <librtmp/log.h>
 
 #include <stdio.h>
@@ -12,22 +11,369 @@ Sends an input FLV file to a designated RTMP URL.
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
-
-// maximum size of a tag is 11 byte header, 0xFFFFFF payload, 4 byte size
-#define MAX_TAG_SIZE 11 + 16777215 + 4
+#include <errno.h>
+
+#include <sys/resource.h>
+
+// FLV tag and AMF parsing
+#include "flv.h"
+// runtime statistics
+#include "metrics.h"
+// RTMP connection, with reconnect
+#include "rtmpout.h"
+// messages, written out off the streaming thread
+#include "logger.h"
+// real or virtual time
+#include "vclock.h"
+// FLV tags from the file, with io_uring where there is one
+#include "flvread.h"
+// dropping tracks, retiming and rewriting onMetaData
+#include "flvfilter.h"
+// FLV tags from MP4 files
+#include "mp4read.h"
 
 #define DEBUG 0
 
-// helper functions
-//  parse 24 bits to an unsigned long
-static unsigned long u24be(const unsigned char * const p)
+// print the properties of an onMetaData script tag
+//  only scalars are shown, nested objects and arrays are skipped
+static void print_metadata(const uint8_t * p, const uint8_t * const end)
+{
+	struct amf_value v;
+
+	p = amf_Decode(p, end, &v);
+
+	if (p == NULL || v.type != AMF_STRING || v.len != 10 || memcmp(v.str, "onMetaData", 10) != 0)
+		return;
+
+	p = amf_Decode(p, end, &v);
+
+	if (p == NULL || (v.type != AMF_OBJECT && v.type != AMF_ECMA_ARRAY))
+		return;
+
+	logger_Printf(stdout, "onMetaData:\n");
+
+	while (p != NULL) {
+		const uint8_t * key;
+		uint32_t len;
+
+		p = amf_DecodeKey(p, end, &key, &len);
+
+		if (p == NULL || (len == 0 && p < end && *p == AMF_OBJECT_END))
+			break;
+
+		// peek at the value type, then skip the whole thing
+		const uint8_t * const value = p;
+		p = amf_Skip(p, end);
+
+		if (p == NULL || amf_Decode(value, end, &v) == NULL)
+			break;
+
+		if (v.type == AMF_NUMBER)
+			logger_Printf(stdout, "\t%.*s = %g\n", (int)len, (const char *)key, v.number);
+		else if (v.type == AMF_BOOLEAN)
+			logger_Printf(stdout, "\t%.*s = %s\n", (int)len, (const char *)key, v.number ? "true" : "false");
+		else if (v.type == AMF_STRING || v.type == AMF_LONG_STRING)
+			logger_Printf(stdout, "\t%.*s = \"%.*s\"\n", (int)len, (const char *)key, (int)v.len, (const char *)v.str);
+	}
+}
+
+// Congestion control
+//  When the socket backlog amounts to more media time than the latency
+//  budget, non-keyframe video is dropped up to the next keyframe.  Audio,
+//  script tags, sequence headers and keyframes always go out: a short video
+//  stutter beats falling minutes behind.
+struct congestion {
+	unsigned long budget;	// ms of queued media allowed, 0 = off
+	double rate;	// stream bytes per ms of media, measured about every second
+	int measuring;
+	uint32_t windowStart;
+	unsigned long windowBytes;
+	int dropping;	// until the next keyframe
+
+	// decisions, for the summary
+	unsigned long events, dropped, droppedBytes, protected;
+};
+
+// Decide whether a tag goes out.  Returns 0 to drop it.
+static int congestion_Pass(struct congestion * const cc, struct rtmpout * const out, const struct flv_tag_header * const h, const uint8_t * const payload)
+{
+	const uint32_t size = 11 + h->size + 4;
+
+	// the stream's own bitrate, from its timestamps, turns a backlog in
+	//  bytes into how far behind live it leaves the viewer
+	if (! cc->measuring || h->timestamp < cc->windowStart) {
+		cc->measuring = 1;
+		cc->windowStart = h->timestamp;
+		cc->windowBytes = 0;
+	}
+
+	cc->windowBytes += size;
+
+	if (h->timestamp - cc->windowStart >= 1000) {
+		const double rate = (double)cc->windowBytes / (h->timestamp - cc->windowStart);
+		cc->rate = (cc->rate > 0 ? (cc->rate + rate) / 2 : rate);
+		cc->windowStart = h->timestamp;
+		cc->windowBytes = 0;
+	}
+
+	const long backlog = rtmpout_Backlog(out);
+
+	// can't tell yet (or at all): send everything
+	if (backlog < 0 || cc->rate <= 0)
+		return 1;
+
+	const unsigned long delay = backlog / cc->rate;
+	const int over = (delay > cc->budget);
+	metrics_Set(METRIC_SOCKET_BACKLOG, backlog);
+	metrics_Set(METRIC_QUEUE_DELAY, delay);
+
+	// protected tags, and keyframes, which also end a run of drops
+	if (h->type != FLV_TAG_VIDEO || flv_IsSequenceHeader(h->type, payload, h->size) || flv_IsKeyframe(payload, h->size)) {
+		if (h->type == FLV_TAG_VIDEO && ! flv_IsSequenceHeader(h->type, payload, h->size))
+			cc->dropping = 0;
+
+		if (over) {
+			cc->protected ++;
+			metrics_Add(METRIC_CONGESTION_PROTECTED_TAGS, 1);
+		}
+
+		return 1;
+	}
+
+	// once a frame is gone, the rest of its GOP can't be decoded either
+	if (! cc->dropping && over) {
+		cc->dropping = 1;
+		cc->events ++;
+		metrics_Add(METRIC_CONGESTION_EVENTS, 1);
+		logger_Printf(stderr, "Over latency budget (%lu ms queued), dropping video until the next keyframe\n", delay);
+	}
+
+	if (cc->dropping) {
+		cc->dropped ++;
+		cc->droppedBytes += size;
+		metrics_Add(METRIC_CONGESTION_DROPPED_TAGS, 1);
+		metrics_Add(METRIC_CONGESTION_DROPPED_BYTES, size);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Bitrate shaping
+//  A token bucket, filled at the peak rate and holding SHAPER_DEPTH ms of it,
+//  holds tags back so the stream never runs above the peak for longer than
+//  that.  Where the kernel paces TCP, each tag's bytes are also spread over
+//  the time until the next tag is due, along with whatever is still queued,
+//  at no more than the peak, rather than leaving at line rate.  While waiting
+//  between tags, how fast the socket actually drains is sampled every
+//  SHAPER_SAMPLE, for a histogram against the peak.
+#define SHAPER_DEPTH 100
+#define SHAPER_SAMPLE 1000000
+#define SHAPER_BUCKETS 8
+
+// histogram bucket upper bounds, in % of the peak rate
+static const unsigned int shaper_bounds[SHAPER_BUCKETS] = { 25, 50, 75, 100, 125, 150, 200, 400 };
+
+struct shaper {
+	uint64_t peak;	// bytes per second, 0 = off
+	int paced;	// the kernel is pacing the socket
+	uint32_t interval;	// ms, the last step between tag timestamps
+	int started;
+	uint32_t lastTimestamp;
+
+	// token bucket, in bytes
+	double tokens;
+	uint64_t filled;	// ns, when it was last topped up
+
+	// socket drain sampling
+	long backlog;
+	uint64_t sampled;	// ns
+
+	// for the summary
+	unsigned long held;
+	uint64_t heldTime;	// ns
+	unsigned long samples, rates[SHAPER_BUCKETS + 1];
+	uint64_t maxRate;
+};
+
+static void shaper_Refill(struct shaper * const s, const uint64_t now)
+{
+	const double depth = (double)s->peak * SHAPER_DEPTH / 1000;
+
+	s->tokens += (double)s->peak * (now - s->filled) / 1000000000;
+	if (s->tokens > depth)
+		s->tokens = depth;
+	s->filled = now;
+}
+
+// How fast the backlog went down since the last sample, if it did
+static void shaper_Sample(struct shaper * const s, struct rtmpout * const out, const uint64_t now)
+{
+	const long backlog = rtmpout_Backlog(out);
+
+	if (backlog >= 0 && s->backlog > backlog && now > s->sampled) {
+		const uint64_t rate = (uint64_t)(s->backlog - backlog) * 1000000000 / (now - s->sampled);
+		const uint64_t percent = rate * 100 / s->peak;
+		unsigned int i = 0;
+
+		while (i < SHAPER_BUCKETS && percent > shaper_bounds[i])
+			i ++;
+
+		s->samples ++;
+		s->rates[i] ++;
+		if (rate > s->maxRate)
+			s->maxRate = rate;
+
+		metrics_Set(METRIC_SEND_RATE, rate);
+	}
+
+	s->backlog = backlog;
+	s->sampled = now;
+}
+
+// Sleep until deadline, sampling the socket on the way
+//  Virtual time has no socket draining to watch, so it just sleeps.
+//  Returns 0 if a signal cut the sleep short.
+static int shaper_Sleep(struct shaper * const s, struct rtmpout * const out, const uint64_t deadline)
+{
+	if (vclock_IsVirtual())
+		return vclock_Sleep(deadline);
+
+	uint64_t now = vclock_Now();
+
+	while (now < deadline) {
+		if (! vclock_Sleep(deadline - now > SHAPER_SAMPLE ? now + SHAPER_SAMPLE : deadline))
+			return 0;
+
+		now = vclock_Now();
+		shaper_Sample(s, out, now);
+	}
+
+	return 1;
+}
+
+static void shaper_Init(struct shaper * const s, struct rtmpout * const out)
+{
+	s->interval = 40;
+	s->filled = s->sampled = vclock_Now();
+	s->tokens = (double)s->peak * SHAPER_DEPTH / 1000;
+	s->backlog = rtmpout_Backlog(out);
+	s->paced = rtmpout_Pace(out, s->peak);
+}
+
+// Wait for the tokens to send a tag, then set the pace it goes out at
+//  Returns 0 if a signal cut the wait short.
+static int shaper_Admit(struct shaper * const s, struct rtmpout * const out, const struct flv_tag_header * const h)
+{
+	const uint32_t size = 11 + h->size + 4;
+	const double depth = (double)s->peak * SHAPER_DEPTH / 1000;
+	// a tag bigger than the bucket waits for a full one, and leaves it in debt
+	const double need = (size < depth ? size : depth);
+	uint64_t now = vclock_Now();
+
+	shaper_Refill(s, now);
+
+	if (s->tokens < need) {
+		const uint64_t ready = now + (uint64_t)((need - s->tokens) * 1000000000 / s->peak);
+
+		s->held ++;
+		s->heldTime += ready - now;
+		metrics_Add(METRIC_SHAPER_HELD_TAGS, 1);
+
+		if (! shaper_Sleep(s, out, ready))
+			return 0;
+
+		now = vclock_Now();
+		shaper_Refill(s, now);
+	}
+
+	s->tokens -= size;
+
+	// the time to the next tag, from the step between the last two
+	if (s->started && h->timestamp != s->lastTimestamp && (int32_t)(h->timestamp - s->lastTimestamp) > 0)
+		s->interval = h->timestamp - s->lastTimestamp;
+	s->started = 1;
+	s->lastTimestamp = h->timestamp;
+
+	// everything queued should be out by then, at no more than the peak
+	if (s->paced) {
+		const long backlog = rtmpout_Backlog(out);
+		uint64_t rate = ((uint64_t)(backlog > 0 ? backlog : 0) + size) * 1000 / s->interval;
+
+		if (rate > s->peak)
+			rate = s->peak;
+
+		rtmpout_Pace(out, rate);
+	}
+
+	return 1;
+}
+
+// A tag has been written: the backlog it adds isn't draining
+static void shaper_Wrote(struct shaper * const s, struct rtmpout * const out)
+{
+	s->backlog = rtmpout_Backlog(out);
+	s->sampled = vclock_Now();
+}
+
+static void shaper_Report(const struct shaper * const s)
+{
+	printf("Shaper: peak %llu kbit/s, %s, %lu tags held %.3f s in all\n",
+		(unsigned long long)s->peak * 8 / 1000, (s->paced ? "kernel pacing" : "token bucket only"),
+		s->held, s->heldTime / 1e9);
+
+	if (s->samples == 0) {
+		puts("\tno send rate samples (the socket backlog can't be read, or the clock is virtual)");
+		return;
+	}
+
+	// how fast the socket drained, in each millisecond that it did
+	printf("\tsend rate, per %.1f ms sample while draining (peak seen %llu kbit/s):\n",
+		SHAPER_SAMPLE / 1e6, (unsigned long long)s->maxRate * 8 / 1000);
+
+	unsigned long seen = 0;
+
+	for (unsigned int i = 0; i <= SHAPER_BUCKETS; i ++) {
+		if (s->rates[i] == 0)
+			continue;
+
+		seen += s->rates[i];
+
+		if (i < SHAPER_BUCKETS)
+			printf("\t<= %3u%% of peak: %8lu (%5.1f%%)\n", shaper_bounds[i], s->rates[i], 100.0 * seen / s->samples);
+		else
+			printf("\t>  %3u%% of peak: %8lu (%5.1f%%)\n", shaper_bounds[i - 1], s->rates[i], 100.0 * seen / s->samples);
+	}
+}
+
+// read() family system calls made by the process so far, from /proc/self/io
+//  (io_uring reads don't count here), or 0 where that isn't available
+static unsigned long read_syscalls(void)
 {
-	return *p << 16 | *(p + 1) << 8 | *(p + 2);
+	unsigned long syscr = 0;
+	char line[64];
+	FILE * const f = fopen("/proc/self/io", "r");
+
+	if (f == NULL)
+		return 0;
+
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "syscr: %lu", &syscr) == 1)
+			break;
+
+	fclose(f);
+	return syscr;
 }
-//  parse 32 bits to an unsigned long
-static unsigned long u32be(const unsigned char * const p)
+
+// process CPU time, user and system, in us
+static uint64_t cpu_time(void)
 {
-	return *p << 24 | *(p + 1) << 16 | *(p + 2) << 8 | *(p + 3);
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
 }
 
 // Flag to indicate whether we should keep playing the movie
@@ -45,17 +391,83 @@ int main(int argc, char * argv[])
 {
 	int ret = EXIT_SUCCESS;
 
+	const char * metricsAddress = NULL;
+	int sendBuffer = 0;
+	struct congestion cc = { 0 };
+	struct shaper shaper = { 0 };
+	int useUring = 1;
+	struct flvfilter filter;
+
+	flvfilter_Init(&filter);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "m:l:d:P:TSx:M:o:s:")) != -1) {
+		switch (opt) {
+		case 'm':
+			metricsAddress = optarg;
+			break;
+		case 'l':
+			sendBuffer = atoi(optarg) * 1024;
+			break;
+		case 'd':
+			cc.budget = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			shaper.peak = strtoull(optarg, NULL, 10) * 1000 / 8;
+			break;
+		case 'T':
+			vclock_Virtual();
+			break;
+		case 'S':
+			useUring = 0;
+			break;
+		case 'x':
+			if (! flvfilter_Drop(&filter, optarg))
+				optind = argc;
+			break;
+		case 'M':
+			if (! flvfilter_Set(&filter, optarg))
+				optind = argc;
+			break;
+		case 'o':
+			filter.offset = strtoll(optarg, NULL, 10);
+			break;
+		case 's':
+			filter.speed = strtod(optarg, NULL);
+			if (! (filter.speed > 0))
+				optind = argc;
+			break;
+		default:
+			optind = argc;
+		}
+	}
+
 	// verify two parameters passed
-	if (argc != 3) {
-		printf("RTMP example code\nUsage:\n\t%s <INPUT.FLV> <URL>\n", argv[0]);
+	if (argc - optind != 2) {
+		printf("RTMP example code\nUsage:\n\t%s [-m metrics_address] [-l kb] [-d budget_ms] [-P kbit/s] [-T] [-S] [-x avs] [-M key=value] [-o offset_ms] [-s speed] <INPUT.FLV|INPUT.MP4> <URL>\n"
+			"Options:\n\t-m\tserve Prometheus metrics on [host:]port or a Unix socket path\n"
+			"\t-l\tlow-latency mode, with a send buffer of this many KB: also measures RTT and send latency\n"
+			"\t-d\tlatency budget: drop video up to the next keyframe when more than this is queued\n"
+			"\t-P\tpeak bitrate: hold tags back, and pace the socket, to keep under it\n"
+			"\t-T\trun on a virtual clock: send as fast as the server takes it, instead of in real time\n"
+			"\t-S\tread the file and poll the socket with ordinary system calls, instead of io_uring\n"
+			"\t-x\tdrop tags by type: a(udio), v(ideo) and / or s(cript data)\n"
+			"\t-M\tset an onMetaData property (repeatable), or remove it with key=\n"
+			"\t-o\tadd this many ms to every timestamp (may be negative)\n"
+			"\t-s\tdivide timestamps by this, e.g. 2 for double speed\n", argv[0]);
+		goto exit;
+	}
+
+	if (metricsAddress && ! metrics_Listen("rtmpcast", metricsAddress)) {
+		ret = EXIT_FAILURE;
 		goto exit;
 	}
 
 	/* *************************************************** */
 	// allocate a very large buffer for all packets and operations
-	unsigned char * tag = malloc(MAX_TAG_SIZE);
+	uint8_t * buffer = malloc(MAX_TAG_SIZE);
 
-	if (tag == NULL) {
+	if (buffer == NULL) {
 		perror("Failed to allocate tag buffer");
 		ret = EXIT_FAILURE;
 		goto exit;
@@ -63,69 +475,101 @@ int main(int argc, char * argv[])
 
 	/* *************************************************** */
 	// Let's open an FLV now
-	FILE * flv = fopen(argv[1], "rb");
+	FILE * flv = fopen(argv[optind], "rb");
 
 	if (flv == NULL) {
 		perror("Failed to open flv");
 		ret = EXIT_FAILURE;
-		goto freeTag;
+		goto freeBuffer;
 	}
 
-	// make sure it's supported FLV
-	fread(tag, 9, 1, flv);
+	// make sure it's supported FLV, or else MP4
+	uint8_t flvFlags;
+	unsigned long flvStartTag = 0;
+	int isMP4 = 0;
+	struct mp4read movie = { 0 };
 
-	if (u32be(tag) != 0x464C5601) {
-		fputs("Does not appear to be valid FLV1 file\n", stderr);
-		ret = EXIT_FAILURE;
-		goto closeFLV;
+	if (fread(buffer, FLV_HEADER_SIZE, 1, flv) == 1) {
+		flvStartTag = flv_ParseHeader(buffer, &flvFlags);
+		isMP4 = (flvStartTag == 0 && mp4read_Probe(buffer, FLV_HEADER_SIZE));
 	}
 
-	if (tag[4] & 0x01)
-		puts("FLV contains VIDEO");
+	if (isMP4) {
+		// only the sample tables are read before streaming starts
+		const uint64_t indexStart = metrics_Now();
+
+		if (! mp4read_Open(&movie, flv)) {
+			ret = EXIT_FAILURE;
+			goto closeFLV;
+		}
 
-	if (tag[4] & 0x04)
-		puts("FLV contains AUDIO");
+		if (movie.video.type)
+			printf("MP4 contains VIDEO (H.264, %u samples)\n", movie.video.count);
 
-	unsigned long flvStartTag = u32be(tag + 5);
-	printf("FLV file start offset is %lu\n", flvStartTag);
+		if (movie.audio.type)
+			printf("MP4 contains AUDIO (AAC, %u samples)\n", movie.audio.count);
+
+		printf("MP4 sample index built in %.3f ms\n", (metrics_Now() - indexStart) / 1000.0);
+	} else if (flvStartTag == 0) {
+		fputs("Does not appear to be valid FLV1 or MP4 file\n", stderr);
+		ret = EXIT_FAILURE;
+		goto closeFLV;
+	} else {
+		if (flvFlags & FLV_FLAG_VIDEO)
+			puts("FLV contains VIDEO");
+
+		if (flvFlags & FLV_FLAG_AUDIO)
+			puts("FLV contains AUDIO");
+
+		printf("FLV file start offset is %lu\n", flvStartTag - 4);
+	}
 
 	/* *************************************************** */
 	// Increase the log level for all RTMP actions
+	//  librtmp's messages, and everything from here on, are written out by
+	//  the logger thread, not this one
 	RTMP_LogSetLevel(RTMP_LOGINFO);
-	RTMP_LogSetOutput(stderr);
+	RTMP_LogSetCallback(logger_RTMP);
+	logger_Start();
 
 	/* *************************************************** */
-	// Init RTMP code
-	RTMP * r = RTMP_Alloc();
-	RTMP_Init(r);
+	// Init RTMP code and connect
+	//  if the connection drops later, rtmpout reconnects and resumes
+	//  at the next keyframe in the file
+	struct rtmpout out;
 
-	if (r == NULL) {
-		fputs("Failed to create RTMP object\n", stderr);
+	if (! rtmpout_Open(&out, argv[optind + 1], sendBuffer)) {
 		ret = EXIT_FAILURE;
-		goto closeFLV;
+		goto stopLogger;
 	}
 
-	RTMP_SetupURL(r, argv[2]);
-	RTMP_EnableWrite(r);
+	// io_uring, if asked for and the kernel has it, for the file reads
+	//  and for noticing packets from the server
+	//  (MP4 samples are read from the mapping instead)
+	struct flvread reader;
 
-	// Make RTMP connection to server
-	if (! RTMP_Connect(r, NULL)) {
-		fputs("Failed to connect to remote RTMP server\n", stderr);
+	if (! isMP4 && ! flvread_Open(&reader, flv, flvStartTag, useUring)) {
 		ret = EXIT_FAILURE;
-		goto freeRTMP;
+		goto closeOut;
 	}
 
-	// Connect to RTMP stream
-	if (! RTMP_ConnectStream(r, 0)) {
-		fputs("Failed to connect to RTMP stream\n", stderr);
-		ret = EXIT_FAILURE;
-		goto freeRTMP;
+	//  (a kernel too old for its plain reads leaves flvread on stdio)
+	const int pollRing = (useUring && rtmpout_Uring(&out));
+
+	if (pollRing && (isMP4 || flvread_Uring(&reader)))
+		puts(isMP4 ? "Using io_uring for socket polling" : "Using io_uring for file reads and socket polling");
+	else if (pollRing)
+		puts("Using io_uring for socket polling, and ordinary reads for the file");
+	else if (useUring)
+		puts("io_uring is not available, using ordinary system calls");
+
+	// shaping starts with a full bucket, and kernel pacing at the peak
+	if (shaper.peak) {
+		shaper_Init(&shaper, &out);
+		printf("Shaping to %llu kbit/s%s\n", (unsigned long long)shaper.peak * 8 / 1000,
+			(shaper.paced ? ", with kernel TCP pacing" : ""));
 	}
 
-	// track the fd for rtmp
-	int fd = RTMP_Socket(r);
-	struct timeval tv = {0, 0};
-
 	// Let's install some signal handlers for a graceful exit
 	running = 1;
 	signal(SIGTERM, sig_handler);
@@ -135,99 +579,161 @@ int main(int argc, char * argv[])
 
 	/* *************************************************** */
 	// Ready to start throwing frames at the streamer
-	fseek(flv, flvStartTag + 4, SEEK_SET);
-	unsigned long prevTimestamp = 0;
+	// tags are paced against the clock, from the first one
+	//  timestamps are summed into ms elapsed, so pacing carries on past the
+	//  32-bit wrap, and a tag a little behind the last just goes at once
+	const uint64_t start = vclock_Now();
+	int started = 0;
+	uint32_t lastTimestamp = 0;
+	uint64_t elapsed = 0;
+
+	// system calls and CPU spent, for the report at the end
+	unsigned long tags = 0;
+	uint64_t position = flvStartTag;
+	const unsigned long startReads = read_syscalls();
+	const uint64_t startCpu = cpu_time(), startWall = metrics_Now();
 
 	while (running) {
-		// read current block
-		if (11 != fread(tag, 1, 11, flv)) {
-			// failed to read next tag - probably end-of-file.
-			if (feof(flv))
-				running = 0;
-			else {
-				perror("Short read looking for next tag header");
-				ret = EXIT_FAILURE;
-				goto restoreSig;
-			}
+		// read current tag: header, payload and the 4-byte tag length at the end
+		struct flv_tag_header header;
+		uint8_t * tag;
+		const int got = (isMP4 ?
+			mp4read_Next(&movie, buffer, &tag, &header) :
+			flvread_Next(&reader, buffer, &tag, &header));
+
+		if (got < 0) {
+			ret = EXIT_FAILURE;
+			goto restoreSig;
+		} else if (got == 0) {
+			// end-of-file.
+			running = 0;
 		} else {
-			// Successfully got header.  Parse it.
-			unsigned char payloadType = tag[0];
-			unsigned long payloadSize = u24be(tag + 1);
-			unsigned long timestamp = u24be(tag + 4) | (tag[7] << 24);
-
-			unsigned long streamId = u24be(tag + 8);
+			// Successfully got a tag.
+			unsigned char payloadType = header.type;
+			unsigned long payloadSize = header.size;
+			unsigned long timestamp = header.timestamp;
 
 			if (DEBUG)
-				printf("Position %lu, Type %hhu, Size %lu, Timestamp %lu, Stream %lu\n", ftell(flv), payloadType, payloadSize, timestamp, streamId);
+				LOGGER_EVERY(1000, stdout, "Position %llu, Type %hhu, Size %lu, Timestamp %lu, Stream %lu\n", (unsigned long long)position + 11, payloadType, payloadSize, timestamp, (unsigned long)header.stream_id);
 
-			// Read the rest of the payload.
-			if (payloadSize != fread(tag + 11, 1, payloadSize, flv)) {
-				perror("Short read trying to get payload");
-				ret = EXIT_FAILURE;
-				goto restoreSig;
-			}
+			position += 11 + payloadSize + 4;
+			tags ++;
 
-			// Remember the 4-byte tag length at the end.
-			//  (This could be folded into the previous call, but for clarity...)
-			if (4 != fread(tag + 11 + payloadSize, 1, 4, flv)) {
-				perror("Short read trying to get tag size");
+			// Double-check that we got our tag size right
+			if (! flv_CheckTrailer(tag, &header)) {
+				logger_Printf(stderr, "Read tag size %lu does not match calculated tag size %lu\n", (unsigned long)parse_u32be(tag + 11 + payloadSize), 11 + payloadSize);
 				ret = EXIT_FAILURE;
 				goto restoreSig;
 			}
 
-			// Double-check that we got our tag size right
-			if (u32be(tag + (11 + payloadSize)) != 11 + payloadSize) {
-				fprintf(stderr, "Read tag size %lu does not match calculated tag size %lu\n", u32be(tag + 11 + payloadSize), 11 + payloadSize);
-				ret = EXIT_FAILURE;
-				goto restoreSig;
+			// Drop, retime or rewrite it, editing the tag where it is
+			if (flvfilter_Active(&filter)) {
+				uint32_t size;
+				const uint8_t * const meta = flvfilter_Inject(&filter, tag, &header, &size);
+
+				if (meta) {
+					print_metadata(meta + 11, meta + size - 4);
+
+					if (! rtmpout_Write(&out, meta, size)) {
+						logger_Printf(stderr, "Failed to RTMP_Write\n");
+						ret = EXIT_FAILURE;
+						goto restoreSig;
+					}
+				}
+
+				size = 11 + payloadSize + 4;
+				tag = flvfilter_Tag(&filter, tag, &header, &size);
+
+				if (tag == NULL)
+					continue;
+
+				payloadType = header.type;
+				payloadSize = header.size;
+				timestamp = header.timestamp;
 			}
 
-			// Toss into RTMP
-			//  cast to char* avoids a warning
-			if (RTMP_Write(r, (const char *)tag, 11 + payloadSize + 4) <= 0) {
-				fputs("Failed to RTMP_Write\n", stderr);
-				ret = EXIT_FAILURE;
-				goto restoreSig;
+			// Show the stream properties as they go by
+			if (payloadType == FLV_TAG_SCRIPT)
+				print_metadata(tag + 11, tag + 11 + payloadSize);
+
+			// Toss into RTMP, unless the uplink is too far behind, once the
+			//  shaper lets it go
+			if (cc.budget == 0 || congestion_Pass(&cc, &out, &header, tag + 11)) {
+				if (shaper.peak && ! shaper_Admit(&shaper, &out, &header))
+					continue;
+
+				if (! rtmpout_Write(&out, tag, 11 + payloadSize + 4)) {
+					logger_Printf(stderr, "Failed to RTMP_Write\n");
+					ret = EXIT_FAILURE;
+					goto restoreSig;
+				}
+
+				if (shaper.peak)
+					shaper_Wrote(&shaper, &out);
 			}
 
 			// Handle any packets from the remote to us.
-			//  We will use select() to see if packet is waiting,
-			//  then read it and dispatch to the handler.
-			fd_set set;
-			FD_ZERO(&set);
-			FD_SET(fd, &set);
-
-			if (select(fd + 1, &set, NULL, NULL, &tv) == -1) {
-				perror("Error calling select()");
+			if (! rtmpout_Poll(&out)) {
 				ret = EXIT_FAILURE;
 				goto restoreSig;
 			}
 
-			// socket is present in read-ready set, safe to call RTMP_ReadPacket
-			if (FD_ISSET(fd, &set)) {
-				RTMPPacket packet = { 0 };
+			// delay
+			//  this is to avoid sending too many frames to the RTMP server,
+			//  overwhelming it: each tag waits until its timestamp comes
+			//  around, measured from the first
+			if (! started) {
+				started = 1;
+				lastTimestamp = timestamp;
+			}
+
+			const int32_t step = (int32_t)((uint32_t)timestamp - lastTimestamp);
 
-				if (RTMP_ReadPacket(r, &packet) && RTMPPacket_IsReady(&packet)) {
-					// this function does all the internal stuff we need
-					RTMP_ClientPacket(r, &packet);
-					RTMPPacket_Free(&packet);
-				}
+			if (step > 0) {
+				elapsed += step;
+				lastTimestamp = timestamp;
 			}
 
-			// delay
-			//  this is to avoid sending too many frames to the RTMP server,
-			//  overwhelming it.  this isn't the most accurate way to do it
-			//  but with server buffering it works OK.
-			if (prevTimestamp < timestamp) {
+			const uint64_t due = start + elapsed * 1000000;
+			const uint64_t now = vclock_Now();
+
+			if (due > now) {
 				if (DEBUG)
-					printf("Sleeping %lu milliseconds\n", timestamp - prevTimestamp);
+					LOGGER_EVERY(1000, stdout, "Sleeping %llu microseconds\n", (unsigned long long)(due - now) / 1000);
 
-				usleep(timestamp - prevTimestamp);
-				prevTimestamp = timestamp;
+				if (shaper.peak)
+					shaper_Sleep(&shaper, &out, due);
+				else
+					vclock_Sleep(due);
 			}
 		}
 	}
 
+	logger_Stop();
+
+	if (flvfilter_Active(&filter))
+		flvfilter_Report(&filter, stdout);
+
+	if (shaper.peak)
+		shaper_Report(&shaper);
+
+	if (cc.budget)
+		printf("Congestion: over budget %lu times, dropped %lu video tags (%lu bytes), sent %lu audio / script / keyframe tags over budget\n",
+			cc.events, cc.dropped, cc.droppedBytes, cc.protected);
+
+	// what the send loop cost: io_uring should bring the file reads down to
+	//  one call per block, and the socket checks to one per packet received
+	if (tags) {
+		const unsigned long reads = read_syscalls() - startReads;
+		const uint64_t cpu = cpu_time() - startCpu, wall = metrics_Now() - startWall;
+
+		printf("I/O (%s): %lu tags, per tag %.3f read() + %.3f io_uring_enter file reads, %.3f socket polls\n",
+			(isMP4 ? "mmap" : flvread_Uring(&reader) ? "io_uring" : "system calls"), tags,
+			(double)reads / tags, (isMP4 ? 0.0 : (double)reader.reads / tags), (double)out.polls / tags);
+		printf("CPU: %.1f us per tag, %.1f%% of a core\n",
+			(double)cpu / tags, (wall ? 100.0 * cpu / wall : 0.0));
+	}
+
 	/* *************************************************** */
 	// CLEANUP CODE
 	// restore signal handlers
@@ -237,12 +743,19 @@ restoreSig:
 	signal(SIGQUIT, SIG_DFL);
 	signal(SIGHUP, SIG_DFL);
 	// Shut down
-freeRTMP:
-	RTMP_Free(r);
+	if (! isMP4)
+		flvread_Close(&reader);
+closeOut:
+	rtmpout_Close(&out);
+stopLogger:
+	// the writer thread has the last messages, including why the connect failed
+	logger_Stop();
 closeFLV:
+	mp4read_Close(&movie);
 	fclose(flv);
-freeTag:
-	free(tag);
+freeBuffer:
+	free(buffer);
 exit:
+	flvfilter_Close(&filter);
 	return ret;
 }
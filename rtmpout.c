@@ -0,0 +1,744 @@
+/* ***************************************************
+rtmpout: RTMP publishing with automatic reconnect
+Greg Kennedy 2021
+*************************************************** */
+#include "rtmpout.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+
+#include <poll.h>
+
+// FLV tag parsing
+#include "flv.h"
+// runtime statistics
+#include "metrics.h"
+// messages, written out off the streaming thread
+#include "logger.h"
+
+// reconnect backoff: the first retry is immediate, then this doubles up to the max
+#define BACKOFF_MIN 100
+#define BACKOFF_MAX 5000
+// a connection lost sooner than this (us) after it was made keeps backing off,
+//  so a server that accepts and then drops us isn't redialled on every tag
+#define STABLE_AFTER 10000000
+
+// socket timeout (seconds), so a dead server can't hold us for librtmp's default 30
+#define TIMEOUT 5
+
+// low-latency mode: unsent data the kernel may hold beyond the send buffer
+//  proper, and how often to ping (us)
+#define NOTSENT_LOWAT 16384
+#define PING_INTERVAL 1000000
+
+// User Control events, and the size librtmp sends a ping request in
+#define UC_PING_REQUEST 6
+#define UC_PING_RESPONSE 7
+#define PING_WIRE_SIZE 10
+
+// user data for the poll ring's requests
+#define POLL_USER 1
+#define CANCEL_USER 2
+
+/* ************************************************************************ */
+// Low-latency socket options
+//  librtmp already sets TCP_NODELAY, but it costs nothing to be sure.  A small
+//  send buffer keeps queued data (and so delay) down, and TCP_NOTSENT_LOWAT
+//  keeps the kernel from holding much more than is actually in flight.
+static void rtmpout_Tune(struct rtmpout * const o)
+{
+	const int fd = RTMP_Socket(o->r);
+	const int one = 1;
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0)
+		logger_Printf(stderr, "Failed to set TCP_NODELAY: %s\n", strerror(errno));
+
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &o->sendBuffer, sizeof(o->sendBuffer)) != 0)
+		logger_Printf(stderr, "Failed to set SO_SNDBUF: %s\n", strerror(errno));
+
+#ifdef TCP_NOTSENT_LOWAT
+	const int lowat = NOTSENT_LOWAT;
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) != 0)
+		logger_Printf(stderr, "Failed to set TCP_NOTSENT_LOWAT: %s\n", strerror(errno));
+#endif
+}
+
+// Which header slot a tag belongs in, or -1 if it is not one
+static int rtmpout_HeaderSlot(const struct flv_tag_header * const h, const uint8_t * const payload)
+{
+	if (h->type == FLV_TAG_SCRIPT) {
+		struct amf_value v;
+
+		if (amf_Decode(payload, payload + h->size, &v) != NULL && v.type == AMF_STRING &&
+			v.len == 10 && memcmp(v.str, "onMetaData", 10) == 0)
+			return RTMPOUT_METADATA;
+	} else if (flv_IsSequenceHeader(h->type, payload, h->size))
+		return (h->type == FLV_TAG_VIDEO ? RTMPOUT_VIDEO_CONFIG : RTMPOUT_AUDIO_CONFIG);
+
+	return -1;
+}
+
+// Bytes librtmp puts on the wire for one tag, since the server acknowledges
+//  those and not tag bytes.  This mirrors the header compression in
+//  RTMP_SendPacket: media on one chunk stream, a full 12 byte header for
+//  metadata and timestamp 0, else 8 bytes, 4 when the size and type repeat,
+//  and 1 when the timestamp does too.  Every chunk after the first costs a
+//  byte, plus the extended timestamp if there is one.
+static uint32_t rtmpout_WireSize(struct rtmpout * const o, const struct flv_tag_header * const h)
+{
+	// librtmp prefixes every script tag (onMetaData, onFI, ...) with the
+	//  "@setDataFrame" string
+	const uint32_t body = h->size + (h->type == FLV_TAG_SCRIPT ? 16 : 0);
+	uint32_t header = 12, delta = h->timestamp;
+
+	if (o->haveLast && h->type != FLV_TAG_SCRIPT && h->timestamp != 0) {
+		header = 8;
+		delta = h->timestamp - o->lastTimestamp;
+
+		if (body == o->lastSize && h->type == o->lastType) {
+			header = 4;
+			if (delta == 0)
+				header = 1;
+		}
+	}
+
+	o->haveLast = 1;
+	o->lastType = h->type;
+	o->lastSize = body;
+	o->lastTimestamp = h->timestamp;
+
+	const uint32_t extended = (delta >= 0xFFFFFF ? 4 : 0);
+	const uint32_t chunkSize = (o->r->m_outChunkSize > 0 ? o->r->m_outChunkSize : 128);
+	const uint32_t chunks = (body ? (body + chunkSize - 1) / chunkSize : 1);
+
+	return header + extended + body + (chunks - 1) * (1 + extended);
+}
+
+// Sent and not yet acknowledged, which the estimate can undershoot slightly
+static uint32_t rtmpout_Unacked(const struct rtmpout * const o)
+{
+	return ((int32_t)(o->bytesSent - o->bytesAcked) > 0 ? o->bytesSent - o->bytesAcked : 0);
+}
+
+// Remember when the bytes of a write went out
+static void rtmpout_Sent(struct rtmpout * const o, const uint32_t bytes)
+{
+	o->bytesSent += bytes;
+
+	o->sent[o->sentHead].bytes = o->bytesSent;
+	o->sent[o->sentHead].time = metrics_Now();
+	o->sentHead = (o->sentHead + 1) % RTMPOUT_SENT_HISTORY;
+
+	// full: forget the oldest
+	if (o->sentHead == o->sentTail)
+		o->sentTail = (o->sentTail + 1) % RTMPOUT_SENT_HISTORY;
+
+	metrics_Set(METRIC_UNACKED_BYTES, rtmpout_Unacked(o));
+}
+
+// The server has received everything up to sequence number "acked":
+//  the write that carried that byte tells us how long it took to get there
+static void rtmpout_Acked(struct rtmpout * const o, const uint32_t acked)
+{
+	o->bytesAcked = acked;
+
+	// skip writes entirely covered by the acknowledgement
+	while (o->sentTail != o->sentHead && (int32_t)(o->sent[o->sentTail].bytes - acked) < 0)
+		o->sentTail = (o->sentTail + 1) % RTMPOUT_SENT_HISTORY;
+
+	if (o->sentTail != o->sentHead) {
+		const uint64_t latency = metrics_Now() - o->sent[o->sentTail].time;
+		metrics_Set(METRIC_SEND_LATENCY, latency / 1000);
+		metrics_Observe(METRIC_SEND_LATENCY_TIME, latency);
+	}
+
+	metrics_Set(METRIC_UNACKED_BYTES, rtmpout_Unacked(o));
+}
+
+// Look at what the server sent, before librtmp handles it as usual
+static void rtmpout_Inspect(struct rtmpout * const o, const RTMPPacket * const packet)
+{
+	const uint8_t * const body = (const uint8_t *)packet->m_body;
+
+	if (packet->m_packetType == RTMP_PACKET_TYPE_BYTES_READ_REPORT && packet->m_nBodySize >= 4)
+		rtmpout_Acked(o, parse_u32be(body));
+	else if (packet->m_packetType == RTMP_PACKET_TYPE_CONTROL && packet->m_nBodySize >= 6 &&
+		parse_u16be(body) == UC_PING_RESPONSE) {
+		// the response echoes our timestamp, in ms
+		const uint32_t rtt = (uint32_t)(metrics_Now() / 1000) - parse_u32be(body + 2);
+		metrics_Set(METRIC_RTT, rtt);
+		metrics_Observe(METRIC_RTT_TIME, (uint64_t)rtt * 1000);
+	}
+
+	metrics_Set(METRIC_ACK_WINDOW, o->r->m_nServerBW);
+}
+
+static int rtmpout_Connect(struct rtmpout * const o)
+{
+	o->r = RTMP_Alloc();
+
+	if (o->r == NULL) {
+		logger_Printf(stderr, "Failed to create RTMP object\n");
+		return 0;
+	}
+
+	RTMP_Init(o->r);
+	o->r->Link.timeout = TIMEOUT;
+
+	free(o->urlCopy);
+	o->urlCopy = strdup(o->url);
+
+	if (o->urlCopy == NULL || ! RTMP_SetupURL(o->r, o->urlCopy)) {
+		logger_Printf(stderr, "Failed to parse RTMP URL\n");
+		goto fail;
+	}
+
+	RTMP_EnableWrite(o->r);
+
+	// Make RTMP connection to server
+	if (! RTMP_Connect(o->r, NULL)) {
+		logger_Printf(stderr, "Failed to connect to remote RTMP server\n");
+		goto fail;
+	}
+
+	// Connect to RTMP stream
+	if (! RTMP_ConnectStream(o->r, 0)) {
+		logger_Printf(stderr, "Failed to connect to RTMP stream\n");
+		goto fail;
+	}
+
+	if (o->sendBuffer)
+		rtmpout_Tune(o);
+
+	// fresh connection: nothing sent, and no header state on the server
+	o->connectedAt = metrics_Now();
+	o->bytesSent = o->bytesAcked = 0;
+	o->sentHead = o->sentTail = 0;
+	o->haveLast = 0;
+	o->nextPing = 0;
+
+	o->connected = 1;
+	return 1;
+
+fail:
+	RTMP_Free(o->r);
+	o->r = NULL;
+	return 0;
+}
+
+// The connect thread, for rtmpout_Start and reconnects
+static void * rtmpout_Connector(void * const arg)
+{
+	struct rtmpout * const o = arg;
+
+	o->connectResult = rtmpout_Connect(o);
+	atomic_store(&o->connectDone, 1);
+	return NULL;
+}
+
+// Toss a finished tag into RTMP, timing and counting it
+//  cast to char* avoids a warning
+static int rtmpout_Send(struct rtmpout * const o, const uint8_t * const buf, const uint32_t size)
+{
+	struct flv_tag_header h;
+	flv_ParseTagHeader(buf, &h);
+	const uint32_t wireSize = rtmpout_WireSize(o, &h);
+
+	const uint64_t start = metrics_Now();
+	const int ret = RTMP_Write(o->r, (const char *)buf, size);
+	metrics_Observe(METRIC_WRITE_TIME, metrics_Now() - start);
+
+	if (ret > 0) {
+		metrics_Add(METRIC_BYTES_SENT, size);
+		metrics_Add(METRIC_TAGS_SENT, 1);
+		rtmpout_Sent(o, wireSize);
+
+		if (! o->firstSent && h.type != FLV_TAG_SCRIPT && ! flv_IsSequenceHeader(h.type, buf + 11, h.size)) {
+			const uint64_t elapsed = metrics_Now() - o->openedAt;
+			metrics_Set(METRIC_FIRST_FRAME, elapsed / 1000);
+			logger_Printf(stdout, "First frame sent %.3f seconds after connecting began\n", elapsed / 1e6);
+			o->firstSent = 1;
+		}
+	}
+
+	return ret;
+}
+
+// Cancel an armed poll, and wait for it to finish, before its socket goes
+static void rtmpout_Disarm(struct rtmpout * const o)
+{
+	if (! o->pollArmed)
+		return;
+
+	uring_PollRemove(&o->ring, POLL_USER, CANCEL_USER);
+
+	while (o->pollArmed) {
+		uint64_t user;
+		int32_t res;
+
+		if (! uring_Complete(&o->ring, &user, &res)) {
+			if (! uring_Submit(&o->ring, 1))
+				break;
+			o->polls ++;
+			continue;
+		}
+
+		if (user == POLL_USER)
+			o->pollArmed = 0;
+	}
+
+	// if the ring failed, the poll is forgotten anyway
+	//  (the cancellation's own completion is skipped by rtmpout_PollRing)
+	o->pollArmed = 0;
+}
+
+// Put off the next attempt, for longer each time
+static void rtmpout_Backoff(struct rtmpout * const o)
+{
+	o->backoff = (o->backoff ? o->backoff * 2 : BACKOFF_MIN);
+	if (o->backoff > BACKOFF_MAX)
+		o->backoff = BACKOFF_MAX;
+
+	o->nextAttempt = metrics_Now() + o->backoff * 1000;
+}
+
+// Let go of the connection
+static void rtmpout_Drop(struct rtmpout * const o)
+{
+	rtmpout_Disarm(o);
+	RTMP_Free(o->r);
+	o->r = NULL;
+	o->connected = 0;
+}
+
+// The connection is gone: drop it, and retry straight away if it had been
+//  up a while, or else carry on backing off
+static void rtmpout_Lost(struct rtmpout * const o)
+{
+	logger_Printf(stderr, "Lost RTMP connection, reconnecting\n");
+
+	rtmpout_Drop(o);
+	o->lostAt = metrics_Now();
+
+	if (o->lostAt - o->connectedAt >= STABLE_AFTER) {
+		o->nextAttempt = o->lostAt;
+		o->backoff = 0;
+	} else
+		rtmpout_Backoff(o);
+}
+
+// Reconnect without holding up the caller: the dial (which can block for
+//  the whole TCP SYN retry period on a host that doesn't answer) runs on
+//  the connect thread, while tags are dropped.  Once it is done, the
+//  headers are replayed, stamped with the current timestamp so the new
+//  session never goes backwards.  Returns 1 once the stream can go on.
+static int rtmpout_Reconnect(struct rtmpout * const o, const uint32_t timestamp)
+{
+	if (! o->reconnecting) {
+		if (metrics_Now() < o->nextAttempt)
+			return 0;
+
+		atomic_store(&o->connectDone, 0);
+
+		if (pthread_create(&o->connector, NULL, rtmpout_Connector, o) != 0) {
+			logger_Printf(stderr, "Failed to start reconnecting\n");
+			rtmpout_Backoff(o);
+			return 0;
+		}
+
+		o->reconnecting = 1;
+		return 0;
+	}
+
+	if (! atomic_load(&o->connectDone))
+		return 0;
+
+	pthread_join(o->connector, NULL);
+	o->reconnecting = 0;
+
+	if (! o->connectResult) {
+		rtmpout_Backoff(o);
+		return 0;
+	}
+
+	for (int i = 0; i < RTMPOUT_HEADERS; i ++) {
+		if (o->header[i] == NULL)
+			continue;
+
+		u24be(o->header[i] + 4, timestamp & 0xFFFFFF);
+		o->header[i][7] = timestamp >> 24;
+
+		// accepted, then dropped: the outage goes on, and so does the backoff
+		if (rtmpout_Send(o, o->header[i], o->headerSize[i]) <= 0) {
+			logger_Printf(stderr, "Lost RTMP connection replaying stream headers\n");
+			rtmpout_Drop(o);
+			rtmpout_Backoff(o);
+			return 0;
+		}
+	}
+
+	// audio-only streams have no keyframes to wait for
+	o->waitKeyframe = o->keyframeWanted = (o->header[RTMPOUT_VIDEO_CONFIG] != NULL);
+
+	const uint64_t outage = metrics_Now() - o->lostAt;
+	metrics_Add(METRIC_RECONNECTS, 1);
+	metrics_Observe(METRIC_RECONNECT_TIME, outage);
+	logger_Printf(stderr, "Reconnected after %.3f seconds\n", outage / 1e6);
+	return 1;
+}
+
+// Hold a tag until the background connect is done
+static int rtmpout_Queue(struct rtmpout * const o, const uint8_t * const tag, const uint32_t size)
+{
+	if (o->queueSize + size > o->queueCapacity) {
+		size_t capacity = (o->queueCapacity ? o->queueCapacity : 65536);
+		while (o->queueSize + size > capacity)
+			capacity *= 2;
+
+		uint8_t * const queue = realloc(o->queue, capacity);
+
+		if (queue == NULL) {
+			logger_Printf(stderr, "Failed to queue tag while connecting: %s\n", strerror(errno));
+			return 0;
+		}
+
+		o->queue = queue;
+		o->queueCapacity = capacity;
+	}
+
+	memcpy(o->queue + o->queueSize, tag, size);
+	o->queueSize += size;
+	return 1;
+}
+
+// Is a packet waiting on fd?  Returns 1 if so, 0 if not, -1 on error
+static int rtmpout_Select(struct rtmpout * const o, const int fd)
+{
+	struct timeval tv = {0, 0};
+	fd_set set;
+	FD_ZERO(&set);
+	FD_SET(fd, &set);
+
+	o->polls ++;
+	const int ready = select(fd + 1, &set, NULL, NULL, &tv);
+
+	if (ready == -1) {
+		if (errno == EINTR)
+			return 0;
+
+		logger_Printf(stderr, "Error calling select(): %s\n", strerror(errno));
+		return -1;
+	}
+
+	return (ready > 0);
+}
+
+// The same, from a poll kept armed in the ring
+//  Arming it is the only system call: while nothing arrives, checking is a
+//  look at the completion queue.
+static int rtmpout_PollRing(struct rtmpout * const o, const int fd)
+{
+	if (! o->pollArmed) {
+		if (! uring_Poll(&o->ring, fd, POLLIN, POLL_USER) || ! uring_Submit(&o->ring, 0)) {
+			logger_Printf(stderr, "Error arming io_uring poll\n");
+			return -1;
+		}
+
+		o->polls ++;
+		o->pollArmed = 1;
+	}
+
+	uint64_t user;
+	int32_t res;
+
+	while (uring_Complete(&o->ring, &user, &res)) {
+		if (user != POLL_USER)
+			continue;
+
+		o->pollArmed = 0;
+
+		if (res < 0) {
+			logger_Printf(stderr, "Error in io_uring poll: %s\n", strerror(-res));
+			return -1;
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/* ************************************************************************ */
+int rtmpout_Open(struct rtmpout * const o, const char * const url, const int sendBuffer)
+{
+	memset(o, 0, sizeof(*o));
+	o->ring.fd = -1;
+	o->url = url;
+	o->sendBuffer = sendBuffer;
+	o->openedAt = metrics_Now();
+
+	if (rtmpout_Connect(o))
+		return 1;
+
+	rtmpout_Close(o);
+	return 0;
+}
+
+int rtmpout_Start(struct rtmpout * const o, const char * const url, const int sendBuffer)
+{
+	memset(o, 0, sizeof(*o));
+	o->ring.fd = -1;
+	o->url = url;
+	o->sendBuffer = sendBuffer;
+	o->openedAt = metrics_Now();
+
+	if (pthread_create(&o->connector, NULL, rtmpout_Connector, o) != 0) {
+		logger_Printf(stderr, "Failed to start connecting\n");
+		return 0;
+	}
+
+	o->starting = 1;
+	return 1;
+}
+
+int rtmpout_Connecting(struct rtmpout * const o)
+{
+	return (o->starting && ! atomic_load(&o->connectDone));
+}
+
+int rtmpout_Wait(struct rtmpout * const o)
+{
+	if (! o->starting)
+		return 1;
+
+	pthread_join(o->connector, NULL);
+	o->starting = 0;
+
+	uint8_t * const queue = o->queue;
+	const size_t queueSize = o->queueSize;
+	o->queue = NULL;
+	o->queueSize = o->queueCapacity = 0;
+
+	if (! o->connectResult) {
+		free(queue);
+		return 0;
+	}
+
+	logger_Printf(stdout, "Connected after %.3f seconds, sending %zu bytes encoded meanwhile\n",
+		(metrics_Now() - o->openedAt) / 1e6, queueSize);
+
+	// the queue holds only whole tags, as they were written
+	const uint8_t * p = queue;
+	const uint8_t * const end = queue + queueSize;
+	struct flv_tag_header h;
+	int ret = 1;
+
+	while (ret && p < end) {
+		const uint8_t * const next = flv_NextTag(p, end, &h);
+		ret = rtmpout_Write(o, p, next - p);
+		p = next;
+	}
+
+	free(queue);
+	return ret;
+}
+
+int rtmpout_Write(struct rtmpout * const o, const uint8_t * const tag, const uint32_t size)
+{
+	struct flv_tag_header h;
+	flv_ParseTagHeader(tag, &h);
+
+	const uint8_t * const payload = tag + 11;
+	const int slot = rtmpout_HeaderSlot(&h, payload);
+
+	// keep the latest copy of each header
+	if (slot >= 0) {
+		uint8_t * const copy = realloc(o->header[slot], size);
+
+		if (copy == NULL) {
+			logger_Printf(stderr, "Failed to cache stream header: %s\n", strerror(errno));
+			return 0;
+		}
+
+		memcpy(copy, tag, size);
+		o->header[slot] = copy;
+		o->headerSize[slot] = size;
+	}
+
+	if (o->starting)
+		return rtmpout_Queue(o, tag, size);
+
+	if (o->reconnecting || ! o->connected) {
+		// a header tag is part of the replay, so it is sent either way
+		if (! rtmpout_Reconnect(o, h.timestamp) || slot >= 0) {
+			if (slot < 0)
+				metrics_Add(METRIC_TAGS_DROPPED, 1);
+			return 1;
+		}
+	}
+
+	// after a reconnect, resume cleanly at a keyframe: everything before it
+	//  would only be undecodable video and audio with no picture
+	if (o->waitKeyframe && slot < 0) {
+		if (h.type != FLV_TAG_VIDEO || ! flv_IsKeyframe(payload, h.size)) {
+			metrics_Add(METRIC_TAGS_DROPPED, 1);
+			return 1;
+		}
+
+		o->waitKeyframe = 0;
+	}
+
+	if (rtmpout_Send(o, tag, size) <= 0)
+		rtmpout_Lost(o);
+
+	return 1;
+}
+
+int rtmpout_Poll(struct rtmpout * const o)
+{
+	if (o->starting)
+		return (rtmpout_Connecting(o) ? 1 : rtmpout_Wait(o));
+
+	// the connect thread has the connection while it redials
+	if (o->reconnecting || ! o->connected)
+		return 1;
+
+	// low-latency mode pings the server, and times the response
+	if (o->sendBuffer && metrics_Now() >= o->nextPing) {
+		if (! RTMP_SendCtrl(o->r, UC_PING_REQUEST, (uint32_t)(metrics_Now() / 1000), 0)) {
+			rtmpout_Lost(o);
+			return 1;
+		}
+
+		o->bytesSent += PING_WIRE_SIZE;
+		o->nextPing = metrics_Now() + PING_INTERVAL;
+	}
+
+	// Handle any packets from the remote to us.
+	//  We will use select() (or the poll ring) to see if packet is waiting,
+	//  then read it and dispatch to the handler.  Anything librtmp has already
+	//  buffered is read first, since neither can see it: this keeps
+	//  acknowledgements and ping responses from waiting a frame or more to be
+	//  noticed.
+	const int fd = RTMP_Socket(o->r);
+
+	for (;;) {
+		if (o->r->m_sb.sb_size <= 0) {
+			const int ready = (o->ring.fd >= 0 ? rtmpout_PollRing(o, fd) : rtmpout_Select(o, fd));
+
+			if (ready < 0)
+				return 0;
+
+			if (ready == 0)
+				return 1;
+		}
+
+		// data is waiting, safe to call RTMP_ReadPacket
+		RTMPPacket packet = { 0 };
+
+		if (! RTMP_ReadPacket(o->r, &packet)) {
+			if (! RTMP_IsConnected(o->r))
+				rtmpout_Lost(o);
+			return 1;
+		}
+
+		if (RTMPPacket_IsReady(&packet)) {
+			metrics_Add(METRIC_CONTROL_PACKETS, 1);
+			rtmpout_Inspect(o, &packet);
+			// this function does all the internal stuff we need
+			RTMP_ClientPacket(o->r, &packet);
+			RTMPPacket_Free(&packet);
+		}
+	}
+}
+
+int rtmpout_Uring(struct rtmpout * const o)
+{
+	// a poll, and its cancellation
+	return uring_Init(&o->ring, 2);
+}
+
+long rtmpout_Backlog(struct rtmpout * const o)
+{
+	if (o->starting || o->reconnecting || ! o->connected)
+		return 0;
+
+#if defined(SIOCOUTQ) || defined(FIONWRITE)
+	int backlog;
+
+#ifdef SIOCOUTQ
+	if (ioctl(RTMP_Socket(o->r), SIOCOUTQ, &backlog) == 0)
+#else
+	if (ioctl(RTMP_Socket(o->r), FIONWRITE, &backlog) == 0)
+#endif
+		return backlog;
+#endif
+
+	return -1;
+}
+
+int rtmpout_Pace(struct rtmpout * const o, const uint64_t rate)
+{
+#ifdef SO_MAX_PACING_RATE
+	if (o->starting || o->reconnecting || ! o->connected)
+		return 1;
+
+	// a 32-bit rate is what every kernel with the option accepts
+	const unsigned int limit = (rate > UINT_MAX ? UINT_MAX : rate);
+
+	return (setsockopt(RTMP_Socket(o->r), SOL_SOCKET, SO_MAX_PACING_RATE, &limit, sizeof(limit)) == 0);
+#else
+	(void)o;
+	(void)rate;
+	return 0;
+#endif
+}
+
+int rtmpout_KeyframeWanted(struct rtmpout * const o)
+{
+	const int wanted = o->keyframeWanted;
+	o->keyframeWanted = 0;
+	return wanted;
+}
+
+void rtmpout_Close(struct rtmpout * const o)
+{
+	if (o->starting || o->reconnecting) {
+		pthread_join(o->connector, NULL);
+		o->starting = o->reconnecting = 0;
+	}
+
+	free(o->queue);
+	o->queue = NULL;
+	o->queueSize = o->queueCapacity = 0;
+
+	if (o->r) {
+		rtmpout_Disarm(o);
+		RTMP_Free(o->r);
+	}
+	o->r = NULL;
+	o->connected = 0;
+	uring_Close(&o->ring);
+
+	for (int i = 0; i < RTMPOUT_HEADERS; i ++) {
+		free(o->header[i]);
+		o->header[i] = NULL;
+	}
+
+	free(o->urlCopy);
+	o->urlCopy = NULL;
+}
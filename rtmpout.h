@@ -0,0 +1,150 @@
+/* ***************************************************
+rtmpout: RTMP publishing with automatic reconnect
+Greg Kennedy 2021
+
+Wraps the librtmp connection for the casting tools.
+ The stream headers (onMetaData, and the AVC and AAC
+ sequence headers) are cached as they go by.  When a
+ write fails the connection is re-established with
+ backoff, dialling on a background thread, the headers
+ are replayed, and the stream resumes at the next video
+ keyframe - all without the caller tearing down, or
+ stalling, its encoders.  Timestamps are
+ passed through untouched, so they stay continuous.
+*************************************************** */
+#ifndef RTMPOUT_H_
+#define RTMPOUT_H_
+
+#include <librtmp/rtmp.h>
+
+// poll ring for incoming packets
+#include "uring.h"
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// writes remembered for matching against acknowledgements
+#define RTMPOUT_SENT_HISTORY 1024
+
+// the cached header tags, in the order they are replayed
+enum rtmpout_header {
+	RTMPOUT_METADATA,
+	RTMPOUT_VIDEO_CONFIG,
+	RTMPOUT_AUDIO_CONFIG,
+	RTMPOUT_HEADERS
+};
+
+struct rtmpout {
+	RTMP * r;
+	const char * url;
+	char * urlCopy;	// librtmp parses the URL in place, and keeps pointers into it
+
+	// latest copy of each header tag
+	uint8_t * header[RTMPOUT_HEADERS];
+	uint32_t headerSize[RTMPOUT_HEADERS];
+
+	int connected;
+
+	// background connect (rtmpout_Start): tags written meanwhile are queued
+	int starting;	// the connect thread is yet to be joined
+	int reconnecting;	// the same thread, redialling: tags are dropped meanwhile
+	pthread_t connector;
+	atomic_int connectDone;
+	int connectResult;
+	uint8_t * queue;
+	size_t queueSize, queueCapacity;
+
+	// time to first frame: from opening to the first audio / video tag sent
+	uint64_t openedAt;	// us
+	int firstSent;
+	int waitKeyframe;	// dropping tags until the next video keyframe
+	int keyframeWanted;	// an encoder should force one
+
+	// reconnect schedule, in microseconds
+	uint64_t connectedAt;
+	uint64_t lostAt;
+	uint64_t nextAttempt;
+	unsigned int backoff;	// ms
+
+	// low-latency mode: socket send buffer in bytes, 0 for off
+	int sendBuffer;
+	uint64_t nextPing;	// us
+
+	// send latency: the bytes librtmp has put on the wire, and when,
+	//  matched against the server's acknowledgements
+	uint32_t bytesSent, bytesAcked;
+	struct {
+		uint32_t bytes;	// bytesSent after this write
+		uint64_t time;	// us
+	} sent[RTMPOUT_SENT_HISTORY];
+	unsigned int sentHead, sentTail;
+
+	// the last media message, to mirror librtmp's header compression
+	int haveLast;
+	uint8_t lastType;
+	uint32_t lastSize, lastTimestamp;
+
+	// with rtmpout_Uring, incoming packets are noticed by a poll kept armed
+	//  in an io_uring, instead of a select() on every rtmpout_Poll
+	struct uring ring;
+	int pollArmed;
+	unsigned long polls;	// system calls made looking for packets
+};
+
+// Connect and start publishing to url
+//  A sendBuffer (bytes) turns on low-latency mode: TCP_NODELAY, that send
+//  buffer, TCP_NOTSENT_LOWAT where supported, and a ping every second to
+//  measure the round trip.
+//  Returns 0 on failure: the first connection is not retried, since that
+//  is usually a bad URL rather than a blip.  Nothing needs closing after a failure.
+int rtmpout_Open(struct rtmpout * o, const char * url, int sendBuffer);
+
+// Start connecting in the background, so the caller can set up its encoders
+//  (and encode the first frames) meanwhile.  Tags written before the
+//  connection is up are queued, and go out in order the moment it is.
+//  Returns 0 if the connect could not be started.  Otherwise, a failure to
+//  connect is reported by rtmpout_Poll or rtmpout_Wait.
+int rtmpout_Start(struct rtmpout * o, const char * url, int sendBuffer);
+
+// True while a connect started by rtmpout_Start is still in progress
+int rtmpout_Connecting(struct rtmpout * o);
+
+// Block until a connect started by rtmpout_Start is done, then send the queue
+//  Returns 0 if the connection failed.  Without a connect in progress, returns 1 at once.
+int rtmpout_Wait(struct rtmpout * o);
+
+// Send one complete FLV tag (header, payload and trailer)
+//  If the connection is down the tag is dropped, and a reconnect tried
+//  when the backoff allows.  Returns 0 only on a fatal error.
+int rtmpout_Write(struct rtmpout * o, const uint8_t * tag, uint32_t size);
+
+// Handle any packets waiting from the server, without blocking
+//  This also finishes a background connect once it is done.
+//  Returns 0 on a fatal error, or if the background connect failed.
+int rtmpout_Poll(struct rtmpout * o);
+
+// Watch for incoming packets with a poll kept armed in an io_uring, so an
+//  rtmpout_Poll with nothing waiting takes no system call
+//  Call after rtmpout_Open or rtmpout_Start.  Returns 0 if io_uring is not
+//  available, and rtmpout_Poll goes on using select().
+int rtmpout_Uring(struct rtmpout * o);
+
+// Bytes written to the socket and not yet acknowledged by the peer's TCP
+//  (SIOCOUTQ on Linux, FIONWRITE on the BSDs), 0 while disconnected, or
+//  -1 where the OS can't tell us
+long rtmpout_Backlog(struct rtmpout * o);
+
+// Have the kernel pace the socket's TCP at no more than rate bytes per second
+//  (SO_MAX_PACING_RATE on Linux), so a large write leaves spread out instead
+//  of at line rate.  Returns 0 where the OS can't do this; while disconnected
+//  there is nothing to pace, and it returns 1.
+int rtmpout_Pace(struct rtmpout * o, uint64_t rate);
+
+// True (once) after a reconnect, when an encoder should emit an IDR
+//  rather than leave the new connection waiting for the next one
+int rtmpout_KeyframeWanted(struct rtmpout * o);
+
+void rtmpout_Close(struct rtmpout * o);
+
+#endif
@@ -0,0 +1,879 @@
+/* ***************************************************
+rtmpsink: minimal local RTMP ingest server
+Greg Kennedy 2021
+
+Accepts publishers (simple handshake, connect,
+ createStream, publish), reassembles their chunk streams
+ back into FLV tags and optionally writes each stream to
+ disk.  Per stream it reports throughput, arrival jitter
+ and timestamp / arrival skew as one JSON object per line,
+ so the casting tools can be load tested over loopback.
+ Streams carrying send-time timecodes (onFI or SEI) also
+ get a histogram of publish-to-ingest latency.
+*************************************************** */
+#include "flv.h"
+#include "flvrec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define RTMP_SIG_SIZE 1536
+
+// chunk streams in use by one client: librtmp uses a handful
+#define MAX_CHUNK_STREAMS 16
+
+// our outgoing chunk size, and the acknowledgement window we ask for
+#define OUT_CHUNK_SIZE 4096
+#define ACK_WINDOW 2500000
+
+// RTMP message types
+#define MSG_SET_CHUNK_SIZE 1
+#define MSG_ABORT 2
+#define MSG_ACK 3
+#define MSG_USER_CONTROL 4
+#define MSG_WINDOW_ACK_SIZE 5
+#define MSG_SET_PEER_BW 6
+#define MSG_AUDIO 8
+#define MSG_VIDEO 9
+#define MSG_DATA_AMF0 18
+#define MSG_COMMAND_AMF0 20
+
+// User Control events
+#define UC_PING_REQUEST 6
+#define UC_PING_RESPONSE 7
+
+// the message stream handed out by createStream
+#define STREAM_ID 1
+
+// settings, from the command line
+static const char * outputDir;	// write streams here, if set
+static unsigned long reportInterval;	// seconds between reports, 0 = only at the end
+
+static atomic_ulong connections;
+
+// one chunk stream: the last header seen, and the message being reassembled
+struct chunk_stream {
+	uint32_t csid;
+	uint32_t timestamp, delta;
+	uint32_t length;
+	uint8_t type;
+	uint32_t msid;
+	int extended;
+
+	uint8_t * body;
+	uint32_t cap, read;
+};
+
+// arrival statistics for one kind of tag
+struct arrival {
+	unsigned long tags;
+	uint64_t bytes;
+	uint64_t lastArrival;	// us
+	uint32_t lastTimestamp;	// ms
+	double jitter;	// ms, running estimate as in RFC 3550
+};
+
+enum { AUDIO, VIDEO, SCRIPT, KINDS };
+static const char * const kind_names[KINDS] = { "audio", "video", "script" };
+
+// publish-to-ingest latency, from the wallclock timecodes a publisher embeds
+//  (onFI script tags, or SEI in the video), bucketed by upper bound in ms
+#define LATENCY_BUCKETS 13
+static const double latency_bounds[LATENCY_BUCKETS - 1] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000 };
+
+struct latency {
+	unsigned long count;
+	double sum, min, max;	// ms
+	unsigned long bucket[LATENCY_BUCKETS];
+};
+
+struct conn {
+	int fd;
+	unsigned long id;
+	char peer[64];
+
+	// buffered input
+	uint8_t in[16384];
+	size_t inPos, inLen;
+	uint64_t bytesIn, lastAck;
+	uint32_t inChunkSize;
+
+	struct chunk_stream streams[MAX_CHUNK_STREAMS];
+	unsigned int streamCount;
+
+	// publish state
+	char app[128];
+	char name[128];
+	struct flvrec rec;
+
+	uint64_t connected, lastReport;	// us
+
+	// skew: how far arrival has drifted from media time, first tag = 0
+	int haveFirst;
+	uint64_t firstArrival;
+	uint32_t firstTimestamp, lastTimestamp;
+	double skew, skewMin, skewMax;
+
+	struct arrival kind[KINDS];
+	struct latency latency;
+};
+
+/* ************************************************************************ */
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// wall clock, to compare with the publisher's timecodes
+static uint64_t wallclock_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Fill dst with exactly n bytes from the client
+//  Returns 0 on disconnect or error.
+static int conn_Read(struct conn * const c, void * const dst, size_t n)
+{
+	uint8_t * d = dst;
+
+	while (n) {
+		if (c->inPos == c->inLen) {
+			const ssize_t r = recv(c->fd, c->in, sizeof(c->in), 0);
+
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				return 0;
+
+			c->inPos = 0;
+			c->inLen = r;
+			c->bytesIn += r;
+		}
+
+		size_t k = c->inLen - c->inPos;
+		if (k > n)
+			k = n;
+
+		memcpy(d, c->in + c->inPos, k);
+		c->inPos += k;
+		d += k;
+		n -= k;
+	}
+
+	return 1;
+}
+
+static int conn_Write(struct conn * const c, const void * const src, size_t n)
+{
+	const uint8_t * s = src;
+
+	while (n) {
+		const ssize_t w = send(c->fd, s, n, MSG_NOSIGNAL);
+
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return 0;
+
+		s += w;
+		n -= w;
+	}
+
+	return 1;
+}
+
+// Send one message, split into chunks: a full header, then one byte
+//  continuation headers.  Everything we send is small, and timestamp 0.
+static int conn_Send(struct conn * const c, const uint8_t csid, const uint8_t type, const uint32_t msid, const uint8_t * const body, const uint32_t len)
+{
+	uint8_t buf[12 + 2048 + 2048 / OUT_CHUNK_SIZE + 1];
+	uint8_t * p = buf;
+
+	if (len > 2048)
+		return 0;
+
+	*p++ = csid;
+	p = u24be(p, 0);
+	p = u24be(p, len);
+	*p++ = type;
+	// the message stream id is the one little-endian field
+	*p++ = msid;
+	*p++ = msid >> 8;
+	*p++ = msid >> 16;
+	*p++ = msid >> 24;
+
+	// nothing is sent before our Set Chunk Size but that message itself,
+	//  and it fits the default of 128
+	for (uint32_t i = 0; i < len; i += OUT_CHUNK_SIZE) {
+		if (i)
+			*p++ = 0xC0 | csid;
+
+		const uint32_t k = (len - i < OUT_CHUNK_SIZE ? len - i : OUT_CHUNK_SIZE);
+		memcpy(p, body + i, k);
+		p += k;
+	}
+
+	return conn_Write(c, buf, p - buf);
+}
+
+// Protocol control messages carry a single 32 bit value (or two, for peer bandwidth)
+static int conn_SendControl(struct conn * const c, const uint8_t type, const uint32_t value)
+{
+	uint8_t body[5];
+	u32be(body, value);
+	body[4] = 2;	// dynamic limit, for Set Peer Bandwidth
+
+	return conn_Send(c, 2, type, 0, body, (type == MSG_SET_PEER_BW ? 5 : 4));
+}
+
+static struct chunk_stream * conn_Stream(struct conn * const c, const uint32_t csid)
+{
+	for (unsigned int i = 0; i < c->streamCount; i ++)
+		if (c->streams[i].csid == csid)
+			return &c->streams[i];
+
+	if (c->streamCount == MAX_CHUNK_STREAMS)
+		return NULL;
+
+	struct chunk_stream * const cs = &c->streams[c->streamCount ++];
+	memset(cs, 0, sizeof(*cs));
+	cs->csid = csid;
+	return cs;
+}
+
+/* ************************************************************************ */
+// Handshake: the simple (non-digest) kind, which librtmp uses for plain rtmp://
+//  C0+C1 in, S0+S1+S2 out with S2 echoing C1, then C2 in
+static int handshake(struct conn * const c)
+{
+	uint8_t c1[1 + RTMP_SIG_SIZE];
+	uint8_t s[1 + 2 * RTMP_SIG_SIZE];
+
+	if (! conn_Read(c, c1, sizeof(c1)))
+		return 0;
+
+	if (c1[0] != 3) {
+		fprintf(stderr, "[%lu] Unsupported RTMP version %u\n", c->id, c1[0]);
+		return 0;
+	}
+
+	s[0] = 3;
+	u32be(s + 1, (uint32_t)(now_us() / 1000));
+	u32be(s + 5, 0);
+	for (int i = 9; i < 1 + RTMP_SIG_SIZE; i ++)
+		s[i] = rand();
+	memcpy(s + 1 + RTMP_SIG_SIZE, c1 + 1, RTMP_SIG_SIZE);
+
+	if (! conn_Write(c, s, sizeof(s)))
+		return 0;
+
+	// C2 should echo S1, but nothing depends on it
+	return conn_Read(c, c1, RTMP_SIG_SIZE);
+}
+
+/* ************************************************************************ */
+// Copy an AMF string value into a C string, truncating, and replacing
+//  anything that would need escaping in a report or a file name
+static void copy_string(char * const dst, const size_t size, const struct amf_value * const v)
+{
+	const size_t len = (v->len < size ? v->len : size - 1);
+
+	for (size_t i = 0; i < len; i ++) {
+		const char ch = v->str[i];
+		dst[i] = (ch < ' ' || ch == '"' || ch == '\\' || ch == '/' ? '_' : ch);
+	}
+
+	dst[len] = '\0';
+}
+
+static int match(const struct amf_value * const v, const char * const str)
+{
+	return (v->type == AMF_STRING && v->len == strlen(str) && memcmp(v->str, str, v->len) == 0);
+}
+
+// Pull "app" out of the connect command object
+static void parse_connect(struct conn * const c, const uint8_t * p, const uint8_t * const end)
+{
+	struct amf_value v;
+
+	if ((p = amf_Decode(p, end, &v)) == NULL || v.type != AMF_OBJECT)
+		return;
+
+	for (;;) {
+		const uint8_t * key;
+		uint32_t len;
+
+		if ((p = amf_DecodeKey(p, end, &key, &len)) == NULL || len == 0)
+			return;
+
+		if (len == 3 && memcmp(key, "app", 3) == 0) {
+			if (amf_Decode(p, end, &v) != NULL && v.type == AMF_STRING)
+				copy_string(c->app, sizeof(c->app), &v);
+			return;
+		}
+
+		if ((p = amf_Skip(p, end)) == NULL)
+			return;
+	}
+}
+
+// Record to <dir>/<connection>-<stream name>.flv, seekable once closed
+static void open_output(struct conn * const c)
+{
+	char path[1024];
+
+	snprintf(path, sizeof(path), "%s/%lu-%s.flv", outputDir, c->id, c->name);
+
+	if (! flvrec_Open(&c->rec, path, FLVREC_KEYFRAMES))
+		fprintf(stderr, "[%lu] Not recording this stream\n", c->id);
+}
+
+// Answer the handful of commands a publisher sends
+//  Returns 0 when the client is done (or the reply failed).
+static int handle_Command(struct conn * const c, const uint8_t * const body, const uint32_t len, const uint32_t msid)
+{
+	const uint8_t * p = body;
+	const uint8_t * const end = body + len;
+	struct amf_value name, txn, v;
+
+	if ((p = amf_Decode(p, end, &name)) == NULL || name.type != AMF_STRING)
+		return 1;
+	if ((p = amf_Decode(p, end, &txn)) == NULL || txn.type != AMF_NUMBER)
+		return 1;
+
+	uint8_t buffer[1024];
+	struct flv_tag reply;
+	flv_TagInit(&reply, buffer, sizeof(buffer));
+
+	if (match(&name, "connect")) {
+		parse_connect(c, p, end);
+
+		if (! conn_SendControl(c, MSG_WINDOW_ACK_SIZE, ACK_WINDOW) ||
+			! conn_SendControl(c, MSG_SET_PEER_BW, ACK_WINDOW) ||
+			! conn_SendControl(c, MSG_SET_CHUNK_SIZE, OUT_CHUNK_SIZE))
+			return 0;
+
+		amf_string(&reply, "_result");
+		amf_number(&reply, txn.number);
+		amf_object(&reply);
+		amf_object_string(&reply, "fmsVer", "FMS/3,5,7,7009");
+		pstring(&reply, "capabilities");
+		amf_number(&reply, 31);
+		amf_object_end(&reply);
+		amf_object(&reply);
+		amf_object_string(&reply, "level", "status");
+		amf_object_string(&reply, "code", "NetConnection.Connect.Success");
+		amf_object_string(&reply, "description", "Connection succeeded.");
+		pstring(&reply, "objectEncoding");
+		amf_number(&reply, 0);
+		amf_object_end(&reply);
+	} else if (match(&name, "createStream")) {
+		amf_string(&reply, "_result");
+		amf_number(&reply, txn.number);
+		amf_null(&reply);
+		amf_number(&reply, STREAM_ID);
+	} else if (match(&name, "publish")) {
+		// null command object, then the stream name
+		if ((p = amf_Skip(p, end)) != NULL && amf_Decode(p, end, &v) != NULL && v.type == AMF_STRING)
+			copy_string(c->name, sizeof(c->name), &v);
+
+		if (outputDir && c->rec.f == NULL)
+			open_output(c);
+
+		amf_string(&reply, "onStatus");
+		amf_number(&reply, 0);
+		amf_null(&reply);
+		amf_object(&reply);
+		amf_object_string(&reply, "level", "status");
+		amf_object_string(&reply, "code", "NetStream.Publish.Start");
+		amf_object_string(&reply, "description", "Publishing.");
+		amf_object_end(&reply);
+	} else if (match(&name, "FCUnpublish") || match(&name, "deleteStream")) {
+		return 0;
+	} else if (txn.number != 0) {
+		// releaseStream, FCPublish and anything else that wants an answer
+		amf_string(&reply, "_result");
+		amf_number(&reply, txn.number);
+		amf_null(&reply);
+	}
+
+	if (reply.len == 0)
+		return 1;
+
+	return conn_Send(c, 3, MSG_COMMAND_AMF0, msid, reply.buf, reply.len);
+}
+
+/* ************************************************************************ */
+// Count one frame's latency: now, less the send time it carries
+//  Negative latency is possible, when the publisher's clock runs ahead.
+static void latency_Add(struct latency * const l, const uint64_t wallclock, const uint64_t sent)
+{
+	const double ms = ((double)wallclock - (double)sent) / 1e3;
+	unsigned int b = 0;
+
+	while (b < LATENCY_BUCKETS - 1 && ms > latency_bounds[b])
+		b ++;
+
+	if (l->count == 0 || ms < l->min)
+		l->min = ms;
+	if (l->count == 0 || ms > l->max)
+		l->max = ms;
+
+	l->count ++;
+	l->sum += ms;
+	l->bucket[b] ++;
+}
+
+// The upper bound of the bucket holding the given fraction of frames,
+//  or the maximum if that is lower (or the bucket is the open-ended one)
+static double latency_Percentile(const struct latency * const l, const double fraction)
+{
+	const double rank = fraction * l->count;
+	unsigned long seen = 0;
+
+	for (unsigned int b = 0; b < LATENCY_BUCKETS - 1; b ++) {
+		seen += l->bucket[b];
+		if (seen >= rank)
+			return (latency_bounds[b] < l->max ? latency_bounds[b] : l->max);
+	}
+
+	return l->max;
+}
+
+static void report(struct conn * const c, const char * const event)
+{
+	const uint64_t now = now_us();
+	const double elapsed = (now - c->connected) / 1e6;
+	char kinds[512];
+	size_t len = 0;
+
+	for (int k = 0; k < KINDS; k ++) {
+		const struct arrival * const a = &c->kind[k];
+		len += snprintf(kinds + len, sizeof(kinds) - len,
+			",\"%s\":{\"tags\":%lu,\"bytes\":%llu,\"jitter_ms\":%.3f}",
+			kind_names[k], a->tags, (unsigned long long)a->bytes, a->jitter);
+	}
+
+	const struct latency * const l = &c->latency;
+	char buckets[256];
+	len = 0;
+
+	for (int b = 0; b < LATENCY_BUCKETS; b ++)
+		len += snprintf(buckets + len, sizeof(buckets) - len, "%s%lu", (b ? "," : ""), l->bucket[b]);
+
+	// one printf per line, so lines from different connections don't mix
+	printf("{\"event\":\"%s\",\"conn\":%lu,\"peer\":\"%s\",\"app\":\"%s\",\"stream\":\"%s\","
+		"\"elapsed_s\":%.3f,\"bytes\":%llu,\"kbps\":%.1f,\"media_ms\":%lu%s,"
+		"\"skew_ms\":{\"last\":%.3f,\"min\":%.3f,\"max\":%.3f},"
+		"\"latency_ms\":{\"frames\":%lu,\"min\":%.3f,\"mean\":%.3f,\"max\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"buckets\":[%s]}}\n",
+		event, c->id, c->peer, c->app, c->name,
+		elapsed, (unsigned long long)c->bytesIn, (elapsed > 0 ? c->bytesIn * 8 / elapsed / 1000 : 0),
+		(unsigned long)(c->haveFirst ? c->lastTimestamp - c->firstTimestamp : 0), kinds,
+		c->skew, c->skewMin, c->skewMax,
+		l->count, l->min, (l->count ? l->sum / l->count : 0), l->max,
+		latency_Percentile(l, 0.5), latency_Percentile(l, 0.9), latency_Percentile(l, 0.99), buckets);
+	fflush(stdout);
+
+	c->lastReport = now;
+}
+
+// An audio, video or script message is one FLV tag
+static void handle_Media(struct conn * const c, const struct chunk_stream * const cs)
+{
+	const uint64_t now = now_us();
+	const uint8_t * payload = cs->body;
+	uint32_t size = cs->length;
+	int k = (cs->type == MSG_AUDIO ? AUDIO : cs->type == MSG_VIDEO ? VIDEO : SCRIPT);
+
+	if (k == SCRIPT) {
+		// publishers prefix metadata with "@setDataFrame", which is not in the file
+		struct amf_value v;
+		const uint8_t * const p = amf_Decode(payload, payload + size, &v);
+
+		if (p && match(&v, "@setDataFrame")) {
+			size -= p - payload;
+			payload = p;
+		}
+
+		uint64_t sent;
+		if (flv_ParseOnFI(payload, payload + size, &sent))
+			latency_Add(&c->latency, wallclock_us(), sent);
+	} else {
+		// an AVC frame (not the sequence header) may carry a timecode SEI
+		uint64_t sent;
+		if (k == VIDEO && size > 5 && (payload[0] & 0x0F) == 7 && payload[1] == 1 &&
+			h264_ParseTimecode(payload + 5, size - 5, &sent))
+			latency_Add(&c->latency, wallclock_us(), sent);
+
+		// arrival jitter: variation of the arrival spacing against the timestamp spacing
+		struct arrival * const a = &c->kind[k];
+
+		if (a->tags) {
+			const double d = (now - a->lastArrival) / 1e3 - (double)(int32_t)(cs->timestamp - a->lastTimestamp);
+			a->jitter += (fabs(d) - a->jitter) / 16;
+		}
+
+		a->lastArrival = now;
+		a->lastTimestamp = cs->timestamp;
+
+		// skew: positive when tags arrive later than their timestamps say
+		if (! c->haveFirst) {
+			c->haveFirst = 1;
+			c->firstArrival = now;
+			c->firstTimestamp = cs->timestamp;
+		}
+
+		c->lastTimestamp = cs->timestamp;
+		c->skew = (now - c->firstArrival) / 1e3 - (double)(int32_t)(cs->timestamp - c->firstTimestamp);
+		if (c->skew < c->skewMin)
+			c->skewMin = c->skew;
+		if (c->skew > c->skewMax)
+			c->skewMax = c->skew;
+	}
+
+	c->kind[k].tags ++;
+	c->kind[k].bytes += size;
+
+	flvrec_Tag(&c->rec, (k == AUDIO ? FLV_TAG_AUDIO : k == VIDEO ? FLV_TAG_VIDEO : FLV_TAG_SCRIPT), cs->timestamp, payload, size);
+}
+
+/* ************************************************************************ */
+// Read one chunk, appending it to its message
+//  Returns the chunk stream when that completes a message, NULL when not,
+//  and sets *error on disconnect or protocol error.
+static struct chunk_stream * read_Chunk(struct conn * const c, int * const error)
+{
+	uint8_t b[11];
+
+	*error = 1;
+
+	if (! conn_Read(c, b, 1))
+		return NULL;
+
+	const uint8_t fmt = b[0] >> 6;
+	uint32_t csid = b[0] & 0x3F;
+
+	if (csid == 0) {
+		if (! conn_Read(c, b, 1))
+			return NULL;
+		csid = 64 + b[0];
+	} else if (csid == 1) {
+		if (! conn_Read(c, b, 2))
+			return NULL;
+		csid = 64 + b[0] + (b[1] << 8);
+	}
+
+	struct chunk_stream * const cs = conn_Stream(c, csid);
+
+	if (cs == NULL) {
+		fprintf(stderr, "[%lu] Too many chunk streams\n", c->id);
+		return NULL;
+	}
+
+	static const uint8_t header_size[4] = { 11, 7, 3, 0 };
+
+	if (! conn_Read(c, b, header_size[fmt]))
+		return NULL;
+
+	uint32_t ts = 0;
+
+	if (fmt <= 2) {
+		ts = parse_u24be(b);
+		cs->extended = (ts == 0xFFFFFF);
+	}
+
+	if (fmt <= 1) {
+		cs->length = parse_u24be(b + 3);
+		cs->type = b[6];
+	}
+
+	if (fmt == 0)
+		cs->msid = b[7] | b[8] << 8 | b[9] << 16 | (uint32_t)b[10] << 24;
+
+	// type 3 chunks repeat the extended timestamp of the header they continue
+	if (cs->extended) {
+		if (! conn_Read(c, b, 4))
+			return NULL;
+		if (fmt <= 2)
+			ts = parse_u32be(b);
+	}
+
+	// a new header abandons any partial message
+	if (fmt != 3)
+		cs->read = 0;
+
+	if (cs->read == 0) {
+		// type 0 is absolute, types 1 and 2 give a delta, type 3 repeats it
+		if (fmt == 0) {
+			cs->timestamp = ts;
+			cs->delta = 0;
+		} else {
+			if (fmt <= 2)
+				cs->delta = ts;
+			cs->timestamp += cs->delta;
+		}
+
+		if (cs->length > cs->cap) {
+			uint8_t * const body = realloc(cs->body, cs->length);
+
+			if (body == NULL) {
+				fprintf(stderr, "[%lu] Failed to allocate %u byte message\n", c->id, cs->length);
+				return NULL;
+			}
+
+			cs->body = body;
+			cs->cap = cs->length;
+		}
+	}
+
+	uint32_t k = cs->length - cs->read;
+	if (k > c->inChunkSize)
+		k = c->inChunkSize;
+
+	if (! conn_Read(c, cs->body + cs->read, k))
+		return NULL;
+
+	cs->read += k;
+	*error = 0;
+
+	if (cs->read < cs->length)
+		return NULL;
+
+	cs->read = 0;
+	return cs;
+}
+
+// Act on one complete message
+//  Returns 0 to close the connection.
+static int handle_Message(struct conn * const c, const struct chunk_stream * const cs)
+{
+	switch (cs->type) {
+	case MSG_SET_CHUNK_SIZE:
+		if (cs->length >= 4) {
+			c->inChunkSize = parse_u32be(cs->body) & 0x7FFFFFFF;
+			if (c->inChunkSize == 0 || c->inChunkSize > 0xFFFFFF) {
+				fprintf(stderr, "[%lu] Bad chunk size %u\n", c->id, c->inChunkSize);
+				return 0;
+			}
+		}
+		break;
+	case MSG_ABORT:
+		if (cs->length >= 4) {
+			struct chunk_stream * const aborted = conn_Stream(c, parse_u32be(cs->body));
+			if (aborted)
+				aborted->read = 0;
+		}
+		break;
+	case MSG_USER_CONTROL:
+		// answer pings, so the publisher can measure round trip time
+		if (cs->length >= 6 && parse_u16be(cs->body) == UC_PING_REQUEST) {
+			uint8_t pong[6];
+			u16be(pong, UC_PING_RESPONSE);
+			memcpy(pong + 2, cs->body + 2, 4);
+			return conn_Send(c, 2, MSG_USER_CONTROL, 0, pong, sizeof(pong));
+		}
+		break;
+	case MSG_COMMAND_AMF0:
+		return handle_Command(c, cs->body, cs->length, cs->msid);
+	case MSG_AUDIO:
+	case MSG_VIDEO:
+	case MSG_DATA_AMF0:
+		handle_Media(c, cs);
+		break;
+	}
+
+	return 1;
+}
+
+static void * serve(void * const arg)
+{
+	struct conn * const c = arg;
+
+	if (! handshake(c))
+		goto done;
+
+	// acknowledgements count bytes after the handshake, as other servers do
+	c->bytesIn = c->inLen - c->inPos;
+
+	for (;;) {
+		int error;
+		const struct chunk_stream * const cs = read_Chunk(c, &error);
+
+		if (error)
+			break;
+		if (cs == NULL)
+			continue;
+
+		if (! handle_Message(c, cs))
+			break;
+
+		// acknowledge every window, as a real server does
+		if (c->bytesIn - c->lastAck >= ACK_WINDOW) {
+			if (! conn_SendControl(c, MSG_ACK, (uint32_t)c->bytesIn))
+				break;
+			c->lastAck = c->bytesIn;
+		}
+
+		if (reportInterval && now_us() - c->lastReport >= reportInterval * 1000000)
+			report(c, "report");
+	}
+
+done:
+	report(c, "end");
+
+	flvrec_Close(&c->rec);
+	for (unsigned int i = 0; i < c->streamCount; i ++)
+		free(c->streams[i].body);
+	close(c->fd);
+	free(c);
+	return NULL;
+}
+
+/* ************************************************************************ */
+int main(int argc, char * argv[])
+{
+	const char * host = "127.0.0.1";
+	unsigned short port = 1935;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:p:o:r:")) != -1) {
+		switch (opt) {
+		case 'b':
+			host = optarg;
+			break;
+		case 'p':
+			port = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			outputDir = optarg;
+			break;
+		case 'r':
+			reportInterval = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			optind = argc + 1;
+		}
+	}
+
+	if (optind != argc || port == 0) {
+		printf("Local RTMP ingest sink\nUsage:\n\t%s [-b address] [-p port] [-o directory] [-r seconds]\n"
+			"Options:\n\t-b\taddress to listen on (default 127.0.0.1)\n"
+			"\t-p\tport to listen on (default 1935)\n"
+			"\t-o\twrite each published stream to an FLV file here\n"
+			"\t-r\treport every stream this often (default: only when it ends)\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+		fprintf(stderr, "Bad listen address: %s\n", host);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	srand(time(NULL));
+
+	const int one = 1;
+	const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd >= 0)
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 1024) != 0) {
+		perror("Failed to listen");
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "Listening on %s:%u\n", host, port);
+
+	// a thread per publisher, on a small stack: hundreds of them is the point
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 256 * 1024);
+
+	int ret = EXIT_SUCCESS;
+	int acceptFailing = 0;
+
+	for (;;) {
+		struct sockaddr_in peer;
+		socklen_t peer_len = sizeof(peer);
+		const int fd = accept(listen_fd, (struct sockaddr *)&peer, &peer_len);
+
+		if (fd < 0) {
+			// a client that gave up, or a signal: just carry on
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			// the listening socket itself is gone: nothing more will come
+			if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK) {
+				perror("Stopped accepting connections");
+				ret = EXIT_FAILURE;
+				break;
+			}
+
+			// out of descriptors or memory (EMFILE, ENFILE, ENOBUFS...): the
+			//  connection stays queued, so wait for some to free up rather
+			//  than spin on accept, and only say so once
+			if (! acceptFailing)
+				perror("accept");
+			acceptFailing = 1;
+			usleep(100000);
+			continue;
+		}
+
+		if (acceptFailing) {
+			fputs("Accepting connections again\n", stderr);
+			acceptFailing = 0;
+		}
+
+		struct conn * const c = calloc(1, sizeof(*c));
+
+		if (c == NULL) {
+			perror("Failed to allocate connection");
+			close(fd);
+			continue;
+		}
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		c->fd = fd;
+		c->id = atomic_fetch_add(&connections, 1) + 1;
+		c->inChunkSize = 128;
+		c->connected = c->lastReport = now_us();
+		snprintf(c->peer, sizeof(c->peer), "%s:%u", inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+
+		pthread_t thread;
+
+		if (pthread_create(&thread, &attr, serve, c) != 0) {
+			fputs("Failed to start connection thread\n", stderr);
+			close(fd);
+			free(c);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	close(listen_fd);
+	return ret;
+}
@@ -0,0 +1,181 @@
+/* ***************************************************
+scale: 8-bit plane downscaling
+Greg Kennedy 2021
+*************************************************** */
+#include "scale.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// largest box filter: a block of 16 x 16 pixels still sums within 16 bits
+#define MAX_FACTOR 16
+
+// Position of output sample i in the source, in 1/256ths, with the sample
+//  centres lined up: (i + 0.5) * src / dst - 0.5.  Clamped to the last sample.
+static void scale_Position(const unsigned int i, const unsigned int src, const unsigned int dst, uint32_t * const pos, uint16_t * const weight)
+{
+	int64_t p = ((int64_t)(2 * i + 1) * src * 256) / (2 * dst) - 128;
+
+	if (p < 0)
+		p = 0;
+
+	*pos = p >> 8;
+	*weight = p & 0xFF;
+
+	if (*pos >= src - 1) {
+		*pos = src - 1;
+		*weight = 0;
+	}
+}
+
+/* ************************************************************************ */
+int scale_Init(struct scaler * const s, const unsigned int srcWidth, const unsigned int srcHeight, const unsigned int dstWidth, const unsigned int dstHeight)
+{
+	memset(s, 0, sizeof(*s));
+
+	if (srcWidth == 0 || srcHeight == 0 || dstWidth == 0 || dstHeight == 0) {
+		fputs("Can't scale an empty picture\n", stderr);
+		return 0;
+	}
+
+	s->srcWidth = srcWidth;
+	s->srcHeight = srcHeight;
+	s->dstWidth = dstWidth;
+	s->dstHeight = dstHeight;
+
+	const unsigned int k = srcWidth / dstWidth;
+
+	if (k <= MAX_FACTOR && srcWidth == k * dstWidth && srcHeight == k * dstHeight)
+		s->factor = k;
+
+	s->row = malloc((srcWidth + 1) * sizeof(*s->row));
+
+	if (s->row == NULL)
+		goto fail;
+
+	if (s->factor == 0) {
+		s->x = malloc(dstWidth * sizeof(*s->x));
+		s->weight = malloc(dstWidth * sizeof(*s->weight));
+
+		if (s->x == NULL || s->weight == NULL)
+			goto fail;
+
+		for (unsigned int i = 0; i < dstWidth; i ++)
+			scale_Position(i, srcWidth, dstWidth, &s->x[i], &s->weight[i]);
+	}
+
+	return 1;
+
+fail:
+	perror("Failed to allocate scaler");
+	scale_Close(s);
+	return 0;
+}
+
+// The row kernels: plain loops over restrict pointers, so they vectorise
+static void row_Load(uint16_t * restrict row, const uint8_t * restrict p, const unsigned int width)
+{
+	for (unsigned int x = 0; x < width; x ++)
+		row[x] = p[x];
+}
+
+static void row_Add(uint16_t * restrict row, const uint8_t * restrict p, const unsigned int width)
+{
+	for (unsigned int x = 0; x < width; x ++)
+		row[x] += p[x];
+}
+
+static void row_Blend(uint16_t * restrict row, const uint8_t * restrict a, const uint8_t * restrict b, const uint16_t w, const unsigned int width)
+{
+	const uint16_t wa = 256 - w;
+
+	for (unsigned int x = 0; x < width; x ++)
+		row[x] = a[x] * wa + b[x] * w;
+}
+
+// the common 2:1 case, with the division a shift
+static void row_Box2(uint8_t * restrict d, const uint16_t * restrict row, const unsigned int width)
+{
+	for (unsigned int x = 0; x < width; x ++)
+		d[x] = (row[2 * x] + row[2 * x + 1] + 2) >> 2;
+}
+
+static void row_Box(uint8_t * restrict d, const uint16_t * restrict row, const unsigned int k, const unsigned int width)
+{
+	const uint32_t area = k * k;
+	// divide by the area as a multiply: with 32 fractional bits the
+	//  reciprocal adds less than 2^-16 to any sum / area, too little to reach
+	//  the next integer (at least 1 / area away), so this is the exact
+	//  rounded average, and never more than 255
+	const uint64_t recip = ((UINT64_C(1) << 32) + area - 1) / area;
+
+	for (unsigned int x = 0; x < width; x ++) {
+		uint32_t sum = area / 2;
+		for (unsigned int i = 0; i < k; i ++)
+			sum += row[x * k + i];
+		d[x] = (sum * recip) >> 32;
+	}
+}
+
+static void row_Bilinear(uint8_t * restrict d, const uint16_t * restrict row, const uint32_t * restrict left, const uint16_t * restrict weight, const unsigned int width)
+{
+	for (unsigned int x = 0; x < width; x ++)
+		d[x] = (row[left[x]] * (256 - weight[x]) + row[left[x] + 1] * weight[x] + 32768) >> 16;
+}
+
+// Average each k x k block: sum k rows, then k columns of the sum
+static void scale_Box(struct scaler * const s, const uint8_t * src, const int srcStride, uint8_t * const dst, const int dstStride)
+{
+	const unsigned int k = s->factor;
+
+	for (unsigned int y = 0; y < s->dstHeight; y ++) {
+		row_Load(s->row, src, s->srcWidth);
+		for (unsigned int j = 1; j < k; j ++)
+			row_Add(s->row, src + j * srcStride, s->srcWidth);
+
+		if (k == 2)
+			row_Box2(dst + y * dstStride, s->row, s->dstWidth);
+		else
+			row_Box(dst + y * dstStride, s->row, k, s->dstWidth);
+
+		src += k * srcStride;
+	}
+}
+
+// Blend the two nearest rows, then the two nearest columns of the blend
+static void scale_Bilinear(struct scaler * const s, const uint8_t * const src, const int srcStride, uint8_t * const dst, const int dstStride)
+{
+	for (unsigned int y = 0; y < s->dstHeight; y ++) {
+		uint32_t top;
+		uint16_t w;
+
+		scale_Position(y, s->srcHeight, s->dstHeight, &top, &w);
+
+		const uint8_t * const a = src + top * srcStride;
+		row_Blend(s->row, a, (w ? a + srcStride : a), w, s->srcWidth);
+		// so the last column can blend with "the next" too
+		s->row[s->srcWidth] = s->row[s->srcWidth - 1];
+
+		row_Bilinear(dst + y * dstStride, s->row, s->x, s->weight, s->dstWidth);
+	}
+}
+
+void scale_Plane(struct scaler * const s, const uint8_t * const src, const int srcStride, uint8_t * const dst, const int dstStride)
+{
+	if (s->factor == 1) {
+		for (unsigned int y = 0; y < s->dstHeight; y ++)
+			memcpy(dst + y * dstStride, src + y * srcStride, s->dstWidth);
+	} else if (s->factor)
+		scale_Box(s, src, srcStride, dst, dstStride);
+	else
+		scale_Bilinear(s, src, srcStride, dst, dstStride);
+}
+
+void scale_Close(struct scaler * const s)
+{
+	free(s->x);
+	free(s->weight);
+	free(s->row);
+	memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,37 @@
+/* ***************************************************
+scale: 8-bit plane downscaling
+Greg Kennedy 2021
+
+Resizes one plane of a picture, e.g. for the renditions
+ of an ABR ladder.  Whole-number ratios (2:1, 3:1 ...)
+ use a box filter, averaging each k x k block; anything
+ else is bilinear.  Both work a row at a time in 16-bit
+ fixed point, with contiguous inner loops that the
+ compiler vectorises at -O2 and up.
+*************************************************** */
+#ifndef SCALE_H_
+#define SCALE_H_
+
+#include <stdint.h>
+
+struct scaler {
+	unsigned int srcWidth, srcHeight, dstWidth, dstHeight;
+	unsigned int factor;	// box filter factor, or 0 for bilinear
+
+	// bilinear: left source column and weight (of 256) of the right one, per output column
+	uint32_t * x;
+	uint16_t * weight;
+
+	uint16_t * row;	// one filtered source row (or sum of rows), srcWidth + 1 wide
+};
+
+// Set up scaling a srcWidth x srcHeight plane to dstWidth x dstHeight
+//  Returns 0 on failure.  A zeroed struct scaler is safe to close.
+int scale_Init(struct scaler * s, unsigned int srcWidth, unsigned int srcHeight, unsigned int dstWidth, unsigned int dstHeight);
+
+// Scale one plane; strides are in bytes
+void scale_Plane(struct scaler * s, const uint8_t * src, int srcStride, uint8_t * dst, int dstStride);
+
+void scale_Close(struct scaler * s);
+
+#endif
@@ -0,0 +1,270 @@
+/* ***************************************************
+shmring: raw I420 frames through shared memory
+Greg Kennedy 2021
+*************************************************** */
+#include "shmring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define PAGE 4096
+#define ROUND_UP(n, to) (((n) + (to) - 1) / (to) * (to))
+
+// Wait up to timeout ms while *word still holds value
+//  Shared (not private) futexes, since the word is in another process too.
+static void shmring_Wait(atomic_uint * const word, const unsigned int value, const int timeout)
+{
+#ifdef __linux__
+	const struct timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+
+	syscall(SYS_futex, word, FUTEX_WAIT, value, &ts, NULL, 0);
+#else
+	// no portable cross-process futex: look again every millisecond
+	const struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+
+	for (int i = 0; i < timeout && atomic_load(word) == value; i ++)
+		nanosleep(&ts, NULL);
+#endif
+}
+
+static void shmring_Wake(atomic_uint * const word)
+{
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+#else
+	(void)word;
+#endif
+}
+
+// Map an open shared memory object
+static int shmring_Map(struct shmring * const s, const int fd, const size_t size)
+{
+	void * const p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (p == MAP_FAILED) {
+		perror("Failed to map frame ring");
+		return 0;
+	}
+
+	s->base = p;
+	s->size = size;
+	s->h = p;
+	return 1;
+}
+
+/* ************************************************************************ */
+int shmring_Create(struct shmring * const s, const char * const name, const unsigned int width, const unsigned int height, const unsigned int fpsNum, const unsigned int fpsDen, const unsigned int slots)
+{
+	memset(s, 0, sizeof(*s));
+
+	if (width == 0 || height == 0 || width % 2 || height % 2 || fpsNum == 0 || fpsDen == 0 ||
+		slots < 2 || slots > SHMRING_MAX_SLOTS) {
+		fprintf(stderr, "Bad frame ring geometry %ux%u, %u/%u fps, %u slots\n", width, height, fpsNum, fpsDen, slots);
+		return 0;
+	}
+
+	// planes start on 64 byte boundaries, which suit SIMD loads
+	const uint32_t lumaSize = ROUND_UP(width * height, 64);
+	const uint32_t chromaSize = ROUND_UP((width / 2) * (height / 2), 64);
+	const uint32_t slotSize = ROUND_UP(lumaSize + 2 * chromaSize, PAGE);
+	const size_t size = ROUND_UP(sizeof(struct shmring_header), PAGE) + (size_t)slots * slotSize;
+
+	const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create frame ring %s: ", name);
+		perror(NULL);
+		return 0;
+	}
+
+	if ((s->name = strdup(name)) == NULL || ftruncate(fd, size) != 0 || ! shmring_Map(s, fd, size)) {
+		perror("Failed to set up frame ring");
+		close(fd);
+		shm_unlink(name);
+		free(s->name);
+		s->name = NULL;
+		return 0;
+	}
+	close(fd);
+
+	struct shmring_header * const h = s->h;
+	h->version = SHMRING_VERSION;
+	h->width = s->width = width;
+	h->height = s->height = height;
+	h->fpsNum = s->fpsNum = fpsNum;
+	h->fpsDen = s->fpsDen = fpsDen;
+	h->slots = s->slots = slots;
+	h->slotSize = s->slotSize = slotSize;
+	h->plane[0] = s->plane[0] = 0;
+	h->plane[1] = s->plane[1] = lumaSize;
+	h->plane[2] = s->plane[2] = lumaSize + chromaSize;
+	h->stride[0] = s->stride[0] = width;
+	h->stride[1] = s->stride[1] = width / 2;
+	h->stride[2] = s->stride[2] = width / 2;
+
+	// a consumer checks the magic last, so it never sees a half-written header
+	atomic_thread_fence(memory_order_release);
+	h->magic = SHMRING_MAGIC;
+	return 1;
+}
+
+uint8_t * shmring_Acquire(struct shmring * const s, const int timeout)
+{
+	struct shmring_header * const h = s->h;
+	const unsigned int head = atomic_load_explicit(&h->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&h->tail, memory_order_acquire);
+
+	if (head - tail == s->slots) {
+		shmring_Wait(&h->tail, tail, timeout);
+		tail = atomic_load_explicit(&h->tail, memory_order_acquire);
+
+		if (head - tail == s->slots)
+			return NULL;
+	}
+
+	return s->base + ROUND_UP(sizeof(struct shmring_header), PAGE) + (size_t)(head % s->slots) * s->slotSize;
+}
+
+void shmring_Publish(struct shmring * const s, const uint64_t time)
+{
+	struct shmring_header * const h = s->h;
+	const unsigned int head = atomic_load_explicit(&h->head, memory_order_relaxed);
+
+	h->time[head % s->slots] = time;
+	atomic_store_explicit(&h->head, head + 1, memory_order_release);
+	shmring_Wake(&h->head);
+}
+
+int shmring_Open(struct shmring * const s, const char * const name)
+{
+	memset(s, 0, sizeof(*s));
+
+	const int fd = shm_open(name, O_RDWR, 0);
+
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open frame ring %s: ", name);
+		perror(NULL);
+		return 0;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct shmring_header) ||
+		! shmring_Map(s, fd, st.st_size)) {
+		fprintf(stderr, "%s is not a frame ring\n", name);
+		close(fd);
+		shmring_Close(s);
+		return 0;
+	}
+	close(fd);
+
+	// take the geometry once, and check it against the mapping,
+	//  so a confused producer can't send us reading out of bounds
+	const struct shmring_header * const h = s->h;
+
+	if (h->magic != SHMRING_MAGIC || h->version != SHMRING_VERSION) {
+		fprintf(stderr, "%s is not a frame ring, or a different version\n", name);
+		goto fail;
+	}
+	atomic_thread_fence(memory_order_acquire);
+
+	s->width = h->width;
+	s->height = h->height;
+	s->fpsNum = h->fpsNum;
+	s->fpsDen = h->fpsDen;
+	s->slots = h->slots;
+	s->slotSize = h->slotSize;
+	memcpy(s->plane, h->plane, sizeof(s->plane));
+	memcpy(s->stride, h->stride, sizeof(s->stride));
+
+	const uint64_t chromaHeight = s->height / 2;
+	const uint64_t ends[3] = {
+		s->plane[0] + (uint64_t)s->stride[0] * s->height,
+		s->plane[1] + (uint64_t)s->stride[1] * chromaHeight,
+		s->plane[2] + (uint64_t)s->stride[2] * chromaHeight
+	};
+
+	int ok = (s->width && s->height && s->width % 2 == 0 && s->height % 2 == 0 &&
+		s->fpsNum && s->fpsDen && s->slots >= 2 && s->slots <= SHMRING_MAX_SLOTS &&
+		s->stride[0] >= s->width && s->stride[1] >= s->width / 2 && s->stride[2] >= s->width / 2 &&
+		ROUND_UP(sizeof(struct shmring_header), PAGE) + (uint64_t)s->slots * s->slotSize <= s->size);
+
+	for (int i = 0; i < 3; i ++)
+		ok &= (ends[i] <= s->slotSize);
+
+	if (! ok) {
+		fprintf(stderr, "Frame ring %s has a bad geometry\n", name);
+		goto fail;
+	}
+
+	return 1;
+
+fail:
+	shmring_Close(s);
+	return 0;
+}
+
+const uint8_t * shmring_Next(struct shmring * const s, uint64_t * const time, const int timeout)
+{
+	struct shmring_header * const h = s->h;
+	const unsigned int tail = atomic_load_explicit(&h->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&h->head, memory_order_acquire);
+
+	if (head == tail) {
+		if (atomic_load(&h->closed))
+			return NULL;
+
+		shmring_Wait(&h->head, head, timeout);
+		head = atomic_load_explicit(&h->head, memory_order_acquire);
+
+		if (head == tail)
+			return NULL;
+	}
+
+	*time = h->time[tail % s->slots];
+	return s->base + ROUND_UP(sizeof(struct shmring_header), PAGE) + (size_t)(tail % s->slots) * s->slotSize;
+}
+
+int shmring_Done(struct shmring * const s)
+{
+	return (atomic_load(&s->h->closed) &&
+		atomic_load(&s->h->head) == atomic_load_explicit(&s->h->tail, memory_order_relaxed));
+}
+
+void shmring_Release(struct shmring * const s)
+{
+	struct shmring_header * const h = s->h;
+
+	atomic_fetch_add_explicit(&h->tail, 1, memory_order_release);
+	shmring_Wake(&h->tail);
+}
+
+void shmring_Close(struct shmring * const s)
+{
+	if (s->h && s->name) {
+		// wake a consumer waiting for a frame, so it sees the end
+		atomic_store(&s->h->closed, 1);
+		shmring_Wake(&s->h->head);
+	}
+
+	if (s->base)
+		munmap(s->base, s->size);
+
+	if (s->name) {
+		shm_unlink(s->name);
+		free(s->name);
+	}
+
+	memset(s, 0, sizeof(*s));
+}
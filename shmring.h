@@ -0,0 +1,96 @@
+/* ***************************************************
+shmring: raw I420 frames through shared memory
+Greg Kennedy 2021
+
+A ring of frame slots in a POSIX shared memory object,
+ passing frames from one producer process (a capture or
+ compositing process) to one consumer (testpattern)
+ without copying them.  The producer creates the ring
+ and fills slots in place; the consumer encodes straight
+ out of each slot, then hands it back.  Waiting on
+ either side is a futex on the shared counters on Linux,
+ and a short sleep and re-check elsewhere.
+
+The producer side links shmring.c too:
+	shmring_Create(&ring, "/camera", 1920, 1080, 60, 1, 4);
+	while (capturing) {
+		uint8_t * slot = shmring_Acquire(&ring, 100);
+		(fill ring.plane[0..2] offsets of slot, with ring.stride[0..2])
+		shmring_Publish(&ring, capture_time_us);
+	}
+	shmring_Close(&ring);
+*************************************************** */
+#ifndef SHMRING_H_
+#define SHMRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SHMRING_MAGIC 0x524D4853	// "SHMR"
+#define SHMRING_VERSION 1
+#define SHMRING_MAX_SLOTS 64
+
+// The start of the shared object: the slots follow, page aligned
+struct shmring_header {
+	uint32_t magic, version;
+
+	uint32_t width, height;
+	uint32_t fpsNum, fpsDen;	// nominal rate, for the encoder settings
+
+	uint32_t slots, slotSize;
+	// each plane's offset within a slot, and its stride in bytes
+	uint32_t plane[3], stride[3];
+
+	// frames published and frames released, counting up forever: the next
+	//  slot to fill is head % slots, the next to read is tail % slots
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+	atomic_uint closed;	// the producer has finished
+
+	// capture time of the frame in each slot, microseconds from any origin
+	uint64_t time[SHMRING_MAX_SLOTS];
+};
+
+struct shmring {
+	struct shmring_header * h;
+	uint8_t * base;	// the whole mapping
+	size_t size;
+
+	char * name;	// kept by the producer, to unlink on close
+
+	// copied out of the header, once checked
+	unsigned int width, height, fpsNum, fpsDen, slots;
+	uint32_t slotSize, plane[3], stride[3];
+};
+
+// Producer: create the named ring with room for slots frames
+//  Returns 0 on failure.  A zeroed struct shmring is safe to close.
+int shmring_Create(struct shmring * s, const char * name, unsigned int width, unsigned int height, unsigned int fpsNum, unsigned int fpsDen, unsigned int slots);
+
+// Producer: the next slot to fill, waiting up to timeout ms while the
+//  consumer has every slot.  Returns NULL on timeout.
+uint8_t * shmring_Acquire(struct shmring * s, int timeout);
+
+// Producer: hand the slot filled since shmring_Acquire to the consumer
+void shmring_Publish(struct shmring * s, uint64_t time);
+
+// Consumer: open a ring created by a producer
+//  Returns 0 if there is no such ring, or it is not one.
+int shmring_Open(struct shmring * s, const char * name);
+
+// Consumer: the oldest frame not yet read, waiting up to timeout ms for one
+//  The slot stays the consumer's until shmring_Release.  Returns NULL on
+//  timeout, or if the producer has closed and every frame has been read.
+const uint8_t * shmring_Next(struct shmring * s, uint64_t * time, int timeout);
+
+// Consumer: true once the producer has closed, and every frame has been read
+int shmring_Done(struct shmring * s);
+
+// Consumer: give the slot from shmring_Next back to the producer
+void shmring_Release(struct shmring * s);
+
+// Unmap the ring.  The producer also marks it closed, and unlinks it.
+void shmring_Close(struct shmring * s);
+
+#endif
@@ -4,10 +4,20 @@ Greg Kennedy 2021
 
 Generates a test pattern, encodes it with x264,
  casts it to RTMP url
+
+With a ladder (-L), the pattern is generated once at
+ the largest size, scaled down for each rendition, and
+ every rendition encoded in parallel on its own thread
+ and sent to its own URL, with keyframes aligned.
+
+With -s, frames come from another process through a
+ shared memory ring (shmring) instead, and are encoded
+ straight out of its slots.  With -i, they come from a
+ Y4M or raw I420 file (yuvfile), encoded straight out of
+ its mapping.
 *************************************************** */
 
 // push packets to stream
-#include <librtmp/rtmp.h>
 #include <librtmp/log.h>
 
 // other necessary includes
@@ -16,273 +26,238 @@ Generates a test pattern, encodes it with x264,
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
 
 #include <stdint.h>
 
-#include <sys/time.h>
-
 // h.264 encoder lib
 //  this requires stdint.h first or else it complains...
 #include <x264.h>
 
-// maximum size of a tag is 11 byte header, 0xFFFFFF payload, 4 byte size
-#define MAX_TAG_SIZE 11 + 16777215 + 4
-
-// video output parameters
+// FLV tag and AMF serialization
+#include "flv.h"
+// runtime statistics
+#include "metrics.h"
+// RTMP connection, with reconnect
+#include "rtmpout.h"
+// frame pacing
+#include "frameclock.h"
+// seekable FLV recording
+#include "flvrec.h"
+// downscaling for the renditions
+#include "scale.h"
+// raw frames from another process
+#include "shmring.h"
+// raw frames from a file
+#include "yuvfile.h"
+// encoded frame size statistics
+#include "framesize.h"
+// messages, written out off the streaming thread
+#include "logger.h"
+// real or virtual time
+#include "vclock.h"
+
+// video output parameters, for the test pattern without a ladder,
+//  and the default for raw video files
 //#define WIDTH 1920
 //#define HEIGHT 1080
 #define WIDTH 640
 #define HEIGHT 360
 #define FPS 24
 
-// some calculations in advance
-#define TIMESTAMP_INCREMENT (1000.0 / FPS)
-
-// turn this on to write a sidecar "out.flv", useful for debugging
-#define DEBUG 1
-
-// get "now" in milliseconds
-static uint32_t getTimestamp()
-{
-	struct timeval timecheck;
-	gettimeofday(&timecheck, NULL);
-	return timecheck.tv_sec * 1000 + timecheck.tv_usec / 1000;
-}
-
-// helper functions
-//  write uint16_t into 16 bits big-endian
-static uint8_t * u16be(uint8_t * const p, const uint16_t value)
-{
-	*p = value >> 8 & 0xFF;
-	*(p + 1) = value & 0xFF;
-	return p + 2;
-}
-
-//  write uint32_t into 24 bits big-endian
-static uint8_t * u24be(uint8_t * const p, const uint32_t value)
-{
-	*p = value >> 16 & 0xFF;
-	*(p + 1) = value >> 8 & 0xFF;
-	*(p + 2) = value & 0xFF;
-	return p + 3;
-}
+// every rendition gets an IDR this often (ms)
+//  also the most to encode ahead while the connection is set up: one GOP
+#define KEYFRAME_INTERVAL 1000
 
-//  write uint32_t into 32 bits big-endian
-static uint8_t * u32be(uint8_t * const p, const uint32_t value)
-{
-	*p = value >> 24 & 0xFF;
-	*(p + 1) = value >> 16 & 0xFF;
-	*(p + 2) = value >> 8 & 0xFF;
-	*(p + 3) = value & 0xFF;
-	return p + 4;
-}
+// how long to wait for a frame from the ring before servicing the connections (ms)
+#define RING_TIMEOUT 100
 
-// deconstruct a host-native double, repack it as big-endian IEEE 754 double
-//  this attempts to figure out endianness of the input by casting it to uint8_t
-static uint8_t * f64be(uint8_t * const p, const double input)
-{
-	const uint8_t * const value = (uint8_t *)&input;
-	static const double testVal = 1;
-	static const uint8_t testBE[8] = { 0x3F, 0xF0 };
-	static const uint8_t testLE[8] = { 0, 0, 0, 0, 0, 0, 0xF0, 0x3F };
+// most renditions in a ladder
+#define MAX_RENDITIONS 8
 
-	if (memcmp(&testVal, testBE, 8) == 0) {
-		// already in big-endian
-		memcpy(p, value, 8);
-	} else { // if (memcmp(&testVal, testLE, 8) == 0)
-		// byteswap
-		for (int i = 0; i < 8; i++)
-			p[i] = value[7 - i];
-	}
+// most values on one axis of a benchmark matrix
+#define MAX_AXIS_VALUES 16
 
-	return p + 8;
-}
-
-// "pascal" string (uint16 strlen, string content)
-static uint8_t * pstring(uint8_t * const p, const char * const str)
-{
-	uint16_t string_length = strlen(str);
-	*p = string_length >> 8 & 0xFF;
-	*(p + 1) = string_length & 0xFF;
-	memcpy(p + 2, str, string_length);
-	return p + 2 + string_length;
-}
+// turn this on to record a sidecar "out.flv" by default, useful for debugging
+#define DEBUG 1
 
-// AMF (Action Message Format) serializers
-//  Number (double floating-point)
-static uint8_t * amf_number(uint8_t * const p, const double value)
-{
-	*p = 0x00;
-	return f64be(p + 1, value);
-}
+// one rung of the ladder: its own encoder, connection and tag buffer
+struct rendition {
+	unsigned int width, height;
+	unsigned int kbps;	// average bitrate, or 0 for constant quality
+	unsigned int fpsNum, fpsDen;	// the source's frame rate
 
-//  String
-static uint8_t * amf_string(uint8_t * const p, const char * const str)
-{
-	*p = 0x02;
-	return pstring(p + 1, str);
-}
+	const char * url;
+	char * urlCopy;	// when the URL was made from the base one
 
-// Beginning of an Associative Array
-static uint8_t * amf_ecma_array(uint8_t * const p, const uint32_t entries)
-{
-	*p = 0x08;
-	return u32be(p + 1, entries);
-}
+	x264_t * encoder;
+	// the rendition's picture: its own planes when scaled,
+	//  otherwise it points straight at the source picture
+	x264_picture_t pic_in;
+	int scaled;
+	struct scaler luma, chroma;
 
-// Closing an Associative Array (final entry)
-static uint8_t * amf_ecma_array_end(uint8_t * const p)
-{
-	return u24be(p, 0x000009);
-}
+	uint8_t * tagBuffer;
+	struct flv_tag tag;
 
-// Entry to an array, as string key and double value
-static uint8_t * amf_ecma_array_entry(uint8_t * const p, const char * const str, const double value)
-{
-	return amf_number(pstring(p, str), value);
-}
+	struct rtmpout out;
+	struct flvrec * rec;	// the recording, kept of the first rendition only
 
-// some h264 output helpers
+	struct framesize sizes;
 
-// AVCDecoder record - some of this data comes out of the SPS for this block
-static uint8_t * h264_AVCDecoderConfigurationRecord(
-	uint8_t * p,
-	const uint8_t * const sps,
-	const uint16_t sps_length,
-	const uint8_t * const pps,
-	const uint16_t pps_length)
-{
-	*p = 0x01;	// version
-	*(p + 1) = sps[1];	// Required profile ID
-	*(p + 2) = sps[2];	// Profile compatibility
-	*(p + 3) = sps[3];	// AVC Level (3.0)
-	*(p + 4) = 0b11111100 | 0b11;	// NAL lengthSizeMinusOne (4 bytes)
-	*(p + 5) = 0b11100000 | 1;	// number of SPS sets
-	p += 6;
-
-	// write the SPS - length (uint16), then data
-	p = u16be(p, sps_length);
-	memcpy(p, sps, sps_length);
-	p += sps_length;
-
-	// write the PPS now
-	p = u16be(p, pps_length);
-	memcpy(p, pps, pps_length);
-	p += pps_length;
-
-	return p;
-}
-
-// sets up the first 11 bytes of a tag
-//  returns pointer to the start of payload area
-static uint8_t * flv_TagHeader(uint8_t * p, const uint8_t type, const uint32_t timestamp)
-{
-	*p = type; p ++; // message type
-	// tag[1 - 3] are the message size, which we don't know yet
-	p += 3;
+	pthread_t thread;
+	int failed;
+};
 
-	// FLV timestamp is written in an odd format
-	p = u24be(p, timestamp & 0x00FFFFFF);
-	*p = timestamp >> 24 & 0xFF; p ++;
+// the frame being encoded, handed from the main loop to the encode threads
+struct job {
+	pthread_mutex_t mutex;
+	pthread_cond_t start, done;
 
-	return u24be(p, 0); // stream ID
-}
+	const x264_picture_t * source;
+	uint32_t timestamp;	// ms
+	int idr;	// force an IDR on every rendition
 
-// Finishes a tag (corrects Payload Size in bytes 1-3, and appends Tag Size)
-//  Returns complete tag size, ready for writing
-static uint32_t flv_TagFinish(uint8_t * tag, uint8_t * p)
-{
-	uint32_t payloadSize = p - (tag + 11);
-	u24be(tag + 1, payloadSize);
-	u32be(p, 11 + payloadSize);
+	unsigned long generation;	// bumped for each frame
+	unsigned int pending;	// renditions still encoding it
+	int stop;
+};
 
-	return 11 + payloadSize + 4;
-}
+struct worker {
+	struct rendition * r;
+	struct job * job;
+};
 
-// FLV Video Packet (AVC format)
-//  Composition Time is 0 for all-I frames, but otherwise should be the time diff. between PTS and DTS
-static uint8_t * flv_AVCVideoPacket(uint8_t * const p, const unsigned int keyframe, const unsigned int type, const long composition_time)
-{
-	if (keyframe)
-		*p = 0x17;
-	else
-		*p = 0x27;
-
-	*(p + 1) = type;
-	return u24be(p + 2, composition_time);
-}
+// embed each frame's send time (-t), to measure latency at the other end
+static enum flv_timecode timecode = TIMECODE_NONE;
 
+// refresh the picture a column at a time (-I), instead of with IDRs
+static int intraRefresh;
 
 // make a test pattern into pic_in
 //  the pattern is based on value of timestamp, so there's some motion
-static void build_picture(x264_picture_t * pic, const uint32_t timestamp)
+static void build_picture(x264_picture_t * pic, const unsigned int width, const unsigned int height, const uint32_t timestamp)
 {
-	//int luma_size = WIDTH * HEIGHT;
-	//int chroma_size = WIDTH * HEIGHT / 4;
+	const int stride = pic->img.i_stride[0];
+	const int chroma_stride = pic->img.i_stride[1];
 
 	// luma
-	for (unsigned int y = 0; y < HEIGHT; y ++) {
-		for (unsigned int x = 0; x < WIDTH; x ++)
-			pic->img.plane[0][y * WIDTH + x] = (y + timestamp) % 256;
+	for (unsigned int y = 0; y < height; y ++) {
+		for (unsigned int x = 0; x < width; x ++)
+			pic->img.plane[0][y * stride + x] = (y + timestamp) % 256;
 	}
 
 	// chroma
-	for (unsigned int y = 0; y < HEIGHT / 2; y ++) {
-		for (unsigned int x = 0; x < WIDTH / 2; x ++) {
-			pic->img.plane[1][y * WIDTH / 2 + x] = 127;
-			pic->img.plane[2][y * WIDTH / 2 + x] = 127;
+	for (unsigned int y = 0; y < height / 2; y ++) {
+		for (unsigned int x = 0; x < width / 2; x ++) {
+			pic->img.plane[1][y * chroma_stride + x] = 127;
+			pic->img.plane[2][y * chroma_stride + x] = 127;
 		}
 	}
 }
 
-// Flag to indicate whether we should keep playing the movie
-//  Set to 0 to close the program
-static int running;
-// replacement signal handler that sets running to 0 for clean shutdown
-static void sig_handler(int signum)
+// Parse a ladder, e.g. "1920x1080:6000,1280x720:3000,640x360:800"
+//  each rung is WIDTHxHEIGHT, and optionally :kbps for an average bitrate
+//  Returns the number of renditions, or 0 if the ladder is malformed.
+static unsigned int parse_ladder(const char * spec, struct rendition * const ladder)
 {
-	fprintf(stderr, "Received signal %d (%s), exiting.\n", signum, strsignal(signum));
-	running = 0;
-}
+	unsigned int count = 0;
 
-/* *************************************************** */
-int main(int argc, char * argv[])
-{
-	int ret = EXIT_SUCCESS;
+	while (*spec) {
+		if (count == MAX_RENDITIONS) {
+			fprintf(stderr, "At most %d renditions are supported\n", MAX_RENDITIONS);
+			return 0;
+		}
 
-	// verify one parameter passed
-	if (argc != 2) {
-		printf("X264 + RTMP example code\nUsage:\n\t%s <URL>\n", argv[0]);
-		goto exit;
+		struct rendition * const r = &ladder[count];
+		int used = 0;
+
+		if (sscanf(spec, "%ux%u%n", &r->width, &r->height, &used) != 2)
+			goto bad;
+		spec += used;
+
+		if (*spec == ':') {
+			if (sscanf(spec + 1, "%u%n", &r->kbps, &used) != 1)
+				goto bad;
+			spec += 1 + used;
+		}
+
+		// I420 halves the chroma planes, so sizes must be even
+		if (r->width == 0 || r->height == 0 || r->width % 2 || r->height % 2) {
+			fprintf(stderr, "Rendition %ux%u must have an even, nonzero width and height\n", r->width, r->height);
+			return 0;
+		}
+
+		count ++;
+
+		if (*spec == ',')
+			spec ++;
+		else if (*spec)
+			goto bad;
 	}
 
-	FILE * fDebug;
+	return count;
 
-if (DEBUG) {
-	const uint8_t flvHeader[] = { 0x46, 0x4C, 0x56, 0x01, 0x01, 0, 0, 0, 9, 0, 0, 0, 0 };
-	fDebug = fopen("out.flv", "wb");
-	fwrite(flvHeader, 1, 13, fDebug);
+bad:
+	fprintf(stderr, "Can't parse ladder at '%s', expected WIDTHxHEIGHT[:kbps][,...]\n", spec);
+	return 0;
 }
+
+// Open the encoder for a rendition, and its picture and tag buffer
+static int rendition_Open(struct rendition * const r, const unsigned int sourceWidth, const unsigned int sourceHeight)
+{
 	/* *************************************************** */
 	// Initialize the x264 encoder
 	//  First set up the parameters struct
 	x264_param_t param;
 	x264_param_default_preset(&param, "veryfast", "zerolatency");
 	param.i_log_level = X264_LOG_DEBUG;
+	param.pf_log = logger_X264;
+	// renditions encode in parallel, one thread each
 	param.i_threads = 1;
-	param.i_width = WIDTH;
-	param.i_height = HEIGHT;
-	param.i_fps_num = FPS;
-	param.i_fps_den = 1;
-	param.i_keyint_max = FPS;
-
-	// Enable intra refresh instead of IDR
-	//param.b_intra_refresh = 1;
+	param.i_width = r->width;
+	param.i_height = r->height;
+	param.i_fps_num = r->fpsNum;
+	param.i_fps_den = r->fpsDen;
+
+	// keyframes are forced by the main loop, on the same frames for every
+	//  rendition, so x264 must not place any of its own
+	param.i_keyint_max = X264_KEYINT_MAX_INFINITE;
+	param.i_scenecut_threshold = 0;
+
+	// Intra refresh instead of IDR: a column of intra blocks sweeps across
+	//  the picture once per keyint, so no frame is much bigger than the
+	//  rest.  Every rendition has the same keyint and sees the same frames,
+	//  so their refreshes start together, as the IDRs would.
+	if (intraRefresh) {
+		param.b_intra_refresh = 1;
+		param.i_keyint_max = (uint64_t)KEYFRAME_INTERVAL * r->fpsNum / (1000 * r->fpsDen);
+		if (param.i_keyint_max < 2)
+			param.i_keyint_max = 2;
+	}
 
 	//Rate control:
-	param.rc.i_rc_method = X264_RC_CRF;
-	param.rc.f_rf_constant = 25;
-	param.rc.f_rf_constant_max = 35;
+	if (r->kbps) {
+		// average bitrate, held to it over a one second VBV buffer
+		param.rc.i_rc_method = X264_RC_ABR;
+		param.rc.i_bitrate = r->kbps;
+		param.rc.i_vbv_max_bitrate = r->kbps;
+		param.rc.i_vbv_buffer_size = r->kbps;
+
+		// a buffer of one frame holds every frame near the average size,
+		//  which intra refresh allows, as there is no IDR to make room for
+		if (intraRefresh) {
+			param.rc.i_vbv_buffer_size = (uint64_t)r->kbps * r->fpsDen / r->fpsNum;
+			if (param.rc.i_vbv_buffer_size < 1)
+				param.rc.i_vbv_buffer_size = 1;
+		}
+	} else {
+		param.rc.i_rc_method = X264_RC_CRF;
+		param.rc.f_rf_constant = 25;
+		param.rc.f_rf_constant_max = 35;
+	}
 
 	// Control x264 output for muxing
 	param.b_aud = 0; // do not generate Access Unit Delimiters
@@ -294,98 +269,104 @@ if (DEBUG) {
 
 	/* *************************************************** */
 	// All done setting up params!  Let's open an encoder
-	x264_t * encoder = x264_encoder_open(&param);
+	r->encoder = x264_encoder_open(&param);
 	// can free the param struct now
 	x264_param_cleanup(&param);
 
-	// These are the two picture structs.  Input must be alloc()
-	//  Output will be created by the encode process
-	x264_picture_t pic_in, pic_out;
-	x264_picture_alloc(&pic_in, X264_CSP_I420, WIDTH, HEIGHT);
+	if (r->encoder == NULL) {
+		logger_Printf(stderr, "Failed to open x264 encoder for %ux%u\n", r->width, r->height);
+		return 0;
+	}
 
-	/* *************************************************** */
-	// allocate a very large buffer for all packets and operations
-	uint8_t * const tag = malloc(MAX_TAG_SIZE);
+	// Input must be alloc(), unless it can be the source picture as it is
+	//  (its planes are taken from the source with each frame)
+	if (r->width == sourceWidth && r->height == sourceHeight)
+		x264_picture_init(&r->pic_in);
+	else {
+		if (x264_picture_alloc(&r->pic_in, X264_CSP_I420, r->width, r->height) < 0) {
+			logger_Printf(stderr, "Failed to allocate rendition picture\n");
+			return 0;
+		}
+		r->scaled = 1;
 
-	if (tag == NULL) {
-		perror("Failed to allocate tag buffer");
-		ret = EXIT_FAILURE;
-		goto freePic;
+		if (! scale_Init(&r->luma, sourceWidth, sourceHeight, r->width, r->height) ||
+			! scale_Init(&r->chroma, sourceWidth / 2, sourceHeight / 2, r->width / 2, r->height / 2))
+			return 0;
 	}
 
 	/* *************************************************** */
-	// Increase the log level for all RTMP actions
-	RTMP_LogSetLevel(RTMP_LOGINFO);
-	RTMP_LogSetOutput(stderr);
-	/* *************************************************** */
-	// Init RTMP code
-	RTMP * r = RTMP_Alloc();
-	RTMP_Init(r);
+	// allocate a very large buffer for all packets and operations
+	r->tagBuffer = malloc(MAX_TAG_SIZE);
 
-	if (r == NULL) {
-		fputs("Failed to create RTMP object\n", stderr);
-		ret = EXIT_FAILURE;
-		goto freeTag;
+	if (r->tagBuffer == NULL) {
+		logger_Printf(stderr, "Failed to allocate tag buffer: %s\n", strerror(errno));
+		return 0;
 	}
 
-	RTMP_SetupURL(r, argv[1]);
-	RTMP_EnableWrite(r);
+	// all tags are built in this buffer, and writes are checked against its size
+	flv_TagInit(&r->tag, r->tagBuffer, MAX_TAG_SIZE);
 
-	// Make RTMP connection to server
-	if (! RTMP_Connect(r, NULL)) {
-		fputs("Failed to connect to remote RTMP server\n", stderr);
-		ret = EXIT_FAILURE;
-		goto freeRTMP;
+	framesize_Init(&r->sizes);
+	return 1;
+}
+
+// Finish the tag built in the rendition's buffer, and send (and record) it
+static int rendition_Send(struct rendition * const r)
+{
+	// calculate tag size and write it
+	const uint32_t tagSize = flv_TagFinish(&r->tag);
+
+	if (tagSize == 0) {
+		logger_Printf(stderr, "Encoded frame does not fit in an FLV tag\n");
+		return 0;
 	}
 
-	// Connect to RTMP stream
-	if (! RTMP_ConnectStream(r, 0)) {
-		fputs("Failed to connect to RTMP stream\n", stderr);
-		ret = EXIT_FAILURE;
-		goto freeRTMP;
+	if (r->rec)
+		flvrec_Write(r->rec, r->tag.buf, tagSize);
+
+	if (! rtmpout_Write(&r->out, r->tag.buf, tagSize)) {
+		logger_Printf(stderr, "Failed to RTMP_Write\n");
+		return 0;
 	}
 
-	// track the fd for rtmp
-	int fd = RTMP_Socket(r);
-	struct timeval tv = {0, 0};
+	return 1;
+}
+
+// Send the onMetaData and the AVC sequence header
+static int rendition_Headers(struct rendition * const r)
+{
+	struct flv_tag * const tag = &r->tag;
 
 	// READY to send the first packet!
 	// First event is the onMetaData, which uses AMF (Action Meta Format)
 	//  to serialize basic stream params
-	uint8_t * p = flv_TagHeader(tag, 18, 0);
+	flv_TagHeader(tag, FLV_TAG_SCRIPT, 0);
 
 	// script data type is "onMetaData"
-	p = amf_string(p, "onMetaData");
+	amf_string(tag, "onMetaData");
 	// associative array with various stream parameters
-	p = amf_ecma_array(p, 4);
-	p = amf_ecma_array_entry(p, "width", WIDTH);
-	p = amf_ecma_array_entry(p, "height", HEIGHT);
-	p = amf_ecma_array_entry(p, "framerate", FPS);
-	p = amf_ecma_array_entry(p, "videocodecid", 7);
+	amf_ecma_array(tag, r->kbps ? 5 : 4);
+	amf_ecma_array_entry(tag, "width", r->width);
+	amf_ecma_array_entry(tag, "height", r->height);
+	amf_ecma_array_entry(tag, "framerate", (double)r->fpsNum / r->fpsDen);
+	amf_ecma_array_entry(tag, "videocodecid", 7);
+	if (r->kbps)
+		amf_ecma_array_entry(tag, "videodatarate", r->kbps);
 	// finalize the array
-	p = amf_ecma_array_end(p);
-
-	// calculate tag size and write it
-	uint32_t tagSize = flv_TagFinish(tag, p);
-
-if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
+	amf_ecma_array_end(tag);
 
-	if (RTMP_Write(r, (const char *)tag, tagSize) <= 0) {
-		fputs("Failed to RTMP_Write\n", stderr);
-		ret = EXIT_FAILURE;
-		goto freeRTMP;
-	}
+	if (! rendition_Send(r))
+		return 0;
 
 	// write the h.264 header now
 	x264_nal_t * pp_nal;
 	int pi_nal;
-	int header_size = x264_encoder_headers(encoder, &pp_nal, &pi_nal);
+	int header_size = x264_encoder_headers(r->encoder, &pp_nal, &pi_nal);
 
 	if (header_size <= 0) {
 		// technically 0 is not an error BUT we call it one anyway
-		fputs("Failed to call x264_encode_headers\n", stderr);
-		ret = EXIT_FAILURE;
-		goto freeRTMP;
+		logger_Printf(stderr, "Failed to call x264_encode_headers\n");
+		return 0;
 	}
 
 	// locate the SPS and PPS
@@ -394,17 +375,15 @@ if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
 	for (int i = 0; i < pi_nal; i ++) {
 		if (pp_nal[i].i_type == NAL_SPS) {
 			if (sps_id > -1) {
-				fputs("ERROR: stream contains multiple SPS, not supported\n", stderr);
-				ret = EXIT_FAILURE;
-				goto freeRTMP;
+				logger_Printf(stderr, "ERROR: stream contains multiple SPS, not supported\n");
+				return 0;
 			}
 
 			sps_id = i;
 		} else if (pp_nal[i].i_type == NAL_PPS) {
 			if (pps_id > -1) {
-				fputs("ERROR: stream contains multiple PPS, not supported\n", stderr);
-				ret = EXIT_FAILURE;
-				goto freeRTMP;
+				logger_Printf(stderr, "ERROR: stream contains multiple PPS, not supported\n");
+				return 0;
 			}
 
 			pps_id = i;
@@ -413,34 +392,758 @@ if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
 
 	//
 	if (sps_id == -1 || pps_id == -1) {
-		fputs("ERROR: x264_encoder_headers missing SPS or PPS\n", stderr);
-		ret = EXIT_FAILURE;
-		goto freeRTMP;
+		logger_Printf(stderr, "ERROR: x264_encoder_headers missing SPS or PPS\n");
+		return 0;
 	}
 
 	// ready to write the tag
-	// First event is the onMetaData, which uses AMF (Action Meta Format)
-	//  to serialize basic stream params
-	p = flv_TagHeader(tag, 9, 0);
+	flv_TagHeader(tag, FLV_TAG_VIDEO, 0);
 
 	// Set up an AVC Video Packet (is keyframe, type 0)
-	p = flv_AVCVideoPacket(p, 1, 0, 0);
+	flv_AVCVideoPacket(tag, 1, 0, 0);
 	// write the decoder config record, the initial SPS and PPS
-	p = h264_AVCDecoderConfigurationRecord(p,
+	h264_AVCDecoderConfigurationRecord(tag,
 			pp_nal[sps_id].p_payload + 4,
-			pp_nal[sps_id].i_payload,
+			pp_nal[sps_id].i_payload - 4,
 			pp_nal[pps_id].p_payload + 4,
-			pp_nal[pps_id].i_payload);
+			pp_nal[pps_id].i_payload - 4);
 
-	// calculate tag size and write it
-	tagSize = flv_TagFinish(tag, p);
+	return rendition_Send(r);
+}
+
+// Scale the source down for this rendition, encode it and send it
+static int rendition_Encode(struct rendition * const r, const x264_picture_t * const source, const uint32_t timestamp, const int idr)
+{
+	if (r->scaled) {
+		scale_Plane(&r->luma, source->img.plane[0], source->img.i_stride[0], r->pic_in.img.plane[0], r->pic_in.img.i_stride[0]);
+		for (int i = 1; i < 3; i ++)
+			scale_Plane(&r->chroma, source->img.plane[i], source->img.i_stride[i], r->pic_in.img.plane[i], r->pic_in.img.i_stride[i]);
+	} else {
+		// the source's planes move from frame to frame when they are ring slots
+		r->pic_in.img = source->img;
+	}
+
+	// with intra refresh, a keyframe is asked for by starting a refresh early
+	if (idr && intraRefresh)
+		x264_encoder_intra_refresh(r->encoder);
+	r->pic_in.i_type = (idr && ! intraRefresh ? X264_TYPE_IDR : X264_TYPE_AUTO);
+
+	/* Encode an x264 frame */
+	x264_picture_t pic_out;
+	x264_nal_t * nals;
+	int i_nals;
+	uint64_t encode_start = metrics_Now();
+	int frame_size = x264_encoder_encode(r->encoder, &nals, &i_nals, &r->pic_in, &pic_out);
+	metrics_Observe(METRIC_VIDEO_ENCODE_TIME, metrics_Now() - encode_start);
+
+	if (frame_size < 0) {
+		// error in encoding
+		logger_Printf(stderr, "Error when encoding frame\n");
+		return 0;
+	} else if (frame_size > 0) {
+		// got an encoded frame
+		framesize_Add(&r->sizes, timestamp, frame_size);
+
+		// the send time, stamped as the frame is handed to the connection
+		const uint64_t wallclock = vclock_Wallclock();
+
+		// an onFI goes just ahead of its frame, with the same timestamp
+		if (timecode == TIMECODE_ONFI) {
+			flv_TagHeader(&r->tag, FLV_TAG_SCRIPT, timestamp);
+			flv_OnFI(&r->tag, wallclock);
+
+			if (! rendition_Send(r))
+				return 0;
+		}
+
+		// Toss into RTMP
+		//  this means building a tag of the correct type and throwing the NAL into it
+		flv_TagHeader(&r->tag, FLV_TAG_VIDEO, timestamp);
+
+		// write every NALU to the packet for this pic
+		//  x264 guarantees all p_payload are sequential
+		flv_AVCVideoPacket(&r->tag, pic_out.b_keyframe, 1, 0);
+		if (timecode == TIMECODE_SEI)
+			h264_TimecodeFrame(&r->tag, nals[0].p_payload, frame_size, wallclock);
+		else
+			flv_Write(&r->tag, nals[0].p_payload, frame_size);
+
+		if (! rendition_Send(r))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void rendition_Close(struct rendition * const r)
+{
+	rtmpout_Close(&r->out);
+
+	if (r->encoder)
+		x264_encoder_close(r->encoder);
+	if (r->scaled)
+		x264_picture_clean(&r->pic_in);
+	scale_Close(&r->luma);
+	scale_Close(&r->chroma);
+	free(r->tagBuffer);
+	free(r->urlCopy);
+}
+
+// Encode thread for one rendition: wait for each frame, and encode it
+static void * worker_Main(void * const arg)
+{
+	struct worker * const w = arg;
+	struct job * const job = w->job;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&job->mutex);
+
+	for (;;) {
+		while (job->generation == seen && ! job->stop)
+			pthread_cond_wait(&job->start, &job->mutex);
+
+		if (job->stop)
+			break;
+
+		seen = job->generation;
+		pthread_mutex_unlock(&job->mutex);
 
-if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
+		// after a failure, just keep step until the main loop stops
+		if (! w->r->failed && ! rendition_Encode(w->r, job->source, job->timestamp, job->idr))
+			w->r->failed = 1;
 
-	if (RTMP_Write(r, (const char *)tag, tagSize) <= 0) {
-		fputs("Failed to RTMP_Write\n", stderr);
+		pthread_mutex_lock(&job->mutex);
+		if (-- job->pending == 0)
+			pthread_cond_signal(&job->done);
+	}
+
+	pthread_mutex_unlock(&job->mutex);
+	return NULL;
+}
+
+// Hand the frame to every encode thread, and wait until all are done with it
+static void job_Run(struct job * const job, const unsigned int count)
+{
+	pthread_mutex_lock(&job->mutex);
+	job->generation ++;
+	job->pending = count;
+	pthread_cond_broadcast(&job->start);
+
+	while (job->pending)
+		pthread_cond_wait(&job->done, &job->mutex);
+	pthread_mutex_unlock(&job->mutex);
+}
+
+// Handle any packets from the servers, and see if any connection is still starting
+//  Returns 0 on a fatal error.
+static int ladder_Poll(struct rendition * const ladder, const unsigned int count, int * const connecting)
+{
+	*connecting = 0;
+
+	for (unsigned int i = 0; i < count; i ++) {
+		if (! rtmpout_Poll(&ladder[i].out))
+			return 0;
+
+		*connecting |= rtmpout_Connecting(&ladder[i].out);
+	}
+
+	return 1;
+}
+
+/* ************************************************************************ */
+// Encoder benchmark (-B): every combination of the matrix (-M) encodes the
+//  same generated clip, without connecting anywhere, as one CSV row each
+enum { AXIS_SIZE, AXIS_PRESET, AXIS_TUNE, AXIS_RC, AXIS_PROFILE, AXIS_THREADS, AXES };
+
+static const char * const axis_names[AXES] = { "size", "preset", "tune", "rc", "profile", "threads" };
+// what testpattern streams with, for any axis the matrix leaves out
+#define STRINGIFY(x) #x
+#define XSTRINGIFY(x) STRINGIFY(x)
+static const char * const axis_defaults[AXES] = { XSTRINGIFY(WIDTH) "x" XSTRINGIFY(HEIGHT), "veryfast", "zerolatency", "crf25", "baseline", "1" };
+
+struct axis {
+	unsigned int count;
+	const char * value[MAX_AXIS_VALUES];
+};
+
+static int in_list(const char * const value, const char * const * list)
+{
+	for (; *list != NULL; list ++)
+		if (strcmp(value, *list) == 0)
+			return 1;
+	return 0;
+}
+
+// Is value one the axis can take
+//  size WIDTHxHEIGHT (even), an x264 preset, tunes joined with + (or none),
+//  rc crfN or a bitrate Nk, an x264 profile, threads (0 = x264 picks)
+static int axis_Check(const int axis, const char * const value)
+{
+	unsigned int a, b;
+	float f;
+	char unit, tail;
+
+	switch (axis) {
+	case AXIS_SIZE:
+		return sscanf(value, "%ux%u%c", &a, &b, &tail) == 2 && a && b && ! (a & 1) && ! (b & 1);
+	case AXIS_PRESET:
+		return in_list(value, x264_preset_names);
+	case AXIS_TUNE: {
+		if (strcmp(value, "none") == 0)
+			return 1;
+
+		char tunes[64];
+		if (strlen(value) >= sizeof(tunes))
+			return 0;
+		strcpy(tunes, value);
+
+		for (char * save, * t = strtok_r(tunes, "+", &save); t != NULL; t = strtok_r(NULL, "+", &save))
+			if (! in_list(t, x264_tune_names))
+				return 0;
+		return 1;
+	}
+	case AXIS_RC:
+		return (sscanf(value, "crf%f%c", &f, &tail) == 1 && f >= 0 && f <= 51) ||
+			(sscanf(value, "%u%c%c", &a, &unit, &tail) == 2 && unit == 'k' && a);
+	case AXIS_PROFILE:
+		return in_list(value, x264_profile_names);
+	case AXIS_THREADS:
+		return sscanf(value, "%u%c", &a, &tail) == 1;
+	}
+
+	return 0;
+}
+
+// Parse a matrix, e.g. "preset=ultrafast,veryfast;rc=crf23,3000k;threads=1,4"
+//  into spec, which the values point into
+static int parse_matrix(char * const spec, struct axis * const axes)
+{
+	for (char * save, * group = strtok_r(spec, ";", &save); group != NULL; group = strtok_r(NULL, ";", &save)) {
+		char * const values = strchr(group, '=');
+		int axis = 0;
+
+		if (values != NULL) {
+			*values = '\0';
+			while (axis < AXES && strcmp(group, axis_names[axis]))
+				axis ++;
+		}
+
+		if (values == NULL || axis == AXES) {
+			fprintf(stderr, "Can't parse benchmark matrix at '%s', expected AXIS=VALUE[,VALUE...] with AXIS one of size, preset, tune, rc, profile, threads\n", group);
+			return 0;
+		}
+
+		axes[axis].count = 0;
+
+		for (char * save2, * v = strtok_r(values + 1, ",", &save2); v != NULL; v = strtok_r(NULL, ",", &save2)) {
+			if (axes[axis].count == MAX_AXIS_VALUES) {
+				fprintf(stderr, "Too many %s values, at most %d\n", axis_names[axis], MAX_AXIS_VALUES);
+				return 0;
+			}
+
+			if (! axis_Check(axis, v)) {
+				fprintf(stderr, "Bad %s '%s' in benchmark matrix\n", axis_names[axis], v);
+				return 0;
+			}
+
+			axes[axis].value[axes[axis].count ++] = v;
+		}
+
+		if (axes[axis].count == 0) {
+			fprintf(stderr, "No %s values in benchmark matrix\n", axis_names[axis]);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Encode frames of the test pattern with one configuration, and print its row
+static int benchmark_Run(const unsigned long frames, const char * const * const v)
+{
+	unsigned int width, height, kbps;
+	float crf;
+	sscanf(v[AXIS_SIZE], "%ux%u", &width, &height);
+
+	// x264 takes several tunes separated by commas, which would split the CSV
+	char tune[64];
+	strcpy(tune, v[AXIS_TUNE]);
+	for (char * c = tune; *c; c ++)
+		if (*c == '+')
+			*c = ',';
+
+	x264_param_t param;
+	if (x264_param_default_preset(&param, v[AXIS_PRESET], strcmp(tune, "none") ? tune : NULL) < 0) {
+		fprintf(stderr, "x264 rejected preset %s / tune %s\n", v[AXIS_PRESET], v[AXIS_TUNE]);
+		return 0;
+	}
+
+	param.i_log_level = X264_LOG_WARNING;
+	param.i_threads = strtoul(v[AXIS_THREADS], NULL, 10);
+	param.i_width = width;
+	param.i_height = height;
+	param.i_fps_num = FPS;
+	param.i_fps_den = 1;
+
+	// IDRs are forced once per KEYFRAME_INTERVAL, as when streaming
+	param.i_keyint_max = X264_KEYINT_MAX_INFINITE;
+	param.i_scenecut_threshold = 0;
+
+	// the same rate control as a rendition with or without a bitrate
+	if (sscanf(v[AXIS_RC], "crf%f", &crf) == 1) {
+		param.rc.i_rc_method = X264_RC_CRF;
+		param.rc.f_rf_constant = crf;
+		param.rc.f_rf_constant_max = crf + 10;
+	} else {
+		kbps = strtoul(v[AXIS_RC], NULL, 10);
+		param.rc.i_rc_method = X264_RC_ABR;
+		param.rc.i_bitrate = kbps;
+		param.rc.i_vbv_max_bitrate = kbps;
+		param.rc.i_vbv_buffer_size = kbps;
+	}
+
+	param.b_aud = 0;
+	param.b_repeat_headers = 1;
+	param.b_annexb = 0;
+
+	// x264 measures each frame against its input
+	param.analyse.b_psnr = 1;
+	param.analyse.b_ssim = 1;
+
+	if (x264_param_apply_profile(&param, v[AXIS_PROFILE]) < 0) {
+		fprintf(stderr, "x264 rejected profile %s with preset %s / tune %s\n", v[AXIS_PROFILE], v[AXIS_PRESET], v[AXIS_TUNE]);
+		x264_param_cleanup(&param);
+		return 0;
+	}
+
+	x264_t * const encoder = x264_encoder_open(&param);
+	x264_param_cleanup(&param);
+
+	if (encoder == NULL) {
+		fprintf(stderr, "Failed to open x264 encoder for %s\n", v[AXIS_SIZE]);
+		return 0;
+	}
+
+	x264_picture_t pic_in, pic_out;
+
+	if (x264_picture_alloc(&pic_in, X264_CSP_I420, width, height) < 0) {
+		fputs("Failed to allocate benchmark picture\n", stderr);
+		x264_encoder_close(encoder);
+		return 0;
+	}
+
+	unsigned long encoded = 0;
+	uint64_t bytes = 0, elapsed = 0;
+	int peak = 0;
+	double psnrY = 0, psnrAvg = 0, ssim = 0;
+	uint32_t nextIdr = 0;
+	int ok = 1;
+
+	// then flush the frames x264 holds back, for lookahead and B-frames
+	for (unsigned long frame = 0; ok && (frame < frames || x264_encoder_delayed_frames(encoder) > 0); frame ++) {
+		x264_picture_t * in = NULL;
+
+		if (frame < frames) {
+			const uint32_t timestamp = frame * 1000 / FPS;
+
+			// only the encode is timed, not making the picture
+			build_picture(&pic_in, width, height, timestamp);
+			pic_in.i_pts = frame;
+			pic_in.i_type = X264_TYPE_AUTO;
+			if (timestamp >= nextIdr) {
+				pic_in.i_type = X264_TYPE_IDR;
+				nextIdr = timestamp + KEYFRAME_INTERVAL;
+			}
+			in = &pic_in;
+		}
+
+		x264_nal_t * nals;
+		int i_nals;
+		const uint64_t start = metrics_Now();
+		const int frame_size = x264_encoder_encode(encoder, &nals, &i_nals, in, &pic_out);
+		elapsed += metrics_Now() - start;
+
+		if (frame_size < 0) {
+			fputs("Error when encoding frame\n", stderr);
+			ok = 0;
+		} else if (frame_size > 0) {
+			encoded ++;
+			bytes += frame_size;
+			if (frame_size > peak)
+				peak = frame_size;
+			psnrY += pic_out.prop.f_psnr[0];
+			psnrAvg += pic_out.prop.f_psnr_avg;
+			ssim += pic_out.prop.f_ssim;
+		}
+	}
+
+	x264_picture_clean(&pic_in);
+	x264_encoder_close(encoder);
+
+	if (! ok || encoded == 0)
+		return 0;
+
+	const double fps = encoded / (elapsed / 1e6);
+	ssim /= encoded;
+
+	printf("%s,%s,%s,%s,%s,%s,%lu,%.2f,%.2f,%.0f,%d,%.1f,%.3f,%.3f,%.5f,%.3f\n",
+		v[AXIS_SIZE], v[AXIS_PRESET], v[AXIS_TUNE], v[AXIS_RC], v[AXIS_PROFILE], v[AXIS_THREADS],
+		encoded, fps, fps / FPS, (double)bytes / encoded, peak, bytes * 8.0 * FPS / encoded / 1000,
+		psnrY / encoded, psnrAvg / encoded, ssim, (ssim < 1 ? -10 * log10(1 - ssim) : 100));
+	fflush(stdout);
+	return 1;
+}
+
+static int x264_Benchmark(const unsigned long frames, const char * const matrix)
+{
+	struct axis axes[AXES];
+
+	for (int a = 0; a < AXES; a ++) {
+		axes[a].count = 1;
+		axes[a].value[0] = axis_defaults[a];
+	}
+
+	char * const spec = strdup(matrix ? matrix : "");
+
+	if (spec == NULL) {
+		perror("Failed to copy benchmark matrix");
+		return EXIT_FAILURE;
+	}
+
+	int ret = EXIT_FAILURE;
+
+	if (! parse_matrix(spec, axes))
+		goto freeSpec;
+
+	unsigned long total = 1;
+	for (int a = 0; a < AXES; a ++)
+		total *= axes[a].count;
+
+	printf("size,preset,tune,rc,profile,threads,frames,encode_fps,realtime,avg_frame_bytes,peak_frame_bytes,kbps,psnr_y,psnr_avg,ssim,ssim_db\n");
+
+	// count through every combination, the last axis changing fastest
+	for (unsigned long n = 0; n < total; n ++) {
+		const char * v[AXES];
+		unsigned long rest = n;
+
+		for (int a = AXES - 1; a >= 0; a --) {
+			v[a] = axes[a].value[rest % axes[a].count];
+			rest /= axes[a].count;
+		}
+
+		if (! benchmark_Run(frames, v))
+			goto freeSpec;
+	}
+
+	ret = EXIT_SUCCESS;
+
+freeSpec:
+	free(spec);
+	return ret;
+}
+
+// Flag to indicate whether we should keep playing the movie
+//  Set to 0 to close the program
+static int running;
+// replacement signal handler that sets running to 0 for clean shutdown
+static void sig_handler(int signum)
+{
+	fprintf(stderr, "Received signal %d (%s), exiting.\n", signum, strsignal(signum));
+	running = 0;
+}
+
+/* *************************************************** */
+int main(int argc, char * argv[])
+{
+	int ret = EXIT_SUCCESS;
+
+	const char * metricsAddress = NULL;
+	int sendBuffer = 0;
+	enum frameclock_policy policy = FRAMECLOCK_BURST;
+	const char * recordPath = (DEBUG ? "out.flv" : NULL);
+	const char * ringName = NULL;
+	const char * inputPath = NULL;
+	// a raw file's size and rate (Y4M files have their own)
+	unsigned int rawWidth = WIDTH, rawHeight = HEIGHT, rawFpsNum = FPS, rawFpsDen = 1;
+	int loop = 0;
+	unsigned long benchmark = 0;
+	const char * matrix = NULL;
+	// the first frame's timestamp, with -T
+	uint32_t firstTimestamp = 0;
+
+	// without -L, a single rendition of the whole source at constant quality
+	struct rendition ladder[MAX_RENDITIONS] = { { 0 } };
+	unsigned int count = 0;
+
+	struct job job = { .mutex = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+	struct worker workers[MAX_RENDITIONS];
+	unsigned int threads = 0;
+
+	// the picture each frame is made from: generated into its own planes,
+	//  or pointing into the ring's slots or the file's mapping
+	x264_picture_t source;
+	int ownSource = 0;
+	struct shmring ring = { 0 };
+	struct yuvfile input = { 0 };
+
+	struct flvrec rec = { 0 };
+
+	int opt;
+	while ((opt = getopt(argc, argv, "m:l:c:o:L:s:i:g:rt:IB:M:T:")) != -1) {
+		switch (opt) {
+		case 'm':
+			metricsAddress = optarg;
+			break;
+		case 'l':
+			sendBuffer = atoi(optarg) * 1024;
+			break;
+		case 'o':
+			recordPath = optarg;
+			break;
+		case 'c':
+			policy = frameclock_Policy(optarg);
+			if (policy == FRAMECLOCK_POLICIES) {
+				fprintf(stderr, "Unknown late frame policy '%s'\n", optarg);
+				ret = EXIT_FAILURE;
+				goto exit;
+			}
+			break;
+		case 'L':
+			memset(ladder, 0, sizeof(ladder));
+			count = parse_ladder(optarg, ladder);
+			if (count == 0) {
+				ret = EXIT_FAILURE;
+				goto exit;
+			}
+			break;
+		case 's':
+			ringName = optarg;
+			break;
+		case 'i':
+			inputPath = optarg;
+			break;
+		case 'g':
+			rawFpsDen = 1;
+			if (sscanf(optarg, "%ux%u@%u/%u", &rawWidth, &rawHeight, &rawFpsNum, &rawFpsDen) < 2 ||
+				rawFpsNum == 0 || rawFpsDen == 0) {
+				fprintf(stderr, "Can't parse raw video geometry '%s', expected WIDTHxHEIGHT[@fps[/den]]\n", optarg);
+				ret = EXIT_FAILURE;
+				goto exit;
+			}
+			break;
+		case 'r':
+			loop = 1;
+			break;
+		case 'I':
+			intraRefresh = 1;
+			break;
+		case 'B':
+			benchmark = strtoul(optarg, NULL, 10);
+			break;
+		case 'M':
+			matrix = optarg;
+			break;
+		case 'T':
+		{
+			char * end;
+			const unsigned long long start = strtoull(optarg, &end, 10);
+			if (*end || end == optarg || start > UINT32_MAX) {
+				fprintf(stderr, "Bad start timestamp '%s', expected 0 to %u ms\n", optarg, UINT32_MAX);
+				ret = EXIT_FAILURE;
+				goto exit;
+			}
+			firstTimestamp = start;
+			vclock_Virtual();
+			break;
+		}
+		case 't':
+			timecode = flv_Timecode(optarg);
+			if (timecode == TIMECODES) {
+				fprintf(stderr, "Unknown timecode '%s'\n", optarg);
+				ret = EXIT_FAILURE;
+				goto exit;
+			}
+			break;
+		default:
+			optind = argc;
+		}
+	}
+
+	if (benchmark && optind == argc) {
+		ret = x264_Benchmark(benchmark, matrix);
+		goto exit;
+	}
+
+	// verify one URL passed, or one per rendition
+	const unsigned int urls = argc - optind;
+
+	if (benchmark || (urls != 1 && urls != (count ? count : 1))) {
+		printf("X264 + RTMP example code\nUsage:\n\t%s [-m metrics_address] [-l kb] [-c burst|skip|rebase] [-o file.flv] [-L ladder] [-s ring | -i file [-g geometry] [-r]] [-t onfi|sei] [-I] [-T start_ms] <URL> [URL ...]\n"
+			"\t%s -B <frames> [-M matrix] > results.csv\n"
+			"Options:\n\t-m\tserve Prometheus metrics on [host:]port or a Unix socket path\n"
+			"\t-l\tlow-latency mode, with a send buffer of this many KB: also measures RTT and send latency\n"
+			"\t-c\twhat to do when frames fall a whole period behind: send them back to back (burst, the default),\n"
+			"\t\tskip ahead to the current frame, or rebase the schedule to now\n"
+			"\t-o\talso record to a seekable FLV file (default out.flv), of the first rendition\n"
+			"\t-L\trenditions to simulcast, e.g. 1920x1080:6000,1280x720:3000,640x360:800 (WIDTHxHEIGHT[:kbps])\n"
+			"\t\teach goes to its own URL, or with a single URL, to URL_<height>p\n"
+			"\t-s\tencode I420 frames from this shared memory ring (e.g. /camera) instead of the test pattern\n"
+			"\t-i\tencode a Y4M or raw I420 file (- for standard input) instead of the test pattern\n"
+			"\t-g\ta raw file's size and frame rate, e.g. 1920x1080@30000/1001 (default 640x360@24)\n"
+			"\t-r\tloop the file\n"
+			"\t-t\tembed each frame's send time (wall clock), in an onFI script tag or an H.264 SEI\n"
+			"\t-I\tintra refresh instead of IDRs, with a one frame VBV buffer for renditions with a bitrate\n"
+			"\t-T\trun on a virtual clock, as fast as frames encode, with the same output every run, and\n"
+			"\t\ttimestamps starting at start_ms: e.g. 4294000000 reaches the 32-bit wrap in about 16 minutes of stream\n"
+			"\t-B\tbenchmark encoding this many frames of the pattern with each configuration, as CSV, then exit\n"
+			"\t-M\tthe configurations: every combination of AXIS=VALUE[,VALUE...] separated by ;\n"
+			"\t\te.g. preset=ultrafast,veryfast,medium;tune=zerolatency,none;rc=crf23,crf28,1500k;profile=baseline,high;threads=1,4\n"
+			"\t\tor size=1280x720,...  Tunes combine with +.  Axes left out keep the streaming settings\n", argv[0], argv[0]);
+		goto exit;
+	}
+
+	if (ringName && inputPath) {
+		fputs("Frames can come from a ring (-s) or a file (-i), not both\n", stderr);
+		ret = EXIT_FAILURE;
+		goto exit;
+	}
+
+	// the source's size and rate come from the ring or file, and otherwise
+	//  the pattern is generated at the largest size, and scaled down from there
+	unsigned int sourceWidth = 0, sourceHeight = 0;
+	unsigned int fpsNum = FPS, fpsDen = 1;
+	uint32_t sourceStride[3];
+
+	if (ringName) {
+		if (! shmring_Open(&ring, ringName)) {
+			ret = EXIT_FAILURE;
+			goto exit;
+		}
+
+		sourceWidth = ring.width;
+		sourceHeight = ring.height;
+		fpsNum = ring.fpsNum;
+		fpsDen = ring.fpsDen;
+		memcpy(sourceStride, ring.stride, sizeof(sourceStride));
+	} else if (inputPath) {
+		if (! yuvfile_Open(&input, inputPath, rawWidth, rawHeight, rawFpsNum, rawFpsDen, loop)) {
+			ret = EXIT_FAILURE;
+			goto exit;
+		}
+
+		sourceWidth = input.width;
+		sourceHeight = input.height;
+		fpsNum = input.fpsNum;
+		fpsDen = input.fpsDen;
+		memcpy(sourceStride, input.stride, sizeof(sourceStride));
+	} else if (count == 0) {
+		sourceWidth = WIDTH;
+		sourceHeight = HEIGHT;
+	}
+
+	if (count == 0) {
+		ladder[0].width = sourceWidth;
+		ladder[0].height = sourceHeight;
+		count = 1;
+	}
+
+	for (unsigned int i = 0; i < count; i ++) {
+		struct rendition * const r = &ladder[i];
+
+		if (! ringName && ! inputPath) {
+			if (r->width > sourceWidth)
+				sourceWidth = r->width;
+			if (r->height > sourceHeight)
+				sourceHeight = r->height;
+		}
+
+		r->fpsNum = fpsNum;
+		r->fpsDen = fpsDen;
+
+		if (urls == count)
+			r->url = argv[optind + i];
+		else {
+			// one base URL: give each rendition its own stream name
+			const size_t size = strlen(argv[optind]) + 16;
+
+			if ((r->urlCopy = malloc(size)) == NULL) {
+				perror("Failed to allocate URL");
+				ret = EXIT_FAILURE;
+				goto freeRenditions;
+			}
+			snprintf(r->urlCopy, size, "%s_%up", argv[optind], r->height);
+			r->url = r->urlCopy;
+		}
+	}
+
+	if (metricsAddress && ! metrics_Listen("testpattern", metricsAddress)) {
 		ret = EXIT_FAILURE;
-		goto freeRTMP;
+		goto freeRenditions;
+	}
+
+	/* *************************************************** */
+	// Increase the log level for all RTMP actions
+	//  librtmp's messages, and everything from here on, are written out by
+	//  the logger thread, not the encode or send threads
+	RTMP_LogSetLevel(RTMP_LOGINFO);
+	RTMP_LogSetCallback(logger_RTMP);
+	logger_Start();
+	/* *************************************************** */
+	// Init RTMP code and start connecting
+	//  the handshakes run in the background while the encoders are set up and
+	//  the first frames encoded, which are queued until publishing starts.
+	//  If a connection drops later, rtmpout reconnects and replays the
+	//  headers below, while the encoders keep running
+	for (unsigned int i = 0; i < count; i ++) {
+		if (! rtmpout_Start(&ladder[i].out, ladder[i].url, sendBuffer)) {
+			ret = EXIT_FAILURE;
+			goto freeRenditions;
+		}
+	}
+
+	// record the first rendition as well, to a seekable FLV
+	//  a recording that can't be opened is reported, and the stream goes on without it
+	if (recordPath)
+		flvrec_Open(&rec, recordPath, FLVREC_KEYFRAMES);
+	ladder[0].rec = &rec;
+
+	// the source picture: the ring's slots and the file's frames are used
+	//  where they are, so only its layout is set up here
+	if (ringName || inputPath) {
+		x264_picture_init(&source);
+		source.img.i_csp = X264_CSP_I420;
+		source.img.i_plane = 3;
+		for (int i = 0; i < 3; i ++)
+			source.img.i_stride[i] = sourceStride[i];
+	} else {
+		if (x264_picture_alloc(&source, X264_CSP_I420, sourceWidth, sourceHeight) < 0) {
+			logger_Printf(stderr, "Failed to allocate source picture\n");
+			ret = EXIT_FAILURE;
+			goto freeRenditions;
+		}
+		ownSource = 1;
+	}
+	job.source = &source;
+
+	for (unsigned int i = 0; i < count; i ++) {
+		if (! rendition_Open(&ladder[i], sourceWidth, sourceHeight) ||
+			! rendition_Headers(&ladder[i])) {
+			ret = EXIT_FAILURE;
+			goto freeRenditions;
+		}
+	}
+
+	// one encode thread per rendition
+	for (unsigned int i = 0; i < count; i ++) {
+		workers[i].r = &ladder[i];
+		workers[i].job = &job;
+
+		if (pthread_create(&ladder[i].thread, NULL, worker_Main, &workers[i]) != 0) {
+			logger_Printf(stderr, "Failed to start encode thread\n");
+			ret = EXIT_FAILURE;
+			goto stopThreads;
+		}
+		threads ++;
 	}
 
 	// Let's install some signal handlers for a graceful exit
@@ -452,83 +1155,137 @@ if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
 	/* *************************************************** */
 	// Ready to start throwing frames at the streamer
 
-	// Current frame
+	// Current frame, and its timestamp
 	unsigned long frame = 0;
-
-	// Starting timestamp of our video
-	uint32_t start = getTimestamp();
+	uint32_t timestamp = 0;
+	// every rendition gets an IDR at this timestamp
+	uint32_t nextIdr = firstTimestamp;
+	// the ring's capture time of the first frame
+	uint64_t firstTime = 0;
+
+	// Frame pacing: frame n is due n frame periods after now
+	//  the clock is restarted when the connection is up, and paces from there.
+	//  Frames from the ring are paced by the producer instead.
+	struct frameclock clock;
+	frameclock_Init(&clock, fpsDen, fpsNum, policy);
+	int paced = 0;
 
 	while (running) {
-		// Produce a test image
-		build_picture(&pic_in, frame);
-
-		/* Encode an x264 frame */
-		x264_nal_t * nals;
-		int i_nals;
-		int frame_size = x264_encoder_encode(encoder, &nals, &i_nals, &pic_in, &pic_out);
-
-		if (frame_size < 0) {
-			// error in encoding
-			fputs("Error when encoding frame\n", stderr);
-			ret = EXIT_FAILURE;
-			goto restoreSig;
-		} else if (frame_size > 0) {
-			// got an encoded frame
-			// Toss into RTMP
-			//  this means building a tag of the correct type and throwing the NAL into it
-			p = flv_TagHeader(tag, 9, frame * TIMESTAMP_INCREMENT);
-
-			// write every NALU to the packet for this pic
-			//  x264 guarantees all p_payload are sequential
-			p = flv_AVCVideoPacket(p, pic_out.b_keyframe, 1, 0);
-			memcpy(p, nals[0].p_payload, frame_size);
-			p += frame_size;
+		int connecting;
+
+		if (ringName) {
+			// wait for the next frame, and encode it where it lies
+			uint64_t time;
+			const uint8_t * const slot = shmring_Next(&ring, &time, RING_TIMEOUT);
+
+			if (slot == NULL) {
+				if (shmring_Done(&ring)) {
+					logger_Printf(stderr, "Frame source closed\n");
+					break;
+				}
+
+				// nothing yet: keep the connections serviced meanwhile
+				if (! ladder_Poll(ladder, count, &connecting)) {
+					ret = EXIT_FAILURE;
+					goto restoreSig;
+				}
+				continue;
+			}
 
-			// calculate tag size and write it
-			tagSize = flv_TagFinish(tag, p);
+			if (frame == 0)
+				firstTime = time;
+			timestamp = firstTimestamp + (uint32_t)((time - firstTime) / 1000);
+
+			for (int i = 0; i < 3; i ++)
+				source.img.plane[i] = (uint8_t *)slot + ring.plane[i];
+		} else {
+			if (inputPath) {
+				// the next frame from the file, where it lies in the mapping
+				const uint8_t * const data = yuvfile_Frame(&input, frame);
+
+				if (data == NULL) {
+					logger_Printf(stderr, "End of input\n");
+					break;
+				}
+
+				for (int i = 0; i < 3; i ++)
+					source.img.plane[i] = (uint8_t *)data + input.plane[i];
+			} else {
+				// Produce a test image
+				build_picture(&source, sourceWidth, sourceHeight, frame);
+			}
 
-if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
+			// in integers, so a stream days long wraps at 32 bits as FLV does
+			timestamp = firstTimestamp + (uint32_t)((uint64_t)frame * 1000 * fpsDen / fpsNum);
+		}
 
-			//  cast to char* avoids a warning
-			if (RTMP_Write(r, (const char *)tag, tagSize) <= 0) {
-				fputs("Failed to RTMP_Write a frame\n", stderr);
+		// keyframes go on the same frames in every rendition, so a player can
+		//  switch between them at any one.  After a reconnect, resume with an
+		//  IDR instead of waiting for the next one: that restarts the GOP everywhere.
+		//  With intra refresh, x264 starts each refresh itself, on its keyint
+		//  Timestamps wrap after 49.7 days, so compare by their difference
+		int idr = (! intraRefresh && (int32_t)(timestamp - nextIdr) >= 0);
+		for (unsigned int i = 0; i < count; i ++)
+			idr |= rtmpout_KeyframeWanted(&ladder[i].out);
+		if (idr)
+			nextIdr = timestamp + KEYFRAME_INTERVAL;
+
+		// every rendition scales and encodes it in parallel
+		job.timestamp = timestamp;
+		job.idr = idr;
+		job_Run(&job, count);
+
+		// x264 has its own copy now, so the slot can go back
+		if (ringName)
+			shmring_Release(&ring);
+
+		for (unsigned int i = 0; i < count; i ++) {
+			if (ladder[i].failed) {
 				ret = EXIT_FAILURE;
 				goto restoreSig;
 			}
 		}
 
 		// Handle any packets from the remote to us.
-		//  We will use select() to see if packet is waiting,
-		//  then read it and dispatch to the handler.
-		fd_set set;
-		FD_ZERO(&set);
-		FD_SET(fd, &set);
-
-		if (select(fd + 1, &set, NULL, NULL, &tv) == -1) {
-			perror("Error calling select()");
+		if (! ladder_Poll(ladder, count, &connecting)) {
 			ret = EXIT_FAILURE;
 			goto restoreSig;
 		}
 
-		// socket is present in read-ready set, safe to call RTMP_ReadPacket
-		if (FD_ISSET(fd, &set)) {
-			RTMPPacket packet = { 0 };
+		// Until the connections are up, encode ahead instead of waiting, up to
+		//  a GOP: it all goes out the moment publishing starts
+		if (! paced) {
+			if (connecting && (frame + 1) * 1000.0 * fpsDen / fpsNum < KEYFRAME_INTERVAL) {
+				frame ++;
+				continue;
+			}
 
-			if (RTMP_ReadPacket(r, &packet) && RTMPPacket_IsReady(&packet)) {
-				// this function does all the internal stuff we need
-				RTMP_ClientPacket(r, &packet);
-				RTMPPacket_Free(&packet);
+			for (unsigned int i = 0; i < count; i ++) {
+				if (! rtmpout_Wait(&ladder[i].out)) {
+					ret = EXIT_FAILURE;
+					goto restoreSig;
+				}
 			}
+
+			frameclock_Restart(&clock, frame);
+			paced = 1;
 		}
 
-		// frame count go up
-		frame ++;
+		// frame count go up, and wait until that frame is due
+		if (ringName)
+			frame ++;
+		else
+			frame = frameclock_Next(&clock);
+	}
 
-		// the time to sleep is the duration between target framestamp and now
-		int64_t delay_time = (frame * TIMESTAMP_INCREMENT) - (getTimestamp() - start);
-		if (delay_time > 0) {
-			//printf("Sleeping for %ld seconds\n", delay_time);
-			usleep(1000 * delay_time);
+	// stopped while still connecting: what was encoded meanwhile is queued,
+	//  so see it sent before the end of the stream
+	if (! paced) {
+		for (unsigned int i = 0; i < count; i ++) {
+			if (! rtmpout_Wait(&ladder[i].out)) {
+				ret = EXIT_FAILURE;
+				goto restoreSig;
+			}
 		}
 	}
 
@@ -548,18 +1305,13 @@ if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
 	 */
 
 	// send the end-of-stream indicator
-	p = flv_TagHeader(tag, 9, frame * TIMESTAMP_INCREMENT);
-	// write the empty-body "stream end" tag
-	p = flv_AVCVideoPacket(p, 1, 2, 0);
-	// calculate tag size and write it
-	tagSize = flv_TagFinish(tag, p);
+	for (unsigned int i = 0; i < count; i ++) {
+		flv_TagHeader(&ladder[i].tag, FLV_TAG_VIDEO, timestamp);
+		// write the empty-body "stream end" tag
+		flv_AVCVideoPacket(&ladder[i].tag, 1, 2, 0);
 
-if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
-
-	//  cast to char* avoids a warning
-	if (RTMP_Write(r, (const char *)tag, tagSize) <= 0) {
-		fputs("Failed to RTMP_Write\n", stderr);
-		ret = EXIT_FAILURE;
+		if (! rendition_Send(&ladder[i]))
+			ret = EXIT_FAILURE;
 	}
 
 	/* *************************************************** */
@@ -570,14 +1322,33 @@ restoreSig:
 	signal(SIGINT, SIG_DFL);
 	signal(SIGQUIT, SIG_DFL);
 	signal(SIGHUP, SIG_DFL);
+	logger_Stop();
+	if (! ringName)
+		frameclock_Report(&clock, stdout);
+	frameclock_Close(&clock);
+	for (unsigned int i = 0; i < count; i ++) {
+		char label[32];
+		snprintf(label, sizeof(label), "%ux%u", ladder[i].width, ladder[i].height);
+		framesize_Report(&ladder[i].sizes, label, stdout);
+	}
 	// Shut down
-freeRTMP:
-	RTMP_Free(r);
-freeTag:
-	free(tag);
-freePic:
-	x264_picture_clean(&pic_in);
-if (DEBUG) fclose(fDebug);
+stopThreads:
+	pthread_mutex_lock(&job.mutex);
+	job.stop = 1;
+	pthread_cond_broadcast(&job.start);
+	pthread_mutex_unlock(&job.mutex);
+
+	for (unsigned int i = 0; i < threads; i ++)
+		pthread_join(ladder[i].thread, NULL);
+freeRenditions:
+	for (unsigned int i = 0; i < count; i ++)
+		rendition_Close(&ladder[i]);
+	if (ownSource)
+		x264_picture_clean(&source);
+	flvrec_Close(&rec);
+	shmring_Close(&ring);
+	yuvfile_Close(&input);
 exit:
+	logger_Stop();
 	return ret;
 }
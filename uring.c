@@ -0,0 +1,282 @@
+/* ***************************************************
+uring: a minimal io_uring, without liburing
+Greg Kennedy 2021
+*************************************************** */
+#include "uring.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// the kernel moves sqHead and cqTail, so they are read with acquire, and
+//  ours published with release
+#define LOAD(p) atomic_load_explicit((_Atomic unsigned int *)(p), memory_order_acquire)
+#define STORE(p, v) atomic_store_explicit((_Atomic unsigned int *)(p), (v), memory_order_release)
+
+/* ************************************************************************ */
+// The next free submission entry, zeroed, or NULL if the queue is full
+static struct io_uring_sqe * uring_Get(struct uring * const u, const uint64_t user)
+{
+	const unsigned int tail = *u->sqTail + u->queued;
+
+	if (tail - LOAD(u->sqHead) >= u->entries)
+		return NULL;
+
+	const unsigned int i = tail & *u->sqMask;
+	struct io_uring_sqe * const sqe = &u->sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = user;
+	u->sqArray[i] = i;
+	u->queued ++;
+	return sqe;
+}
+
+int uring_Init(struct uring * const u, const unsigned int entries)
+{
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	const int fd = syscall(__NR_io_uring_setup, entries, &p);
+
+	if (fd < 0)
+		return 0;
+
+	u->fd = fd;
+	u->entries = p.sq_entries;
+	u->sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	// newer kernels map both rings at once
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cqMapSize > u->sqMapSize)
+			u->sqMapSize = u->cqMapSize;
+		u->cqMapSize = 0;
+	}
+
+	u->sqMap = mmap(NULL, u->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->sqMap == MAP_FAILED) {
+		u->sqMap = NULL;
+		goto fail;
+	}
+
+	if (u->cqMapSize) {
+		u->cqMap = mmap(NULL, u->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (u->cqMap == MAP_FAILED) {
+			u->cqMap = NULL;
+			goto fail;
+		}
+	}
+
+	u->sqes = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto fail;
+	}
+
+	uint8_t * const sq = u->sqMap;
+	uint8_t * const cq = (u->cqMap ? u->cqMap : u->sqMap);
+
+	u->sqHead = (unsigned int *)(sq + p.sq_off.head);
+	u->sqTail = (unsigned int *)(sq + p.sq_off.tail);
+	u->sqMask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	u->sqArray = (unsigned int *)(sq + p.sq_off.array);
+	u->cqHead = (unsigned int *)(cq + p.cq_off.head);
+	u->cqTail = (unsigned int *)(cq + p.cq_off.tail);
+	u->cqMask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 1;
+
+fail:
+	uring_Close(u);
+	return 0;
+}
+
+int uring_Register(struct uring * const u, const struct iovec * const iov, const unsigned int count)
+{
+	return (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, count) == 0);
+}
+
+int uring_Read(struct uring * const u, const int fd, void * const buf, const uint32_t len, const uint64_t offset, const uint64_t user)
+{
+	struct io_uring_sqe * const sqe = uring_Get(u, user);
+
+	if (sqe == NULL)
+		return 0;
+
+	// needs Linux 5.6: on older kernels it completes with -EINVAL
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	return 1;
+}
+
+int uring_ReadFixed(struct uring * const u, const int fd, void * const buf, const uint32_t len, const uint64_t offset, const unsigned int index, const uint64_t user)
+{
+	struct io_uring_sqe * const sqe = uring_Get(u, user);
+
+	if (sqe == NULL)
+		return 0;
+
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->buf_index = index;
+	return 1;
+}
+
+int uring_Poll(struct uring * const u, const int fd, const unsigned int events, const uint64_t user)
+{
+	struct io_uring_sqe * const sqe = uring_Get(u, user);
+
+	if (sqe == NULL)
+		return 0;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll_events = events;
+	return 1;
+}
+
+int uring_PollRemove(struct uring * const u, const uint64_t target, const uint64_t user)
+{
+	struct io_uring_sqe * const sqe = uring_Get(u, user);
+
+	if (sqe == NULL)
+		return 0;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = target;
+	return 1;
+}
+
+int uring_Submit(struct uring * const u, const unsigned int wait)
+{
+	// publish the entries filled in, then tell the kernel
+	//  the kernel stops at the first entry it can't even start (an opcode
+	//  it doesn't know), leaving the rest in the ring, so every entry it
+	//  hasn't taken yet is submitted again, not just the new ones
+	STORE(u->sqTail, *u->sqTail + u->queued);
+	u->queued = 0;
+
+	const unsigned int submit = *u->sqTail - LOAD(u->sqHead);
+
+	for (;;) {
+		u->enters ++;
+		const int ret = syscall(__NR_io_uring_enter, u->fd, submit, wait, (wait ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+
+		if (ret >= 0)
+			return 1;
+		// a signal while waiting: the submissions went in, so just return
+		if (errno == EINTR)
+			return 1;
+		if (errno != EAGAIN && errno != EBUSY)
+			return 0;
+	}
+}
+
+int uring_Complete(struct uring * const u, uint64_t * const user, int32_t * const res)
+{
+	const unsigned int head = *u->cqHead;
+
+	if (head == LOAD(u->cqTail))
+		return 0;
+
+	const struct io_uring_cqe * const cqe = &u->cqes[head & *u->cqMask];
+	*user = cqe->user_data;
+	*res = cqe->res;
+
+	STORE(u->cqHead, head + 1);
+	return 1;
+}
+
+void uring_Close(struct uring * const u)
+{
+	if (u->sqes)
+		munmap(u->sqes, u->sqesSize);
+	if (u->cqMap)
+		munmap(u->cqMap, u->cqMapSize);
+	if (u->sqMap)
+		munmap(u->sqMap, u->sqMapSize);
+	if (u->fd >= 0)
+		close(u->fd);
+
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+#else
+/* ************************************************************************ */
+// no io_uring: every call fails, and callers use their ordinary path
+int uring_Init(struct uring * const u, const unsigned int entries)
+{
+	(void)entries;
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+	return 0;
+}
+
+int uring_Register(struct uring * const u, const struct iovec * const iov, const unsigned int count)
+{
+	(void)u; (void)iov; (void)count;
+	return 0;
+}
+
+int uring_Read(struct uring * const u, const int fd, void * const buf, const uint32_t len, const uint64_t offset, const uint64_t user)
+{
+	(void)u; (void)fd; (void)buf; (void)len; (void)offset; (void)user;
+	return 0;
+}
+
+int uring_ReadFixed(struct uring * const u, const int fd, void * const buf, const uint32_t len, const uint64_t offset, const unsigned int index, const uint64_t user)
+{
+	(void)u; (void)fd; (void)buf; (void)len; (void)offset; (void)index; (void)user;
+	return 0;
+}
+
+int uring_Poll(struct uring * const u, const int fd, const unsigned int events, const uint64_t user)
+{
+	(void)u; (void)fd; (void)events; (void)user;
+	return 0;
+}
+
+int uring_PollRemove(struct uring * const u, const uint64_t target, const uint64_t user)
+{
+	(void)u; (void)target; (void)user;
+	return 0;
+}
+
+int uring_Submit(struct uring * const u, const unsigned int wait)
+{
+	(void)u; (void)wait;
+	errno = ENOSYS;
+	return 0;
+}
+
+int uring_Complete(struct uring * const u, uint64_t * const user, int32_t * const res)
+{
+	(void)u; (void)user; (void)res;
+	return 0;
+}
+
+void uring_Close(struct uring * const u)
+{
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+#endif
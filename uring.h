@@ -0,0 +1,72 @@
+/* ***************************************************
+uring: a minimal io_uring, without liburing
+Greg Kennedy 2021
+
+Just enough of io_uring for rtmpcast's file reads and
+ socket polling: the rings are set up and driven with the
+ raw system calls, and the few operations used are filled
+ in here.  Requests are queued in shared memory and go to
+ the kernel together, one io_uring_enter for a whole
+ batch, and completions are read straight out of shared
+ memory, with no system call at all when nothing is due.
+ Linux only: elsewhere, or on a kernel without io_uring
+ (or with it turned off), uring_Init fails and callers
+ keep to their ordinary system calls.
+*************************************************** */
+#ifndef URING_H_
+#define URING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct uring {
+	int fd;	// -1 when not set up
+
+	// submission queue: indices into sqes, between head (kernel) and tail (us)
+	unsigned int * sqHead, * sqTail, * sqMask, * sqArray;
+	struct io_uring_sqe * sqes;
+	unsigned int entries;
+	unsigned int queued;	// filled in, and not yet submitted
+
+	// completion queue: between head (us) and tail (kernel)
+	unsigned int * cqHead, * cqTail, * cqMask;
+	struct io_uring_cqe * cqes;
+
+	void * sqMap, * cqMap;
+	size_t sqMapSize, cqMapSize, sqesSize;
+
+	unsigned long enters;	// io_uring_enter calls made
+};
+
+// Set up a ring with room for entries requests
+//  Returns 0 if io_uring is not available.  A zeroed struct uring with fd -1
+//  is safe to close.
+int uring_Init(struct uring * u, unsigned int entries);
+
+// Register buffers for uring_ReadFixed.  Returns 0 on failure
+//  (usually RLIMIT_MEMLOCK), in which case plain reads still work.
+int uring_Register(struct uring * u, const struct iovec * iov, unsigned int count);
+
+// Queue a request, tagged with user data to match its completion
+//  Returns 0 if the submission queue is full.
+int uring_Read(struct uring * u, int fd, void * buf, uint32_t len, uint64_t offset, uint64_t user);
+int uring_ReadFixed(struct uring * u, int fd, void * buf, uint32_t len, uint64_t offset, unsigned int index, uint64_t user);
+// a one-shot poll for events (POLLIN etc.) on fd, and a cancellation of one
+int uring_Poll(struct uring * u, int fd, unsigned int events, uint64_t user);
+int uring_PollRemove(struct uring * u, uint64_t target, uint64_t user);
+
+// Hand the queued requests to the kernel, and wait for at least wait of them
+//  to complete.  Returns 0 on failure.
+int uring_Submit(struct uring * u, unsigned int wait);
+
+// The oldest completion not yet seen, or 0 if there is none
+//  Takes no system call.  On 1, *user and *res are its user data and result.
+int uring_Complete(struct uring * u, uint64_t * user, int32_t * res);
+
+void uring_Close(struct uring * u);
+
+#endif
@@ -0,0 +1,63 @@
+/* ***************************************************
+vclock: the time that decides what a stream contains
+Greg Kennedy 2021
+*************************************************** */
+#include "vclock.h"
+
+#include <stdatomic.h>
+#include <time.h>
+
+static int virtual;
+
+// virtual time, in ns since the epoch so the two clocks are one counter
+//  atomic because encode threads stamp timecodes with it
+static _Atomic uint64_t virtual_ns = (uint64_t)VCLOCK_EPOCH * 1000000000;
+
+static uint64_t vclock_Read(const clockid_t id)
+{
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ************************************************************************ */
+void vclock_Virtual(void)
+{
+	virtual = 1;
+}
+
+int vclock_IsVirtual(void)
+{
+	return virtual;
+}
+
+uint64_t vclock_Now(void)
+{
+	if (virtual)
+		return atomic_load_explicit(&virtual_ns, memory_order_relaxed);
+
+	return vclock_Read(CLOCK_MONOTONIC);
+}
+
+uint64_t vclock_Wallclock(void)
+{
+	if (virtual)
+		return atomic_load_explicit(&virtual_ns, memory_order_relaxed) / 1000;
+
+	return vclock_Read(CLOCK_REALTIME) / 1000;
+}
+
+int vclock_Sleep(const uint64_t deadline)
+{
+	if (virtual) {
+		// time never goes back, so a deadline already past costs nothing
+		uint64_t now = atomic_load_explicit(&virtual_ns, memory_order_relaxed);
+
+		while (now < deadline && ! atomic_compare_exchange_weak_explicit(&virtual_ns, &now, deadline, memory_order_relaxed, memory_order_relaxed))
+			;
+		return 1;
+	}
+
+	const struct timespec ts = { .tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000 };
+	return (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == 0);
+}
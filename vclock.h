@@ -0,0 +1,42 @@
+/* ***************************************************
+vclock: the time that decides what a stream contains
+Greg Kennedy 2021
+
+Frame pacing, rtmpcast's tag pacing and the wall clock
+ timecodes all read the time here.  Normally that is
+ CLOCK_MONOTONIC and CLOCK_REALTIME.  In virtual mode the
+ clock only moves when a tool sleeps, and a sleep returns
+ at once with the clock moved on to its deadline: a tool
+ runs as fast as it can encode, nothing is ever late, and
+ the wall clock starts from a fixed date, so the same
+ options give the same stream every run.  Days of output
+ (to a recording, or a local rtmpsink) take minutes, which
+ is how long-run behaviour like the 32-bit FLV timestamp
+ wrap can be checked.  Timing measurements (metrics_Now)
+ stay on the real clock.
+*************************************************** */
+#ifndef VCLOCK_H_
+#define VCLOCK_H_
+
+#include <stdint.h>
+
+// where the virtual wall clock starts: 2021-01-01 00:00:00 UTC
+#define VCLOCK_EPOCH 1609459200
+
+// Switch to virtual time, before anything has read the clock
+void vclock_Virtual(void);
+
+int vclock_IsVirtual(void);
+
+// monotonic clock in nanoseconds
+uint64_t vclock_Now(void);
+
+// wall clock in microseconds since the epoch, for timecodes another host
+//  compares against its own: only meaningful if both keep NTP time
+uint64_t vclock_Wallclock(void);
+
+// Sleep until deadline, on vclock_Now's scale
+//  Returns 0 if a signal cut the sleep short.
+int vclock_Sleep(uint64_t deadline);
+
+#endif
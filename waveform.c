@@ -16,7 +16,6 @@ Proper muxing would allow video and audio to run independently
 *************************************************** */
 
 // push packets to stream
-#include <librtmp/rtmp.h>
 #include <librtmp/log.h>
 
 // libfdk's AAC encoder header
@@ -28,17 +27,32 @@ Proper muxing would allow video and audio to run independently
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
 
 #include <stdint.h>
 
-#include <sys/time.h>
+#include <time.h>
 
 // h.264 encoder lib
 //  this requires stdint.h first or else it complains...
 #include <x264.h>
 
-// maximum size of a tag is 11 byte header, 0xFFFFFF payload, 4 byte size
-#define MAX_TAG_SIZE 11 + 16777215 + 4
+// FLV tag and AMF serialization
+#include "flv.h"
+// runtime statistics
+#include "metrics.h"
+// RTMP connection, with reconnect
+#include "rtmpout.h"
+// frame pacing
+#include "frameclock.h"
+// seekable FLV recording
+#include "flvrec.h"
+// encoded frame size statistics
+#include "framesize.h"
+// messages, written out off the streaming thread
+#include "logger.h"
+// real or virtual time
+#include "vclock.h"
 
 // video output parameters
 #define WIDTH 640
@@ -49,162 +63,125 @@ Proper muxing would allow video and audio to run independently
 #define CHANNELS 2
 #define SAMPLE_COUNT 1024
 
-// some calculations in advance
-#define TIMESTAMP_INCREMENT (1000.0 / (SAMPLE_RATE / SAMPLE_COUNT))
+// the timestamp of a sample count since the start, in integers, so
+//  a stream days long wraps at 32 bits as FLV does
+#define SAMPLE_TIMESTAMP(samples) ((uint32_t)((uint64_t)(samples) * 1000 / SAMPLE_RATE))
 
-// turn this on to write a sidecar "out.flv", useful for debugging
+// most frames to encode ahead while the connection is set up: a second,
+//  which covers the handshake without holding back a whole 4 second GOP
+#define PREROLL (SAMPLE_RATE / SAMPLE_COUNT)
+
+// turn this on to record a sidecar "out.flv" by default, useful for debugging
 #define DEBUG 1
 
 /* ************************************************************************ */
-// helper functions
-// get "now" in milliseconds
-static uint32_t getTimestamp() {
-	struct timeval timecheck;
-	gettimeofday(&timecheck, NULL);
-	return timecheck.tv_sec * 1000 + timecheck.tv_usec / 1000;
-}
-
-// write big-endian values to memory area
-static uint8_t * u16be(uint8_t * const p, const uint16_t value) {
-	*p = value >> 8 & 0xFF;
-	*(p + 1) = value & 0xFF;
-	return p + 2;
-}
-static uint8_t * u24be(uint8_t * const p, const uint32_t value) {
-	*p = value >> 16 & 0xFF;
-	*(p + 1) = value >> 8 & 0xFF;
-	*(p + 2) = value & 0xFF;
-	return p + 3;
-}
-static uint8_t * u32be(uint8_t * const p, const uint32_t value) {
-	*p = value >> 24 & 0xFF;
-	*(p + 1) = value >> 16 & 0xFF;
-	*(p + 2) = value >> 8 & 0xFF;
-	*(p + 3) = value & 0xFF;
-	return p + 4;
-}
+// AAC encoder profiles
+//  HE-AAC adds Spectral Band Replication (SBR) on top of an AAC-LC core running
+//  at half the sample rate, and HE-AACv2 adds Parametric Stereo (PS) to that.
+//  Both hold up at a fraction of the AAC-LC bitrate, for a bit more encoder CPU.
+struct aac_profile {
+	const char * name;
+	AUDIO_OBJECT_TYPE aot;
+	UINT modules;	// aacEncOpen module mask: 0x01 AAC, 0x02 SBR, 0x04 PS
+	unsigned int bitrate;	// default bitrate (kbps)
+};
+
+static const struct aac_profile aac_profiles[] = {
+	{ "lc", AOT_AAC_LC, 0x01, 128 },
+	{ "he", AOT_SBR, 0x03, 64 },
+	{ "hev2", AOT_PS, 0x07, 32 },
+	{ NULL, AOT_NONE, 0, 0 }
+};
+
+// Open and configure an AAC encoder
+//  On success, info holds the frame length and AudioSpecificConfig
+static AACENC_ERROR aac_Open(HANDLE_AACENCODER * const enc, AACENC_InfoStruct * const info, const struct aac_profile * const profile, const unsigned int bitrate, const unsigned int afterburner)
+{
+	AACENC_ERROR err = aacEncOpen(enc, profile->modules, CHANNELS);
 
-// deconstruct a host-native double, repack it as big-endian IEEE 754 double
-static uint8_t * f64be(uint8_t * const p, const double input) {
-	const uint8_t * const value = (uint8_t *)&input;
-	static const double testVal = 1;
-	static const uint8_t testBE[8] = { 0x3F, 0xF0 };
-	static const uint8_t testLE[8] = { 0, 0, 0, 0, 0, 0, 0xF0, 0x3F };
-
-	if (memcmp(&testVal, testBE, 8) == 0) {
-		// already in big-endian
-		memcpy(p, value, 8);
-	} else { // if (memcmp(&testVal, testLE, 8) == 0)
-		// byteswap
-		for (int i = 0; i < 8; i++)
-			p[i] = value[7 - i];
+	if (err != AACENC_OK) {
+		fprintf(stderr, "Failed to open encoder: %d\n", err);
+		return err;
 	}
 
-	return p + 8;
-}
-
-// "pascal" string (uint16 strlen, string content)
-static uint8_t * pstring(uint8_t * p, const char * const str) {
-	uint16_t string_length = strlen(str);
-	p = u16be(p, string_length);
-	memcpy(p, str, string_length);
-	return p + string_length;
-}
+#define aacSetParam(x, y) if ((err = aacEncoder_SetParam(*enc, x, y)) != AACENC_OK) { fprintf(stderr, "Failed to set param " #x " to %u: %d\n", (unsigned int)(y), err); goto close; }
 
-// AMF (Action Message Format) serializers
-static uint8_t * amf_number(uint8_t * const p, const double value) {
-	*p = 0x00;
-	return f64be(p + 1, value);
-}
-static uint8_t * amf_boolean(uint8_t * const p, const uint8_t value) {
-	*p = 0x01;
-	*(p+1) = (value ? 1 : 0);
-	return p + 2;
-}
-static uint8_t * amf_string(uint8_t * const p, const char * const str) {
-	*p = 0x02;
-	return pstring(p + 1, str);
-}
-static uint8_t * amf_ecma_array(uint8_t * const p, const uint32_t entries) {
-	*p = 0x08;
-	return u32be(p + 1, entries);
-}
-static uint8_t * amf_ecma_array_end(uint8_t * const p) {
-	return u24be(p, 0x000009);
-}
-static uint8_t * amf_ecma_array_entry(uint8_t * const p, const char * const str, const double value) {
-	return amf_number(pstring(p, str), value);
-}
+	aacSetParam(AACENC_AOT, profile->aot);
+	// Explicit hierarchical signaling: the AudioSpecificConfig names SBR / PS
+	//  directly, instead of describing a half-rate AAC-LC stream that players
+	//  have to sniff the extension out of
+	if (profile->aot != AOT_AAC_LC)
+		aacSetParam(AACENC_SIGNALING_MODE, 2);
+	// Controls the output format of blocks coming from the encoder
+	//  this is just raw outputs (no special framing / container)
+	aacSetParam(AACENC_TRANSMUX, TT_MP4_RAW);
+	// Better quality at the expense of processing power
+	aacSetParam(AACENC_AFTERBURNER, afterburner);
 
-/* ************************************************************************ */
-// some h264 output helpers
-// AVCDecoder record - some of this data comes out of the SPS for this block
-static uint8_t * h264_AVCDecoderConfigurationRecord(
-	uint8_t * p,
-	const uint8_t * const sps,
-	const uint16_t sps_length,
-	const uint8_t * const pps,
-	const uint16_t pps_length)
-{
-	*p = 0x01;	// version
-	*(p + 1) = sps[1];	// Required profile ID
-	*(p + 2) = sps[2];	// Profile compatibility
-	*(p + 3) = sps[3];	// AVC Level (3.0)
-	*(p + 4) = 0b11111100 | 0b11;	// NAL lengthSizeMinusOne (4 bytes)
-	*(p + 5) = 0b11100000 | 1;	// number of SPS sets
-	p += 6;
-
-	// write the SPS - length (uint16), then data
-	p = u16be(p, sps_length);
-	memcpy(p, sps, sps_length);
-	p += sps_length;
-
-	// write the PPS now
-	p = u16be(p, pps_length);
-	memcpy(p, pps, pps_length);
-	p += pps_length;
-
-	return p;
-}
+	aacSetParam(AACENC_BITRATE, bitrate * 1000);
+	aacSetParam(AACENC_SAMPLERATE, SAMPLE_RATE);
+	// channel arrangement
+	aacSetParam(AACENC_CHANNELMODE, (CHANNELS == 2 ? MODE_2 : MODE_1) );
+	aacSetParam(AACENC_CHANNELORDER, 1);
 
-/* ************************************************************************ */
-// sets up the first 11 bytes of a tag
-//  returns pointer to the start of payload area
-static uint8_t * flv_TagHeader(uint8_t * p, const uint8_t type, const uint32_t timestamp)
-{
-	*p = type; p ++; // message type
-	// tag[1 - 3] are the message size, which we don't know yet
-	p += 3;
+#undef aacSetParam
 
-	// FLV timestamp is written in an odd format
-	p = u24be(p, timestamp & 0x00FFFFFF);
-	*p = timestamp >> 24 & 0xFF; p ++;
+	// This strange call is needed to "lock in" the settings for encoding
+	if ((err = aacEncEncode(*enc, NULL, NULL, NULL, NULL)) != AACENC_OK) {
+		fprintf(stderr, "Failed to initialize encoder: %d\n", err);
+		goto close;
+	}
 
-	return u24be(p, 0); // stream ID
-}
+	// Now we have encoder info in a struct and can use it for writing audio packets
+	if ((err = aacEncInfo(*enc, info)) != AACENC_OK) {
+		fprintf(stderr, "Failed to copy Encoder Info: %d\n", err);
+		goto close;
+	}
 
-// Finishes a tag (corrects Payload Size in bytes 1-3, and appends Tag Size)
-//  Returns complete tag size, ready for writing
-static uint32_t flv_TagFinish(uint8_t * tag, uint8_t * p)
-{
-	uint32_t payloadSize = p - (tag + 11);
-	u24be(tag + 1, payloadSize);
-	u32be(p, 11 + payloadSize);
+	return AACENC_OK;
 
-	return 11 + payloadSize + 4;
+close:
+	aacEncClose(enc);
+	return err;
 }
 
-// FLV Video Packet (AVC format)
-//  Composition Time is 0 for all-I frames, but otherwise should be the time diff. between PTS and DTS
-static uint8_t * flv_AVCVideoPacket(uint8_t * const p, const unsigned int keyframe, const uint8_t type, const long composition_time)
+// Encode one block of SAMPLE_COUNT samples (per channel)
+//  The encoder buffers internally, so *outBytes may be 0: HE-AAC consumes
+//  two blocks for every access unit it emits.
+static AACENC_ERROR aac_Encode(const HANDLE_AACENCODER enc, INT_PCM * const pcmBuffer, uint8_t * const outBuffer, const int outSize, int * const outBytes)
 {
-	if (keyframe)
-		*p = 0x17;
-	else
-		*p = 0x27;
-
-	*(p + 1) = type;
-	return u24be(p + 2, composition_time);
+	AACENC_BufDesc in_buf = { 0 }, out_buf = { 0 };
+	AACENC_InArgs in_args = { 0 };
+
+	in_args.numInSamples     = SAMPLE_COUNT * CHANNELS;
+
+	void * in_buffers[]           = { pcmBuffer };
+	int in_buffer_sizes[]         = { SAMPLE_COUNT * CHANNELS * sizeof(INT_PCM) };
+	int in_buffer_element_sizes[] = { sizeof(INT_PCM) };
+	int in_buffer_identifiers[]   = { IN_AUDIO_DATA };
+
+	in_buf.numBufs           = 1;
+	in_buf.bufs              = in_buffers;
+	in_buf.bufferIdentifiers = in_buffer_identifiers;
+	in_buf.bufSizes          = in_buffer_sizes;
+	in_buf.bufElSizes        = in_buffer_element_sizes;
+
+	void * out_buffers[]           = { outBuffer };
+	int out_buffer_sizes[]         = { outSize };
+	int out_buffer_element_sizes[] = { sizeof(uint8_t) };
+	int out_buffer_identifiers[]   = { OUT_BITSTREAM_DATA };
+
+	out_buf.numBufs             = 1;
+	out_buf.bufs                = out_buffers;
+	out_buf.bufferIdentifiers   = out_buffer_identifiers;
+	out_buf.bufSizes            = out_buffer_sizes;
+	out_buf.bufElSizes          = out_buffer_element_sizes;
+
+	AACENC_OutArgs out_args; // does not need init - is set by encode
+	AACENC_ERROR err = aacEncEncode(enc, &in_buf, &out_buf, &in_args, &out_args);
+
+	*outBytes = (err == AACENC_OK ? out_args.numOutBytes : 0);
+	return err;
 }
 
 /* ************************************************************************ */
@@ -228,6 +205,55 @@ static void build_waveform(INT_PCM * buffer, const uint32_t timestamp)
 	}
 }
 
+// Encode-cost benchmark: run every profile over the same generated waveform,
+//  and report the CPU time per block against the block's duration
+static int aac_Benchmark(const unsigned long frames, const unsigned int bitrate, const unsigned int afterburner)
+{
+	for (const struct aac_profile * profile = aac_profiles; profile->name != NULL; profile ++) {
+		if (profile->aot == AOT_PS && CHANNELS != 2)
+			continue;
+
+		const unsigned int kbps = (bitrate ? bitrate : profile->bitrate);
+		HANDLE_AACENCODER enc;
+		AACENC_InfoStruct info;
+
+		if (aac_Open(&enc, &info, profile, kbps, afterburner) != AACENC_OK)
+			return EXIT_FAILURE;
+
+		INT_PCM pcmBuffer[SAMPLE_COUNT * CHANNELS] = { 0 };
+		uint8_t outBuffer[768 * CHANNELS];
+		unsigned long bytes = 0;
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (unsigned long frame = 0; frame < frames; frame ++) {
+			build_waveform(pcmBuffer, frame);
+
+			int outBytes;
+			AACENC_ERROR err = aac_Encode(enc, pcmBuffer, outBuffer, sizeof(outBuffer), &outBytes);
+
+			if (err != AACENC_OK) {
+				fprintf(stderr, "Encoding failed: %d\n", err);
+				aacEncClose(&enc);
+				return EXIT_FAILURE;
+			}
+
+			bytes += outBytes;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		aacEncClose(&enc);
+
+		double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+		double audio_ns = frames * (1e9 * SAMPLE_COUNT / SAMPLE_RATE);
+		printf("%-5s %4u kbps, afterburner %u: %8.0f ns/block, %7.1fx realtime, %.1f kbps actual\n",
+			profile->name, kbps, afterburner, ns / frames, audio_ns / ns, bytes * 8 / (audio_ns / 1e6));
+	}
+
+	return EXIT_SUCCESS;
+}
+
 // Flag to indicate whether we should keep playing the movie
 //  Set to 0 to close the program
 static int running;
@@ -243,25 +269,157 @@ int main(int argc, char * argv[])
 {
 	int ret = EXIT_SUCCESS;
 
+	// audio encoder options
+	const struct aac_profile * profile = aac_profiles;
+	unsigned int bitrate = 0;
+	unsigned int afterburner = 0;
+	unsigned long benchmark = 0;
+	const char * metricsAddress = NULL;
+	int sendBuffer = 0;
+	enum frameclock_policy policy = FRAMECLOCK_BURST;
+	const char * recordPath = (DEBUG ? "out.flv" : NULL);
+	enum flv_timecode timecode = TIMECODE_NONE;
+	int intraRefresh = 0;
+	// the first frame's timestamp, with -T
+	uint32_t firstTimestamp = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "p:b:aB:m:l:c:o:t:IT:")) != -1) {
+		switch (opt) {
+		case 'p':
+			for (profile = aac_profiles; profile->name != NULL; profile ++)
+				if (strcmp(profile->name, optarg) == 0)
+					break;
+			if (profile->name == NULL) {
+				fprintf(stderr, "Unknown AAC profile '%s'\n", optarg);
+				ret = EXIT_FAILURE;
+				goto exit;
+			}
+			break;
+		case 'b':
+			bitrate = strtoul(optarg, NULL, 10);
+			break;
+		case 'a':
+			afterburner = 1;
+			break;
+		case 'B':
+			benchmark = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			metricsAddress = optarg;
+			break;
+		case 'l':
+			sendBuffer = atoi(optarg) * 1024;
+			break;
+		case 'o':
+			recordPath = optarg;
+			break;
+		case 'c':
+			policy = frameclock_Policy(optarg);
+			if (policy == FRAMECLOCK_POLICIES) {
+				fprintf(stderr, "Unknown late frame policy '%s'\n", optarg);
+				ret = EXIT_FAILURE;
+				goto exit;
+			}
+			break;
+		case 'I':
+			intraRefresh = 1;
+			break;
+		case 'T':
+		{
+			char * end;
+			const unsigned long long start = strtoull(optarg, &end, 10);
+			if (*end || end == optarg || start > UINT32_MAX) {
+				fprintf(stderr, "Bad start timestamp '%s', expected 0 to %u ms\n", optarg, UINT32_MAX);
+				ret = EXIT_FAILURE;
+				goto exit;
+			}
+			firstTimestamp = start;
+			vclock_Virtual();
+			break;
+		}
+		case 't':
+			timecode = flv_Timecode(optarg);
+			if (timecode == TIMECODES) {
+				fprintf(stderr, "Unknown timecode '%s'\n", optarg);
+				ret = EXIT_FAILURE;
+				goto exit;
+			}
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (benchmark)
+		return aac_Benchmark(benchmark, bitrate, afterburner);
+
 	// verify one parameter passed
-	if (argc != 2) {
-		printf("X264 + RTMP example code\nUsage:\n\t%s <URL>\n", argv[0]);
+	if (argc - optind != 1) {
+usage:
+		printf("X264 + RTMP example code\nUsage:\n\t%s [-p lc|he|hev2] [-b kbps] [-a] [-m metrics_address] [-l kb] [-c burst|skip|rebase] [-o file.flv] [-t onfi|sei] [-I] [-T start_ms] <URL>\n\t%s [-b kbps] [-a] -B <blocks>\n"
+			"Options:\n\t-p\tAAC profile (default lc)\n\t-b\taudio bitrate (default 128 / 64 / 32 by profile)\n"
+			"\t-a\tenable the AAC afterburner\n\t-B\tbenchmark encode cost of each profile, then exit\n"
+			"\t-m\tserve Prometheus metrics on [host:]port or a Unix socket path\n"
+			"\t-l\tlow-latency mode, with a send buffer of this many KB: also measures RTT and send latency\n"
+			"\t-c\twhat to do when frames fall a whole period behind: send them back to back (burst, the default),\n"
+			"\t\tskip ahead to the current frame, or rebase the schedule to now\n"
+			"\t-o\talso record to a seekable FLV file (default out.flv)\n"
+			"\t-t\tembed each video frame's send time (wall clock), in an onFI script tag or an H.264 SEI\n"
+			"\t-I\tintra refresh instead of IDRs, with a one frame VBV buffer\n"
+			"\t-T\trun on a virtual clock, as fast as frames encode, with the same output every run, and\n"
+			"\t\ttimestamps starting at start_ms: e.g. 4294000000 reaches the 32-bit wrap in about 16 minutes of stream\n", argv[0], argv[0]);
 		goto exit;
 	}
 
-	FILE * fDebug;
+	if (profile->aot == AOT_PS && CHANNELS != 2) {
+		fputs("HE-AACv2 (Parametric Stereo) requires a stereo stream\n", stderr);
+		ret = EXIT_FAILURE;
+		goto exit;
+	}
+
+	if (bitrate == 0)
+		bitrate = profile->bitrate;
+
+	if (metricsAddress && ! metrics_Listen("waveform", metricsAddress)) {
+		ret = EXIT_FAILURE;
+		goto exit;
+	}
+
+	/* *************************************************** */
+	// Increase the log level for all RTMP actions
+	//  librtmp's messages, and everything from here on, are written out by
+	//  the logger thread, not this one
+	RTMP_LogSetLevel(RTMP_LOGINFO);
+	RTMP_LogSetCallback(logger_RTMP);
+	logger_Start();
+	/* *************************************************** */
+	// Init RTMP code and start connecting
+	//  the handshake runs in the background while the encoders are set up and
+	//  the first frames encoded, which are queued until publishing starts.
+	//  If the connection drops later, rtmpout reconnects and replays the
+	//  headers below, while the encoders keep running
+	struct rtmpout out;
+
+	if (! rtmpout_Start(&out, argv[optind], sendBuffer)) {
+		ret = EXIT_FAILURE;
+		goto exit;
+	}
+
+	// record the stream as well, to a seekable FLV
+	//  a recording that can't be opened is reported, and the stream goes on without it
+	struct flvrec rec = { 0 };
+
+	if (recordPath)
+		flvrec_Open(&rec, recordPath, FLVREC_KEYFRAMES);
 
-if (DEBUG) {
-	const uint8_t flvHeader[] = { 0x46, 0x4C, 0x56, 0x01, 0x05, 0, 0, 0, 9, 0, 0, 0, 0 };
-	fDebug = fopen("out.flv", "wb");
-	fwrite(flvHeader, 1, 13, fDebug);
-}
 	/* *************************************************** */
 	// Initialize the x264 encoder
 	//  First set up the parameters struct
 	x264_param_t param;
 	x264_param_default_preset(&param, "veryfast", "zerolatency");
 	param.i_log_level = X264_LOG_INFO;
+	param.pf_log = logger_X264;
 	param.i_threads = 1;
 	param.i_width = WIDTH;
 	param.i_height = HEIGHT;
@@ -269,14 +427,20 @@ if (DEBUG) {
 	param.i_fps_den = SAMPLE_COUNT;
 	param.i_keyint_max = (SAMPLE_RATE / SAMPLE_COUNT) * 4; // Twitch likes keyframes every 4 sec or less
 
-	// Enable intra refresh instead of IDR
-	//param.b_intra_refresh = 1;
-
 	//Rate control - use CBR not CRF.  allow (up to) 256kbps video rate.
 	param.rc.i_rc_method = X264_RC_ABR;
 	param.rc.i_bitrate = 256;
 	param.rc.i_vbv_max_bitrate = 256;
 
+	// Intra refresh instead of IDR: a column of intra blocks sweeps across
+	//  the picture once per keyint, so there is no keyframe many times the
+	//  size of the rest, and a VBV buffer of one frame can keep every frame
+	//  near the average
+	if (intraRefresh) {
+		param.b_intra_refresh = 1;
+		param.rc.i_vbv_buffer_size = 256 * SAMPLE_COUNT / SAMPLE_RATE + 1;
+	}
+
 	// Control x264 output for muxing
 	param.b_aud = 0; // do not generate Access Unit Delimiters
 	param.b_repeat_headers = 1; // Do not put SPS/PPS before each keyframe.
@@ -301,112 +465,63 @@ if (DEBUG) {
 	/* *************************************************** */
 	// Initialize the AAC encoder
 	//  libfdk-aac takes a bunch of these params to set it all up
-	//  ordinarily you should check the return value of these but... this is example code
 	HANDLE_AACENCODER m_aacenc;
 	AACENC_InfoStruct info;
 	AACENC_ERROR err;
-	// get encoder with support for only basic (AAC-LC) and 1 channel
-	err = aacEncOpen(&m_aacenc, 0x01, CHANNELS); if (err != AACENC_OK) { fprintf(stderr, "Failed to open encoder: %d\n", err); goto freePic; }
-
-#define aacSetParam(x, y) { AACENC_ERROR err = aacEncoder_SetParam(m_aacenc, x, y); if (err != AACENC_OK) { fprintf(stderr, "Failed to set param x to y: %d\n", err); goto freePic; } }
-
-	// give me just AAC-LC output (no HC, SSR, SBR etc)
-	aacSetParam(AACENC_AOT, AOT_AAC_LC); // AAC-LC
-	// Controls the output format of blocks coming from the encoder
-	//  this is just raw outputs (no special framing / container)
-	aacSetParam(AACENC_TRANSMUX, TT_MP4_RAW);
-	// Better quality at the expense of processing power
-	//aacSetParam(AACENC_AFTERBURNER,1);
 
-	aacSetParam(AACENC_BITRATE,128 * 1024);
-	aacSetParam(AACENC_SAMPLERATE, SAMPLE_RATE);
-	// channel arrangement
-	aacSetParam(AACENC_CHANNELMODE, (CHANNELS == 2 ? MODE_2 : MODE_1) );
-	aacSetParam(AACENC_CHANNELORDER, 1);
-
-	// This strange call is needed to "lock in" the settings for encoding
-	err = aacEncEncode(m_aacenc, NULL, NULL, NULL, NULL); if (err != AACENC_OK) { fprintf(stderr, "Failed to initialize encoder: %d\n", err); goto freePic; }
-
-	// Now we have encoder info in a struct and can use it for writing audio packets
-	err = aacEncInfo(m_aacenc, &info); if (err != AACENC_OK) { fprintf(stderr, "Failed to copy Encoder Info: %d\n", err); goto freePic; } 
-	printf("Opened encoder with these values: maxOutBufBytes = %u, maxAncBytes = %u, inBufFillLevel = %u, inputChannels = %u, frameLength = %u, nDelay = %u, nDelayCore = %u\n", info.maxOutBufBytes, info.maxAncBytes, info.inBufFillLevel, info.inputChannels, info.frameLength, info.nDelay, info.nDelayCore);
-
-	/* *************************************************** */
-	// allocate a very large buffer for all packets and operations
-	uint8_t * const tag = malloc(MAX_TAG_SIZE);
-
-	if (tag == NULL) {
-		perror("Failed to allocate tag buffer");
+	if (aac_Open(&m_aacenc, &info, profile, bitrate, afterburner) != AACENC_OK) {
 		ret = EXIT_FAILURE;
 		goto freePic;
 	}
 
-	/* *************************************************** */
-	// Increase the log level for all RTMP actions
-	RTMP_LogSetLevel(RTMP_LOGINFO);
-	RTMP_LogSetOutput(stderr);
-	/* *************************************************** */
-	// Init RTMP code
-	RTMP * r = RTMP_Alloc();
-	RTMP_Init(r);
+	logger_Printf(stdout, "Opened %s encoder at %u kbps\n", profile->name, bitrate);
+	logger_Printf(stdout, "Opened encoder with these values: maxOutBufBytes = %u, maxAncBytes = %u, inBufFillLevel = %u, inputChannels = %u, frameLength = %u, nDelay = %u, nDelayCore = %u\n", info.maxOutBufBytes, info.maxAncBytes, info.inBufFillLevel, info.inputChannels, info.frameLength, info.nDelay, info.nDelayCore);
 
-	if (r == NULL) {
-		fputs("Failed to create RTMP object\n", stderr);
-		ret = EXIT_FAILURE;
-		goto freeTag;
-	}
-
-	RTMP_SetupURL(r, argv[1]);
-	RTMP_EnableWrite(r);
-
-	// Make RTMP connection to server
-	if (! RTMP_Connect(r, NULL)) {
-		fputs("Failed to connect to remote RTMP server\n", stderr);
-		ret = EXIT_FAILURE;
-		goto freeRTMP;
-	}
+	/* *************************************************** */
+	// allocate a very large buffer for all packets and operations
+	uint8_t * const tagBuffer = malloc(MAX_TAG_SIZE);
 
-	// Connect to RTMP stream
-	if (! RTMP_ConnectStream(r, 0)) {
-		fputs("Failed to connect to RTMP stream\n", stderr);
+	if (tagBuffer == NULL) {
+		logger_Printf(stderr, "Failed to allocate tag buffer: %s\n", strerror(errno));
 		ret = EXIT_FAILURE;
-		goto freeRTMP;
+		goto closeAAC;
 	}
 
-	// track the fd for rtmp
-	int fd = RTMP_Socket(r);
-	struct timeval tv = {0, 0};
+	// all tags are built in this buffer, and writes are checked against its size
+	struct flv_tag tag;
+	flv_TagInit(&tag, tagBuffer, MAX_TAG_SIZE);
 
 	// READY to send the first packet!
 	// First event is the onMetaData, which uses AMF (Action Meta Format)
 	//  to serialize basic stream params
-	uint8_t * p = flv_TagHeader(tag, 18, 0);
+	flv_TagHeader(&tag, FLV_TAG_SCRIPT, 0);
 
 	// script data type is "onMetaData"
-	p = amf_string(p, "onMetaData");
+	amf_string(&tag, "onMetaData");
 	// associative array with various stream parameters
-	p = amf_ecma_array(p, 8);
-	p = amf_ecma_array_entry(p, "width", WIDTH);
-	p = amf_ecma_array_entry(p, "height", HEIGHT);
-	p = amf_ecma_array_entry(p, "framerate", (double)SAMPLE_RATE / SAMPLE_COUNT);
-	p = amf_ecma_array_entry(p, "videocodecid", 7);
-	p = amf_ecma_array_entry(p, "audiocodecid", 10);
-	p = amf_ecma_array_entry(p, "audiodatarate", 128);
-	p = amf_ecma_array_entry(p, "audiosamplerate", SAMPLE_RATE);
-	//p = amf_ecma_array_entry(p, "audiosamplesize", 16);
-	p = amf_boolean(pstring(p, "stereo"), CHANNELS == 2);
+	amf_ecma_array(&tag, 8);
+	amf_ecma_array_entry(&tag, "width", WIDTH);
+	amf_ecma_array_entry(&tag, "height", HEIGHT);
+	amf_ecma_array_entry(&tag, "framerate", (double)SAMPLE_RATE / SAMPLE_COUNT);
+	amf_ecma_array_entry(&tag, "videocodecid", 7);
+	amf_ecma_array_entry(&tag, "audiocodecid", 10);
+	amf_ecma_array_entry(&tag, "audiodatarate", bitrate);
+	amf_ecma_array_entry(&tag, "audiosamplerate", SAMPLE_RATE);
+	//amf_ecma_array_entry(&tag, "audiosamplesize", 16);
+	pstring(&tag, "stereo");
+	amf_boolean(&tag, CHANNELS == 2);
 	// finalize the array
-	p = amf_ecma_array_end(p);
+	amf_ecma_array_end(&tag);
 
 	// calculate tag size and write it
-	uint32_t tagSize = flv_TagFinish(tag, p);
+	uint32_t tagSize = flv_TagFinish(&tag);
 
-if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
+	flvrec_Write(&rec, tag.buf, tagSize);
 
-	if (RTMP_Write(r, (const char *)tag, tagSize) <= 0) {
-		fputs("Failed to RTMP_Write\n", stderr);
+	if (! rtmpout_Write(&out, tag.buf, tagSize)) {
+		logger_Printf(stderr, "Failed to RTMP_Write\n");
 		ret = EXIT_FAILURE;
-		goto freeRTMP;
+		goto freeTag;
 	}
 
 	// write the h.264 header now
@@ -416,26 +531,26 @@ if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
 	// ready to write the tag
 	// First event is the onMetaData, which uses AMF (Action Meta Format)
 	//  to serialize basic stream params
-	p = flv_TagHeader(tag, 9, 0);
+	flv_TagHeader(&tag, FLV_TAG_VIDEO, 0);
 
 	// Set up an AVC Video Packet (is keyframe, type 0)
-	p = flv_AVCVideoPacket(p, 1, 0, 0);
+	flv_AVCVideoPacket(&tag, 1, 0, 0);
 	// write the decoder config record, the initial SPS and PPS
-	p = h264_AVCDecoderConfigurationRecord(p,
+	h264_AVCDecoderConfigurationRecord(&tag,
 			pp_nal[0].p_payload + 4,
-			pp_nal[0].i_payload,
+			pp_nal[0].i_payload - 4,
 			pp_nal[1].p_payload + 4,
-			pp_nal[1].i_payload);
+			pp_nal[1].i_payload - 4);
 
 	// calculate tag size and write it
-	tagSize = flv_TagFinish(tag, p);
+	tagSize = flv_TagFinish(&tag);
 
-if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
+	flvrec_Write(&rec, tag.buf, tagSize);
 
-	if (RTMP_Write(r, (const char *)tag, tagSize) <= 0) {
-		fputs("Failed to RTMP_Write\n", stderr);
+	if (! rtmpout_Write(&out, tag.buf, tagSize)) {
+		logger_Printf(stderr, "Failed to RTMP_Write\n");
 		ret = EXIT_FAILURE;
-		goto freeRTMP;
+		goto freeTag;
 	}
 
 	// Produce a test image - do this just once here,
@@ -447,23 +562,21 @@ if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
 	/* ************************************************************************** */
 	// NOW!!! we have set up the video encoder.
 	//  so let's do audio next - the Initial Audio Packet.
-	p = flv_TagHeader(tag, 8, 0);
-	// 0xA0 for "AAC"
-	// 0x0F for flags (44khz, stereo, 16bit)
-	*p = 0xAF; p++;
-	*p = 0; p++;
-
-	memcpy(p, info.confBuf, info.confSize);
-	p += info.confSize;
+	//  Its payload is the AudioSpecificConfig, which tells the decoder
+	//  the object type (LC / SBR / PS), sample rate and channel layout.
+	flv_TagHeader(&tag, FLV_TAG_AUDIO, 0);
+	flv_AACAudioPacket(&tag, 0);
+
+	flv_Write(&tag, info.confBuf, info.confSize);
 	// calculate tag size and write it
-	tagSize = flv_TagFinish(tag, p);
+	tagSize = flv_TagFinish(&tag);
 
-if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
+	flvrec_Write(&rec, tag.buf, tagSize);
 
-	if (RTMP_Write(r, (const char *)tag, tagSize) <= 0) {
-		fputs("Failed to RTMP_Write\n", stderr);
+	if (! rtmpout_Write(&out, tag.buf, tagSize)) {
+		logger_Printf(stderr, "Failed to RTMP_Write\n");
 		ret = EXIT_FAILURE;
-		goto freeRTMP;
+		goto freeTag;
 	}
 
 	// Let's install some signal handlers for a graceful exit
@@ -477,145 +590,174 @@ if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
 
 	// Current frame
 	unsigned long frame = 0;
+	// Number of AAC access units emitted
+	//  each spans info.frameLength samples, which is 2048 for HE-AAC
+	unsigned long audioFrame = 0;
+	// samples never encoded, when the frame clock skips ahead
+	unsigned long skippedSamples = 0;
 
-	// Starting timestamp of our video
-	uint32_t start = getTimestamp();
+	// Frame pacing: frame n is due n frame periods after now
+	//  the clock is restarted when the connection is up, and paces from there
+	struct frameclock clock;
+	frameclock_Init(&clock, SAMPLE_COUNT, SAMPLE_RATE, policy);
+	int paced = 0;
+
+	struct framesize sizes;
+	framesize_Init(&sizes);
 
 	while (running) {
-		printf("FRAME %08lu, TIME %011lu\n", frame, (unsigned long)(frame * TIMESTAMP_INCREMENT));
+		const uint32_t timestamp = firstTimestamp + SAMPLE_TIMESTAMP((uint64_t)frame * SAMPLE_COUNT);
+		LOGGER_EVERY(1000, stdout, "FRAME %08lu, TIME %011lu\n", frame, (unsigned long)timestamp);
+
+		// after a reconnect, resume with an IDR instead of waiting for the next one
+		//  or with intra refresh, start the next refresh now
+		pic_in.i_type = X264_TYPE_AUTO;
+		if (rtmpout_KeyframeWanted(&out)) {
+			if (intraRefresh)
+				x264_encoder_intra_refresh(encoder);
+			else
+				pic_in.i_type = X264_TYPE_IDR;
+		}
 
 		/* Encode an x264 frame */
 		x264_nal_t * nals;
 		int i_nals;
+		uint64_t encode_start = metrics_Now();
 		int frame_size = x264_encoder_encode(encoder, &nals, &i_nals, &pic_in, &pic_out);
+		metrics_Observe(METRIC_VIDEO_ENCODE_TIME, metrics_Now() - encode_start);
 
 		if (frame_size <= 0) {
 			// error in encoding
-			fputs("Error when encoding frame\n", stderr);
+			logger_Printf(stderr, "Error when encoding frame\n");
 			ret = EXIT_FAILURE;
 			goto restoreSig;
 		}
 
+		framesize_Add(&sizes, timestamp, frame_size);
+
+		// the send time, stamped as the frame is handed to the connection
+		const uint64_t wallclock = vclock_Wallclock();
+
+		// an onFI goes just ahead of its frame, with the same timestamp
+		if (timecode == TIMECODE_ONFI) {
+			flv_TagHeader(&tag, FLV_TAG_SCRIPT, timestamp);
+			flv_OnFI(&tag, wallclock);
+			tagSize = flv_TagFinish(&tag);
+
+			flvrec_Write(&rec, tag.buf, tagSize);
+
+			if (! rtmpout_Write(&out, tag.buf, tagSize)) {
+				logger_Printf(stderr, "Failed to RTMP_Write a timecode\n");
+				ret = EXIT_FAILURE;
+				goto restoreSig;
+			}
+		}
+
 		// Post our video frame
-		p = flv_TagHeader(tag, 9, frame * TIMESTAMP_INCREMENT);
+		flv_TagHeader(&tag, FLV_TAG_VIDEO, timestamp);
 
 		// write every NALU to the packet for this pic
 		//  x264 guarantees all p_payload are sequential
-		p = flv_AVCVideoPacket(p, pic_out.b_keyframe, 1, 0);
-		memcpy(p, nals[0].p_payload, frame_size);
-		p += frame_size;
+		flv_AVCVideoPacket(&tag, pic_out.b_keyframe, 1, 0);
+		if (timecode == TIMECODE_SEI)
+			h264_TimecodeFrame(&tag, nals[0].p_payload, frame_size, wallclock);
+		else
+			flv_Write(&tag, nals[0].p_payload, frame_size);
 
 		// calculate tag size and write it
-		tagSize = flv_TagFinish(tag, p);
+		tagSize = flv_TagFinish(&tag);
+		if (tagSize == 0) {
+			logger_Printf(stderr, "Encoded frame does not fit in an FLV tag\n");
+			ret = EXIT_FAILURE;
+			goto restoreSig;
+		}
 
-if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
+		flvrec_Write(&rec, tag.buf, tagSize);
 
-		//  cast to char* avoids a warning
-		if (RTMP_Write(r, (const char *)tag, tagSize) <= 0) {
-			fputs("Failed to RTMP_Write a frame\n", stderr);
+		if (! rtmpout_Write(&out, tag.buf, tagSize)) {
+			logger_Printf(stderr, "Failed to RTMP_Write a frame\n");
 			ret = EXIT_FAILURE;
 			goto restoreSig;
 		}
 
 		/* *************************************************** */
 		// produce a test waveform
-		AACENC_BufDesc in_buf = { 0 }, out_buf = { 0 };
-		AACENC_InArgs in_args = { 0 };
-
 		INT_PCM pcmBuffer[SAMPLE_COUNT * CHANNELS] = { 0 };
-		in_args.numInSamples     = SAMPLE_COUNT * CHANNELS;
-
-		INT_PCM * in_buffers[]        = { pcmBuffer };
-		int in_buffer_sizes[]         = { sizeof(pcmBuffer) };
-		int in_buffer_element_sizes[] = { sizeof(INT_PCM) };
-		int in_buffer_identifiers[]   = { IN_AUDIO_DATA };
-
-		in_buf.numBufs           = 1;
-		in_buf.bufs              = in_buffers;
-		in_buf.bufferIdentifiers = in_buffer_identifiers;
-		in_buf.bufSizes          = in_buffer_sizes;
-		in_buf.bufElSizes        = in_buffer_element_sizes;
-
 		build_waveform(pcmBuffer, frame);
 
 		/* The maximum packet size is 6144 bits aka 768 bytes per channel. */
 		uint8_t outBuffer[768 * CHANNELS];
+		int outBytes;
 
-		uint8_t * out_buffers[]        = { outBuffer };
-		int out_buffer_sizes[]         = { sizeof(outBuffer) };
-		int out_buffer_element_sizes[] = { sizeof(uint8_t) };
-		int out_buffer_identifiers[]   = { OUT_BITSTREAM_DATA };
-
-		out_buf.numBufs             = 1;
-		out_buf.bufs                = out_buffers;
-		out_buf.bufferIdentifiers   = out_buffer_identifiers;
-		out_buf.bufSizes            = out_buffer_sizes;
-		out_buf.bufElSizes          = out_buffer_element_sizes;
+		encode_start = metrics_Now();
+		err = aac_Encode(m_aacenc, pcmBuffer, outBuffer, sizeof(outBuffer), &outBytes);
+		metrics_Observe(METRIC_AUDIO_ENCODE_TIME, metrics_Now() - encode_start);
 
-		// ok write some info
-		AACENC_OutArgs out_args; // does not need init - is set by encode
-		if ( (err = aacEncEncode(m_aacenc, &in_buf, &out_buf, &in_args, &out_args)) != AACENC_OK)
+		if (err != AACENC_OK)
 		{
-			fprintf(stderr, "Encoding failed: %ld\n", err);
-			return 1;
+			logger_Printf(stderr, "Encoding failed: %d\n", err);
+			ret = EXIT_FAILURE;
+			goto restoreSig;
 		}
 
-		if (out_args.numOutBytes <= 0) {
-			fprintf(stderr, "Encoding returned %d bytes\n", out_args.numOutBytes);
-		} else {
+		// no output is normal while the encoder fills its lookahead,
+		//  and on every other block for HE-AAC
+		if (outBytes > 0) {
 			// done, build tag
-			p = flv_TagHeader(tag, 8, frame * TIMESTAMP_INCREMENT);
-			*p = 0xAF; p++;
-			*p = 1; p++;
-			memcpy(p, outBuffer, out_args.numOutBytes);
-			p += out_args.numOutBytes;
+			//  timestamp comes from the samples actually emitted, since
+			//  access units need not line up with video frames
+			flv_TagHeader(&tag, FLV_TAG_AUDIO, firstTimestamp + SAMPLE_TIMESTAMP((uint64_t)audioFrame * info.frameLength + skippedSamples));
+			flv_AACAudioPacket(&tag, 1);
+			flv_Write(&tag, outBuffer, outBytes);
+			audioFrame ++;
 
 			// calculate tag size and write it
-			tagSize = flv_TagFinish(tag, p);
+			tagSize = flv_TagFinish(&tag);
 
-			if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
+			flvrec_Write(&rec, tag.buf, tagSize);
 
-			//  cast to char* avoids a warning
-			if (RTMP_Write(r, (const char *)tag, tagSize) <= 0) {
-				fputs("Failed to RTMP_Write audio block\n", stderr);
+			if (! rtmpout_Write(&out, tag.buf, tagSize)) {
+				logger_Printf(stderr, "Failed to RTMP_Write audio block\n");
 				ret = EXIT_FAILURE;
 				goto restoreSig;
 			}
 		}
 
 		// Handle any packets from the remote to us.
-		//  We will use select() to see if packet is waiting,
-		//  then read it and dispatch to the handler.
-		fd_set set;
-		FD_ZERO(&set);
-		FD_SET(fd, &set);
-
-		if (select(fd + 1, &set, NULL, NULL, &tv) == -1) {
-			perror("Error calling select()");
+		if (! rtmpout_Poll(&out)) {
 			ret = EXIT_FAILURE;
 			goto restoreSig;
 		}
 
-		// socket is present in read-ready set, safe to call RTMP_ReadPacket
-		if (FD_ISSET(fd, &set)) {
-			RTMPPacket packet = { 0 };
+		// Until the connection is up, encode ahead instead of waiting, up to
+		//  a second: it all goes out the moment publishing starts
+		if (! paced) {
+			if (rtmpout_Connecting(&out) && frame + 1 < PREROLL) {
+				frame ++;
+				continue;
+			}
 
-			if (RTMP_ReadPacket(r, &packet) && RTMPPacket_IsReady(&packet)) {
-				// this function does all the internal stuff we need
-				RTMP_ClientPacket(r, &packet);
-				RTMPPacket_Free(&packet);
+			if (! rtmpout_Wait(&out)) {
+				ret = EXIT_FAILURE;
+				goto restoreSig;
 			}
+
+			frameclock_Restart(&clock, frame);
+			paced = 1;
 		}
 
-		// frame count go up
-		frame ++;
+		// frame count go up, and wait until that frame is due
+		const unsigned long next = frameclock_Next(&clock);
+		// frames skipped to catch up leave the same gap in the audio
+		skippedSamples += (next - frame - 1) * SAMPLE_COUNT;
+		frame = next;
+	}
 
-		// the time to sleep is the duration between target framestamp and now
-		int64_t delay_time = (frame * TIMESTAMP_INCREMENT) - (getTimestamp() - start);
-		if (delay_time > 0) {
-			//printf("Sleeping for %ld seconds\n", delay_time);
-			usleep(1000 * delay_time);
-		}
+	// stopped while still connecting: what was encoded meanwhile is queued,
+	//  so see it sent before the end of the stream
+	if (! paced && ! rtmpout_Wait(&out)) {
+		ret = EXIT_FAILURE;
+		goto restoreSig;
 	}
 
 /* Flush delayed frames for a clean shutdown */
@@ -634,17 +776,16 @@ if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
  */
 
 	// send the end-of-stream indicator
-	p = flv_TagHeader(tag, 9, frame * TIMESTAMP_INCREMENT);
+	flv_TagHeader(&tag, FLV_TAG_VIDEO, firstTimestamp + SAMPLE_TIMESTAMP((uint64_t)frame * SAMPLE_COUNT));
 	// write the empty-body "stream end" tag
-	p = flv_AVCVideoPacket(p, 1, 2, 0);
+	flv_AVCVideoPacket(&tag, 1, 2, 0);
 	// calculate tag size and write it
-	tagSize = flv_TagFinish(tag, p);
+	tagSize = flv_TagFinish(&tag);
 
-if (DEBUG) fwrite(tag, 1, tagSize, fDebug);
+	flvrec_Write(&rec, tag.buf, tagSize);
 
-	//  cast to char* avoids a warning
-	if (RTMP_Write(r, (const char *)tag, tagSize) <= 0) {
-		fputs("Failed to RTMP_Write\n", stderr);
+	if (! rtmpout_Write(&out, tag.buf, tagSize)) {
+		logger_Printf(stderr, "Failed to RTMP_Write\n");
 		ret = EXIT_FAILURE;
 	}
 
@@ -656,14 +797,20 @@ restoreSig:
 	signal(SIGINT, SIG_DFL);
 	signal(SIGQUIT, SIG_DFL);
 	signal(SIGHUP, SIG_DFL);
+	logger_Stop();
+	frameclock_Report(&clock, stdout);
+	frameclock_Close(&clock);
+	framesize_Report(&sizes, "video", stdout);
 // Shut down
-freeRTMP:
-	RTMP_Free(r);
 freeTag:
-	free(tag);
+	free(tagBuffer);
+closeAAC:
+	aacEncClose(&m_aacenc);
 freePic:
 	x264_picture_clean(&pic_in);
-if (DEBUG) fclose(fDebug);
+	rtmpout_Close(&out);
+	flvrec_Close(&rec);
 exit:
+	logger_Stop();
 	return ret;
 }
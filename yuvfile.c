@@ -0,0 +1,307 @@
+/* ***************************************************
+yuvfile: Y4M / raw I420 video file reader
+Greg Kennedy 2021
+*************************************************** */
+#include "yuvfile.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// frames to ask the kernel to read ahead of the one being encoded
+#define READAHEAD 8
+
+// longest Y4M header line kept; parameters past it are ignored
+#define MAX_LINE 1024
+
+static const char y4m_magic[] = "YUV4MPEG2 ";
+
+// Lay out the planes of a fullWidth x fullHeight frame, as Y4M and raw
+//  I420 files store them: each plane packed, chroma rounded up.  An odd
+//  size is cropped to even just by the strides, so no copy is needed.
+static int yuvfile_Geometry(struct yuvfile * const y, const unsigned int fullWidth, const unsigned int fullHeight)
+{
+	y->width = fullWidth & ~1U;
+	y->height = fullHeight & ~1U;
+
+	if (y->width == 0 || y->height == 0 || fullWidth > 16384 || fullHeight > 16384) {
+		fprintf(stderr, "Unsupported video size %ux%u\n", fullWidth, fullHeight);
+		return 0;
+	}
+
+	const uint32_t chromaWidth = (fullWidth + 1) / 2, chromaHeight = (fullHeight + 1) / 2;
+
+	y->stride[0] = fullWidth;
+	y->stride[1] = y->stride[2] = chromaWidth;
+	y->plane[0] = 0;
+	y->plane[1] = fullWidth * fullHeight;
+	y->plane[2] = y->plane[1] + chromaWidth * chromaHeight;
+	y->frameSize = y->plane[2] + chromaWidth * chromaHeight;
+	return 1;
+}
+
+// Parse the Y4M stream header's parameters (after the magic)
+static int yuvfile_Y4M(struct yuvfile * const y, char * const line)
+{
+	unsigned int width = 0, height = 0;
+
+	for (char * p = strtok(line, " \n"); p != NULL; p = strtok(NULL, " \n")) {
+		switch (p[0]) {
+		case 'W':
+			width = strtoul(p + 1, NULL, 10);
+			break;
+		case 'H':
+			height = strtoul(p + 1, NULL, 10);
+			break;
+		case 'F': {
+			unsigned int num, den;
+			if (sscanf(p + 1, "%u:%u", &num, &den) == 2 && num && den) {
+				y->fpsNum = num;
+				y->fpsDen = den;
+			}
+			break;
+		}
+		case 'C':
+			// 8-bit 4:2:0 only; the suffixes are just chroma siting
+			if (strcmp(p, "C420") && strcmp(p, "C420jpeg") && strcmp(p, "C420paldv") && strcmp(p, "C420mpeg2")) {
+				fprintf(stderr, "Unsupported Y4M colorspace %s, only 8-bit 4:2:0 is\n", p + 1);
+				return 0;
+			}
+			break;
+		default:
+			// interlacing, aspect ratio and comments don't matter here
+			break;
+		}
+	}
+
+	return yuvfile_Geometry(y, width, height);
+}
+
+// Read one line from the stream, up to max - 1 bytes of it
+//  Returns its length, or -1 at the end of the stream.
+static int yuvfile_Line(FILE * const f, char * const line, const size_t max)
+{
+	size_t len = 0;
+	int c;
+
+	while ((c = getc(f)) != EOF && c != '\n') {
+		if (len < max - 1)
+			line[len ++] = c;
+	}
+
+	line[len] = '\0';
+	return (c == EOF && len == 0 ? -1 : (int)len);
+}
+
+// Ask the kernel to start reading frame i in, before it is needed
+static void yuvfile_Readahead(const struct yuvfile * const y, const unsigned long i)
+{
+	static long page;
+
+	if (page == 0)
+		page = sysconf(_SC_PAGESIZE);
+
+	const uint64_t offset = y->first + (uint64_t)i * (y->header + y->frameSize);
+	const uint64_t start = offset & ~(uint64_t)(page - 1);
+
+	madvise(y->map + start, offset + y->header + y->frameSize - start, MADV_WILLNEED);
+}
+
+// Open the mapped file's first frame, and count them
+static int yuvfile_MapFrames(struct yuvfile * const y)
+{
+	if (y->y4m) {
+		// every FRAME header is taken to be as long as the first: that
+		//  allows seeking straight to any frame, and is checked when read
+		const uint8_t * const nl = memchr(y->map + y->first, '\n', y->size - y->first < 256 ? y->size - y->first : 256);
+
+		if (y->size - y->first < 5 || memcmp(y->map + y->first, "FRAME", 5) || nl == NULL) {
+			fputs("Y4M file has no frames\n", stderr);
+			return 0;
+		}
+		y->header = nl + 1 - (y->map + y->first);
+	}
+
+	y->frames = (y->size - y->first) / (y->header + y->frameSize);
+
+	if (y->frames == 0) {
+		fputs("Video file has no complete frames\n", stderr);
+		return 0;
+	}
+
+	madvise(y->map, y->size, MADV_SEQUENTIAL);
+	for (unsigned long i = 0; i < READAHEAD && i < y->frames; i ++)
+		yuvfile_Readahead(y, i);
+	return 1;
+}
+
+/* ************************************************************************ */
+int yuvfile_Open(struct yuvfile * const y, const char * const path, const unsigned int width, const unsigned int height, const unsigned int fpsNum, const unsigned int fpsDen, const int loop)
+{
+	memset(y, 0, sizeof(*y));
+	y->loop = loop;
+	y->fpsNum = fpsNum;
+	y->fpsDen = fpsDen;
+
+	// "-" reads standard input, e.g. ffmpeg -f yuv4mpegpipe -
+	const int fd = (strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY));
+	struct stat st;
+	char line[MAX_LINE];
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Failed to open %s: ", path);
+		perror(NULL);
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		void * const p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (p != MAP_FAILED) {
+			y->map = p;
+			y->size = st.st_size;
+		}
+	}
+
+	if (y->map) {
+		close(fd);
+		y->y4m = (y->size >= sizeof(y4m_magic) - 1 && memcmp(y->map, y4m_magic, sizeof(y4m_magic) - 1) == 0);
+
+		if (y->y4m) {
+			const size_t max = (y->size < MAX_LINE ? y->size : MAX_LINE);
+			const uint8_t * const nl = memchr(y->map, '\n', max);
+
+			if (nl == NULL) {
+				fputs("Y4M header is too long, or not terminated\n", stderr);
+				goto fail;
+			}
+
+			const size_t len = nl - y->map - (sizeof(y4m_magic) - 1);
+			memcpy(line, y->map + sizeof(y4m_magic) - 1, len);
+			line[len] = '\0';
+			y->first = nl + 1 - y->map;
+
+			if (! yuvfile_Y4M(y, line))
+				goto fail;
+		} else if (! yuvfile_Geometry(y, width, height))
+			goto fail;
+
+		if (! yuvfile_MapFrames(y))
+			goto fail;
+		return 1;
+	}
+
+	// not a regular file, or it would not map: read it into a frame buffer
+	if ((y->f = fdopen(fd, "rb")) == NULL) {
+		perror("Failed to open video stream");
+		close(fd);
+		return 0;
+	}
+
+	char magic[sizeof(y4m_magic) - 1];
+	const size_t got = fread(magic, 1, sizeof(magic), y->f);
+
+	y->y4m = (got == sizeof(magic) && memcmp(magic, y4m_magic, sizeof(magic)) == 0);
+
+	if (y->y4m) {
+		if (yuvfile_Line(y->f, line, sizeof(line)) < 0 || ! yuvfile_Y4M(y, line))
+			goto fail;
+	} else if (! yuvfile_Geometry(y, width, height))
+		goto fail;
+
+	if ((y->buf = malloc(y->frameSize)) == NULL) {
+		perror("Failed to allocate frame buffer");
+		goto fail;
+	}
+
+	// raw frames start right away, so what was read to check for Y4M is
+	//  the start of the first one; rewinding to loop skips past the Y4M header
+	if (y->y4m)
+		y->first = ftello(y->f);
+	else {
+		memcpy(y->buf, magic, got);
+		y->pending = got;
+	}
+
+	return 1;
+
+fail:
+	yuvfile_Close(y);
+	return 0;
+}
+
+const uint8_t * yuvfile_Frame(struct yuvfile * const y, const unsigned long n)
+{
+	if (y->map) {
+		if (n >= y->frames && ! y->loop)
+			return NULL;
+
+		const unsigned long i = n % y->frames;
+		const uint8_t * const frame = y->map + y->first + (uint64_t)i * (y->header + y->frameSize);
+
+		if (y->y4m && memcmp(frame, "FRAME", 5)) {
+			fprintf(stderr, "Y4M frame %lu has a header of a different length, which is not supported\n", i);
+			return NULL;
+		}
+
+		if (y->loop || i + READAHEAD < y->frames)
+			yuvfile_Readahead(y, (i + READAHEAD) % y->frames);
+
+		return frame + y->header;
+	}
+
+	if (n < y->next) {
+		fputs("Can't go back in a video stream\n", stderr);
+		return NULL;
+	}
+
+	// read up to frame n, discarding any skipped over
+	int rewound = 0;
+
+	while (y->next <= n) {
+		char line[MAX_LINE];
+		const size_t have = y->pending;
+
+		if ((y->y4m && yuvfile_Line(y->f, line, sizeof(line)) < 0) ||
+			fread(y->buf + have, 1, y->frameSize - have, y->f) != y->frameSize - have) {
+			// the end: start over if looping, and the stream can
+			if (! y->loop || rewound)
+				return NULL;
+
+			if (fseeko(y->f, y->first, SEEK_SET) != 0) {
+				fputs("Can't loop a video stream that can't seek\n", stderr);
+				return NULL;
+			}
+
+			rewound = 1;
+			y->pending = 0;
+			continue;
+		}
+
+		if (y->y4m && strncmp(line, "FRAME", 5)) {
+			fputs("Y4M stream is missing a FRAME header\n", stderr);
+			return NULL;
+		}
+
+		rewound = 0;
+		y->pending = 0;
+		y->next ++;
+	}
+
+	return y->buf;
+}
+
+void yuvfile_Close(struct yuvfile * const y)
+{
+	if (y->map)
+		munmap(y->map, y->size);
+	if (y->f)
+		fclose(y->f);
+	free(y->buf);
+	memset(y, 0, sizeof(*y));
+}
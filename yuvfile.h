@@ -0,0 +1,60 @@
+/* ***************************************************
+yuvfile: Y4M / raw I420 video file reader
+Greg Kennedy 2021
+
+Reads uncompressed 8-bit 4:2:0 video, either a Y4M file
+ (size and frame rate from its header) or headerless raw
+ I420 frames of a size given by the caller.  Regular
+ files are mmap()ed and frames handed out as pointers
+ into the mapping, with sequential readahead advised to
+ the kernel, so no frame is copied.  Anything that can't
+ be mapped (a pipe from ffmpeg, say) is read a frame at
+ a time into a buffer instead.
+*************************************************** */
+#ifndef YUVFILE_H_
+#define YUVFILE_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct yuvfile {
+	// a mapped file, or a stream read frame by frame into buf
+	uint8_t * map;
+	size_t size;
+	FILE * f;
+	uint8_t * buf;
+
+	int y4m;
+	int loop;	// start over at the end
+
+	// the picture, cropped to even sizes for I420 encoding
+	unsigned int width, height;
+	unsigned int fpsNum, fpsDen;
+
+	// each plane's offset within a frame's data, and its stride in bytes
+	//  (those of the full size, when an odd one was cropped)
+	uint32_t plane[3], stride[3];
+	size_t frameSize;
+
+	uint64_t first;	// file offset of the first frame (of its FRAME header, in Y4M)
+	size_t header;	// mapped Y4M: length of each FRAME header
+	unsigned long frames;	// mapped: frames in the file
+	unsigned long next;	// read: the frame the stream is positioned at
+	size_t pending;	// read: bytes of it already in buf, from checking for Y4M
+};
+
+// Open a Y4M file, or a raw I420 file of width x height at fpsNum / fpsDen
+//  A Y4M header overrides the size and rate given.  Returns 0 on failure.
+//  A zeroed struct yuvfile is safe to close.
+int yuvfile_Open(struct yuvfile * y, const char * path, unsigned int width, unsigned int height, unsigned int fpsNum, unsigned int fpsDen, int loop);
+
+// Frame n's data, with its planes at the offsets in y->plane
+//  Frames are best asked for in order, though they may skip ahead; a
+//  mapped file may also go back.  Valid until the next call.  Returns
+//  NULL at the end of the file (unless looping), or on a read error.
+const uint8_t * yuvfile_Frame(struct yuvfile * y, unsigned long n);
+
+void yuvfile_Close(struct yuvfile * y);
+
+#endif